@@ -15,52 +15,117 @@
  *
  */
 
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
 #include "aes-crypt.h"
+#include "encfs-arena.h"
 
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+extern int crypt_derive_key(char* key_str, unsigned char key[32], unsigned char iv[32]){
+    int nrounds = 5;
+    int i;
+
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return 0;
+    }
+    /* Build Key from String */
+    i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+		       (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
+    if (i != 32) {
+	/* Error */
+	fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	return 0;
+    }
+    return 1;
+}
+
+/* pread() that also works on O_DIRECT descriptors, where the file offset,
+ * length and buffer all have to be DIRECT_ALIGN aligned. Returns bytes
+ * read (short at end of file) or -1. */
+static ssize_t read_cipher(int fd, unsigned char* dst, size_t len, off_t off){
+    off_t astart, aend;
+    unsigned char* abuf;
+    ssize_t got;
+    int flags = fcntl(fd, F_GETFL);
+
+    if(flags == -1 || !(flags & O_DIRECT)){
+	return pread(fd, dst, len, off);
+    }
+
+    astart = off - off % DIRECT_ALIGN;
+    aend = off + len;
+    if(aend % DIRECT_ALIGN){
+	aend += DIRECT_ALIGN - aend % DIRECT_ALIGN;
+    }
+    abuf = arena_get(aend - astart);
+    if(!abuf){
+	return -1;
+    }
+    got = pread(fd, abuf, aend - astart, astart);
+    if(got >= 0){
+	got -= off - astart;
+	if(got < 0){
+	    got = 0;
+	}
+	if((size_t)got > len){
+	    got = len;
+	}
+	memcpy(dst, abuf + (off - astart), got);
+    }
+    arena_put(abuf, aend - astart);
+    return got;
+}
+
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* Local Vars */
 
-    /* Buffers */
-    unsigned char inbuf[BLOCKSIZE];
+    /* Buffers, locked arena blocks so plaintext never reaches swap */
+    unsigned char* inbuf;
     int inlen;
     /* Allow enough space in output buffer for additional cipher block */
-    unsigned char outbuf[BLOCKSIZE + EVP_MAX_BLOCK_LENGTH];
+    unsigned char* outbuf;
     int outlen;
     int writelen;
+    int res = 0;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
+    EVP_CIPHER_CTX* ctx = NULL;
     unsigned char key[32];
     unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
 
     /* Setup Encryption Key and Cipher Engine if in cipher mode */
     if(action >= 0){
-	if(!key_str){
-	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
+	if(!crypt_derive_key(key_str, key, iv)){
 	    return 0;
 	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
+	/* Init Engine */
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
 	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	    fprintf(stderr, "EVP_CIPHER_CTX_new failed\n");
 	    return 0;
 	}
-	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
     }    
 
+    inbuf = arena_get(BLOCKSIZE);
+    outbuf = arena_get(BLOCKSIZE + EVP_MAX_BLOCK_LENGTH);
+    if(!inbuf || !outbuf){
+	goto out;
+    }
+
     /* Loop through Input File*/
     for(;;){
 	/* Read Block */
@@ -72,11 +137,10 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
 		{
 		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
+		    goto out;
 		}
 	}
 	/* If in pass-through mode. copy block as is */
@@ -90,25 +154,601 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
-	    return 0;
+	    goto out;
 	}
     }
     
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
 	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
 	    {
 		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
+		goto out;
 	    }
 	/* Write remainign cipher block + padding*/
 	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
     }
     
     /* Success */
-    return 1;
+    res = 1;
+
+out:
+    EVP_CIPHER_CTX_free(ctx);
+    arena_put(inbuf, BLOCKSIZE);
+    arena_put(outbuf, BLOCKSIZE + EVP_MAX_BLOCK_LENGTH);
+    return res;
+}
+
+extern off_t crypt_plainsize(int fd, char* key_str){
+    struct stat st;
+    unsigned char key[32];
+    unsigned char iv[32];
+    /* The last cipher block and the one chained in front of it */
+    unsigned char tail[2*AES_BLOCK_SIZE];
+    unsigned char plain[2*AES_BLOCK_SIZE];
+    unsigned char* prev;
+    EVP_CIPHER_CTX* ctx;
+    int outlen;
+    int pad;
+    int i;
+
+    if(fstat(fd, &st) == -1){
+	return -1;
+    }
+    if(st.st_size < AES_BLOCK_SIZE || st.st_size % AES_BLOCK_SIZE){
+	/* Not a padded CBC stream */
+	return -1;
+    }
+    if(!crypt_derive_key(key_str, key, iv)){
+	return -1;
+    }
+
+    /* CBC only needs the previous cipher block (or the IV) to decrypt a
+     * block, so the padding can be read without touching the rest */
+    if(st.st_size == AES_BLOCK_SIZE){
+	if(pread(fd, tail + AES_BLOCK_SIZE, AES_BLOCK_SIZE, 0) != AES_BLOCK_SIZE){
+	    return -1;
+	}
+	prev = iv;
+    }
+    else{
+	if(pread(fd, tail, sizeof(tail), st.st_size - sizeof(tail)) != sizeof(tail)){
+	    return -1;
+	}
+	prev = tail;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+	return -1;
+    }
+    EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, prev, 0);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if(!EVP_CipherUpdate(ctx, plain, &outlen, tail + AES_BLOCK_SIZE, AES_BLOCK_SIZE)
+       || outlen != AES_BLOCK_SIZE){
+	EVP_CIPHER_CTX_free(ctx);
+	return -1;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    /* Check PKCS#7 padding */
+    pad = plain[AES_BLOCK_SIZE - 1];
+    if(pad < 1 || pad > AES_BLOCK_SIZE){
+	return -1;
+    }
+    for(i = AES_BLOCK_SIZE - pad; i < AES_BLOCK_SIZE; i++){
+	if(plain[i] != pad){
+	    return -1;
+	}
+    }
+
+    return st.st_size - pad;
+}
+
+extern ssize_t crypt_pread(int fd, char* buf, size_t size, off_t offset, char* key_str){
+    struct stat st;
+    unsigned char key[32];
+    unsigned char iv[32];
+    unsigned char* cipher;
+    unsigned char* plain;
+    EVP_CIPHER_CTX* ctx;
+    off_t start, end, plainend;
+    size_t clen;
+    int outlen;
+    int pad;
+    ssize_t res = -1;
+
+    if(fstat(fd, &st) == -1){
+	return -1;
+    }
+    if(st.st_size < AES_BLOCK_SIZE || st.st_size % AES_BLOCK_SIZE){
+	/* Not a padded CBC stream */
+	return -1;
+    }
+    if(offset < 0){
+	return -1;
+    }
+    if(size == 0 || offset >= st.st_size){
+	return 0;
+    }
+    if(!crypt_derive_key(key_str, key, iv)){
+	return -1;
+    }
+
+    /* Cipher block range covering [offset, offset+size) */
+    start = offset - offset % AES_BLOCK_SIZE;
+    end = offset + size;
+    if(end % AES_BLOCK_SIZE){
+	end += AES_BLOCK_SIZE - end % AES_BLOCK_SIZE;
+    }
+    if(end > st.st_size){
+	end = st.st_size;
+    }
+
+    /* Read one extra block in front: it is the chaining IV for start */
+    clen = end - start + AES_BLOCK_SIZE;
+    cipher = arena_get(clen);
+    plain = arena_get(clen);
+    if(!cipher || !plain){
+	goto out;
+    }
+    if(start == 0){
+	memcpy(cipher, iv, AES_BLOCK_SIZE);
+	if(read_cipher(fd, cipher + AES_BLOCK_SIZE, end, 0) != end){
+	    goto out;
+	}
+    }
+    else if(read_cipher(fd, cipher, clen, start - AES_BLOCK_SIZE) != (ssize_t)clen){
+	goto out;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+	goto out;
+    }
+    EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, cipher, 0);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if(!EVP_CipherUpdate(ctx, plain, &outlen, cipher + AES_BLOCK_SIZE, end - start)
+       || outlen != end - start){
+	EVP_CIPHER_CTX_free(ctx);
+	goto out;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    /* The final cipher block carries the padding */
+    plainend = end;
+    if(end == st.st_size){
+	pad = plain[end - start - 1];
+	if(pad < 1 || pad > AES_BLOCK_SIZE){
+	    goto out;
+	}
+	plainend -= pad;
+    }
+
+    if(offset >= plainend){
+	res = 0;
+    }
+    else{
+	res = plainend - offset;
+	if((size_t)res > size){
+	    res = size;
+	}
+	memcpy(buf, plain + (offset - start), res);
+    }
+
+out:
+    arena_put(cipher, clen);
+    arena_put(plain, clen);
+    return res;
+}
+
+/* Chunk cipher engines */
+
+#define AEAD_NONCE 12
+#define AEAD_TAG 16
+
+/* Per thread cipher contexts, set up on first use and kept until the
+ * thread exits */
+struct engine_ctx {
+    EVP_CIPHER_CTX* cbc;
+    /* Residual block pads, CBC key */
+    EVP_CIPHER_CTX* ecb[CRYPT_KEYS];
+    /* ESSIV, essiv_keys */
+    EVP_CIPHER_CTX* ivc[CRYPT_KEYS];
+    /* Keyed AEAD contexts, only the nonce changes per chunk */
+    EVP_CIPHER_CTX* aead[CRYPT_KEYS][CRYPT_ENGINES];
+};
+
+/* Key slots are filled in order and never change once nkeys covers them,
+ * so the cipher paths read them without a lock */
+static unsigned char engine_keys[CRYPT_KEYS][CRYPT_ENGINES][32];
+static unsigned char essiv_keys[CRYPT_KEYS][32];
+static unsigned char id_keys[CRYPT_KEYS][32];
+static unsigned char mac_keys[CRYPT_KEYS][32];
+static unsigned int key_ids[CRYPT_KEYS];
+static int nkeys;
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ctx_key;
+
+static void ctx_free(void* arg){
+    struct engine_ctx* c = arg;
+    int i, k;
+
+    EVP_CIPHER_CTX_free(c->cbc);
+    for(k = 0; k < CRYPT_KEYS; k++){
+	EVP_CIPHER_CTX_free(c->ecb[k]);
+	EVP_CIPHER_CTX_free(c->ivc[k]);
+	for(i = 0; i < CRYPT_ENGINES; i++){
+	    EVP_CIPHER_CTX_free(c->aead[k][i]);
+	}
+    }
+    free(c);
+}
+
+static void make_ctx_key(void){
+    pthread_key_create(&ctx_key, ctx_free);
+}
+
+static struct engine_ctx* ctx_get(void){
+    struct engine_ctx* c;
+
+    pthread_once(&ctx_once, make_ctx_key);
+    c = pthread_getspecific(ctx_key);
+    if(c){
+	return c;
+    }
+    c = calloc(1, sizeof(*c));
+    if(!c){
+	return NULL;
+    }
+    c->cbc = EVP_CIPHER_CTX_new();
+    if(!c->cbc || pthread_setspecific(ctx_key, c)){
+	ctx_free(c);
+	return NULL;
+    }
+    return c;
+}
+
+static int key_valid(int key){
+    return key >= 0 && key < __atomic_load_n(&nkeys, __ATOMIC_ACQUIRE);
+}
+
+/* AES-256-ECB context without padding, set up on first use */
+static EVP_CIPHER_CTX* ecb_ctx(EVP_CIPHER_CTX** slot, const unsigned char* key){
+    EVP_CIPHER_CTX* ctx = *slot;
+
+    if(ctx){
+	return ctx;
+    }
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx || !EVP_EncryptInit_ex(ctx, EVP_aes_256_ecb(), NULL, key, NULL)){
+	EVP_CIPHER_CTX_free(ctx);
+	return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    *slot = ctx;
+    return ctx;
+}
+
+/* aes256-cbc: encrypts (enc=1) or decrypts len bytes, in may be out */
+static int cbc_crypt(int key, const unsigned char* tweak, const unsigned char* in,
+		     size_t len, unsigned char* out, int enc){
+    struct engine_ctx* c = ctx_get();
+    EVP_CIPHER_CTX *ecb, *ivc;
+    unsigned char iv[16], last[16], pad[16];
+    size_t full = len & ~(size_t)15;
+    size_t i;
+    int n;
+
+    if(!c || !key_valid(key)){
+	return FAILURE;
+    }
+    ecb = ecb_ctx(&c->ecb[key], engine_keys[key][CRYPT_AES256_CBC]);
+    ivc = ecb_ctx(&c->ivc[key], essiv_keys[key]);
+    if(!ecb || !ivc || !EVP_EncryptUpdate(ivc, iv, &n, tweak, CRYPT_TWEAK)){
+	return FAILURE;
+    }
+
+    /* Last cipher block (or the IV) feeds the residual pad */
+    memcpy(last, iv, 16);
+    if(full && !enc){
+	memcpy(last, in + full - 16, 16);
+    }
+    if(full){
+	if(!EVP_CipherInit_ex(c->cbc, EVP_aes_256_cbc(), NULL,
+			      engine_keys[key][CRYPT_AES256_CBC], iv, enc)){
+	    return FAILURE;
+	}
+	EVP_CIPHER_CTX_set_padding(c->cbc, 0);
+	if(!EVP_CipherUpdate(c->cbc, out, &n, in, full)){
+	    return FAILURE;
+	}
+	if(enc){
+	    memcpy(last, out + full - 16, 16);
+	}
+    }
+    if(len > full){
+	if(!EVP_EncryptUpdate(ecb, pad, &n, last, 16)){
+	    return FAILURE;
+	}
+	for(i = full; i < len; i++){
+	    out[i] = in[i] ^ pad[i - full];
+	}
+    }
+    return SUCCESS;
+}
+
+static int cbc_seal(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		    const unsigned char* in, size_t len, unsigned char* out){
+    (void) e;
+    return cbc_crypt(key, tweak, in, len, out, 1);
+}
+
+static int cbc_open(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		    const unsigned char* in, size_t len, unsigned char* out){
+    (void) e;
+    return cbc_crypt(key, tweak, in, len, out, 0);
+}
+
+static EVP_CIPHER_CTX* aead_ctx(const struct crypt_engine* e, int key){
+    struct engine_ctx* c = ctx_get();
+    EVP_CIPHER_CTX* ctx;
+
+    if(!c || !key_valid(key)){
+	return NULL;
+    }
+    if(c->aead[key][e->id]){
+	return c->aead[key][e->id];
+    }
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx ||
+       !EVP_CipherInit_ex(ctx, e->cipher(), NULL, NULL, NULL, 1) ||
+       !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCE, NULL) ||
+       !EVP_CipherInit_ex(ctx, NULL, NULL, engine_keys[key][e->id], NULL, 1)){
+	EVP_CIPHER_CTX_free(ctx);
+	return NULL;
+    }
+    c->aead[key][e->id] = ctx;
+    return ctx;
+}
+
+/* nonce | ciphertext | tag */
+static int aead_seal(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		     const unsigned char* in, size_t len, unsigned char* out){
+    EVP_CIPHER_CTX* ctx = aead_ctx(e, key);
+    unsigned char* tag = out + AEAD_NONCE + len;
+    int n;
+
+    if(!ctx || RAND_bytes(out, AEAD_NONCE) != 1){
+	return FAILURE;
+    }
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, out, 1) ||
+       !EVP_CipherUpdate(ctx, NULL, &n, tweak, CRYPT_TWEAK) ||
+       !EVP_CipherUpdate(ctx, out + AEAD_NONCE, &n, in, len) ||
+       !EVP_CipherFinal_ex(ctx, tag, &n) ||
+       !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG, tag)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static int aead_open(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		     const unsigned char* in, size_t len, unsigned char* out){
+    EVP_CIPHER_CTX* ctx = aead_ctx(e, key);
+    size_t plen;
+    int n;
+
+    if(!ctx || len < e->overhead){
+	return FAILURE;
+    }
+    plen = len - e->overhead;
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, in, 0) ||
+       !EVP_CipherUpdate(ctx, NULL, &n, tweak, CRYPT_TWEAK) ||
+       !EVP_CipherUpdate(ctx, out, &n, in + AEAD_NONCE, plen) ||
+       !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG,
+			    (void*)(in + AEAD_NONCE + plen)) ||
+       EVP_CipherFinal_ex(ctx, out + plen, &n) <= 0){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static const struct crypt_engine engines[CRYPT_ENGINES] = {
+    { "aes256-cbc", 0, cbc_seal, cbc_open,
+      CRYPT_AES256_CBC, EVP_aes_256_cbc, 32 },
+    { "aes128-gcm", AEAD_NONCE + AEAD_TAG, aead_seal, aead_open,
+      CRYPT_AES128_GCM, EVP_aes_128_gcm, 16 },
+    { "aes256-gcm", AEAD_NONCE + AEAD_TAG, aead_seal, aead_open,
+      CRYPT_AES256_GCM, EVP_aes_256_gcm, 32 },
+    { "chacha20-poly1305", AEAD_NONCE + AEAD_TAG, aead_seal, aead_open,
+      CRYPT_CHACHA20_POLY1305, EVP_chacha20_poly1305, 32 },
+};
+
+/* Fills the engine keys of one slot from a passphrase */
+static int derive_keys(char* key_str, unsigned char keys[CRYPT_ENGINES][32],
+		       unsigned char essiv[32], unsigned char id_key[32],
+		       unsigned char mac_key[32], unsigned int* id){
+    unsigned char iv[32], digest[32];
+    unsigned int len;
+    EVP_MD_CTX* md;
+    int i;
+    int res = FAILURE;
+
+    /* aes256-cbc keeps the passphrase key, so existing chunked files
+     * still open; the AEAD engines get a key each */
+    if(!crypt_derive_key(key_str, keys[CRYPT_AES256_CBC], iv)){
+	return FAILURE;
+    }
+    if(!EVP_Digest(keys[CRYPT_AES256_CBC], 32, essiv, &len,
+		   EVP_sha256(), NULL)){
+	return FAILURE;
+    }
+    md = EVP_MD_CTX_new();
+    if(!md){
+	return FAILURE;
+    }
+    for(i = 1; i < CRYPT_ENGINES; i++){
+	if(!EVP_DigestInit_ex(md, EVP_sha256(), NULL) ||
+	   !EVP_DigestUpdate(md, "pa4-encfs:", 10) ||
+	   !EVP_DigestUpdate(md, engines[i].name, strlen(engines[i].name)) ||
+	   !EVP_DigestUpdate(md, keys[CRYPT_AES256_CBC], 32) ||
+	   !EVP_DigestFinal_ex(md, keys[i], &len)){
+	    goto out;
+	}
+    }
+    /* Chunk IDs are MACs under a key of their own */
+    if(!EVP_DigestInit_ex(md, EVP_sha256(), NULL) ||
+       !EVP_DigestUpdate(md, "pa4-encfs:chunk-id", 18) ||
+       !EVP_DigestUpdate(md, keys[CRYPT_AES256_CBC], 32) ||
+       !EVP_DigestFinal_ex(md, id_key, &len)){
+	goto out;
+    }
+    /* and metadata MACs under another, so no chunk ID doubles as one */
+    if(!EVP_DigestInit_ex(md, EVP_sha256(), NULL) ||
+       !EVP_DigestUpdate(md, "pa4-encfs:mac", 13) ||
+       !EVP_DigestUpdate(md, keys[CRYPT_AES256_CBC], 32) ||
+       !EVP_DigestFinal_ex(md, mac_key, &len)){
+	goto out;
+    }
+    /* The key ID names the key in file formats without giving it away */
+    if(!EVP_DigestInit_ex(md, EVP_sha256(), NULL) ||
+       !EVP_DigestUpdate(md, "pa4-encfs:key-id", 16) ||
+       !EVP_DigestUpdate(md, keys[CRYPT_AES256_CBC], 32) ||
+       !EVP_DigestFinal_ex(md, digest, &len)){
+	goto out;
+    }
+    *id = (unsigned int)digest[0] << 24 | digest[1] << 16 | digest[2] << 8 | digest[3];
+    res = SUCCESS;
+
+out:
+    EVP_MD_CTX_free(md);
+    return res;
+}
+
+extern int crypt_engines_init(char* key_str){
+    return crypt_key_add(key_str) == 0 ? SUCCESS : FAILURE;
+}
+
+extern int crypt_key_add(char* key_str){
+    unsigned int id;
+    int k, res = -1;
+
+    pthread_mutex_lock(&keys_lock);
+    if(nkeys < CRYPT_KEYS &&
+       derive_keys(key_str, engine_keys[nkeys], essiv_keys[nkeys],
+		   id_keys[nkeys], mac_keys[nkeys], &id)){
+	for(k = 0; k < nkeys && key_ids[k] != id; k++){
+	}
+	if(k == nkeys){
+	    key_ids[k] = id;
+	    /* Publishes the slot filled in above */
+	    __atomic_store_n(&nkeys, nkeys + 1, __ATOMIC_RELEASE);
+	}
+	res = k;
+    }
+    pthread_mutex_unlock(&keys_lock);
+    return res;
+}
+
+extern unsigned int crypt_key_id(int key){
+    return key_valid(key) ? key_ids[key] : 0;
+}
+
+extern int crypt_key_find(unsigned int id){
+    int n = __atomic_load_n(&nkeys, __ATOMIC_ACQUIRE);
+    int k;
+
+    for(k = 0; k < n; k++){
+	if(key_ids[k] == id){
+	    return k;
+	}
+    }
+    return -1;
+}
+
+extern int crypt_chunk_id(int key, const unsigned char* in, size_t len,
+			  unsigned char id[CRYPT_ID]){
+    unsigned int n = CRYPT_ID;
+
+    if(!key_valid(key) ||
+       !HMAC(EVP_sha256(), id_keys[key], 32, in, len, id, &n)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int crypt_mac(int key, const unsigned char* in, size_t len,
+		     unsigned char mac[CRYPT_ID]){
+    unsigned int n = CRYPT_ID;
+
+    if(!key_valid(key) ||
+       !HMAC(EVP_sha256(), mac_keys[key], 32, in, len, mac, &n)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern const struct crypt_engine* crypt_engine(int id){
+    if(id < 0 || id >= CRYPT_ENGINES){
+	return NULL;
+    }
+    return &engines[id];
+}
+
+extern int crypt_engine_find(const char* name, size_t len){
+    int i;
+
+    for(i = 0; i < CRYPT_ENGINES; i++){
+	if(strlen(engines[i].name) == len && !strncmp(engines[i].name, name, len)){
+	    return i;
+	}
+    }
+    return -1;
+}
+
+extern double crypt_engine_bench(int id){
+    const struct crypt_engine* e = crypt_engine(id);
+    unsigned char tweak[CRYPT_TWEAK];
+    unsigned char* plain;
+    unsigned char* sealed;
+    struct timespec t0, t1;
+    double secs = 0;
+    double bytes = 0;
+    double res = -1;
+    int i;
+
+    if(!e){
+	return -1;
+    }
+    plain = arena_get(CRYPT_CHUNK_MAX);
+    sealed = arena_get(CRYPT_CHUNK_MAX + e->overhead);
+    if(!plain || !sealed){
+	goto out;
+    }
+    memset(tweak, 0, sizeof(tweak));
+    memset(plain, 0xa5, CRYPT_CHUNK_MAX);
+
+    /* A round trip of at least 20ms worth of chunks */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do{
+	for(i = 0; i < 64; i++){
+	    tweak[15] = i;
+	    if(!e->seal(e, 0, tweak, plain, CRYPT_CHUNK_MAX, sealed) ||
+	       !e->open(e, 0, tweak, sealed, CRYPT_CHUNK_MAX + e->overhead, plain)){
+		goto out;
+	    }
+	}
+	bytes += 64.0 * CRYPT_CHUNK_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    }while(secs < 0.02);
+    res = bytes / secs / 1e6;
+
+out:
+    arena_put(plain, CRYPT_CHUNK_MAX);
+    arena_put(sealed, CRYPT_CHUNK_MAX + e->overhead);
+    return res;
 }
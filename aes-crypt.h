@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
@@ -29,6 +32,19 @@
 #define FAILURE 0
 #define SUCCESS 1
 
+/* O_DIRECT offset/length/buffer alignment */
+#define DIRECT_ALIGN 4096
+
+/* int crypt_derive_key(char* key_str, unsigned char key[32], unsigned char iv[32])
+ * Purpose: Build the AES-256-CBC key and IV from the passphrase, the same
+ *          way do_crypt does, so existing files keep decrypting
+ * Args: char* key_str      : C-string containing passpharse from which key is derived
+ *       unsigned char* key : Key output
+ *       unsigned char* iv  : IV output
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_derive_key(char* key_str, unsigned char key[32], unsigned char iv[32]);
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
@@ -39,4 +55,149 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* off_t crypt_plainsize(int fd, char* key_str)
+ * Purpose: Find the plaintext length of a file encrypted by do_crypt
+ *          by decrypting only its final (padding) cipher block
+ * Args: int fd        : Readable descriptor of the encrypted file
+ *	 char* key_str : C-string containing passpharse from which key is derived
+ * Return: Plaintext size in bytes, -1 on error or bad padding
+ */
+extern off_t crypt_plainsize(int fd, char* key_str);
+
+/* ssize_t crypt_pread(int fd, char* buf, size_t size, off_t offset, char* key_str)
+ * Purpose: pread() on the plaintext of a file encrypted by do_crypt.
+ *          Only the cipher blocks covering the range (plus the one block
+ *          chained in front of them) are read and decrypted.
+ * Args: int fd        : Readable descriptor of the encrypted file
+ *       char* buf     : Plaintext output
+ *       size_t size   : Bytes wanted
+ *       off_t offset  : Plaintext offset
+ *	 char* key_str : C-string containing passpharse from which key is derived
+ *          fd may be opened with O_DIRECT; the cipher blocks are then
+ *          read through a DIRECT_ALIGN aligned buffer.
+ * Return: Bytes read (short or 0 at end of file), -1 on error
+ */
+extern ssize_t crypt_pread(int fd, char* buf, size_t size, off_t offset, char* key_str);
+
+/* Chunk cipher engines
+ *
+ * An engine encrypts one chunk (up to CRYPT_CHUNK_MAX bytes) on its own.
+ * The tweak ties a chunk to its file and position (8 byte file nonce,
+ * then the big endian chunk index) and a sealed chunk is overhead bytes
+ * longer than its plaintext:
+ *
+ *  aes256-cbc        : CBC with an ESSIV IV derived from the tweak and
+ *                      residual block termination, no overhead. The
+ *                      original chunked format.
+ *  aes128-gcm,
+ *  aes256-gcm,
+ *  chacha20-poly1305 : AEAD with the tweak as associated data. A fresh
+ *                      random 12 byte nonce is stored in front of the
+ *                      ciphertext and the 16 byte tag behind it, so a
+ *                      chunk can be rewritten in place without nonce
+ *                      reuse, and a modified or moved chunk fails to open.
+ *
+ * Engines are numbered by enum crypt_engine_id; the numbers never change.
+ *
+ * Several passphrases can be loaded at once, for key rotation. Each gets a
+ * key slot (0 for the first) holding the keys of every engine, and a 32
+ * bit key ID derived from them that files record instead of the slot.
+ */
+
+#define CRYPT_TWEAK 16
+#define CRYPT_CHUNK_MAX 4096
+#define CRYPT_KEYS 16
+#define CRYPT_ID 32
+
+enum crypt_engine_id {
+    CRYPT_AES256_CBC,
+    CRYPT_AES128_GCM,
+    CRYPT_AES256_GCM,
+    CRYPT_CHACHA20_POLY1305,
+    CRYPT_ENGINES
+};
+
+struct crypt_engine {
+    const char* name;
+    /* Bytes a sealed chunk is longer than its plaintext */
+    size_t overhead;
+    /* in (len bytes) -> out (len + overhead bytes) with the keys of
+     * slot key */
+    int (*seal)(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		const unsigned char* in, size_t len, unsigned char* out);
+    /* in (len bytes, overhead included) -> out (len - overhead bytes),
+     * FAILURE if the chunk doesn't authenticate */
+    int (*open)(const struct crypt_engine* e, int key, const unsigned char* tweak,
+		const unsigned char* in, size_t len, unsigned char* out);
+    int id;
+    const EVP_CIPHER* (*cipher)(void);
+    int keylen;
+};
+
+/* int crypt_engines_init(char* key_str)
+ * Purpose: Derive the keys of all engines from the passphrase into key
+ *          slot 0
+ * Args: char* key_str : C-string containing passpharse from which key is derived
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_engines_init(char* key_str);
+
+/* int crypt_key_add(char* key_str)
+ * Purpose: Load another passphrase into the next free key slot. Safe to
+ *          call while other threads encrypt and decrypt.
+ * Args: char* key_str : C-string containing passpharse from which key is derived
+ * Return: The key slot (the existing one if the passphrase is already
+ *         loaded), -1 on error or if all CRYPT_KEYS slots are taken
+ */
+extern int crypt_key_add(char* key_str);
+
+/* unsigned int crypt_key_id(int key)
+ * Purpose: Key ID of a key slot
+ * Return: The ID, 0 if the slot is empty
+ */
+extern unsigned int crypt_key_id(int key);
+
+/* int crypt_key_find(unsigned int id)
+ * Purpose: Look up a loaded key by its key ID
+ * Return: The key slot, -1 if no loaded passphrase has that ID
+ */
+extern int crypt_key_find(unsigned int id);
+
+/* int crypt_chunk_id(int key, const unsigned char* in, size_t len,
+ *                     unsigned char id[CRYPT_ID])
+ * Purpose: Name a chunk by its contents: HMAC-SHA256 of in under a key
+ *          derived from key slot key, so equal chunks get equal IDs but
+ *          nobody without the passphrase can work out the ID of a guess
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_chunk_id(int key, const unsigned char* in, size_t len,
+			  unsigned char id[CRYPT_ID]);
+
+/* int crypt_mac(int key, const unsigned char* in, size_t len,
+ *                unsigned char mac[CRYPT_ID])
+ * Purpose: Authenticate file metadata: HMAC-SHA256 of in under a key
+ *          derived from key slot key, separate from the chunk ID key
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_mac(int key, const unsigned char* in, size_t len,
+		     unsigned char mac[CRYPT_ID]);
+
+/* const struct crypt_engine* crypt_engine(int id)
+ * Purpose: Look up an engine by enum crypt_engine_id
+ * Return: The engine, NULL if id is unknown
+ */
+extern const struct crypt_engine* crypt_engine(int id);
+
+/* int crypt_engine_find(const char* name, size_t len)
+ * Purpose: Look up an engine by the first len characters of name
+ * Return: The engine id, -1 if there is no such engine
+ */
+extern int crypt_engine_find(const char* name, size_t len);
+
+/* double crypt_engine_bench(int id)
+ * Purpose: Time sealing and opening full chunks with an engine on this CPU
+ * Return: Throughput in MB/s, negative if the engine doesn't work here
+ */
+extern double crypt_engine_bench(int id);
+
 #endif
@@ -0,0 +1,185 @@
+/* encfs-arena.c
+ * Locked buffer arena for pa4-encfs
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <openssl/crypto.h>
+
+#include "encfs-arena.h"
+#include "encfs-stats.h"
+
+#define ARENA_CLASSES 3
+/* free blocks a thread keeps for itself, per class */
+#define ARENA_KEEP 8
+
+struct arena_free {
+	struct arena_free* next;
+};
+
+struct arena_local {
+	struct arena_free* free[ARENA_CLASSES];
+	int count[ARENA_CLASSES];
+	int registered;
+};
+
+static const size_t class_size[ARENA_CLASSES] = {
+	ARENA_SMALL, ARENA_MEDIUM, ARENA_LARGE
+};
+
+static __thread struct arena_local local;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_free* pool[ARENA_CLASSES];
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+
+/* blocks mapped and blocks handed out, per class */
+static unsigned long total[ARENA_CLASSES];
+static unsigned long in_use[ARENA_CLASSES];
+
+static int class_of(size_t size)
+{
+	int c;
+
+	for (c = 0; c < ARENA_CLASSES; c++)
+		if (size <= class_size[c])
+			return c;
+	return -1;
+}
+
+static void* map_block(size_t size)
+{
+	void* p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (mlock(p, size) == -1)
+		STAT_INC(arena_unlocked);
+	madvise(p, size, MADV_DONTDUMP);
+	STAT_INC(arena_maps);
+	return p;
+}
+
+//a dying thread hands its free blocks to the shared pool
+static void local_flush(void* arg)
+{
+	struct arena_local* l = arg;
+	struct arena_free* b;
+	int c;
+
+	pthread_mutex_lock(&pool_lock);
+	for (c = 0; c < ARENA_CLASSES; c++) {
+		while ((b = l->free[c])) {
+			l->free[c] = b->next;
+			b->next = pool[c];
+			pool[c] = b;
+		}
+		l->count[c] = 0;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void make_key(void)
+{
+	pthread_key_create(&exit_key, local_flush);
+}
+
+static int arena_report(char* buf, size_t size)
+{
+	size_t len = 0;
+	int c;
+
+	for (c = 0; c < ARENA_CLASSES; c++) {
+		len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0,
+				"arena_%zuk_blocks %lu\narena_%zuk_in_use %lu\n",
+				class_size[c] >> 10,
+				__atomic_load_n(&total[c], __ATOMIC_RELAXED),
+				class_size[c] >> 10,
+				__atomic_load_n(&in_use[c], __ATOMIC_RELAXED));
+	}
+	return len;
+}
+
+int arena_init(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_MEMLOCK, &rl);
+	}
+	return stats_register(arena_report);
+}
+
+void* arena_get(size_t size)
+{
+	int c = class_of(size);
+	struct arena_free* b;
+
+	if (c < 0) {
+		STAT_INC(arena_oversize);
+		return map_block(size);
+	}
+
+	b = local.free[c];
+	if (b) {
+		local.free[c] = b->next;
+		local.count[c]--;
+	} else {
+		pthread_mutex_lock(&pool_lock);
+		b = pool[c];
+		if (b)
+			pool[c] = b->next;
+		pthread_mutex_unlock(&pool_lock);
+		if (!b) {
+			b = map_block(class_size[c]);
+			if (!b)
+				return NULL;
+			__atomic_add_fetch(&total[c], 1, __ATOMIC_RELAXED);
+		}
+	}
+	b->next = NULL;
+	__atomic_add_fetch(&in_use[c], 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void arena_put(void* p, size_t size)
+{
+	int c = class_of(size);
+	struct arena_free* b = p;
+
+	if (!p)
+		return;
+	if (c < 0) {
+		OPENSSL_cleanse(p, size);
+		munmap(p, size);
+		return;
+	}
+
+	OPENSSL_cleanse(p, class_size[c]);
+	__atomic_sub_fetch(&in_use[c], 1, __ATOMIC_RELAXED);
+	if (!local.registered) {
+		pthread_once(&key_once, make_key);
+		pthread_setspecific(exit_key, &local);
+		local.registered = 1;
+	}
+	if (local.count[c] < ARENA_KEEP) {
+		b->next = local.free[c];
+		local.free[c] = b;
+		local.count[c]++;
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	b->next = pool[c];
+	pool[c] = b;
+	pthread_mutex_unlock(&pool_lock);
+}
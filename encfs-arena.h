@@ -0,0 +1,44 @@
+/* encfs-arena.h
+ * Locked buffer arena for pa4-encfs
+ *
+ * Plaintext and ciphertext buffers come from here instead of malloc().
+ * Blocks are page aligned (so they also work for O_DIRECT), mlock()ed so
+ * plaintext can't be written to swap, left out of core dumps, and wiped
+ * when they are handed back. Freed blocks are kept on a per-thread free
+ * list (spilling into a shared pool), so the read and write paths don't
+ * touch the allocator once the pool has warmed up.
+ *
+ */
+
+#ifndef ENCFS_ARENA_H
+#define ENCFS_ARENA_H
+
+#include <stddef.h>
+
+/* Block sizes. Requests are rounded up to the next one; bigger requests
+ * get a one-off block that is unmapped again on arena_put(). */
+#define ARENA_SMALL (4 * 1024)
+#define ARENA_MEDIUM (64 * 1024)
+#define ARENA_LARGE (256 * 1024)
+
+/* int arena_init(void)
+ * Purpose: Raise RLIMIT_MEMLOCK as far as allowed and register the pool
+ *          occupancy report. Blocks can be taken before this is called.
+ * Return: 0 on success, -1 on error
+ */
+extern int arena_init(void);
+
+/* void* arena_get(size_t size)
+ * Purpose: Take a zeroed, page aligned, locked block of at least size bytes
+ * Return: The block, NULL if out of memory
+ */
+extern void* arena_get(size_t size);
+
+/* void arena_put(void* p, size_t size)
+ * Purpose: Wipe a block and give it back
+ * Args: void* p     : Block from arena_get() (NULL is ignored)
+ *       size_t size : The size it was asked for with
+ */
+extern void arena_put(void* p, size_t size);
+
+#endif
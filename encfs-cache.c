@@ -0,0 +1,360 @@
+/* encfs-cache.c
+ * Plaintext block cache for pa4-encfs
+ *
+ * The cache is split into shards by (dev, ino) so that all blocks of a
+ * file live in one shard. Each shard has its own lock, hash table and LRU
+ * list; a miss decrypts with the shard unlocked.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-cache.h"
+#include "encfs-stats.h"
+
+#define NSHARDS 16
+
+struct cache_entry {
+	dev_t dev;
+	ino_t ino;
+	off_t idx;
+	/* backing file state the block was decrypted from */
+	off_t csize;
+	struct timespec mtime;
+	/* set by decrypt-ahead until a reader uses the block */
+	int prefetched;
+	size_t len;
+	struct cache_entry* hnext;
+	struct cache_entry* prev;
+	struct cache_entry* next;
+	/* the plaintext, a locked arena block */
+	char* data;
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry** table;
+	size_t nbuckets;
+	/* LRU list, most recently used after head */
+	struct cache_entry head;
+	size_t count;
+	size_t max;
+	/* bumped by every invalidation, see cache_fill() */
+	unsigned long inval;
+};
+
+static struct cache_shard shards[NSHARDS];
+static int cache_enabled;
+static size_t cache_bytes;
+
+static unsigned long hash_file(dev_t dev, ino_t ino)
+{
+	unsigned long h = (unsigned long) ino * 0x9e3779b97f4a7c15UL;
+
+	return h ^ (unsigned long) dev;
+}
+
+static struct cache_shard* shard_of(dev_t dev, ino_t ino)
+{
+	return &shards[(hash_file(dev, ino) >> 16) % NSHARDS];
+}
+
+static size_t bucket_of(struct cache_shard* sh, dev_t dev, ino_t ino, off_t idx)
+{
+	return (hash_file(dev, ino) + (unsigned long) idx * 31) % sh->nbuckets;
+}
+
+static int stamp_ok(const struct cache_entry* e, const struct stat* st)
+{
+	return e->csize == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void lru_unlink(struct cache_entry* e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct cache_shard* sh, struct cache_entry* e)
+{
+	e->next = sh->head.next;
+	e->prev = &sh->head;
+	sh->head.next->prev = e;
+	sh->head.next = e;
+}
+
+static struct cache_entry* find(struct cache_shard* sh, dev_t dev, ino_t ino, off_t idx)
+{
+	struct cache_entry* e;
+
+	for (e = sh->table[bucket_of(sh, dev, ino, idx)]; e; e = e->hnext)
+		if (e->ino == ino && e->dev == dev && e->idx == idx)
+			return e;
+	return NULL;
+}
+
+static void entry_free(struct cache_entry* e)
+{
+	arena_put(e->data, CACHE_BLOCK);
+	free(e);
+}
+
+//unhooks e from the table and LRU and frees it; shard must be locked
+static void drop(struct cache_shard* sh, struct cache_entry* e)
+{
+	struct cache_entry** pp = &sh->table[bucket_of(sh, e->dev, e->ino, e->idx)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	lru_unlink(e);
+	sh->count--;
+	if (e->prefetched)
+		STAT_INC(prefetch_wasted);
+	entry_free(e);
+}
+
+static int cache_report(char* buf, size_t size)
+{
+	size_t blocks = 0;
+	int i;
+
+	for (i = 0; i < NSHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		blocks += shards[i].count;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	return snprintf(buf, size, "cache_blocks %zu\ncache_bytes %zu\ncache_limit %zu\n",
+			blocks, blocks * CACHE_BLOCK, cache_bytes);
+}
+
+int cache_init(size_t bytes)
+{
+	size_t per_shard = bytes / CACHE_BLOCK / NSHARDS;
+	int i;
+
+	cache_bytes = bytes;
+	if (per_shard == 0)
+		return 0;
+
+	for (i = 0; i < NSHARDS; i++) {
+		struct cache_shard* sh = &shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->nbuckets = per_shard * 2 + 1;
+		sh->table = calloc(sh->nbuckets, sizeof(*sh->table));
+		if (!sh->table)
+			return -1;
+		sh->head.next = sh->head.prev = &sh->head;
+		sh->max = per_shard;
+	}
+	cache_enabled = 1;
+	stats_register(cache_report);
+	return 0;
+}
+
+void cache_destroy(void)
+{
+	int i;
+
+	if (!cache_enabled)
+		return;
+	cache_enabled = 0;
+	for (i = 0; i < NSHARDS; i++) {
+		struct cache_shard* sh = &shards[i];
+
+		pthread_mutex_lock(&sh->lock);
+		while (sh->head.next != &sh->head)
+			drop(sh, sh->head.next);
+		free(sh->table);
+		sh->table = NULL;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+//decrypts block idx and inserts it unless the file was invalidated while
+//we were decrypting. Returns the new entry's length or -1.
+static ssize_t cache_fill(int fd, const struct stat* st, off_t idx,
+			  const struct fmt_meta* m, int prefetched, char* out)
+{
+	struct cache_shard* sh = shard_of(st->st_dev, st->st_ino);
+	struct cache_entry* e;
+	struct cache_entry* old;
+	unsigned long inval;
+	ssize_t len;
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		return -1;
+	e->data = arena_get(CACHE_BLOCK);
+	if (!e->data) {
+		free(e);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	inval = sh->inval;
+	pthread_mutex_unlock(&sh->lock);
+
+	len = fmt_pread(fd, m, e->data, CACHE_BLOCK, idx * CACHE_BLOCK);
+	if (len <= 0) {
+		entry_free(e);
+		return len;
+	}
+	if (out)
+		memcpy(out, e->data, len);
+
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->idx = idx;
+	e->csize = st->st_size;
+	e->mtime = st->st_mtim;
+	e->prefetched = prefetched;
+	e->len = len;
+
+	pthread_mutex_lock(&sh->lock);
+	if (inval != sh->inval || !sh->table) {
+		//a writer got in while we were decrypting, don't cache
+		pthread_mutex_unlock(&sh->lock);
+		entry_free(e);
+		return len;
+	}
+	old = find(sh, e->dev, e->ino, idx);
+	if (old)
+		drop(sh, old);
+	while (sh->count >= sh->max) {
+		drop(sh, sh->head.prev);
+		STAT_INC(cache_evictions);
+	}
+	e->hnext = sh->table[bucket_of(sh, e->dev, e->ino, idx)];
+	sh->table[bucket_of(sh, e->dev, e->ino, idx)] = e;
+	lru_push(sh, e);
+	sh->count++;
+	pthread_mutex_unlock(&sh->lock);
+
+	return len;
+}
+
+//copies block idx out of the cache; returns its length or -1 on a miss
+static ssize_t cache_lookup(const struct stat* st, off_t idx, char* out,
+			    int* prefetched)
+{
+	struct cache_shard* sh = shard_of(st->st_dev, st->st_ino);
+	struct cache_entry* e;
+	ssize_t len = -1;
+
+	pthread_mutex_lock(&sh->lock);
+	e = sh->table ? find(sh, st->st_dev, st->st_ino, idx) : NULL;
+	if (e && stamp_ok(e, st)) {
+		memcpy(out, e->data, e->len);
+		len = e->len;
+		if (e->prefetched) {
+			e->prefetched = 0;
+			(*prefetched)++;
+			STAT_INC(prefetch_hits);
+		}
+		lru_unlink(e);
+		lru_push(sh, e);
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return len;
+}
+
+ssize_t cache_read(int fd, const struct stat* st, char* buf, size_t size,
+		   off_t offset, const struct fmt_meta* m, int* prefetched)
+{
+	char* block;
+	size_t done = 0;
+	int pf = 0;
+
+	if (!cache_enabled) {
+		if (prefetched)
+			*prefetched = 0;
+		return fmt_pread(fd, m, buf, size, offset);
+	}
+
+	block = arena_get(CACHE_BLOCK);
+	if (!block)
+		return -1;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t idx = pos / CACHE_BLOCK;
+		size_t in = pos % CACHE_BLOCK;
+		size_t n;
+		ssize_t len;
+
+		len = cache_lookup(st, idx, block, &pf);
+		if (len >= 0) {
+			STAT_INC(cache_hits);
+		} else {
+			STAT_INC(cache_misses);
+			len = cache_fill(fd, st, idx, m, 0, block);
+			if (len < 0) {
+				arena_put(block, CACHE_BLOCK);
+				return done ? (ssize_t) done : -1;
+			}
+		}
+		if ((size_t) len <= in)
+			break;
+		n = len - in;
+		if (n > size - done)
+			n = size - done;
+		memcpy(buf + done, block + in, n);
+		done += n;
+		if ((size_t) len < CACHE_BLOCK)
+			break;
+	}
+
+	arena_put(block, CACHE_BLOCK);
+	if (prefetched)
+		*prefetched = pf;
+	return done;
+}
+
+int cache_prefetch(int fd, const struct stat* st, off_t idx,
+		   const struct fmt_meta* m)
+{
+	struct cache_shard* sh = shard_of(st->st_dev, st->st_ino);
+	struct cache_entry* e;
+	int present;
+
+	if (!cache_enabled || idx * CACHE_BLOCK >= st->st_size)
+		return -1;
+
+	pthread_mutex_lock(&sh->lock);
+	e = find(sh, st->st_dev, st->st_ino, idx);
+	present = e && stamp_ok(e, st);
+	pthread_mutex_unlock(&sh->lock);
+	if (present)
+		return 0;
+
+	if (cache_fill(fd, st, idx, m, 1, NULL) <= 0)
+		return -1;
+	return 1;
+}
+
+void cache_invalidate(dev_t dev, ino_t ino)
+{
+	struct cache_shard* sh = shard_of(dev, ino);
+	struct cache_entry* e;
+	struct cache_entry* next;
+
+	if (!cache_enabled)
+		return;
+
+	pthread_mutex_lock(&sh->lock);
+	sh->inval++;
+	for (e = sh->head.next; e != &sh->head; e = next) {
+		next = e->next;
+		if (e->ino == ino && e->dev == dev)
+			drop(sh, e);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
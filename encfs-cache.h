@@ -0,0 +1,65 @@
+/* encfs-cache.h
+ * Plaintext block cache for pa4-encfs
+ *
+ * Decrypted data is cached in CACHE_BLOCK sized blocks keyed by the
+ * backing file's (dev, ino) and block index. Every block remembers the
+ * backing size and mtime it was decrypted from and is ignored once those
+ * change. Writers still call cache_invalidate(), since mtime updates are
+ * too coarse to tell two quick writes apart.
+ *
+ */
+
+#ifndef ENCFS_CACHE_H
+#define ENCFS_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "encfs-format.h"
+
+#define CACHE_BLOCK (64 * 1024)
+
+/* int cache_init(size_t bytes)
+ * Purpose: Set up the cache
+ * Args: size_t bytes : Upper bound for cached plaintext (0 disables caching)
+ * Return: 0 on success, -1 on error
+ */
+extern int cache_init(size_t bytes);
+
+/* void cache_destroy(void)
+ * Purpose: Drop every block and free the cache
+ */
+extern void cache_destroy(void);
+
+/* ssize_t cache_read(int fd, const struct stat* st, char* buf, size_t size,
+ *                    off_t offset, const struct fmt_meta* m, int* prefetched)
+ * Purpose: Read plaintext of an encrypted file through the cache,
+ *          decrypting and inserting any missing blocks
+ * Args: int fd                : Readable descriptor of the backing file
+ *       const struct stat* st : fstat() of fd, used to validate blocks
+ *       char* buf             : Plaintext output
+ *       size_t size           : Bytes wanted
+ *       off_t offset          : Plaintext offset
+ *       const struct fmt_meta* m : Format of the file (fmt_get())
+ *       int* prefetched       : Set to the number of blocks that were there
+ *                               because of decrypt-ahead (may be NULL)
+ * Return: Bytes read (short at end of file), -1 on error
+ */
+extern ssize_t cache_read(int fd, const struct stat* st, char* buf, size_t size,
+			  off_t offset, const struct fmt_meta* m, int* prefetched);
+
+/* int cache_prefetch(int fd, const struct stat* st, off_t idx,
+ *                    const struct fmt_meta* m)
+ * Purpose: Decrypt block idx into the cache ahead of a reader
+ * Return: 1 if the block was decrypted, 0 if it was already cached,
+ *         -1 past end of file or on error
+ */
+extern int cache_prefetch(int fd, const struct stat* st, off_t idx,
+			  const struct fmt_meta* m);
+
+/* void cache_invalidate(dev_t dev, ino_t ino)
+ * Purpose: Drop all blocks of a file whose contents are being changed
+ */
+extern void cache_invalidate(dev_t dev, ino_t ino);
+
+#endif
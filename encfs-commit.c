@@ -0,0 +1,187 @@
+/* encfs-commit.c
+ * Group commit for fsync() on pa4-encfs
+ *
+ * Groups are numbered. open_gen is the group new callers join, done_gen
+ * the last group whose flush has finished. A caller in group g may return
+ * once done_gen >= g.
+ *
+ */
+
+/* For syncfs() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "encfs-commit.h"
+#include "encfs-intent.h"
+#include "encfs-stats.h"
+#include "encfs-stripe.h"
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t committer;
+static int running;
+static int stopping;
+static int rootfd = -1;
+static int interval;
+
+static unsigned long open_gen = 1;
+static unsigned long done_gen;
+static int waiting; /* callers in open_gen */
+static int kicked; /* a flush was asked for without anybody waiting */
+/* newest failed group and its error */
+static unsigned long fail_gen;
+static int fail_err;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//the mirror root, then the other stripes of striped files. the chunks
+//rewritten in place since the last flush are in an intent log, which
+//can go once they are durable
+static int flush_all(void)
+{
+	int log = intent_switch();
+	int err = 0;
+
+	STAT_INC(commit_flushes);
+	if (syncfs(rootfd) == -1)
+		err = -errno;
+	else
+		err = stripe_syncfs();
+	intent_retire(log, !err);
+	return err;
+}
+
+static void* commit_thread(void* arg)
+{
+	struct timespec ts;
+	unsigned long gen;
+	int err;
+
+	(void) arg;
+	pthread_mutex_lock(&commit_lock);
+	for (;;) {
+		while (!waiting && !kicked && !stopping)
+			pthread_cond_wait(&request_cond, &commit_lock);
+		if (!waiting && stopping)
+			break;
+
+		//keep the group open a little longer so more callers can join
+		if (interval > 0 && !stopping) {
+			pthread_mutex_unlock(&commit_lock);
+			ts.tv_sec = interval / 1000;
+			ts.tv_nsec = (interval % 1000) * 1000000L;
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&commit_lock);
+		}
+
+		gen = open_gen++;
+		waiting = 0;
+		kicked = 0;
+		pthread_mutex_unlock(&commit_lock);
+
+		err = flush_all();
+
+		pthread_mutex_lock(&commit_lock);
+		if (err) {
+			fail_gen = gen;
+			fail_err = err;
+		}
+		done_gen = gen;
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return NULL;
+}
+
+static int commit_report(char* buf, size_t size)
+{
+	unsigned long long flushes = STAT_GET(commit_flushes);
+
+	return snprintf(buf, size, "commit_fsyncs_per_flush %llu\n",
+			flushes ? STAT_GET(commit_requests) / flushes : 0);
+}
+
+int commit_init(const char* root, int interval_ms)
+{
+	rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1)
+		return -1;
+	interval = interval_ms;
+	if (pthread_create(&committer, NULL, commit_thread, NULL)) {
+		close(rootfd);
+		rootfd = -1;
+		return -1;
+	}
+	running = 1;
+	stats_register(commit_report);
+	return 0;
+}
+
+void commit_destroy(void)
+{
+	if (!running)
+		return;
+	pthread_mutex_lock(&commit_lock);
+	stopping = 1;
+	pthread_cond_signal(&request_cond);
+	pthread_mutex_unlock(&commit_lock);
+	pthread_join(committer, NULL);
+	running = 0;
+
+	flush_all();
+	close(rootfd);
+	rootfd = -1;
+}
+
+void commit_kick(void)
+{
+	pthread_mutex_lock(&commit_lock);
+	if (running && !kicked++)
+		pthread_cond_signal(&request_cond);
+	pthread_mutex_unlock(&commit_lock);
+}
+
+int commit_wait(void)
+{
+	unsigned long gen;
+	unsigned long long start = now_us();
+	int err = 0;
+
+	STAT_INC(commit_requests);
+	if (!running) {
+		//no committer (yet), flush on our own
+		if (rootfd != -1)
+			return flush_all();
+		sync();
+		return 0;
+	}
+
+	pthread_mutex_lock(&commit_lock);
+	gen = open_gen;
+	if (waiting++ == 0)
+		pthread_cond_signal(&request_cond);
+	while (done_gen < gen)
+		pthread_cond_wait(&done_cond, &commit_lock);
+	//report failures of our group or a later one (that one covered our
+	//data too)
+	if (fail_gen >= gen)
+		err = fail_err;
+	pthread_mutex_unlock(&commit_lock);
+
+	STAT_ADD(commit_wait_us, now_us() - start);
+	return err;
+}
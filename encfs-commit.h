@@ -0,0 +1,43 @@
+/* encfs-commit.h
+ * Group commit for fsync() on pa4-encfs
+ *
+ * fsync/fdatasync callers don't flush anything themselves. They join the
+ * currently open group and sleep; a committer thread closes the group
+ * after the flush interval, makes everything on the backing filesystem
+ * durable with a single syncfs() (plus one per --stripe-root, see
+ * encfs-stripe.h) and wakes the whole group. N concurrent
+ * fsyncs therefore cost one disk flush instead of N. Each flush also
+ * empties an intent log (encfs-intent.h), which can ask for one without
+ * anybody waiting.
+ *
+ */
+
+#ifndef ENCFS_COMMIT_H
+#define ENCFS_COMMIT_H
+
+/* int commit_init(const char* root, int interval_ms)
+ * Purpose: Start the committer thread
+ * Args: const char* root : Any path on the backing filesystem
+ *       int interval_ms  : How long a group stays open to collect more
+ *                          fsync calls after the first one arrives
+ * Return: 0 on success, -1 on error
+ */
+extern int commit_init(const char* root, int interval_ms);
+
+/* void commit_destroy(void)
+ * Purpose: Flush once more and stop the committer thread
+ */
+extern void commit_destroy(void);
+
+/* void commit_kick(void)
+ * Purpose: Have the committer flush soon even if no fsync is waiting
+ */
+extern void commit_kick(void);
+
+/* int commit_wait(void)
+ * Purpose: Block until everything written before the call is durable
+ * Return: 0 on success, -errno if the flush failed
+ */
+extern int commit_wait(void);
+
+#endif
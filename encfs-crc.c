@@ -0,0 +1,97 @@
+/* encfs-crc.c
+ * CRC32C for pa4-encfs
+ *
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "encfs-crc.h"
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static int use_hw = -1;
+
+static void make_table(void)
+{
+	uint32_t c;
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+}
+
+//slicing-by-8, crc is the inverted running value
+static uint32_t crc_sw(uint32_t crc, const unsigned char* p, size_t len)
+{
+	uint64_t w;
+
+	pthread_once(&table_once, make_table);
+	for (; len && ((uintptr_t) p & 7); len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+			table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+			table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+			table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	for (; len && ((uintptr_t) p & 7); len--)
+		c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+	return (uint32_t) c;
+}
+
+int crc32c_hw(void)
+{
+	if (use_hw < 0) {
+		__builtin_cpu_init();
+		use_hw = __builtin_cpu_supports("sse4.2");
+	}
+	return use_hw;
+}
+#else
+static uint32_t crc_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+	return crc_sw(crc, p, len);
+}
+
+int crc32c_hw(void)
+{
+	return use_hw = 0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+	crc = ~crc;
+	crc = crc32c_hw() ? crc_hw(crc, buf, len) : crc_sw(crc, buf, len);
+	return ~crc;
+}
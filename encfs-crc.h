@@ -0,0 +1,31 @@
+/* encfs-crc.h
+ * CRC32C for pa4-encfs
+ *
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and btrfs. On x86-64 CPUs
+ * with SSE4.2 it runs on the crc32 instruction, 8 bytes at a time;
+ * elsewhere it falls back to slicing-by-8 tables.
+ *
+ */
+
+#ifndef ENCFS_CRC_H
+#define ENCFS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+ * Purpose: Extend a CRC32C over len more bytes
+ * Args: uint32_t crc     : CRC of the bytes so far, 0 to start
+ *       const void* buf  : Bytes to add
+ *       size_t len       : Their count
+ * Return: The CRC over all bytes
+ */
+extern uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+/* int crc32c_hw(void)
+ * Purpose: Tell whether the crc32 instruction is used
+ * Return: 1 if it is, 0 for the table fallback
+ */
+extern int crc32c_hw(void);
+
+#endif
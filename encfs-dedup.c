@@ -0,0 +1,1586 @@
+/* encfs-dedup.c
+ * Deduplicating chunk store for pa4-encfs
+ *
+ * The index is split into DEDUP_LOCKS sets by the first byte of the ID,
+ * each with a mutex of its own; a chunk's entry (where it is, its count)
+ * is only read or changed with its set locked, so a hit costs one lock
+ * and no I/O. Appends (and compaction's copies) are serialized by a
+ * mutex of their own, taken before a set's. Readers hold files_lock
+ * shared across their pread() so compaction can't close a container
+ * under them; adding or removing a container takes it exclusive.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-crc.h"
+#include "encfs-dedup.h"
+#include "encfs-format.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-tier.h"
+
+#define DEDUP_DIR "/.pa4-encfs-chunks"
+/* written at a clean unmount, and removed again once it is loaded: a
+ * mount that finds none rebuilds the index from the containers and the
+ * tables */
+#define DEDUP_INDEX "/index"
+/* names in the mirror tree that aren't files of the mount */
+#define HIDDEN_PREFIX ".pa4-encfs"
+/* a container takes no more chunks past this size */
+#define DEDUP_ROLL (64 << 20)
+/* the newest container is closed early, so it can be compacted, once
+ * this much of it is dead */
+#define DEDUP_DEAD_MIN (16 << 20)
+#define DEDUP_MAGIC 0x4b434444
+#define DEDUP_INDEX_MAGIC 0x58444444
+#define DEDUP_LOCKS 256
+#define DEDUP_BUCKETS_MIN 64
+/* count of every chunk when the tables couldn't be walked, none is ever
+ * dropped */
+#define DEDUP_PINNED (LONG_MAX / 2)
+/* sealed bytes of a chunk: the plaintext and the engine's nonce and tag */
+#define DEDUP_SEALED_MAX (FMT_CHUNK + 64)
+#define DEDUP_CHUNK_MAX (sizeof(struct dedup_chunk) + DEDUP_SEALED_MAX)
+/* table entries per read when references are dropped or counted */
+#define DEDUP_DROP_BATCH (FMT_BATCH * FMT_CHUNK / DEDUP_REF)
+
+/* header of a chunk in a container, the sealed chunk follows it */
+struct dedup_chunk {
+	uint32_t magic;
+	uint32_t crc;		/* CRC32C of the rest of the header and the data */
+	unsigned char id[DEDUP_REF];
+	uint32_t key;		/* key ID */
+	uint16_t cipher;
+	uint16_t len;		/* plaintext bytes */
+	uint32_t slen;		/* sealed bytes following the header */
+};
+
+struct chunk_file {
+	unsigned int no;
+	int fd;
+	off_t size;		/* bytes of chunks, the next one goes here */
+	off_t live;		/* bytes of the chunks the index points at */
+};
+
+struct dedup_entry {
+	unsigned char id[DEDUP_REF];
+	struct chunk_file* file;
+	off_t off;
+	uint32_t size;		/* header and sealed bytes */
+	long refs;		/* table entries pointing at it */
+	struct dedup_entry* next;
+};
+
+struct dedup_set {
+	pthread_mutex_t lock;
+	struct dedup_entry** table;
+	size_t nbuckets, n;
+};
+
+/* an entry of the index file */
+struct dedup_index_rec {
+	unsigned char id[DEDUP_REF];
+	uint32_t file;
+	uint32_t size;
+	uint64_t off;
+	uint64_t refs;
+};
+
+/* end of the index file */
+struct dedup_index_tail {
+	uint32_t magic;
+	uint32_t crc;		/* CRC32C of the entries */
+	uint64_t count;
+};
+
+/* a table with more than one link, counted once after the walk */
+struct dedup_linked {
+	dev_t dev;
+	ino_t ino;
+	char* path;
+};
+
+struct dedup_dir {
+	char* path;
+	struct dedup_dir* next;
+};
+
+static char tree[PATH_MAX];
+static char store[PATH_MAX];
+static int loaded;
+/* the counts couldn't be rebuilt, they are pinned and no index is
+ * written, so the next mount tries again */
+static int unclean;
+/* table entries the rebuild found no chunk for */
+static size_t missing;
+static struct dedup_set sets[DEDUP_LOCKS];
+static pthread_once_t sets_once = PTHREAD_ONCE_INIT;
+static pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+/* oldest first, the last one takes the appends */
+static struct chunk_file** files;
+static int nfiles;
+/* a container compaction gave up on, it is left alone */
+static unsigned int stuck;
+
+static pthread_t thread;
+static int running;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+static int registered;
+
+static const unsigned char zeros[FMT_CHUNK];
+
+static void sets_init(void)
+{
+	int i;
+
+	for (i = 0; i < DEDUP_LOCKS; i++)
+		pthread_mutex_init(&sets[i].lock, NULL);
+}
+
+static struct dedup_set* set_of(const unsigned char* id)
+{
+	return &sets[id[0]];
+}
+
+static size_t bucket_of(const unsigned char* id, size_t n)
+{
+	uint64_t h;
+
+	memcpy(&h, id + 1, sizeof(h));
+	return (h * 0x9e3779b97f4a7c15ULL >> 32) & (n - 1);
+}
+
+//the set's lock held
+static struct dedup_entry* find(const struct dedup_set* s, const unsigned char* id)
+{
+	struct dedup_entry* e;
+
+	if (!s->nbuckets)
+		return NULL;
+	for (e = s->table[bucket_of(id, s->nbuckets)]; e; e = e->next)
+		if (!memcmp(e->id, id, DEDUP_REF))
+			return e;
+	return NULL;
+}
+
+//doubles the buckets of a set, its lock held. Failing only makes the
+//chains longer.
+static void grow(struct dedup_set* s)
+{
+	size_t n = s->nbuckets ? s->nbuckets * 2 : DEDUP_BUCKETS_MIN;
+	struct dedup_entry** t = calloc(n, sizeof(*t));
+	struct dedup_entry* e;
+	size_t i;
+
+	if (!t)
+		return;
+	for (i = 0; i < s->nbuckets; i++) {
+		while ((e = s->table[i]) != NULL) {
+			s->table[i] = e->next;
+			e->next = t[bucket_of(e->id, n)];
+			t[bucket_of(e->id, n)] = e;
+		}
+	}
+	free(s->table);
+	s->table = t;
+	s->nbuckets = n;
+}
+
+//the set's lock held; -1 if there are no buckets at all
+static int insert(struct dedup_set* s, struct dedup_entry* e)
+{
+	size_t b;
+
+	if (s->n >= s->nbuckets)
+		grow(s);
+	if (!s->nbuckets)
+		return -1;
+	b = bucket_of(e->id, s->nbuckets);
+	e->next = s->table[b];
+	s->table[b] = e;
+	s->n++;
+	return 0;
+}
+
+//the set's lock held
+static void drop(struct dedup_set* s, struct dedup_entry* e)
+{
+	struct dedup_entry** p = &s->table[bucket_of(e->id, s->nbuckets)];
+
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	s->n--;
+	free(e);
+}
+
+static void sets_free(void)
+{
+	struct dedup_entry* e;
+	size_t i;
+	int k;
+
+	for (k = 0; k < DEDUP_LOCKS; k++) {
+		for (i = 0; i < sets[k].nbuckets; i++) {
+			while ((e = sets[k].table[i]) != NULL) {
+				sets[k].table[i] = e->next;
+				free(e);
+			}
+		}
+		free(sets[k].table);
+		sets[k].table = NULL;
+		sets[k].nbuckets = sets[k].n = 0;
+	}
+}
+
+static int is_zero(const unsigned char* p, size_t len)
+{
+	return len == 0 || (p[0] == 0 && !memcmp(p, p + 1, len - 1));
+}
+
+static off_t nchunks(off_t size)
+{
+	return (size + FMT_CHUNK - 1) / FMT_CHUNK;
+}
+
+off_t dedup_plainsize(off_t backing)
+{
+	return backing > DEDUP_REF ? backing - DEDUP_REF : 0;
+}
+
+static off_t table_size(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return dedup_plainsize(st.st_size);
+}
+
+//reads the IDs of chunks [first, first + n), as far as the table has them
+static int table_read(int fd, off_t first, size_t n, unsigned char* ids)
+{
+	ssize_t got = fmt_backing_io(fd, ids, n * DEDUP_REF, first * DEDUP_REF, 0);
+
+	if (got < 0)
+		return -1;
+	memset(ids + got, 0, n * DEDUP_REF - got);
+	return 0;
+}
+
+//zero IDs over entries [first, first + n) of the table
+static int table_clear(int fd, off_t first, off_t n)
+{
+	off_t off = first * DEDUP_REF, len = n * DEDUP_REF;
+	size_t k;
+
+	if (len <= 0 || tier_punch(fd, off, len) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+	for (; len > 0; off += k, len -= k) {
+		k = len < FMT_CHUNK ? len : FMT_CHUNK;
+		if (fmt_backing_io(fd, (unsigned char*) zeros, k, off, 1) != (ssize_t) k)
+			return -1;
+	}
+	return 0;
+}
+
+
+static off_t chunk_size(const struct dedup_chunk* h)
+{
+	return sizeof(*h) + h->slen;
+}
+
+static uint32_t chunk_sum(const struct dedup_chunk* h)
+{
+	uint32_t crc = crc32c(0, h->id, sizeof(*h) - offsetof(struct dedup_chunk, id));
+
+	return crc32c(crc, h + 1, h->slen);
+}
+
+//a header that can be the start of a chunk
+static int chunk_sane(const struct dedup_chunk* h)
+{
+	return h->magic == DEDUP_MAGIC && h->slen <= DEDUP_SEALED_MAX &&
+		h->len && h->len <= FMT_CHUNK;
+}
+
+static void file_path(char* path, size_t size, unsigned int no)
+{
+	snprintf(path, size, "%s/chunks.%u", store, no);
+}
+
+static struct chunk_file* file_open(unsigned int no, int create)
+{
+	char path[PATH_MAX + 32];
+	struct chunk_file* p = calloc(1, sizeof(*p));
+
+	if (!p)
+		return NULL;
+	file_path(path, sizeof(path), no);
+	p->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+	if (p->fd == -1) {
+		free(p);
+		return NULL;
+	}
+	p->no = no;
+	return p;
+}
+
+static void file_close(struct chunk_file* p, int remove)
+{
+	char path[PATH_MAX + 32];
+
+	close(p->fd);
+	if (remove) {
+		file_path(path, sizeof(path), p->no);
+		unlink(path);
+	}
+	free(p);
+}
+
+//the container numbered no, NULL if there is none
+static struct chunk_file* file_of(unsigned int no)
+{
+	int lo = 0, hi = nfiles, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (files[mid]->no == no)
+			return files[mid];
+		if (files[mid]->no < no)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+//starts a new container for appends, append_lock held
+static int roll(void)
+{
+	struct chunk_file* p;
+	struct chunk_file** t;
+
+	p = file_open(nfiles ? files[nfiles - 1]->no + 1 : 1, 1);
+	if (!p)
+		return -1;
+	pthread_rwlock_wrlock(&files_lock);
+	t = realloc(files, (nfiles + 1) * sizeof(*t));
+	if (t) {
+		files = t;
+		files[nfiles++] = p;
+	}
+	pthread_rwlock_unlock(&files_lock);
+	if (!t) {
+		file_close(p, 1);
+		return -1;
+	}
+	return 0;
+}
+
+//writes a chunk at the end of the newest container, append_lock held.
+//Returns the container, NULL on error.
+static struct chunk_file* put(const struct dedup_chunk* h)
+{
+	off_t size = chunk_size(h);
+	struct chunk_file* p = nfiles ? files[nfiles - 1] : NULL;
+	ssize_t n;
+	int err;
+
+	if ((!p || (p->size && p->size + size > DEDUP_ROLL)) && roll())
+		return NULL;
+	p = files[nfiles - 1];
+	n = pwrite(p->fd, h, size, p->size);
+	if (n != size) {
+		err = n == -1 ? errno : ENOSPC;
+		//nothing may follow a torn chunk
+		if (ftruncate(p->fd, p->size) == -1)
+			perror("chunk store");
+		errno = err;
+		return NULL;
+	}
+	return p;
+}
+
+//takes a reference to chunk id if it is stored
+static int hit(const unsigned char* id, size_t len)
+{
+	struct dedup_set* s = set_of(id);
+	struct dedup_entry* e;
+
+	pthread_mutex_lock(&s->lock);
+	e = find(s, id);
+	if (e)
+		e->refs++;
+	pthread_mutex_unlock(&s->lock);
+	if (e) {
+		STAT_INC(dedup_hits);
+		STAT_ADD(dedup_hit_bytes, len);
+	}
+	return e != NULL;
+}
+
+//takes a reference to chunk id holding plain, storing it if it's new
+static int chunk_ref(const struct fmt_meta* m, const unsigned char* id,
+		     const unsigned char* plain, size_t len)
+{
+	const struct crypt_engine* e;
+	struct dedup_set* s = set_of(id);
+	struct dedup_entry* fresh = NULL;
+	struct dedup_chunk* h;
+	struct chunk_file* p;
+	off_t size;
+	int res = -1;
+
+	if (!loaded) {
+		errno = EIO;
+		return -1;
+	}
+	if (hit(id, len))
+		return 0;
+	e = crypt_engine(m->cipher);
+	if (!e) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	h = arena_get(DEDUP_CHUNK_MAX);
+	if (!h)
+		return -1;
+	memset(h, 0, sizeof(*h));
+	h->magic = DEDUP_MAGIC;
+	memcpy(h->id, id, DEDUP_REF);
+	h->key = crypt_key_id(m->key);
+	h->cipher = m->cipher;
+	h->len = len;
+	h->slen = len + e->overhead;
+	size = chunk_size(h);
+	if (!e->seal(e, m->key, id, plain, len, (unsigned char*) (h + 1))) {
+		errno = EIO;
+		goto out;
+	}
+	h->crc = chunk_sum(h);
+	fresh = calloc(1, sizeof(*fresh));
+	if (!fresh)
+		goto out;
+
+	//every chunk is stored with append_lock held, so one that isn't
+	//there now won't be until it is released
+	pthread_mutex_lock(&append_lock);
+	if (hit(id, len)) {
+		res = 0;
+	} else if ((p = put(h)) != NULL) {
+		memcpy(fresh->id, id, DEDUP_REF);
+		fresh->file = p;
+		fresh->off = p->size;
+		fresh->size = size;
+		fresh->refs = 1;
+		p->size += size;
+		pthread_mutex_lock(&s->lock);
+		if (insert(s, fresh) == 0) {
+			__atomic_add_fetch(&p->live, size, __ATOMIC_RELAXED);
+			fresh = NULL;
+			res = 0;
+		} else {
+			errno = ENOMEM;
+		}
+		pthread_mutex_unlock(&s->lock);
+		if (!res)
+			STAT_INC(dedup_stored);
+	}
+	pthread_mutex_unlock(&append_lock);
+out:
+	free(fresh);
+	arena_put(h, DEDUP_CHUNK_MAX);
+	return res;
+}
+
+//drops a reference to chunk id; one with none left is dead, compaction
+//reclaims its space
+static void chunk_unref(const unsigned char* id)
+{
+	struct dedup_set* s = set_of(id);
+	struct dedup_entry* e;
+
+	pthread_mutex_lock(&s->lock);
+	e = find(s, id);
+	if (e && --e->refs == 0) {
+		__atomic_sub_fetch(&e->file->live, e->size, __ATOMIC_RELAXED);
+		STAT_INC(dedup_freed);
+		STAT_ADD(dedup_freed_bytes, e->size);
+		drop(s, e);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+//opens chunk id into plain, which takes its len bytes
+static int chunk_open(const unsigned char* id, unsigned char* plain, size_t len)
+{
+	const struct crypt_engine* e;
+	struct dedup_set* s = set_of(id);
+	struct dedup_entry* ent;
+	struct dedup_chunk* h;
+	ssize_t want = 0, got = 0;
+	int key, res = -1;
+
+	if (!loaded) {
+		errno = EIO;
+		return -1;
+	}
+	h = arena_get(DEDUP_CHUNK_MAX);
+	if (!h)
+		return -1;
+	pthread_rwlock_rdlock(&files_lock);
+	pthread_mutex_lock(&s->lock);
+	ent = find(s, id);
+	if (ent) {
+		int fd = ent->file->fd;
+		off_t off = ent->off;
+
+		want = ent->size;
+		pthread_mutex_unlock(&s->lock);
+		if (want <= (ssize_t) DEDUP_CHUNK_MAX)
+			got = pread(fd, h, want, off);
+	} else {
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_rwlock_unlock(&files_lock);
+	//a table pointing at a chunk that isn't there is damaged
+	errno = EIO;
+	if (!ent || got != want || got < (ssize_t) sizeof(*h) || !chunk_sane(h) ||
+	    memcmp(h->id, id, DEDUP_REF) || h->len != len || chunk_size(h) != got)
+		goto out;
+	e = crypt_engine(h->cipher);
+	if (!e || h->slen != len + e->overhead)
+		goto out;
+	if (chunk_sum(h) != h->crc) {
+		STAT_INC(fmt_crc_failures);
+		goto out;
+	}
+	key = crypt_key_find(h->key);
+	if (key < 0) {
+		errno = ENOKEY;
+		goto out;
+	}
+	if (!e->open(e, key, id, (unsigned char*) (h + 1), h->slen, plain)) {
+		STAT_INC(fmt_auth_failures);
+		goto out;
+	}
+	res = 0;
+out:
+	arena_put(h, DEDUP_CHUNK_MAX);
+	return res;
+}
+
+ssize_t dedup_pread(int fd, const struct fmt_meta* m, char* buf, size_t size,
+		    off_t offset)
+{
+	unsigned char* ids;
+	unsigned char* plain;
+	off_t psize;
+	size_t done = 0;
+
+	(void) m;
+	psize = table_size(fd);
+	if (psize < 0)
+		return -1;
+	if (offset >= psize)
+		return 0;
+	if (size > (size_t) (psize - offset))
+		size = psize - offset;
+	ids = arena_get(FMT_BATCH * DEDUP_REF);
+	plain = arena_get(FMT_CHUNK);
+	if (!ids || !plain)
+		goto out;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t first = pos / FMT_CHUNK;
+		size_t in = pos - first * FMT_CHUNK;
+		size_t count = (in + (size - done) + FMT_CHUNK - 1) / FMT_CHUNK;
+		size_t k;
+
+		if (count > FMT_BATCH)
+			count = FMT_BATCH;
+		if (table_read(fd, first, count, ids))
+			goto out;
+		for (k = 0; k < count && done < size; k++) {
+			off_t cs = (first + k) * FMT_CHUNK;
+			size_t clen = psize - cs < FMT_CHUNK ? psize - cs : FMT_CHUNK;
+			size_t n = clen - in < size - done ? clen - in : size - done;
+			unsigned char* dst;
+
+			if (is_zero(ids + k * DEDUP_REF, DEDUP_REF)) {
+				STAT_INC(fmt_hole_reads);
+				memset(buf + done, 0, n);
+			} else {
+				//whole chunks are opened straight into buf
+				dst = in == 0 && n == clen ? (unsigned char*) buf + done : plain;
+				if (chunk_open(ids + k * DEDUP_REF, dst, clen))
+					goto out;
+				if (dst == plain)
+					memcpy(buf + done, plain + in, n);
+			}
+			done += n;
+			in = 0;
+		}
+	}
+out:
+	arena_put(plain, FMT_CHUNK);
+	arena_put(ids, FMT_BATCH * DEDUP_REF);
+	return done ? (ssize_t) done : (size ? -1 : 0);
+}
+
+ssize_t dedup_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+		     size_t size, off_t offset)
+{
+	unsigned char* ids;
+	unsigned char* old_ids;
+	unsigned char* plain;
+	char same[FMT_BATCH];
+	off_t old, newsize, nold, end = offset + size;
+	struct stat st;
+	size_t done = 0;
+	int err = 0;
+
+	if (size == 0)
+		return 0;
+	if (m->key < 0) {
+		errno = ENOKEY;
+		return -1;
+	}
+	old = table_size(fd);
+	if (old < 0)
+		return -1;
+	if (offset > old) {
+		if (dedup_truncate(fd, m, offset))
+			return -1;
+		old = offset;
+	}
+	newsize = end > old ? end : old;
+	nold = nchunks(old);
+	ids = arena_get(FMT_BATCH * DEDUP_REF);
+	old_ids = arena_get(FMT_BATCH * DEDUP_REF);
+	plain = arena_get(FMT_CHUNK);
+	if (!ids || !old_ids || !plain) {
+		err = 1;
+		goto out;
+	}
+
+	while (done < size && !err) {
+		off_t first = (offset + done) / FMT_CHUNK;
+		off_t start = first * FMT_CHUNK;
+		size_t n = (end - start + FMT_CHUNK - 1) / FMT_CHUNK;
+		size_t have, i, k;
+
+		if (n > FMT_BATCH)
+			n = FMT_BATCH;
+		have = first >= nold ? 0 : nold - first < (off_t) n ? (size_t) (nold - first) : n;
+		memset(old_ids, 0, n * DEDUP_REF);
+		if (have && table_read(fd, first, have, old_ids)) {
+			err = 1;
+			break;
+		}
+
+		//name every chunk the write touches, partially overwritten
+		//ones keep the rest of their old plaintext
+		for (k = 0; k < n; k++) {
+			off_t cs = start + k * FMT_CHUNK;
+			size_t clen = newsize - cs < FMT_CHUNK ? newsize - cs : FMT_CHUNK;
+			size_t oldlen = old <= cs ? 0 :
+					old - cs < FMT_CHUNK ? old - cs : FMT_CHUNK;
+			off_t ws = offset > cs ? offset : cs;
+			off_t we = end < cs + (off_t) clen ? end : cs + (off_t) clen;
+			unsigned char* id = ids + k * DEDUP_REF;
+			unsigned char* was = old_ids + k * DEDUP_REF;
+
+			memset(plain, 0, FMT_CHUNK);
+			if ((ws > cs || we < cs + (off_t) clen) && oldlen &&
+			    !is_zero(was, DEDUP_REF) && chunk_open(was, plain, oldlen)) {
+				err = 1;
+				break;
+			}
+			if (buf)
+				memcpy(plain + (ws - cs), buf + (ws - offset), we - ws);
+			else
+				memset(plain + (ws - cs), 0, we - ws);
+
+			if (is_zero(plain, clen)) {
+				STAT_INC(fmt_hole_writes);
+				memset(id, 0, DEDUP_REF);
+			} else if (!crypt_chunk_id(m->key, plain, clen, id)) {
+				errno = EIO;
+				err = 1;
+				break;
+			}
+			//a chunk rewritten as it was keeps its reference
+			same[k] = !memcmp(id, was, DEDUP_REF);
+			if (!same[k] && !is_zero(id, DEDUP_REF) &&
+			    chunk_ref(m, id, plain, clen)) {
+				err = 1;
+				break;
+			}
+		}
+		if (!err && fmt_backing_io(fd, ids, n * DEDUP_REF, first * DEDUP_REF, 1) !=
+		    (ssize_t) (n * DEDUP_REF))
+			err = 1;
+
+		//the old chunks lose their references once the table is
+		//written, the new ones if it wasn't
+		for (i = 0; i < k; i++) {
+			const unsigned char* drop = err ? ids + i * DEDUP_REF :
+						    old_ids + i * DEDUP_REF;
+
+			if (!same[i] && !is_zero(drop, DEDUP_REF))
+				chunk_unref(drop);
+		}
+		done = (start + (off_t) n * FMT_CHUNK < end ?
+			start + (off_t) n * FMT_CHUNK : end) - offset;
+	}
+	if (!err && fstat(fd, &st) == 0 && st.st_size != newsize + DEDUP_REF &&
+	    tier_ftruncate(fd, newsize + DEDUP_REF) == -1)
+		err = 1;
+out:
+	arena_put(plain, FMT_CHUNK);
+	arena_put(old_ids, FMT_BATCH * DEDUP_REF);
+	arena_put(ids, FMT_BATCH * DEDUP_REF);
+	return err ? -1 : (ssize_t) size;
+}
+
+//drops the references of table entries [from, to), last ones first.
+//With clear, each batch is zeroed in the table before its chunks lose
+//their references.
+static int drop_range(int fd, off_t from, off_t to, int clear)
+{
+	unsigned char* ids;
+	off_t lo, hi;
+	size_t k;
+	int res = 0;
+
+	if (from >= to)
+		return 0;
+	ids = arena_get(DEDUP_DROP_BATCH * DEDUP_REF);
+	if (!ids)
+		return -1;
+	for (hi = to; hi > from && !res; hi = lo) {
+		lo = hi - from > DEDUP_DROP_BATCH ? hi - DEDUP_DROP_BATCH : from;
+		if (table_read(fd, lo, hi - lo, ids) ||
+		    (clear && table_clear(fd, lo, hi - lo))) {
+			res = -1;
+			break;
+		}
+		for (k = 0; k < (size_t) (hi - lo); k++)
+			if (!is_zero(ids + k * DEDUP_REF, DEDUP_REF))
+				chunk_unref(ids + k * DEDUP_REF);
+	}
+	arena_put(ids, DEDUP_DROP_BATCH * DEDUP_REF);
+	return res;
+}
+
+int dedup_truncate(int fd, const struct fmt_meta* m, off_t size)
+{
+	unsigned char id[DEDUP_REF], was[DEDUP_REF];
+	unsigned char* plain;
+	off_t cur, keep;
+	size_t tail;
+	int res = 0;
+
+	cur = table_size(fd);
+	if (cur < 0)
+		return -1;
+	if (size == cur)
+		return 0;
+	tail = (size > cur ? cur : size) % FMT_CHUNK;
+	//a partial last chunk becomes a longer one, with zeros at its end
+	if (size > cur) {
+		size_t n = FMT_CHUNK - tail;
+
+		if ((off_t) n > size - cur)
+			n = size - cur;
+		if (tail && dedup_pwrite(fd, m, NULL, n, cur) != (ssize_t) n)
+			return -1;
+		return tier_ftruncate(fd, size + DEDUP_REF);
+	}
+
+	//a new partial last chunk gets a new, shorter one
+	keep = nchunks(size);
+	if (tail) {
+		plain = arena_get(FMT_CHUNK);
+		if (!plain)
+			return -1;
+		if (dedup_pread(fd, m, (char*) plain, tail, size - tail) != (ssize_t) tail ||
+		    table_read(fd, keep - 1, 1, was))
+			res = -1;
+		else if (is_zero(plain, tail))
+			memset(id, 0, DEDUP_REF);
+		else if (!crypt_chunk_id(m->key, plain, tail, id) ||
+			 chunk_ref(m, id, plain, tail))
+			res = -1;
+		if (!res && fmt_backing_io(fd, id, DEDUP_REF, (keep - 1) * DEDUP_REF, 1) !=
+		    DEDUP_REF) {
+			if (!is_zero(id, DEDUP_REF))
+				chunk_unref(id);
+			res = -1;
+		}
+		arena_put(plain, FMT_CHUNK);
+		if (res)
+			return -1;
+		if (!is_zero(was, DEDUP_REF))
+			chunk_unref(was);
+	}
+	//the entries cut off are zeroed first, so none of them comes back
+	//if the file grows again
+	if (drop_range(fd, keep, nchunks(cur), 1))
+		return -1;
+	return tier_ftruncate(fd, size ? size + DEDUP_REF : 0);
+}
+
+void dedup_release(int fd)
+{
+	off_t size = table_size(fd);
+
+	if (size > 0 && drop_range(fd, 0, nchunks(size), 0))
+		perror("dedup release");
+}
+
+//counts one more table entry pointing at chunk id, while the index is
+//rebuilt
+static void mark(const unsigned char* id)
+{
+	struct dedup_entry* e = find(set_of(id), id);
+
+	if (e)
+		e->refs++;
+	else
+		missing++;
+}
+
+//marks every chunk ID in the table of the deduplicated file at path
+static int mark_table(const char* path)
+{
+	unsigned char* ids;
+	struct stat st;
+	off_t n, first;
+	size_t k, count;
+	ssize_t got;
+	int fd, res = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	ids = arena_get(DEDUP_DROP_BATCH * DEDUP_REF);
+	if (!ids || fstat(fd, &st) == -1) {
+		arena_put(ids, DEDUP_DROP_BATCH * DEDUP_REF);
+		close(fd);
+		return -1;
+	}
+	n = nchunks(dedup_plainsize(st.st_size));
+	for (first = 0; first < n && !res; first += count) {
+		count = n - first < DEDUP_DROP_BATCH ? n - first : DEDUP_DROP_BATCH;
+		got = pread(fd, ids, count * DEDUP_REF, first * DEDUP_REF);
+		if (got < 0) {
+			res = -1;
+			break;
+		}
+		memset(ids + got, 0, count * DEDUP_REF - got);
+		for (k = 0; k < count; k++)
+			if (!is_zero(ids + k * DEDUP_REF, DEDUP_REF))
+				mark(ids + k * DEDUP_REF);
+	}
+	arena_put(ids, DEDUP_DROP_BATCH * DEDUP_REF);
+	close(fd);
+	return res;
+}
+
+static int cmp_linked(const void* a, const void* b)
+{
+	const struct dedup_linked* x = a;
+	const struct dedup_linked* y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int push_dir(struct dedup_dir** stack, const char* path)
+{
+	struct dedup_dir* d = malloc(sizeof(*d));
+
+	if (!d)
+		return -1;
+	d->path = strdup(path);
+	if (!d->path) {
+		free(d);
+		return -1;
+	}
+	d->next = *stack;
+	*stack = d;
+	return 0;
+}
+
+//walks the mirror tree and marks the chunks every deduplicated file's
+//table points at, a file with several links once
+static int mark_tree(void)
+{
+	struct dedup_linked* linked = NULL;
+	struct dedup_linked* t;
+	struct dedup_dir* stack = NULL;
+	struct dedup_dir* d;
+	size_t nlinked = 0, maxlinked = 0, i;
+	char path[PATH_MAX];
+	struct fmt_meta m;
+	struct dirent* de;
+	struct stat st;
+	DIR* dp;
+	int res = 0;
+
+	if (push_dir(&stack, tree))
+		return -1;
+	while ((d = stack) != NULL) {
+		stack = d->next;
+		dp = res ? NULL : opendir(d->path);
+		//a directory that can't be read could hide tables, nothing
+		//may be deleted
+		if (!dp && !res)
+			res = -1;
+		while (dp && (de = readdir(dp)) != NULL && !res) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+			    !strncmp(de->d_name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", d->path, de->d_name) >=
+			    (int) sizeof(path)) {
+				res = -1;
+				break;
+			}
+			if (lstat(path, &st) == -1)
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				res = push_dir(&stack, path);
+				continue;
+			}
+			if (!S_ISREG(st.st_mode) || fmt_get_path(path, &m) != FMT_DEDUP)
+				continue;
+			if (st.st_nlink == 1) {
+				res = mark_table(path);
+				continue;
+			}
+			if (nlinked == maxlinked) {
+				maxlinked = maxlinked ? maxlinked * 2 : 64;
+				t = realloc(linked, maxlinked * sizeof(*t));
+				if (!t) {
+					res = -1;
+					break;
+				}
+				linked = t;
+			}
+			linked[nlinked].dev = st.st_dev;
+			linked[nlinked].ino = st.st_ino;
+			linked[nlinked].path = strdup(path);
+			if (!linked[nlinked++].path)
+				res = -1;
+		}
+		if (dp)
+			closedir(dp);
+		free(d->path);
+		free(d);
+	}
+	if (nlinked)
+		qsort(linked, nlinked, sizeof(*linked), cmp_linked);
+	for (i = 0; i < nlinked; i++) {
+		if (!res && (!i || cmp_linked(&linked[i], &linked[i - 1])))
+			res = mark_table(linked[i].path);
+		free(linked[i].path);
+	}
+	free(linked);
+	return res;
+}
+
+
+//the store directory, so renames and unlinks in it last
+static int sync_store(void)
+{
+	int fd = open(store, O_RDONLY | O_DIRECTORY);
+	int res;
+
+	if (fd == -1)
+		return -1;
+	res = fsync(fd);
+	close(fd);
+	return res;
+}
+
+//adds the chunks of p to the index with no references; a damaged chunk
+//ends the container, and is cut off if it is the last one (a torn
+//append)
+static int scan(struct chunk_file* p, int last)
+{
+	struct dedup_entry* ent;
+	struct dedup_chunk* h;
+	struct stat st;
+	off_t off, size;
+	int res = 0;
+
+	h = arena_get(DEDUP_CHUNK_MAX);
+	if (!h || fstat(p->fd, &st) == -1) {
+		arena_put(h, DEDUP_CHUNK_MAX);
+		return -1;
+	}
+	for (off = 0; off + (off_t) sizeof(*h) <= st.st_size; off += size) {
+		if (pread(p->fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !chunk_sane(h))
+			break;
+		size = chunk_size(h);
+		if (off + size > st.st_size ||
+		    pread(p->fd, h + 1, h->slen, off + sizeof(*h)) != (ssize_t) h->slen ||
+		    chunk_sum(h) != h->crc)
+			break;
+		//a copy made by compaction is as good as the first one
+		if (find(set_of(h->id), h->id))
+			continue;
+		ent = calloc(1, sizeof(*ent));
+		if (ent) {
+			memcpy(ent->id, h->id, DEDUP_REF);
+			ent->file = p;
+			ent->off = off;
+			ent->size = size;
+		}
+		if (!ent || insert(set_of(h->id), ent)) {
+			free(ent);
+			res = -1;
+			break;
+		}
+	}
+	if (!res && off < st.st_size) {
+		fprintf(stderr, "chunks.%u: damaged chunk at %lld, %s\n", p->no,
+			(long long) off, last ? "cut off" : "rest ignored");
+		if (last && ftruncate(p->fd, off) == -1)
+			res = -1;
+	}
+	p->size = off;
+	arena_put(h, DEDUP_CHUNK_MAX);
+	return res;
+}
+
+long dedup_verify(int fd, void (*bad)(void* arg, off_t off), void* arg)
+{
+	struct dedup_chunk* h;
+	struct stat st;
+	off_t off, size;
+	long nbad = 0;
+
+	h = arena_get(DEDUP_CHUNK_MAX);
+	if (!h || fstat(fd, &st) == -1) {
+		arena_put(h, DEDUP_CHUNK_MAX);
+		return -1;
+	}
+	for (off = 0; off < st.st_size; off += size) {
+		size = sizeof(*h);
+		if (off + size > st.st_size ||
+		    pread(fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !chunk_sane(h) || off + (size = chunk_size(h)) > st.st_size ||
+		    pread(fd, h + 1, h->slen, off + sizeof(*h)) != (ssize_t) h->slen ||
+		    chunk_sum(h) != h->crc) {
+			STAT_INC(fmt_crc_failures);
+			if (bad)
+				bad(arg, off);
+			nbad++;
+			break;
+		}
+	}
+	arena_put(h, DEDUP_CHUNK_MAX);
+	return nbad;
+}
+
+//rebuilds the index after a mount that didn't end cleanly: every chunk
+//in the containers, counted from the tables of the deduplicated files.
+//A crash between a chunk being stored or counted and the table pointing
+//at it leaves a chunk nothing uses, it is dropped.
+static int rebuild(void)
+{
+	struct dedup_entry* e;
+	struct dedup_entry* next;
+	size_t i, n = 0, dropped = 0;
+	int k, walked;
+
+	for (k = 0; k < nfiles; k++)
+		if (scan(files[k], k == nfiles - 1))
+			return -1;
+	for (k = 0; k < DEDUP_LOCKS; k++)
+		n += sets[k].n;
+	if (!n)
+		return 0;
+	missing = 0;
+	walked = mark_tree() == 0;
+	if (!walked) {
+		//a table that wasn't seen could use any of them
+		fprintf(stderr, "chunk store: can't recount references, unused "
+			"chunks stay until the next mount\n");
+		unclean = 1;
+	}
+	for (k = 0; k < DEDUP_LOCKS; k++) {
+		for (i = 0; i < sets[k].nbuckets; i++) {
+			for (e = sets[k].table[i]; e; e = next) {
+				next = e->next;
+				if (!walked) {
+					e->refs = DEDUP_PINNED;
+				} else if (!e->refs) {
+					drop(&sets[k], e);
+					dropped++;
+				}
+			}
+		}
+	}
+	fprintf(stderr, "chunk store: recounted %zu chunks, %zu unused\n", n, dropped);
+	if (walked && missing)
+		fprintf(stderr, "chunk store: %zu chunks used by tables are missing\n",
+			missing);
+	return 0;
+}
+
+//loads the index a clean unmount left. Returns -1 if there is none or
+//it doesn't match the containers, with nothing loaded.
+static int load_index(void)
+{
+	struct dedup_index_tail tail;
+	struct dedup_index_rec* r;
+	struct dedup_entry* e;
+	char path[PATH_MAX + 16];
+	struct chunk_file* p;
+	uint32_t crc = 0;
+	uint64_t count;
+	size_t i, n, got;
+	struct stat st;
+	FILE* f;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s%s", store, DEDUP_INDEX);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	r = arena_get(FMT_BATCH * FMT_CHUNK);
+	n = FMT_BATCH * FMT_CHUNK / sizeof(*r);
+	if (!r || fstat(fileno(f), &st) == -1 ||
+	    st.st_size < (off_t) sizeof(tail) ||
+	    (st.st_size - sizeof(tail)) % sizeof(*r)) {
+		res = -1;
+		goto out;
+	}
+	for (count = (st.st_size - sizeof(tail)) / sizeof(*r); count && !res; count -= got) {
+		got = count < n ? count : n;
+		if (fread(r, sizeof(*r), got, f) != got) {
+			res = -1;
+			break;
+		}
+		crc = crc32c(crc, r, got * sizeof(*r));
+		for (i = 0; i < got; i++) {
+			p = file_of(r[i].file);
+			if (!p || r[i].size < sizeof(struct dedup_chunk) ||
+			    r[i].size > DEDUP_CHUNK_MAX || !r[i].refs ||
+			    r[i].off + r[i].size > (uint64_t) p->size ||
+			    find(set_of(r[i].id), r[i].id) ||
+			    !(e = calloc(1, sizeof(*e)))) {
+				res = -1;
+				break;
+			}
+			memcpy(e->id, r[i].id, DEDUP_REF);
+			e->file = p;
+			e->off = r[i].off;
+			e->size = r[i].size;
+			e->refs = r[i].refs;
+			if (insert(set_of(r[i].id), e)) {
+				free(e);
+				res = -1;
+				break;
+			}
+		}
+	}
+	if (!res && (fread(&tail, sizeof(tail), 1, f) != 1 ||
+		     tail.magic != DEDUP_INDEX_MAGIC || tail.crc != crc ||
+		     tail.count != (st.st_size - sizeof(tail)) / sizeof(*r)))
+		res = -1;
+out:
+	arena_put(r, FMT_BATCH * FMT_CHUNK);
+	fclose(f);
+	if (res) {
+		fprintf(stderr, "chunk store: index doesn't match the chunks, "
+			"rebuilding it\n");
+		sets_free();
+	}
+	return res;
+}
+
+//writes the index for the next mount, once the containers are on disk
+static int write_index(void)
+{
+	char path[PATH_MAX + 16], tmp[PATH_MAX + 16];
+	struct dedup_index_tail tail;
+	struct dedup_index_rec r;
+	struct dedup_entry* e;
+	size_t i;
+	FILE* f;
+	int k, res = 0;
+
+	for (k = 0; k < nfiles; k++)
+		if (fdatasync(files[k]->fd) == -1)
+			return -1;
+	snprintf(path, sizeof(path), "%s%s", store, DEDUP_INDEX);
+	snprintf(tmp, sizeof(tmp), "%s%s.tmp", store, DEDUP_INDEX);
+	f = fopen(tmp, "w");
+	if (!f)
+		return -1;
+	memset(&tail, 0, sizeof(tail));
+	tail.magic = DEDUP_INDEX_MAGIC;
+	for (k = 0; k < DEDUP_LOCKS && !res; k++) {
+		for (i = 0; i < sets[k].nbuckets && !res; i++) {
+			for (e = sets[k].table[i]; e && !res; e = e->next) {
+				memset(&r, 0, sizeof(r));
+				memcpy(r.id, e->id, DEDUP_REF);
+				r.file = e->file->no;
+				r.size = e->size;
+				r.off = e->off;
+				r.refs = e->refs;
+				tail.crc = crc32c(tail.crc, &r, sizeof(r));
+				tail.count++;
+				if (fwrite(&r, sizeof(r), 1, f) != 1)
+					res = -1;
+			}
+		}
+	}
+	if (!res && fwrite(&tail, sizeof(tail), 1, f) != 1)
+		res = -1;
+	if (fflush(f) == EOF || fsync(fileno(f)) == -1)
+		res = -1;
+	if (fclose(f) == EOF)
+		res = -1;
+	if (!res && rename(tmp, path) == -1)
+		res = -1;
+	if (res) {
+		unlink(tmp);
+		return -1;
+	}
+	return sync_store();
+}
+
+//bytes every container has live, from the index
+static void count_live(void)
+{
+	struct dedup_entry* e;
+	size_t i;
+	int k;
+
+	for (k = 0; k < DEDUP_LOCKS; k++)
+		for (i = 0; i < sets[k].nbuckets; i++)
+			for (e = sets[k].table[i]; e; e = e->next)
+				e->file->live += e->size;
+}
+
+static int cmp_no(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+//opens every container, oldest first
+static int open_files(void)
+{
+	unsigned int* nos = NULL;
+	unsigned int* t;
+	struct dirent* de;
+	struct stat st;
+	size_t i, n = 0;
+	unsigned int no;
+	char c;
+	DIR* dp;
+	int res = 0;
+
+	dp = opendir(store);
+	if (!dp)
+		return -1;
+	while ((de = readdir(dp)) != NULL) {
+		if (sscanf(de->d_name, "chunks.%u%c", &no, &c) != 1)
+			continue;
+		t = realloc(nos, (n + 1) * sizeof(*nos));
+		if (!t) {
+			res = -1;
+			break;
+		}
+		nos = t;
+		nos[n++] = no;
+	}
+	closedir(dp);
+	if (n)
+		qsort(nos, n, sizeof(*nos), cmp_no);
+	files = n ? calloc(n, sizeof(*files)) : NULL;
+	if (n && !files)
+		res = -1;
+	for (i = 0; i < n && !res; i++) {
+		files[nfiles] = file_open(nos[i], 0);
+		if (!files[nfiles] || fstat(files[nfiles]->fd, &st) == -1) {
+			if (files[nfiles])
+				file_close(files[nfiles], 0);
+			res = -1;
+		} else {
+			files[nfiles++]->size = st.st_size;
+		}
+	}
+	free(nos);
+	return res;
+}
+
+static void close_files(void)
+{
+	int k;
+
+	for (k = 0; k < nfiles; k++)
+		file_close(files[k], 0);
+	free(files);
+	files = NULL;
+	nfiles = 0;
+}
+
+//copies the live chunks of the oldest container to the newest and
+//deletes it. One chunk per turn of the append mutex, so writers get in
+//between.
+static int compact_oldest(size_t* moved)
+{
+	struct dedup_entry* ent;
+	struct dedup_chunk* h;
+	struct dedup_set* s;
+	struct chunk_file* old;
+	struct chunk_file* p = NULL;
+	off_t off, size;
+	int k, res = 0;
+
+	pthread_mutex_lock(&append_lock);
+	old = nfiles > 1 ? files[0] : NULL;
+	pthread_mutex_unlock(&append_lock);
+	*moved = 0;
+	if (!old)
+		return 0;
+	h = arena_get(DEDUP_CHUNK_MAX);
+	if (!h)
+		return -1;
+
+	//only the newest container grows, old->size stays put
+	for (off = 0; off < old->size && !res; off += size) {
+		if (__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+			res = 1;
+			break;
+		}
+		pthread_mutex_lock(&append_lock);
+		size = sizeof(*h);
+		if (pread(old->fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !chunk_sane(h)) {
+			res = -1;
+		} else {
+			size = chunk_size(h);
+			s = set_of(h->id);
+			pthread_mutex_lock(&s->lock);
+			ent = find(s, h->id);
+			ent = ent && ent->file == old && ent->off == off ? ent : NULL;
+			pthread_mutex_unlock(&s->lock);
+			//chunks the index doesn't point at are left behind; one
+			//that loses its last reference while it is copied is
+			//left behind in the newest container
+			if (ent && (pread(old->fd, h + 1, h->slen, off + sizeof(*h)) !=
+				    (ssize_t) h->slen || !(p = put(h)))) {
+				res = -1;
+			} else if (ent) {
+				pthread_mutex_lock(&s->lock);
+				ent = find(s, h->id);
+				if (ent && ent->file == old && ent->off == off) {
+					ent->file = p;
+					ent->off = p->size;
+					__atomic_add_fetch(&p->live, size, __ATOMIC_RELAXED);
+					__atomic_sub_fetch(&old->live, size, __ATOMIC_RELAXED);
+				}
+				pthread_mutex_unlock(&s->lock);
+				p->size += size;
+				STAT_ADD(dedup_compacted_bytes, size);
+				*moved += size;
+			}
+		}
+		pthread_mutex_unlock(&append_lock);
+	}
+	arena_put(h, DEDUP_CHUNK_MAX);
+	*moved += off;
+	//the index lives in memory until a clean unmount, the copies must
+	//be on disk before the only other one goes
+	pthread_rwlock_rdlock(&files_lock);
+	for (k = 1; k < nfiles && !res; k++)
+		if (fdatasync(files[k]->fd) == -1)
+			res = -1;
+	pthread_rwlock_unlock(&files_lock);
+	if (res < 0) {
+		fprintf(stderr, "chunks.%u: can't be compacted\n", old->no);
+		stuck = old->no;
+	}
+	if (res)
+		return res;
+
+	pthread_mutex_lock(&append_lock);
+	pthread_rwlock_wrlock(&files_lock);
+	memmove(files, files + 1, --nfiles * sizeof(*files));
+	pthread_rwlock_unlock(&files_lock);
+	pthread_mutex_unlock(&append_lock);
+	file_close(old, 1);
+	STAT_INC(dedup_compactions);
+	return 0;
+}
+
+//whether the oldest container should be compacted; rolls the newest one
+//over if it is the one holding the garbage
+static int want_compact(void)
+{
+	off_t size = 0, live = 0, last_live;
+	struct chunk_file* last;
+	int i, roll_over;
+
+	pthread_mutex_lock(&append_lock);
+	if (!nfiles || files[0]->no == stuck) {
+		pthread_mutex_unlock(&append_lock);
+		return 0;
+	}
+	for (i = 0; i + 1 < nfiles; i++) {
+		size += files[i]->size;
+		live += __atomic_load_n(&files[i]->live, __ATOMIC_RELAXED);
+	}
+	last = files[nfiles - 1];
+	last_live = __atomic_load_n(&last->live, __ATOMIC_RELAXED);
+	roll_over = last->size - last_live >= DEDUP_DEAD_MIN &&
+		last->size - last_live > last_live;
+	if (roll_over && roll())
+		roll_over = 0;
+	pthread_mutex_unlock(&append_lock);
+	return roll_over || size - live > live;
+}
+
+static void* compact_thread(void* arg)
+{
+	struct sched_job job;
+	struct timespec ts;
+	size_t moved;
+	int res;
+
+	(void) arg;
+	pthread_mutex_lock(&compact_lock);
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&compact_cond, &compact_lock, &ts);
+		pthread_mutex_unlock(&compact_lock);
+		while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED) && want_compact()) {
+			sched_bg_begin(&job, SCHED_COMPACT);
+			res = compact_oldest(&moved);
+			sched_bg_end(&job, moved);
+			if (res)
+				break;
+		}
+		pthread_mutex_lock(&compact_lock);
+	}
+	pthread_mutex_unlock(&compact_lock);
+	return NULL;
+}
+
+static int dedup_report(char* buf, size_t size)
+{
+	off_t bytes = 0, live = 0;
+	size_t chunks = 0;
+	int k, n;
+
+	for (k = 0; k < DEDUP_LOCKS; k++) {
+		pthread_mutex_lock(&sets[k].lock);
+		chunks += sets[k].n;
+		pthread_mutex_unlock(&sets[k].lock);
+	}
+	pthread_mutex_lock(&append_lock);
+	n = nfiles;
+	for (k = 0; k < nfiles; k++) {
+		bytes += files[k]->size;
+		live += __atomic_load_n(&files[k]->live, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&append_lock);
+	return snprintf(buf, size, "dedup_chunks %zu\ndedup_containers %d\n"
+			"dedup_live_bytes %lld\ndedup_dead_bytes %lld\n",
+			chunks, n, (long long) live, (long long) (bytes - live));
+}
+
+int dedup_init(const char* root, int on)
+{
+	char path[PATH_MAX + 16];
+	struct stat st;
+
+	pthread_once(&sets_once, sets_init);
+	if (snprintf(tree, sizeof(tree), "%s", root) >= (int) sizeof(tree) ||
+	    snprintf(store, sizeof(store), "%s%s", root, DEDUP_DIR) >=
+	    (int) sizeof(store))
+		return -1;
+	//without dedup on and nothing stored, there is nothing to load
+	if (stat(store, &st) == -1) {
+		if (errno != ENOENT || !on)
+			return errno == ENOENT ? 0 : -1;
+		if (mkdir(store, 0700) == -1 && errno != EEXIST)
+			return -1;
+	}
+	unclean = 0;
+	if (open_files() || (load_index() && rebuild()))
+		goto fail;
+	count_live();
+	//no index on disk while the store is in use: a crash leaves none,
+	//and the next mount rebuilds it
+	snprintf(path, sizeof(path), "%s%s", store, DEDUP_INDEX);
+	if ((unlink(path) == -1 && errno != ENOENT) || sync_store())
+		goto fail;
+	loaded = 1;
+
+	stopping = 0;
+	if (pthread_create(&thread, NULL, compact_thread, NULL) == 0)
+		running = 1;
+	if (!registered)
+		registered = stats_register(dedup_report) == 0;
+	return 0;
+fail:
+	sets_free();
+	close_files();
+	return -1;
+}
+
+void dedup_destroy(void)
+{
+	if (running) {
+		pthread_mutex_lock(&compact_lock);
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&compact_cond);
+		pthread_mutex_unlock(&compact_lock);
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	if (!loaded)
+		return;
+	loaded = 0;
+	//with counts that couldn't be rebuilt, the next mount tries again
+	if (!unclean && write_index())
+		perror("chunk store index");
+	sets_free();
+	close_files();
+}
@@ -0,0 +1,108 @@
+/* encfs-dedup.h
+ * Deduplicating chunk store for pa4-encfs
+ *
+ * With --dedup, new files keep no ciphertext of their own. The file in
+ * the mirror tree is a table with the DEDUP_REF byte ID of chunk i at
+ * i * DEDUP_REF, DEDUP_REF bytes longer than the plaintext (so its size
+ * still gives the plaintext size) and sparse past the table; an all zero
+ * ID is a chunk of zeros. Its FMT_ATTR reads
+ * "dedup;nonce=<hex>[;cipher=<engine>][;key=<id>]".
+ *
+ * Every distinct chunk is stored once, sealed, in an append-only
+ * container <root>/.pa4-encfs-chunks/chunks.<n>. The ID is a MAC of the
+ * plaintext under the file's key (crypt_chunk_id()) and the chunk is
+ * sealed with it as the tweak. Where each chunk is and how many table
+ * entries point at it is kept in memory, so writing a chunk that is
+ * already stored costs the MAC and a count update, no encryption and no
+ * I/O. A chunk whose count drops to zero is dead; a background thread
+ * copies the live chunks out of containers that are mostly dead and
+ * deletes them.
+ *
+ * Counts go up before a table points at a chunk and down after it
+ * stopped. A clean unmount writes them to <store>/index, which the next
+ * mount loads and deletes again; a mount that finds no index rebuilds
+ * it before it uses the store, from the chunks in the containers and
+ * the tables of every deduplicated file in the tree, and drops the
+ * chunks nothing uses.
+ *
+ * Callers hold the file lock, as for the other formats.
+ *
+ */
+
+#ifndef ENCFS_DEDUP_H
+#define ENCFS_DEDUP_H
+
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "encfs-format.h"
+
+#define DEDUP_REF CRYPT_ID
+
+/* int dedup_init(const char* root, int on)
+ * Purpose: Load (or rebuild) the index of the chunk store under root and
+ *          start compaction
+ * Args: const char* root : Mirror directory
+ *       int on           : New files are deduplicated (the store is
+ *                          created if need be); deduplicated files are
+ *                          read either way
+ * Return: 0 on success, -1 on error
+ */
+extern int dedup_init(const char* root, int on);
+
+/* void dedup_destroy(void)
+ * Purpose: Stop compaction and write the index for the next mount
+ */
+extern void dedup_destroy(void);
+
+/* off_t dedup_plainsize(off_t backing)
+ * Purpose: Plaintext size of a deduplicated file from its table's size
+ */
+extern off_t dedup_plainsize(off_t backing);
+
+/* ssize_t dedup_pread(int fd, const struct fmt_meta* m, char* buf,
+ *                     size_t size, off_t offset)
+ * Purpose: pread() on the plaintext of a deduplicated file
+ * Return: Bytes read (short or 0 at end of file), -1 on error (errno EIO
+ *         if a chunk is missing or damaged)
+ */
+extern ssize_t dedup_pread(int fd, const struct fmt_meta* m, char* buf,
+			   size_t size, off_t offset);
+
+/* ssize_t dedup_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+ *                      size_t size, off_t offset)
+ * Purpose: pwrite() on the plaintext of a deduplicated file; chunks that
+ *          end up all zero get the zero ID
+ * Args: const char* buf : Data, NULL to write zeros
+ * Return: size on success, -1 on error
+ */
+extern ssize_t dedup_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+			    size_t size, off_t offset);
+
+/* int dedup_truncate(int fd, const struct fmt_meta* m, off_t size)
+ * Purpose: Truncate (or zero-extend) a deduplicated file to size,
+ *          dropping the references of the chunks cut off
+ * Return: 0 on success, -1 on error
+ */
+extern int dedup_truncate(int fd, const struct fmt_meta* m, off_t size);
+
+/* void dedup_release(int fd)
+ * Purpose: Drop every reference in the table of a deduplicated file
+ *          whose last link is gone
+ * Args: int fd : The file, still open
+ */
+extern void dedup_release(int fd);
+
+/* long dedup_verify(int fd, void (*bad)(void* arg, off_t off), void* arg)
+ * Purpose: Check every chunk of a container against its CRC, without the
+ *          key and without decrypting. Chunks can't be found past a
+ *          damaged one, so the first ends the check.
+ * Args: int fd                              : A chunks.<n> file
+ *       void (*bad)(void* arg, off_t off)   : Called with the offset of
+ *                                             a damaged chunk, may be
+ *                                             NULL
+ * Return: Number of damaged chunks (0 or 1), -1 on error
+ */
+extern long dedup_verify(int fd, void (*bad)(void* arg, off_t off), void* arg);
+
+#endif
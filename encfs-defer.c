@@ -0,0 +1,381 @@
+/* encfs-defer.c
+ * Deferred encryption of new files for pa4-encfs
+ *
+ * Pending files are kept in a table by (dev, ino), each with its own
+ * descriptor, its count of open handles and the time by which it has to
+ * be encrypted even if still open. Closed files are queued for the
+ * workers right away.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-cache.h"
+#include "encfs-defer.h"
+#include "encfs-format.h"
+#include "encfs-lock.h"
+#include "encfs-meta.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-tier.h"
+
+#define STAGING_DIR "/.pa4-encfs-staging"
+/* every pending file holds a descriptor, past this many new files are
+ * encrypted right away */
+#define DEFER_MAX 512
+#define DEFER_BUCKETS 256
+#define DEFER_THREADS_MAX 16
+
+struct pending {
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	int opens;
+	int busy;		/* a worker is encrypting it */
+	unsigned long long deadline;	/* us */
+	struct pending* next;
+};
+
+static char staging[PATH_MAX];
+static int delay = -1;
+static pthread_mutex_t defer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct pending* table[DEFER_BUCKETS];
+static int npending;
+static pthread_t workers[DEFER_THREADS_MAX];
+static int nworkers;
+static int draining;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t bucket(dev_t dev, ino_t ino)
+{
+	return (((unsigned long) ino * 0x9e3779b97f4a7c15UL) ^ (unsigned long) dev) %
+		DEFER_BUCKETS;
+}
+
+//defer_lock held
+static struct pending* find(dev_t dev, ino_t ino)
+{
+	struct pending* p;
+
+	for (p = table[bucket(dev, ino)]; p; p = p->next)
+		if (p->dev == dev && p->ino == ino)
+			return p;
+	return NULL;
+}
+
+//defer_lock held
+static struct pending* add(int fd, const struct stat* st)
+{
+	struct pending* p = calloc(1, sizeof(*p));
+	size_t h = bucket(st->st_dev, st->st_ino);
+
+	if (!p)
+		return NULL;
+	p->dev = st->st_dev;
+	p->ino = st->st_ino;
+	p->fd = fd;
+	p->deadline = now_us() + (delay > 0 ? delay : 0) * 1000ULL;
+	p->next = table[h];
+	table[h] = p;
+	npending++;
+	return p;
+}
+
+//defer_lock held
+static void drop(struct pending* p)
+{
+	struct pending** pp;
+
+	for (pp = &table[bucket(p->dev, p->ino)]; *pp != p; pp = &(*pp)->next)
+		;
+	*pp = p->next;
+	npending--;
+	close(p->fd);
+	free(p);
+}
+
+int defer_staging(const struct fmt_meta* m, char* path, size_t size)
+{
+	size_t len = snprintf(path, size, "%s/", staging);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(m->nonce) && len < size; i++)
+		len += snprintf(path + len, size - len, "%02x", m->nonce[i]);
+	return len < size ? 0 : -1;
+}
+
+void defer_remove(const struct fmt_meta* m)
+{
+	char path[PATH_MAX];
+
+	if (m->kind == FMT_PENDING && !defer_staging(m, path, sizeof(path)))
+		unlink(path);
+}
+
+//encrypts the staging file into the mirror file, which is locked
+//exclusive. The staging copy only goes once the ciphertext is on disk.
+//moved is what was read and written, for the scheduler
+static int encrypt_locked(struct pending* p, size_t* moved)
+{
+	char path[PATH_MAX];
+	struct fmt_meta m;
+	struct stat st, pst;
+	FILE* plain;
+	int res = 0;
+
+	if (fstat(p->fd, &st) == -1 || fmt_get(p->fd, &m) != FMT_PENDING)
+		return 0;
+	if (defer_staging(&m, path, sizeof(path)))
+		return -1;
+	//the last link went while the file was pending
+	if (st.st_nlink == 0) {
+		unlink(path);
+		return 0;
+	}
+	plain = fopen(path, "r");
+	if (!plain)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fileno(plain), &pst) == 0)
+		*moved = 2 * (size_t) pst.st_size;
+	//written now, so with the key new files use now
+	m.kind = FMT_CHUNKED;
+	m.key = fmt_current_key();
+	if (tier_ftruncate(p->fd, 0) == -1 || fmt_import(p->fd, &m, plain) ||
+	    fmt_fdatasync(p->fd, &m) || fmt_set(p->fd, &m)) {
+		//stays pending, reads still go to the staging file
+		if (tier_ftruncate(p->fd, 0) == -1)
+			perror("defer");
+		res = -1;
+	}
+	fclose(plain);
+	if (res)
+		return res;
+	unlink(path);
+	cache_invalidate(st.st_dev, st.st_ino);
+	meta_invalidate(st.st_dev, st.st_ino);
+	STAT_INC(defer_encrypted);
+	return 0;
+}
+
+static void encrypt_one(struct pending* p)
+{
+	struct file_lock* l;
+	struct sched_job job;
+	size_t moved = 0;
+
+	sched_bg_begin(&job, SCHED_ENCRYPT);
+	l = lock_acquire(p->dev, p->ino, LOCK_EXCLUSIVE);
+	if (!l || encrypt_locked(p, &moved)) {
+		STAT_INC(defer_failures);
+		fprintf(stderr, "defer: could not encrypt inode %lu, left pending\n",
+			(unsigned long) p->ino);
+	}
+	lock_release(l);
+	sched_bg_end(&job, moved);
+}
+
+//defer_lock held; a file that may be encrypted now, or NULL and the time
+//of the next deadline
+static struct pending* next_job(unsigned long long* wake)
+{
+	unsigned long long now = now_us();
+	struct pending* p;
+	size_t h;
+
+	*wake = now + 1000000;
+	for (h = 0; h < DEFER_BUCKETS; h++) {
+		for (p = table[h]; p; p = p->next) {
+			if (p->busy)
+				continue;
+			if (draining || p->opens == 0 || p->deadline <= now)
+				return p;
+			if (p->deadline < *wake)
+				*wake = p->deadline;
+		}
+	}
+	return NULL;
+}
+
+static void* defer_thread(void* arg)
+{
+	unsigned long long wake;
+	struct pending* p;
+	struct timespec ts;
+
+	(void) arg;
+	pthread_mutex_lock(&defer_lock);
+	for (;;) {
+		p = next_job(&wake);
+		if (!p) {
+			if (draining)
+				break;
+			//deadlines are in monotonic time, the wait is relative
+			clock_gettime(CLOCK_REALTIME, &ts);
+			wake -= now_us();
+			ts.tv_sec += wake / 1000000;
+			ts.tv_nsec += (wake % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&work_cond, &defer_lock, &ts);
+			continue;
+		}
+		p->busy = 1;
+		pthread_mutex_unlock(&defer_lock);
+		encrypt_one(p);
+		pthread_mutex_lock(&defer_lock);
+		drop(p);
+	}
+	pthread_mutex_unlock(&defer_lock);
+	return NULL;
+}
+
+static int defer_report(char* buf, size_t size)
+{
+	int n;
+
+	pthread_mutex_lock(&defer_lock);
+	n = npending;
+	pthread_mutex_unlock(&defer_lock);
+	return snprintf(buf, size, "defer_pending %d\n", n);
+}
+
+int defer_init(const char* root, int delay_ms, int threads)
+{
+	if (snprintf(staging, sizeof(staging), "%s%s", root, STAGING_DIR) >=
+	    (int) sizeof(staging))
+		return -1;
+	//plaintext lives here, nobody else gets to look
+	if (mkdir(staging, 0700) == -1 && errno != EEXIST)
+		return -1;
+	if (chmod(staging, 0700) == -1)
+		return -1;
+	if (threads < 1)
+		threads = 1;
+	if (threads > DEFER_THREADS_MAX)
+		threads = DEFER_THREADS_MAX;
+	for (nworkers = 0; nworkers < threads; nworkers++)
+		if (pthread_create(&workers[nworkers], NULL, defer_thread, NULL))
+			break;
+	if (!nworkers)
+		return -1;
+	delay = delay_ms;
+	stats_register(defer_report);
+	return 0;
+}
+
+void defer_destroy(void)
+{
+	int i;
+
+	pthread_mutex_lock(&defer_lock);
+	delay = -1;
+	draining = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&defer_lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	nworkers = 0;
+}
+
+int defer_create(int fd, struct fmt_meta* m, dev_t* dev, ino_t* ino)
+{
+	struct pending* p;
+	char path[PATH_MAX], self[64];
+	struct stat st;
+	int sfd, dfd, res;
+
+	pthread_mutex_lock(&defer_lock);
+	res = delay >= 0 && nworkers && npending < DEFER_MAX;
+	pthread_mutex_unlock(&defer_lock);
+	if (!res || fstat(fd, &st) == -1)
+		return 0;
+
+	m->kind = FMT_PENDING;
+	if (defer_staging(m, path, sizeof(path)) ||
+	    (sfd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+		m->kind = FMT_CHUNKED;
+		return 0;
+	}
+	close(sfd);
+	//fd may be write only, the worker reads back partial slots
+	snprintf(self, sizeof(self), "/proc/self/fd/%d", fd);
+	dfd = open(self, O_RDWR);
+	res = dfd == -1 ? -errno : fmt_set(fd, m);
+	if (res) {
+		unlink(path);
+		m->kind = FMT_CHUNKED;
+		if (dfd != -1)
+			close(dfd);
+		return dfd == -1 ? 0 : res;
+	}
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	pthread_mutex_lock(&defer_lock);
+	p = add(dfd, &st);
+	if (p)
+		p->opens = 1;
+	pthread_mutex_unlock(&defer_lock);
+	//left for defer_open() to pick up, like after a crash
+	if (!p)
+		close(dfd);
+	STAT_INC(defer_staged);
+	return 1;
+}
+
+int defer_open(const char* path, dev_t* dev, ino_t* ino)
+{
+	struct pending* p;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	pthread_mutex_lock(&defer_lock);
+	p = find(st.st_dev, st.st_ino);
+	//pending since an earlier mount
+	if (!p && (p = add(fd, &st)) != NULL)
+		fd = -1;
+	if (p)
+		p->opens++;
+	pthread_mutex_unlock(&defer_lock);
+	if (fd != -1)
+		close(fd);
+	return p ? 0 : -1;
+}
+
+void defer_release(dev_t dev, ino_t ino)
+{
+	struct pending* p;
+
+	pthread_mutex_lock(&defer_lock);
+	p = find(dev, ino);
+	if (p && p->opens > 0 && --p->opens == 0)
+		pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&defer_lock);
+}
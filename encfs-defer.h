@@ -0,0 +1,85 @@
+/* encfs-defer.h
+ * Deferred encryption of new files for pa4-encfs
+ *
+ * With --defer-encrypt, a new file starts out "pending": the file in the
+ * mirror tree is empty and carries the format it will get (FMT_PENDING,
+ * same nonce and cipher), and its data is kept as plaintext in a staging
+ * file under <root>/.pa4-encfs-staging (mode 0700). Reads and writes of
+ * a pending file go to the staging file. Once the last handle is closed,
+ * or at the latest after the configured delay, a worker encrypts the
+ * staging file into the mirror file under the file's exclusive lock,
+ * flips the format to chunked and removes the staging file. Unmounting
+ * encrypts whatever is still pending.
+ *
+ * The workers hold a descriptor of every pending file, so renames don't
+ * get in their way; files left pending by a crash are picked up again
+ * when they are next opened.
+ *
+ */
+
+#ifndef ENCFS_DEFER_H
+#define ENCFS_DEFER_H
+
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+/* int defer_init(const char* root, int delay_ms, int threads)
+ * Purpose: Create the staging area and start the encryption workers
+ * Args: const char* root : Mirror directory
+ *       int delay_ms     : Longest time a file stays pending while it is
+ *                          still open, -1 to encrypt new files right away
+ *                          (files left pending earlier are still handled)
+ *       int threads      : Encryption workers
+ * Return: 0 on success, -1 on error
+ */
+extern int defer_init(const char* root, int delay_ms, int threads);
+
+/* void defer_destroy(void)
+ * Purpose: Encrypt all pending files and stop the workers
+ */
+extern void defer_destroy(void);
+
+/* int defer_create(int fd, struct fmt_meta* m, dev_t* dev, ino_t* ino)
+ * Purpose: Make a just created, empty mirror file pending instead of
+ *          encrypted. It counts as opened, as if by defer_open().
+ * Args: int fd             : The new file
+ *       struct fmt_meta* m : Its format from fmt_new(), becomes FMT_PENDING
+ *       dev_t* dev, ino_t* ino : Set to the file's identity for
+ *                                defer_release()
+ * Return: 1 if the file is pending, 0 if it should be encrypted right
+ *         away (deferring is off or too many files are pending), -errno
+ *         on error
+ */
+extern int defer_create(int fd, struct fmt_meta* m, dev_t* dev, ino_t* ino);
+
+/* int defer_open(const char* path, dev_t* dev, ino_t* ino)
+ * Purpose: Note a new handle on a pending file, so it isn't encrypted
+ *          before it's closed
+ * Args: const char* path : Mirror file
+ *       dev_t* dev, ino_t* ino : Set to the file's identity for
+ *                                defer_release()
+ * Return: 0 on success, -1 on error
+ */
+extern int defer_open(const char* path, dev_t* dev, ino_t* ino);
+
+/* void defer_release(dev_t dev, ino_t ino)
+ * Purpose: A handle from defer_open() was closed
+ */
+extern void defer_release(dev_t dev, ino_t ino);
+
+/* int defer_staging(const struct fmt_meta* m, char* path, size_t size)
+ * Purpose: Path of a pending file's staging file
+ * Args: const struct fmt_meta* m : The file's format
+ *       char* path, size_t size  : Buffer for the path
+ * Return: 0 on success, -1 if the path doesn't fit
+ */
+extern int defer_staging(const struct fmt_meta* m, char* path, size_t size);
+
+/* void defer_remove(const struct fmt_meta* m)
+ * Purpose: Delete the staging file of a pending file whose last link
+ *          is gone
+ */
+extern void defer_remove(const struct fmt_meta* m);
+
+#endif
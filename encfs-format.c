@@ -0,0 +1,1780 @@
+/* encfs-format.c
+ * Chunked on-disk format for pa4-encfs
+ *
+ */
+
+/* For O_DIRECT, fallocate() and SEEK_DATA/SEEK_HOLE */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/falloc.h>
+#include <openssl/rand.h>
+
+#include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-crc.h"
+#include "encfs-dedup.h"
+#include "encfs-format.h"
+#include "encfs-intent.h"
+#include "encfs-pack.h"
+#include "encfs-stats.h"
+#include "encfs-stripe.h"
+#include "encfs-tier.h"
+#include "encfs-trace.h"
+
+/* passphrase of every key slot, do_crypt files need it as it is */
+static char* key_strs[CRYPT_KEYS];
+/* key slot of files without a key ID, -1 if that key isn't loaded */
+static int base_key;
+/* key slot of new files */
+static int new_key;
+/* engine of new files */
+static int new_cipher = CRYPT_AES256_CBC;
+/* new files get chunk checksums */
+static int new_crc = 1;
+/* new files are deduplicated */
+static int new_dedup;
+/* engines --cipher=auto picks from, once fmt_pick_cipher() runs */
+static int auto_allowed[CRYPT_ENGINES];
+static int auto_pending;
+
+static const unsigned char zeros[FMT_CHUNK];
+
+int fmt_init(char* key_str)
+{
+	key_strs[0] = key_str;
+	return crypt_engines_init(key_str) ? 0 : -1;
+}
+
+int fmt_add_key(char* key_str)
+{
+	int key = crypt_key_add(key_str);
+
+	if (key >= 0 && !key_strs[key])
+		key_strs[key] = key_str;
+	return key;
+}
+
+void fmt_use_key(int key)
+{
+	__atomic_store_n(&new_key, key, __ATOMIC_RELAXED);
+}
+
+int fmt_current_key(void)
+{
+	return __atomic_load_n(&new_key, __ATOMIC_RELAXED);
+}
+
+int fmt_init_root(const char* root)
+{
+	char val[16];
+	unsigned int id;
+	ssize_t len;
+
+	len = getxattr(root, FMT_BASE_ATTR, val, sizeof(val) - 1);
+	if (len < 0) {
+		//files from before key IDs were written with the mount key
+		len = snprintf(val, sizeof(val), "%08x", crypt_key_id(0));
+		if (setxattr(root, FMT_BASE_ATTR, val, len, XATTR_CREATE) == -1 &&
+		    errno != EEXIST && errno != ENOTSUP)
+			return -1;
+		base_key = 0;
+		return 0;
+	}
+	val[len] = '\0';
+	if (sscanf(val, "%x", &id) != 1)
+		return -1;
+	base_key = crypt_key_find(id);
+	return base_key < 0 ? -1 : 0;
+}
+
+char* fmt_legacy_key(void)
+{
+	return base_key < 0 ? NULL : key_strs[base_key];
+}
+
+int fmt_use_cipher(const char* spec)
+{
+	const char* p;
+	int i, id;
+
+	if (strncmp(spec, "auto", 4)) {
+		id = crypt_engine_find(spec, strlen(spec));
+		if (id < 0)
+			return -1;
+		new_cipher = id;
+		auto_pending = 0;
+		return 0;
+	}
+
+	//auto[:name,name...] benchmarks the allowed engines later
+	if (spec[4] != ':' || !spec[5]) {
+		for (i = 0; i < CRYPT_ENGINES; i++)
+			auto_allowed[i] = 1;
+	} else {
+		memset(auto_allowed, 0, sizeof(auto_allowed));
+		for (p = spec + 5; *p; p += *p == ',') {
+			size_t len = strcspn(p, ",");
+
+			id = crypt_engine_find(p, len);
+			if (id < 0)
+				return -1;
+			auto_allowed[id] = 1;
+			p += len;
+		}
+	}
+	auto_pending = 1;
+	return 0;
+}
+
+int fmt_pick_cipher(void)
+{
+	double best = 0, mbps;
+	int i, id = -1;
+
+	if (!auto_pending)
+		return 0;
+	auto_pending = 0;
+	for (i = 0; i < CRYPT_ENGINES; i++) {
+		if (!auto_allowed[i])
+			continue;
+		mbps = crypt_engine_bench(i);
+		fprintf(stderr, "cipher %-18s %8.0f MB/s\n", crypt_engine(i)->name, mbps);
+		if (mbps > best) {
+			best = mbps;
+			id = i;
+		}
+	}
+	if (id < 0)
+		return -1;
+	fprintf(stderr, "new files use %s\n", crypt_engine(id)->name);
+	new_cipher = id;
+	return 0;
+}
+
+void fmt_use_crc(int on)
+{
+	new_crc = on;
+}
+
+void fmt_use_dedup(int on)
+{
+	new_dedup = on;
+}
+
+int fmt_parse(const char* val, struct fmt_meta* m)
+{
+	const char* p;
+	unsigned int i, byte;
+
+	memset(m, 0, sizeof(*m));
+	m->key = base_key;
+	if (!strcmp(val, "true"))
+		return m->kind = FMT_LEGACY;
+	if (!strncmp(val, "chunked", 7) && (!val[7] || val[7] == ';'))
+		m->kind = FMT_CHUNKED;
+	else if (!strncmp(val, "pending", 7) && (!val[7] || val[7] == ';'))
+		m->kind = FMT_PENDING;
+	else if (!strncmp(val, "packed", 6) && (!val[6] || val[6] == ';'))
+		m->kind = FMT_PACKED;
+	else if (!strncmp(val, "dedup", 5) && (!val[5] || val[5] == ';'))
+		m->kind = FMT_DEDUP;
+	else
+		return m->kind = FMT_PLAIN;
+
+	m->cipher = CRYPT_AES256_CBC;
+	for (p = strchr(val, ';'); p; p = strchr(p + 1, ';')) {
+		if (sscanf(p + 1, "stripes=%d,%d", &m->stripes, &m->stripe_unit) == 2) {
+			if (m->stripe_unit <= 0)
+				m->stripes = 0;
+			continue;
+		}
+		if (!strncmp(p + 1, "crc", 3) && (!p[4] || p[4] == ';')) {
+			m->crc = 1;
+			continue;
+		}
+		if (!strncmp(p + 1, "holes", 5) && (!p[6] || p[6] == ';')) {
+			m->holes = 1;
+			continue;
+		}
+		if (sscanf(p + 1, "key=%x", &byte) == 1) {
+			//a key that wasn't loaded leaves the file unreadable
+			m->key = crypt_key_find(byte);
+			continue;
+		}
+		if (!strncmp(p + 1, "cipher=", 7)) {
+			//an engine we don't know leaves the file unreadable
+			m->cipher = crypt_engine_find(p + 8, strcspn(p + 8, ";"));
+			continue;
+		}
+		if (strncmp(p + 1, "nonce=", 6))
+			continue;
+		for (i = 0; i < sizeof(m->nonce); i++) {
+			if (sscanf(p + 7 + 2 * i, "%2x", &byte) != 1)
+				break;
+			m->nonce[i] = byte;
+		}
+	}
+	return m->kind;
+}
+
+int fmt_get(int fd, struct fmt_meta* m)
+{
+	TRACE_SPAN("xattr_lookup");
+	char val[128];
+	ssize_t len;
+
+	len = fgetxattr(fd, FMT_ATTR, val, sizeof(val) - 1);
+	if (len < 0) {
+		memset(m, 0, sizeof(*m));
+		if (errno == ENODATA || errno == ENOTSUP)
+			return m->kind = FMT_PLAIN;
+		return -errno;
+	}
+	val[len] = '\0';
+	return fmt_parse(val, m);
+}
+
+int fmt_get_path(const char* path, struct fmt_meta* m)
+{
+	TRACE_SPAN("xattr_lookup");
+	char val[128];
+	ssize_t len;
+
+	len = getxattr(path, FMT_ATTR, val, sizeof(val) - 1);
+	if (len < 0) {
+		memset(m, 0, sizeof(*m));
+		if (errno == ENODATA || errno == ENOTSUP || errno == ERANGE)
+			return m->kind = FMT_PLAIN;
+		return -errno;
+	}
+	val[len] = '\0';
+	return fmt_parse(val, m);
+}
+
+int fmt_new(struct fmt_meta* m)
+{
+	memset(m, 0, sizeof(*m));
+	m->kind = new_dedup ? FMT_DEDUP : FMT_CHUNKED;
+	m->cipher = new_cipher;
+	m->key = fmt_current_key();
+	//stored chunks always carry a checksum, the table has nothing to sum
+	m->crc = new_dedup ? 0 : new_crc;
+	//where a slot can be told from zeros it has to be listed as a hole
+	m->holes = !new_dedup && (m->crc || crypt_engine(new_cipher)->overhead);
+	if (!new_dedup && stripe_count() > 1) {
+		m->stripes = stripe_count();
+		m->stripe_unit = stripe_unit();
+	}
+	return RAND_bytes(m->nonce, sizeof(m->nonce)) == 1 ? 0 : -1;
+}
+
+int fmt_set(int fd, const struct fmt_meta* m)
+{
+	char val[128];
+	size_t len;
+	unsigned int i;
+
+	if (m->kind == FMT_LEGACY) {
+		len = snprintf(val, sizeof(val), "true");
+	} else {
+		len = snprintf(val, sizeof(val), "%s;nonce=",
+			       m->kind == FMT_PENDING ? "pending" :
+			       m->kind == FMT_PACKED ? "packed" :
+			       m->kind == FMT_DEDUP ? "dedup" : "chunked");
+		for (i = 0; i < sizeof(m->nonce); i++)
+			len += snprintf(val + len, sizeof(val) - len, "%02x", m->nonce[i]);
+		//aes256-cbc files are left as older versions wrote them
+		if (m->cipher != CRYPT_AES256_CBC && crypt_engine(m->cipher))
+			len += snprintf(val + len, sizeof(val) - len, ";cipher=%s",
+					crypt_engine(m->cipher)->name);
+		if (m->stripes > 1)
+			len += snprintf(val + len, sizeof(val) - len, ";stripes=%d,%d",
+					m->stripes, m->stripe_unit);
+		if (m->crc)
+			len += snprintf(val + len, sizeof(val) - len, ";crc");
+		if (m->holes)
+			len += snprintf(val + len, sizeof(val) - len, ";holes");
+		//so are files of the key they were written with
+		if (m->key != base_key && crypt_key_id(m->key))
+			len += snprintf(val + len, sizeof(val) - len, ";key=%08x",
+					crypt_key_id(m->key));
+	}
+	if (fsetxattr(fd, FMT_ATTR, val, len, 0) == -1)
+		return -errno;
+	return 0;
+}
+
+//how the slots of a chunked file are laid out
+struct layout {
+	const struct crypt_engine* e;
+	size_t overhead;	/* the engine's, plus the checksum */
+	int crc;
+};
+
+//the layout of a chunked file, -1 with errno set if its cipher is unknown
+static int layout_of(const struct fmt_meta* m, struct layout* lo)
+{
+	lo->e = crypt_engine(m->cipher);
+	if (!lo->e) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	lo->crc = m->crc;
+	lo->overhead = lo->e->overhead + (m->crc ? FMT_CRC : 0);
+	return 0;
+}
+
+//layout_of() for reading and writing chunks, which needs the file's key
+static int keyed_layout(const struct fmt_meta* m, struct layout* lo)
+{
+	if (m->key < 0) {
+		errno = ENOKEY;
+		return -1;
+	}
+	return layout_of(m, lo);
+}
+
+//bytes chunk idx takes up in the backing file, and where it starts there
+static size_t slot_size(const struct layout* lo)
+{
+	return FMT_CHUNK + lo->overhead;
+}
+
+static off_t slot_off(const struct layout* lo, off_t idx)
+{
+	return idx * (off_t) slot_size(lo);
+}
+
+static off_t plain_size(const struct layout* lo, off_t backing)
+{
+	off_t tail = backing % slot_size(lo);
+
+	return backing / slot_size(lo) * FMT_CHUNK +
+		(tail > (off_t) lo->overhead ? tail - (off_t) lo->overhead : 0);
+}
+
+static off_t backing_size(const struct layout* lo, off_t plain)
+{
+	off_t tail = plain % FMT_CHUNK;
+
+	return slot_off(lo, plain / FMT_CHUNK) + (tail ? tail + (off_t) lo->overhead : 0);
+}
+
+//bytes of a slen byte slot the engine sealed, the checksum follows them
+static size_t sealed_len(const struct layout* lo, size_t slen)
+{
+	return lo->crc ? slen - FMT_CRC : slen;
+}
+
+//stores the checksum of the sealed bytes after them
+static void slot_sum(const struct layout* lo, unsigned char* s, size_t slen)
+{
+	uint32_t crc;
+	int i;
+
+	if (!lo->crc)
+		return;
+	crc = crc32c(0, s, slen - FMT_CRC);
+	for (i = 0; i < FMT_CRC; i++)
+		s[slen - FMT_CRC + i] = crc >> (8 * i);
+}
+
+//whether a slot that isn't a hole matches its checksum
+static int slot_ok(const struct layout* lo, const unsigned char* s, size_t slen)
+{
+	uint32_t crc = 0;
+	int i;
+
+	if (!lo->crc)
+		return 1;
+	if (slen < FMT_CRC)
+		return 0;
+	for (i = 0; i < FMT_CRC; i++)
+		crc |= (uint32_t) s[slen - FMT_CRC + i] << (8 * i);
+	return crc32c(0, s, slen - FMT_CRC) == crc;
+}
+
+static void make_tweak(const struct fmt_meta* m, off_t idx,
+		       unsigned char tweak[CRYPT_TWEAK])
+{
+	int i;
+
+	memcpy(tweak, m->nonce, 8);
+	for (i = 0; i < 8; i++)
+		tweak[8 + i] = (unsigned long long) idx >> (56 - 8 * i);
+	//chunk indices never get that far, so the top bit can say the file
+	//lists its holes: taking ";holes" off the xattr fails every chunk
+	if (m->holes)
+		tweak[8] |= 0x80;
+}
+
+//the FMT_HOLES_ATTR list of a ";holes" file, as sorted, disjoint
+//[start, end) chunk ranges
+struct holes {
+	int n;
+	int dirty;
+	uint64_t run[FMT_HOLE_RUNS + 2][2];
+};
+
+#define HOLES_MAX (FMT_HOLE_RUNS * 16 + FMT_CRC + CRYPT_ID)
+
+static void put_le(unsigned char* p, uint64_t v, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char* p, int len)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		v |= (uint64_t) p[i] << (8 * i);
+	return v;
+}
+
+//MAC of the encoded runs, bound to the file by its nonce
+static int holes_mac(const struct fmt_meta* m, const unsigned char* runs,
+		     size_t len, unsigned char mac[CRYPT_ID])
+{
+	unsigned char msg[8 + FMT_HOLE_RUNS * 16];
+
+	memcpy(msg, m->nonce, 8);
+	memcpy(msg + 8, runs, len);
+	return crypt_mac(m->key, msg, 8 + len, mac) ? 0 : -1;
+}
+
+//reads the hole list of fd; without mac only its CRC is checked, which
+//needs no key. -1 with errno EIO if the list is damaged or forged.
+static int holes_load(int fd, const struct fmt_meta* m, struct holes* h, int mac)
+{
+	unsigned char val[HOLES_MAX], sum[CRYPT_ID];
+	ssize_t len;
+	size_t rl;
+	int i;
+
+	h->n = 0;
+	h->dirty = 0;
+	len = fgetxattr(fd, FMT_HOLES_ATTR, val, sizeof(val));
+	if (len < 0)
+		return errno == ENODATA ? 0 : -1;
+	rl = len - FMT_CRC - CRYPT_ID;
+	if (len < FMT_CRC + CRYPT_ID || rl % 16 ||
+	    get_le(val + rl, FMT_CRC) != crc32c(0, val, rl) ||
+	    (mac && (holes_mac(m, val, rl, sum) ||
+		     memcmp(sum, val + rl + FMT_CRC, CRYPT_ID))))
+		goto bad;
+	for (i = 0; i < (int) (rl / 16); i++) {
+		h->run[i][0] = get_le(val + 16 * i, 8);
+		h->run[i][1] = h->run[i][0] + get_le(val + 16 * i + 8, 8);
+		if (h->run[i][1] <= h->run[i][0] ||
+		    (i && h->run[i][0] <= h->run[i - 1][1]))
+			goto bad;
+	}
+	h->n = i;
+	return 0;
+bad:
+	h->n = 0;
+	errno = EIO;
+	return -1;
+}
+
+static int holes_store(int fd, const struct fmt_meta* m, struct holes* h)
+{
+	unsigned char val[HOLES_MAX];
+	size_t rl = h->n * 16;
+	int i;
+
+	if (!m->holes || !h->dirty)
+		return 0;
+	if (!h->n) {
+		if (fremovexattr(fd, FMT_HOLES_ATTR) == -1 && errno != ENODATA)
+			return -1;
+		h->dirty = 0;
+		return 0;
+	}
+	for (i = 0; i < h->n; i++) {
+		put_le(val + 16 * i, h->run[i][0], 8);
+		put_le(val + 16 * i + 8, h->run[i][1] - h->run[i][0], 8);
+	}
+	put_le(val + rl, crc32c(0, val, rl), FMT_CRC);
+	if (holes_mac(m, val, rl, val + rl + FMT_CRC) ||
+	    fsetxattr(fd, FMT_HOLES_ATTR, val, rl + FMT_CRC + CRYPT_ID, 0) == -1)
+		return -1;
+	h->dirty = 0;
+	return 0;
+}
+
+static int holes_has(const struct holes* h, uint64_t idx)
+{
+	int i;
+
+	for (i = 0; i < h->n && h->run[i][0] <= idx; i++)
+		if (idx < h->run[i][1])
+			return 1;
+	return 0;
+}
+
+//lists (hole 1) or unlists chunks [a, b). Past FMT_HOLE_RUNS runs the two
+//closest ones are merged; listing data only lets a zeroed slot pass.
+static void holes_mark(struct holes* h, uint64_t a, uint64_t b, int hole)
+{
+	uint64_t (*r)[2] = h->run;
+	uint64_t cut[FMT_HOLE_RUNS + 2][2];
+	int i, j, n = 0, best;
+
+	if (a >= b)
+		return;
+	//nothing to do if [a, b) is already (un)listed
+	for (i = 0; i < h->n; i++) {
+		if (hole && r[i][0] <= a && b <= r[i][1])
+			return;
+		if (!hole && r[i][0] < b && a < r[i][1])
+			break;
+	}
+	if (!hole && i == h->n)
+		return;
+	h->dirty = 1;
+
+	//cut [a, b) out, one run may split in two
+	for (i = 0; i < h->n; i++) {
+		uint64_t s = r[i][0], e = r[i][1];
+
+		if (s < a) {
+			cut[n][0] = s;
+			cut[n++][1] = e < a ? e : a;
+		}
+		if (e > b) {
+			cut[n][0] = s > b ? s : b;
+			cut[n++][1] = e;
+		}
+	}
+	memcpy(r, cut, n * sizeof(r[0]));
+	h->n = n;
+	if (!hole)
+		goto cap;
+	//then put it back in as a run of its own and merge the neighbours
+	for (i = 0; i < n && r[i][0] < a; i++)
+		;
+	memmove(r[i + 1], r[i], (n - i) * sizeof(r[0]));
+	r[i][0] = a;
+	r[i][1] = b;
+	n++;
+	for (i = 1, j = 0; i < n; i++) {
+		if (r[i][0] <= r[j][1]) {
+			if (r[i][1] > r[j][1])
+				r[j][1] = r[i][1];
+		} else {
+			j++;
+			r[j][0] = r[i][0];
+			r[j][1] = r[i][1];
+		}
+	}
+	h->n = n = j + 1;
+cap:
+	while (h->n > FMT_HOLE_RUNS) {
+		best = 0;
+		for (i = 1; i < h->n - 1; i++)
+			if (r[i + 1][0] - r[i][1] < r[best + 1][0] - r[best][1])
+				best = i;
+		r[best][1] = r[best + 1][1];
+		memmove(r[best + 1], r[best + 2], (h->n - best - 2) * sizeof(r[0]));
+		h->n--;
+	}
+}
+
+//loads the list for a change to a file of plaintext size size, an empty
+//file starts a new one whatever is left of an old one
+static int holes_begin(int fd, const struct fmt_meta* m, struct holes* h, off_t size)
+{
+	if (m->holes && size)
+		return holes_load(fd, m, h, 1);
+	h->n = 0;
+	h->dirty = m->holes;
+	return 0;
+}
+
+//whether zero slot idx is a hole; the list of a ";holes" file is loaded
+//into h (n -1 until then) on first use. If not, errno is EIO and the
+//slot is counted as one that failed its tag or checksum.
+static int hole_ok(int fd, const struct fmt_meta* m, const struct layout* lo,
+		   struct holes* h, off_t idx)
+{
+	if (!m->holes)
+		return 1;
+	//a bad list lists nothing
+	if (h->n < 0)
+		holes_load(fd, m, h, 1);
+	if (holes_has(h, idx))
+		return 1;
+	if (lo->e->overhead)
+		STAT_INC(fmt_auth_failures);
+	else
+		STAT_INC(fmt_crc_failures);
+	errno = EIO;
+	return 0;
+}
+
+int fmt_copy_holes(int from, int to)
+{
+	unsigned char val[HOLES_MAX];
+	ssize_t len;
+
+	len = fgetxattr(from, FMT_HOLES_ATTR, val, sizeof(val));
+	if (len < 0) {
+		if (errno != ENODATA)
+			return -errno;
+		if (fremovexattr(to, FMT_HOLES_ATTR) == -1 && errno != ENODATA)
+			return -errno;
+		return 0;
+	}
+	if (fsetxattr(to, FMT_HOLES_ATTR, val, len, 0) == -1)
+		return -errno;
+	return 0;
+}
+
+//a change to a packed file doesn't touch its stub, whose times are set
+//by hand instead
+static int packed_done(int fd, ssize_t res)
+{
+	if (res < 0)
+		return -1;
+	if (futimens(fd, NULL) == -1)
+		return -1;
+	return 0;
+}
+
+off_t fmt_plainsize(const struct fmt_meta* m, off_t backing)
+{
+	struct layout lo;
+
+	//the size of a pending file is its staging file's
+	if (m->kind == FMT_PENDING)
+		return -1;
+	//a packed file's stub is empty, its size is in the pack index
+	if (m->kind == FMT_PACKED)
+		return pack_size(m);
+	if (m->kind == FMT_DEDUP)
+		return dedup_plainsize(backing);
+	if (m->kind != FMT_CHUNKED)
+		return backing;
+	return layout_of(m, &lo) ? -1 : plain_size(&lo, backing);
+}
+
+off_t fmt_size(int fd, const struct fmt_meta* m)
+{
+	struct stat st;
+
+	if (m->kind == FMT_LEGACY)
+		return crypt_plainsize(fd, fmt_legacy_key());
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return fmt_plainsize(m, st.st_size);
+}
+
+static int is_zero(const unsigned char* p, size_t len)
+{
+	return len == 0 || (p[0] == 0 && !memcmp(p, p + 1, len - 1));
+}
+
+//pread/pwrite all of len bytes, short only at end of file
+static ssize_t io_all(int fd, unsigned char* buf, size_t len, off_t off, int wr)
+{
+	size_t done = 0;
+	ssize_t res = 0;
+
+	while (done < len) {
+		res = wr ? pwrite(fd, buf + done, len - done, off + done) :
+			   pread(fd, buf + done, len - done, off + done);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+	if (res < 0 && done == 0)
+		return -1;
+	return done;
+}
+
+//io_all() on an O_DIRECT descriptor for any range. Slots aren't
+//DIRECT_ALIGN sized, so the aligned blocks around the range go through a
+//bounce buffer, at most ARENA_LARGE at a time; a write reads back the
+//partial blocks at either end first and cuts off what the last one added
+//past the end of the file.
+static ssize_t direct_io(int fd, unsigned char* buf, size_t len, off_t off, int wr)
+{
+	unsigned char* b;
+	struct stat st;
+	size_t done = 0;
+	ssize_t res = 0;
+
+	if (((uintptr_t) buf | off | len) % DIRECT_ALIGN == 0)
+		return io_all(fd, buf, len, off, wr);
+	b = arena_get(ARENA_LARGE);
+	if (!b || (wr && fstat(fd, &st) == -1)) {
+		arena_put(b, ARENA_LARGE);
+		return -1;
+	}
+	while (done < len) {
+		off_t pos = off + done;
+		off_t a = pos - pos % DIRECT_ALIGN;
+		size_t in = pos - a;
+		size_t n = ARENA_LARGE - in < len - done ? ARENA_LARGE - in : len - done;
+		off_t e = (pos + n + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+		if (!wr) {
+			res = io_all(fd, b, e - a, a, 0);
+			if (res <= (ssize_t) in)
+				break;
+			if (n > (size_t) res - in)
+				n = res - in;
+			memcpy(buf + done, b + in, n);
+			done += n;
+			if (a + res < e)
+				break;
+			continue;
+		}
+		memset(b, 0, e - a);
+		if ((in && io_all(fd, b, DIRECT_ALIGN, a, 0) < 0) ||
+		    ((pos + n) % DIRECT_ALIGN &&
+		     io_all(fd, b + (e - a) - DIRECT_ALIGN, DIRECT_ALIGN, e - DIRECT_ALIGN, 0) < 0)) {
+			res = -1;
+			break;
+		}
+		memcpy(b + in, buf + done, n);
+		res = io_all(fd, b, e - a, a, 1);
+		if (res != (ssize_t) (e - a)) {
+			res = -1;
+			break;
+		}
+		if (e > st.st_size && pos + (off_t) n < e &&
+		    ftruncate(fd, pos + (off_t) n > st.st_size ? pos + (off_t) n : st.st_size) == -1) {
+			res = -1;
+			break;
+		}
+		if (pos + (off_t) n > st.st_size)
+			st.st_size = pos + n;
+		done += n;
+	}
+	arena_put(b, ARENA_LARGE);
+	if (res < 0 && done == 0)
+		return -1;
+	return done;
+}
+
+//pread/pwrite of whole slots, through the local cache tier; O_DIRECT
+//descriptors never use the tier and go through direct_io()
+static ssize_t slot_io(int fd, unsigned char* buf, size_t len, off_t off, int wr)
+{
+	TRACE_SPAN("backing_io");
+	int flags = fcntl(fd, F_GETFL);
+	struct stat st;
+	size_t done = 0;
+	ssize_t res = 0;
+
+	if (flags != -1 && (flags & O_DIRECT)) {
+		if (fstat(fd, &st) == 0)
+			tier_invalidate(st.st_dev, st.st_ino);
+		return direct_io(fd, buf, len, off, wr);
+	}
+	while (done < len) {
+		res = wr ? tier_pwrite(fd, buf + done, len - done, off + done) :
+			   tier_pread(fd, buf + done, len - done, off + done);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+	if (res < 0 && done == 0)
+		return -1;
+	return done;
+}
+
+ssize_t fmt_backing_io(int fd, void* buf, size_t len, off_t off, int wr)
+{
+	return slot_io(fd, buf, len, off, wr);
+}
+
+//stores zeros over [off, off + len) of the backing file, as a hole if
+//the filesystem can
+static int zero_slots(int fd, off_t off, off_t len)
+{
+	size_t n;
+
+	if (len <= 0)
+		return 0;
+	if (tier_punch(fd, off, len) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+	while (len > 0) {
+		n = len < FMT_CHUNK ? len : FMT_CHUNK;
+		if (slot_io(fd, (unsigned char*) zeros, n, off, 1) != (ssize_t) n)
+			return -1;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//a chunked file's backing storage: the caller's descriptor, which holds
+//stripe 0, and for striped files the other stripes, opened when needed
+struct backing {
+	const struct fmt_meta* m;
+	off_t unit;		/* backing bytes per stripe unit, 0 = one file */
+	int flags;		/* open() flags of the stripe files */
+	int fd[STRIPE_MAX];
+};
+
+struct segment {
+	int k;			/* stripe */
+	int fd;			/* -1: stripe file doesn't exist yet */
+	unsigned char* buf;
+	size_t len;
+	off_t off;
+	int wr;
+	int err;
+};
+
+static void backing_init(struct backing* bk, int fd, const struct fmt_meta* m,
+			 const struct layout* lo, int wr)
+{
+	int flags = fcntl(fd, F_GETFL);
+	int k;
+
+	bk->m = m;
+	bk->unit = m->stripes > 1 ? m->stripe_unit * (off_t) slot_size(lo) : 0;
+	bk->flags = (wr ? O_RDWR | O_CREAT : O_RDONLY) |
+		(flags != -1 ? flags & O_DIRECT : 0);
+	bk->fd[0] = fd;
+	for (k = 1; k < STRIPE_MAX; k++)
+		bk->fd[k] = -1;
+}
+
+static void backing_done(struct backing* bk)
+{
+	int k;
+
+	for (k = 1; k < STRIPE_MAX; k++)
+		if (bk->fd[k] != -1)
+			close(bk->fd[k]);
+}
+
+//stripe and offset in its file of backing offset off, and how much of
+//the stripe unit is left from there. Stripe 0 keeps every offset (the
+//units of the other stripes are holes in it, so its size is the file's
+//backing size), the other stripes are packed.
+static int backing_map(const struct backing* bk, off_t off, off_t* local,
+		       off_t* left)
+{
+	off_t u = off / bk->unit;
+	int n = bk->m->stripes;
+	int k = u % n;
+
+	*local = k == 0 ? off : u / n * bk->unit + off % bk->unit;
+	*left = bk->unit - off % bk->unit;
+	return k;
+}
+
+//descriptor of stripe k, -1 with errno set (ENOENT if it was never written)
+static int backing_fd(struct backing* bk, int k)
+{
+	if (k >= bk->m->stripes || k >= STRIPE_MAX) {
+		errno = EIO;
+		return -1;
+	}
+	if (bk->fd[k] == -1)
+		bk->fd[k] = stripe_open(bk->m->nonce, k, bk->flags);
+	return bk->fd[k];
+}
+
+//the segments of stripe k, in order: one worker per stripe file, so
+//direct_io() never has two writes to the same block in flight
+static void segment_run(void* arg, int k)
+{
+	struct segment* s;
+	ssize_t res;
+
+	for (s = arg; s->len; s++) {
+		if (s->k != k)
+			continue;
+		res = 0;
+		if (s->fd != -1)
+			res = slot_io(s->fd, s->buf, s->len, s->off, s->wr);
+		if (res < 0 || (s->wr && (size_t) res != s->len)) {
+			s->err = 1;
+			return;
+		}
+		//stripe files end where their last data does
+		if (!s->wr && (size_t) res < s->len)
+			memset(s->buf + res, 0, s->len - res);
+	}
+}
+
+//slot_io() on the backing storage, the stripes a range spans are
+//read or written in parallel
+static ssize_t backing_io(struct backing* bk, unsigned char* buf, size_t len,
+			  off_t off, int wr)
+{
+	struct segment segs[FMT_BATCH + 2];
+	off_t local, left;
+	size_t pos, n;
+	int nsegs = 0;
+	int i, k;
+
+	if (!bk->unit)
+		return slot_io(bk->fd[0], buf, len, off, wr);
+
+	for (pos = 0; pos < len; pos += n) {
+		k = backing_map(bk, off + pos, &local, &left);
+		n = len - pos < (size_t) left ? len - pos : (size_t) left;
+		if (nsegs == FMT_BATCH + 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		segs[nsegs].k = k;
+		segs[nsegs].fd = backing_fd(bk, k);
+		if (segs[nsegs].fd == -1 && (wr || errno != ENOENT))
+			return -1;
+		segs[nsegs].buf = buf + pos;
+		segs[nsegs].len = n;
+		segs[nsegs].off = local;
+		segs[nsegs].wr = wr;
+		segs[nsegs].err = 0;
+		nsegs++;
+	}
+	segs[nsegs].len = 0;
+	stripe_parallel(bk->m->stripes < STRIPE_MAX ? bk->m->stripes : STRIPE_MAX,
+			segment_run, segs);
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].err) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return len;
+}
+
+//zero_slots() on the backing storage
+static int backing_zero(struct backing* bk, off_t off, off_t len)
+{
+	off_t local, left, n;
+	int fd, k;
+
+	if (!bk->unit)
+		return zero_slots(bk->fd[0], off, len);
+	for (; len > 0; off += n, len -= n) {
+		k = backing_map(bk, off, &local, &left);
+		n = len < left ? len : left;
+		fd = backing_fd(bk, k);
+		if (fd == -1 && errno == ENOENT)
+			continue;
+		if (fd == -1 || zero_slots(fd, local, n))
+			return -1;
+	}
+	return 0;
+}
+
+ssize_t fmt_pread(int fd, const struct fmt_meta* m, char* buf, size_t size,
+		  off_t offset)
+{
+	struct layout lo;
+	unsigned char tweak[CRYPT_TWEAK];
+	struct backing bk;
+	struct stat st;
+	struct holes h;
+	unsigned char* slots;
+	unsigned char* plain;
+	size_t ssz, nslots;
+	off_t psize;
+	size_t done = 0;
+
+	if (m->kind == FMT_LEGACY)
+		return crypt_pread(fd, buf, size, offset, fmt_legacy_key());
+	if (m->kind == FMT_PACKED)
+		return pack_pread(m, buf, size, offset);
+	if (m->kind == FMT_DEDUP)
+		return dedup_pread(fd, m, buf, size, offset);
+
+	if (keyed_layout(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	psize = plain_size(&lo, st.st_size);
+	if (offset >= psize)
+		return 0;
+	if (size > (size_t) (psize - offset))
+		size = psize - offset;
+	ssz = slot_size(&lo);
+	nslots = FMT_BATCH * FMT_CHUNK / ssz;
+	backing_init(&bk, fd, m, &lo, 0);
+	h.n = -1;
+	slots = arena_get(FMT_BATCH * FMT_CHUNK);
+	plain = arena_get(FMT_CHUNK);
+	if (!slots || !plain)
+		goto out;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t first = pos / FMT_CHUNK;
+		size_t in = pos - first * FMT_CHUNK;
+		size_t count = (in + (size - done) + FMT_CHUNK - 1) / FMT_CHUNK;
+		size_t want, k;
+		ssize_t got;
+
+		//whole slots only, the tail one is as long as the file allows
+		if (count > nslots)
+			count = nslots;
+		want = count * ssz;
+		if ((off_t) want > st.st_size - slot_off(&lo, first))
+			want = st.st_size - slot_off(&lo, first);
+		got = backing_io(&bk, slots, want, slot_off(&lo, first), 0);
+		if (got <= 0)
+			break;
+
+		TRACE_SPAN("decrypt");
+		for (k = 0; k * ssz < (size_t) got && done < size; k++) {
+			unsigned char* s = slots + k * ssz;
+			size_t slen = got - k * ssz < ssz ? got - k * ssz : ssz;
+			size_t len = slen > lo.overhead ? slen - lo.overhead : 0;
+			size_t n = len > in ? len - in : 0;
+			unsigned char* dst;
+
+			if (n == 0)
+				goto out;
+			if (n > size - done)
+				n = size - done;
+			if (is_zero(s, slen)) {
+				if (!hole_ok(fd, m, &lo, &h, first + k))
+					goto out;
+				STAT_INC(fmt_hole_reads);
+				memset(buf + done, 0, n);
+			} else {
+				//a bad checksum is a damaged slot, not a wrong key
+				if (!slot_ok(&lo, s, slen)) {
+					STAT_INC(fmt_crc_failures);
+					errno = EIO;
+					goto out;
+				}
+				//whole chunks are opened straight into buf
+				dst = in == 0 && n == len ? (unsigned char*) buf + done : plain;
+				make_tweak(m, first + k, tweak);
+				if (!lo.e->open(lo.e, m->key, tweak, s, sealed_len(&lo, slen), dst)) {
+					STAT_INC(fmt_auth_failures);
+					errno = EIO;
+					goto out;
+				}
+				if (dst == plain)
+					memcpy(buf + done, plain + in, n);
+			}
+			done += n;
+			in = 0;
+		}
+		if ((size_t) got < want)
+			break;
+	}
+out:
+	backing_done(&bk);
+	arena_put(plain, FMT_CHUNK);
+	arena_put(slots, FMT_BATCH * FMT_CHUNK);
+	return done ? (ssize_t) done : (size ? -1 : 0);
+}
+
+int fmt_extend(int fd, const struct fmt_meta* m, off_t size)
+{
+	struct layout lo;
+	struct holes h;
+	struct stat st;
+	off_t cur;
+	size_t tail;
+
+	if (m->kind == FMT_PACKED) {
+		cur = pack_size(m);
+		if (cur < 0)
+			return -1;
+		return size <= cur ? 0 : packed_done(fd, pack_truncate(m, size));
+	}
+	if (m->kind == FMT_DEDUP) {
+		if (fstat(fd, &st) == -1)
+			return -1;
+		cur = dedup_plainsize(st.st_size);
+		return size <= cur ? 0 : dedup_truncate(fd, m, size);
+	}
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	cur = plain_size(&lo, st.st_size);
+	if (size <= cur)
+		return 0;
+	//a partial last chunk becomes a longer one and has to be
+	//re-encrypted at its new length, the rest is a hole
+	tail = cur % FMT_CHUNK;
+	if (tail) {
+		size_t n = FMT_CHUNK - tail;
+
+		if ((off_t) n > size - cur)
+			n = size - cur;
+		if (fmt_pwrite(fd, m, (const char*) zeros, n, cur) != (ssize_t) n)
+			return -1;
+	}
+	if (holes_begin(fd, m, &h, cur))
+		return -1;
+	holes_mark(&h, (cur + FMT_CHUNK - 1) / FMT_CHUNK,
+		   (size + FMT_CHUNK - 1) / FMT_CHUNK, 1);
+	if (holes_store(fd, m, &h) || tier_ftruncate(fd, backing_size(&lo, size)) == -1)
+		return -1;
+	return 0;
+}
+
+//puts a slot holding only the first len bytes of chunk idx, the new last
+//one, where its old slot is. it is logged like any rewrite and the file
+//is only cut to the new slot's end afterwards, so a crash anywhere in
+//between leaves the old slot or finishes the new one at the next mount
+static int cut_tail(int fd, const struct fmt_meta* m, const struct layout* lo,
+		    const struct stat* st, const unsigned char* plain, size_t len,
+		    off_t idx, unsigned char* s)
+{
+	unsigned char tweak[CRYPT_TWEAK];
+	struct backing bk;
+	struct holes h;
+	size_t slen = len + lo->overhead;
+	off_t so = slot_off(lo, idx);
+	int zero = is_zero(plain, len);
+	int log, res;
+
+	if (zero) {
+		//listed before it is punched, like in fmt_pwrite()
+		if (holes_begin(fd, m, &h, plain_size(lo, st->st_size)))
+			return -1;
+		holes_mark(&h, idx, idx + 1, 1);
+		if (holes_store(fd, m, &h))
+			return -1;
+	} else {
+		make_tweak(m, idx, tweak);
+		if (!lo->e->seal(lo->e, m->key, tweak, plain, len, s))
+			return -1;
+		slot_sum(lo, s, slen);
+	}
+	log = intent_begin();
+	res = intent_add(log, m, st->st_dev, st->st_ino, so, zero ? NULL : s, slen,
+			 so + slen) || intent_sync(log);
+	if (!res) {
+		backing_init(&bk, fd, m, lo, 1);
+		if (zero)
+			res = backing_zero(&bk, so, slen);
+		else
+			res = backing_io(&bk, s, slen, so, 1) == (ssize_t) slen ? 0 : -1;
+		backing_done(&bk);
+	}
+	intent_end(log);
+	if (zero)
+		STAT_INC(fmt_hole_writes);
+	return res || tier_ftruncate(fd, so + slen) == -1 ? -1 : 0;
+}
+
+int fmt_truncate(int fd, const struct fmt_meta* m, off_t size)
+{
+	struct layout lo;
+	struct holes h;
+	struct stat st;
+	off_t cur, start, keep;
+	size_t tail;
+	unsigned char* buf;
+	int res = 0;
+
+	if (m->kind == FMT_PACKED)
+		return packed_done(fd, pack_truncate(m, size));
+	if (m->kind == FMT_DEDUP)
+		return dedup_truncate(fd, m, size);
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	cur = plain_size(&lo, st.st_size);
+	if (size >= cur)
+		return fmt_extend(fd, m, size);
+	intent_settle(st.st_dev, st.st_ino);
+	//the chunks past the new end are cut off as they are; only a new
+	//partial last chunk has to be re-encrypted at its shorter length,
+	//its old slot stays until the new one replaces it
+	tail = size % FMT_CHUNK;
+	start = size - tail;
+	keep = slot_off(&lo, start / FMT_CHUNK + (tail ? 1 : 0));
+	if (tail) {
+		if (keyed_layout(m, &lo))
+			return -1;
+		//the plaintext, then the new slot
+		buf = arena_get(3 * FMT_CHUNK);
+		if (!buf)
+			return -1;
+		if (fmt_pread(fd, m, (char*) buf, tail, start) != (ssize_t) tail ||
+		    (st.st_size > keep && tier_ftruncate(fd, keep) == -1) ||
+		    cut_tail(fd, m, &lo, &st, buf, tail, start / FMT_CHUNK, buf + FMT_CHUNK))
+			res = -1;
+		arena_put(buf, 3 * FMT_CHUNK);
+	} else if (tier_ftruncate(fd, keep) == -1) {
+		res = -1;
+	}
+	//whatever was listed past the new end isn't there any more
+	if (!res && !holes_begin(fd, m, &h, size)) {
+		holes_mark(&h, (size + FMT_CHUNK - 1) / FMT_CHUNK, UINT64_MAX, 0);
+		res = holes_store(fd, m, &h);
+	} else {
+		res = -1;
+	}
+	if (!res)
+		res = fmt_trim(fd, m);
+	return res;
+}
+
+ssize_t fmt_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+		   size_t size, off_t offset)
+{
+	struct layout lo;
+	unsigned char tweak[CRYPT_TWEAK];
+	struct backing bk;
+	struct holes h;
+	struct stat st;
+	unsigned char* slots;
+	unsigned char* plain;
+	char hole[FMT_BATCH];
+	off_t old, newsize, bold, bnew, end = offset + size;
+	size_t ssz, nslots;
+	size_t done = 0;
+	int err = 0;
+	int log;
+
+	if (size == 0)
+		return 0;
+	if (m->kind == FMT_PACKED)
+		return packed_done(fd, pack_pwrite(m, buf, size, offset)) ? -1 :
+			(ssize_t) size;
+	if (m->kind == FMT_DEDUP)
+		return dedup_pwrite(fd, m, buf, size, offset);
+	if (keyed_layout(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	old = plain_size(&lo, st.st_size);
+	if (offset > old) {
+		//leave the gap as a hole
+		if (fmt_extend(fd, m, offset))
+			return -1;
+		old = offset;
+	}
+	if (holes_begin(fd, m, &h, old))
+		return -1;
+	newsize = end > old ? end : old;
+	bold = backing_size(&lo, old);
+	bnew = backing_size(&lo, newsize);
+	ssz = slot_size(&lo);
+	nslots = FMT_BATCH * FMT_CHUNK / ssz;
+
+	slots = arena_get(FMT_BATCH * FMT_CHUNK);
+	plain = arena_get(FMT_CHUNK);
+	if (!slots || !plain) {
+		arena_put(plain, FMT_CHUNK);
+		arena_put(slots, FMT_BATCH * FMT_CHUNK);
+		return -1;
+	}
+	backing_init(&bk, fd, m, &lo, 1);
+
+	while (done < size && !err) {
+		off_t first = (offset + done) / FMT_CHUNK;
+		off_t start = first * FMT_CHUNK;
+		size_t n;
+		size_t i, j;
+
+		//re-encrypt every chunk the write touches, partially
+		//overwritten ones keep the rest of their old plaintext
+		{
+			TRACE_SPAN("encrypt");
+			for (n = 0; n < nslots && start + (off_t) n * FMT_CHUNK < end; n++) {
+				off_t cs = start + n * FMT_CHUNK;
+				unsigned char* s = slots + n * ssz;
+				size_t clen = newsize - cs < FMT_CHUNK ? newsize - cs : FMT_CHUNK;
+				size_t oldlen = old <= cs ? 0 :
+						old - cs < FMT_CHUNK ? old - cs : FMT_CHUNK;
+				off_t ws = offset > cs ? offset : cs;
+				off_t we = end < cs + (off_t) clen ? end : cs + (off_t) clen;
+
+				memset(plain, 0, FMT_CHUNK);
+				if ((ws > cs || we < cs + (off_t) clen) && oldlen) {
+					size_t slen = oldlen + lo.overhead;
+					int zero;
+
+					//the old slot is read where the new one goes
+					if (backing_io(&bk, s, slen, slot_off(&lo, first + n), 0) !=
+					    (ssize_t) slen) {
+						err = 1;
+						break;
+					}
+					zero = is_zero(s, slen);
+					if (zero && !hole_ok(fd, m, &lo, &h, first + n)) {
+						err = 1;
+						break;
+					}
+					if (!zero && !slot_ok(&lo, s, slen)) {
+						STAT_INC(fmt_crc_failures);
+						errno = EIO;
+						err = 1;
+						break;
+					}
+					make_tweak(m, first + n, tweak);
+					if (!zero && !lo.e->open(lo.e, m->key, tweak, s, sealed_len(&lo, slen),
+								 plain)) {
+						STAT_INC(fmt_auth_failures);
+						errno = EIO;
+						err = 1;
+						break;
+					}
+				}
+				memcpy(plain + (ws - cs), buf + (ws - offset), we - ws);
+
+				hole[n] = is_zero(plain, clen);
+				if (hole[n])
+					continue;
+				make_tweak(m, first + n, tweak);
+				if (!lo.e->seal(lo.e, m->key, tweak, plain, clen, s)) {
+					err = 1;
+					break;
+				}
+				slot_sum(&lo, s, clen + lo.overhead);
+			}
+		}
+
+		//holes are listed before they are punched and data is taken
+		//off once written, so a crash in between leaves listed slots
+		//rather than unlisted zero ones
+		for (i = 0; i < n && !err; i = j) {
+			for (j = i + 1; j < n && hole[j] == hole[i]; j++)
+				;
+			if (hole[i])
+				holes_mark(&h, first + i, first + j, 1);
+		}
+		if (!err && holes_store(fd, m, &h))
+			err = 1;
+
+		//runs over slots that are already there are logged first, so a
+		//crash while they are rewritten is finished at the next mount
+		log = slot_off(&lo, first) < bold ? intent_begin() : -1;
+		for (i = 0; i < n && !err && log != -1 && slot_off(&lo, first + i) < bold;
+		     i = j) {
+			off_t rs = slot_off(&lo, first + i);
+			off_t re;
+
+			for (j = i + 1; j < n && hole[j] == hole[i]; j++)
+				;
+			re = slot_off(&lo, first + j) < bnew ? slot_off(&lo, first + j) : bnew;
+			if (hole[i] && re > bold)
+				re = bold;
+			if (intent_add(log, m, st.st_dev, st.st_ino, rs,
+				       hole[i] ? NULL : slots + i * ssz, re - rs, bnew))
+				err = 1;
+		}
+		if (!err && intent_sync(log))
+			err = 1;
+
+		//one write per run of data slots, one punch per run of holes
+		for (i = 0; i < n && !err; i = j) {
+			off_t rs = slot_off(&lo, first + i);
+			off_t re;
+
+			for (j = i + 1; j < n && hole[j] == hole[i]; j++)
+				;
+			re = slot_off(&lo, first + j) < bnew ? slot_off(&lo, first + j) : bnew;
+			if (!hole[i]) {
+				if (backing_io(&bk, slots + i * ssz, re - rs, rs, 1) != re - rs)
+					err = 1;
+				else
+					holes_mark(&h, first + i, first + j, 0);
+				continue;
+			}
+			STAT_ADD(fmt_hole_writes, j - i);
+			//past the old end the file is extended with a hole below
+			if (rs < bold && backing_zero(&bk, rs, (re < bold ? re : bold) - rs))
+				err = 1;
+		}
+		intent_end(log);
+		done = (start + (off_t) n * FMT_CHUNK < end ?
+			start + (off_t) n * FMT_CHUNK : end) - offset;
+	}
+
+	if (holes_store(fd, m, &h))
+		err = 1;
+	backing_done(&bk);
+	arena_put(plain, FMT_CHUNK);
+	arena_put(slots, FMT_BATCH * FMT_CHUNK);
+	//zero chunks at the end were never written, and a shorter tail
+	//slot leaves the old one's stale end behind
+	if (!err && fstat(fd, &st) == 0 && st.st_size != bnew &&
+	    tier_ftruncate(fd, bnew) == -1)
+		err = 1;
+	return err ? -1 : (ssize_t) size;
+}
+
+int fmt_import(int fd, const struct fmt_meta* m, FILE* plain)
+{
+	char* buf;
+	size_t n;
+	off_t off = 0;
+	int res = 0;
+
+	buf = arena_get(FMT_BATCH * FMT_CHUNK);
+	if (!buf)
+		return -1;
+	while ((n = fread(buf, 1, FMT_BATCH * FMT_CHUNK, plain)) > 0) {
+		if (fmt_pwrite(fd, m, buf, n, off) != (ssize_t) n) {
+			res = -1;
+			break;
+		}
+		off += n;
+	}
+	if (ferror(plain))
+		res = -1;
+	arena_put(buf, FMT_BATCH * FMT_CHUNK);
+	return res;
+}
+
+int fmt_zero(int fd, const struct fmt_meta* m, off_t offset, off_t len)
+{
+	struct layout lo;
+	struct backing bk;
+	struct holes h;
+	struct stat st;
+	off_t size, end, a, b, ba, bb;
+	int res, log;
+
+	//a packed file is a single record, rewritten either way
+	if (m->kind == FMT_PACKED) {
+		size = pack_size(m);
+		end = offset + len < size ? offset + len : size;
+		if (offset >= end)
+			return size < 0 ? -1 : 0;
+		return fmt_pwrite(fd, m, (const char*) zeros, end - offset, offset) ==
+			end - offset ? 0 : -1;
+	}
+	//zero chunks of a deduplicated file are zero IDs in its table
+	if (m->kind == FMT_DEDUP) {
+		if (fstat(fd, &st) == -1)
+			return -1;
+		size = dedup_plainsize(st.st_size);
+		end = offset + len < size ? offset + len : size;
+		if (offset >= end)
+			return 0;
+		return dedup_pwrite(fd, m, NULL, end - offset, offset) == end - offset ?
+			0 : -1;
+	}
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	size = plain_size(&lo, st.st_size);
+	end = offset + len < size ? offset + len : size;
+	if (offset >= end)
+		return 0;
+	//whole chunks become holes, the partial ones at either end are
+	//rewritten
+	a = (offset + FMT_CHUNK - 1) / FMT_CHUNK * FMT_CHUNK;
+	b = end / FMT_CHUNK * FMT_CHUNK;
+	if (end == size)
+		b = end;
+	if (a >= b) {
+		a = b = end;
+	}
+	if (offset < a && fmt_pwrite(fd, m, (const char*) zeros, a - offset, offset) !=
+	    a - offset)
+		return -1;
+	if (a < b) {
+		if (holes_begin(fd, m, &h, size))
+			return -1;
+		holes_mark(&h, a / FMT_CHUNK, (b + FMT_CHUNK - 1) / FMT_CHUNK, 1);
+		if (holes_store(fd, m, &h))
+			return -1;
+		ba = slot_off(&lo, a / FMT_CHUNK);
+		bb = b == size ? st.st_size : slot_off(&lo, b / FMT_CHUNK);
+		log = intent_begin();
+		res = intent_add(log, m, st.st_dev, st.st_ino, ba, NULL, bb - ba, st.st_size) ||
+			intent_sync(log);
+		if (!res) {
+			backing_init(&bk, fd, m, &lo, 1);
+			res = backing_zero(&bk, ba, bb - ba);
+			backing_done(&bk);
+		}
+		intent_end(log);
+		if (res)
+			return -1;
+		STAT_ADD(fmt_hole_writes, (b - a + FMT_CHUNK - 1) / FMT_CHUNK);
+	}
+	if (b < end && fmt_pwrite(fd, m, (const char*) zeros, end - b, b) != end - b)
+		return -1;
+	return 0;
+}
+
+int fmt_trim(int fd, const struct fmt_meta* m)
+{
+	struct layout lo;
+	struct backing bk;
+	struct stat st;
+	off_t units, rem, keep;
+	int n = m->stripes;
+	int k, sfd, res = 0;
+
+	if (m->kind != FMT_CHUNKED || n <= 1)
+		return 0;
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	backing_init(&bk, fd, m, &lo, 0);
+	bk.flags = O_RDWR;
+	//stripe k holds every n-th unit from unit k on, packed
+	units = st.st_size / bk.unit;
+	rem = st.st_size % bk.unit;
+	for (k = 1; k < n && !res; k++) {
+		keep = (units / n + (k < units % n)) * bk.unit +
+			(k == units % n ? rem : 0);
+		sfd = backing_fd(&bk, k);
+		if (sfd == -1) {
+			if (errno != ENOENT)
+				res = -1;
+			continue;
+		}
+		if (fstat(sfd, &st) == -1 ||
+		    (st.st_size > keep && tier_ftruncate(sfd, keep) == -1))
+			res = -1;
+	}
+	backing_done(&bk);
+	return res;
+}
+
+int fmt_apply(int fd, const struct fmt_meta* m, off_t off, const void* data,
+	      size_t len, off_t size)
+{
+	struct layout lo;
+	struct backing bk;
+	struct holes h;
+	struct stat st;
+	size_t ssz;
+	int res;
+
+	if (m->kind != FMT_CHUNKED) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	ssz = slot_size(&lo);
+	backing_init(&bk, fd, m, &lo, 1);
+	if (data)
+		res = backing_io(&bk, (unsigned char*) data, len, off, 1) ==
+			(ssize_t) len ? 0 : -1;
+	else
+		res = backing_zero(&bk, off, len);
+	backing_done(&bk);
+	//the hole list may not have reached the disk either. it is signed,
+	//without the file's key it stays as it is
+	if (!res && m->holes && m->key >= 0 &&
+	    !holes_begin(fd, m, &h, plain_size(&lo, st.st_size))) {
+		holes_mark(&h, off / ssz, (off + len + ssz - 1) / ssz, !data);
+		res = holes_store(fd, m, &h);
+	}
+	if (res || size < 0 || fstat(fd, &st) == -1)
+		return res;
+	//a file can only have grown since by rewriting a partial last slot,
+	//which would have logged a later record
+	if (st.st_size < size || (st.st_size > size && size % ssz))
+		res = tier_ftruncate(fd, size) == -1 || fmt_trim(fd, m) ? -1 : 0;
+	return res;
+}
+
+int fmt_sync(dev_t dev, ino_t ino, const struct fmt_meta* m)
+{
+	struct stat st;
+	int k, fd, res;
+
+	res = tier_sync(dev, ino);
+	if (m->kind != FMT_CHUNKED || m->stripes <= 1)
+		return res;
+	//the other stripes go through the tier as inodes of their own
+	for (k = 1; k < m->stripes && !res; k++) {
+		fd = stripe_open(m->nonce, k, O_RDONLY);
+		if (fd == -1) {
+			if (errno != ENOENT)
+				res = -errno;
+			continue;
+		}
+		res = fstat(fd, &st) == -1 ? -errno : tier_sync(st.st_dev, st.st_ino);
+		close(fd);
+	}
+	return res;
+}
+
+int fmt_fdatasync(int fd, const struct fmt_meta* m)
+{
+	struct stat st;
+	int res;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	res = fmt_sync(st.st_dev, st.st_ino, m);
+	if (!res && fdatasync(fd) == -1)
+		res = -errno;
+	if (!res && m->kind == FMT_CHUNKED && m->stripes > 1)
+		res = stripe_fdatasync(m->nonce, m->stripes);
+	return res;
+}
+
+void fmt_remove(int fd, const struct fmt_meta* m)
+{
+	if (m->kind == FMT_PACKED)
+		pack_remove(m);
+	else if (m->kind == FMT_DEDUP && fd != -1)
+		dedup_release(fd);
+	else if (m->kind == FMT_CHUNKED && m->stripes > 1)
+		stripe_unlink(m->nonce, m->stripes);
+}
+
+long fmt_verify(int fd, const struct fmt_meta* m,
+		void (*bad)(void* arg, off_t chunk), void* arg)
+{
+	struct layout lo;
+	struct backing bk;
+	struct holes h;
+	struct stat st;
+	unsigned char* slots;
+	size_t ssz, want, slen, k;
+	off_t off;
+	long nbad = 0;
+
+	if (m->kind != FMT_CHUNKED || !m->crc) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (layout_of(m, &lo) || fstat(fd, &st) == -1)
+		return -1;
+	ssz = slot_size(&lo);
+	//without the key only the list's CRC can be checked, a bad list
+	//lists nothing
+	h.n = 0;
+	if (m->holes)
+		holes_load(fd, m, &h, 0);
+	slots = arena_get(FMT_BATCH * FMT_CHUNK);
+	if (!slots)
+		return -1;
+	backing_init(&bk, fd, m, &lo, 0);
+	//stripe 0 has the backing size of the whole file
+	for (off = 0; off < st.st_size; off += want) {
+		want = FMT_BATCH * FMT_CHUNK / ssz * ssz;
+		if ((off_t) want > st.st_size - off)
+			want = st.st_size - off;
+		if (backing_io(&bk, slots, want, off, 0) != (ssize_t) want) {
+			nbad = -1;
+			break;
+		}
+		for (k = 0; k * ssz < want; k++) {
+			unsigned char* s = slots + k * ssz;
+
+			slen = want - k * ssz < ssz ? want - k * ssz : ssz;
+			if (is_zero(s, slen) ?
+			    !m->holes || holes_has(&h, off / (off_t) ssz + k) :
+			    slot_ok(&lo, s, slen))
+				continue;
+			STAT_INC(fmt_crc_failures);
+			if (bad)
+				bad(arg, off / (off_t) ssz + k);
+			nbad++;
+		}
+	}
+	backing_done(&bk);
+	arena_put(slots, FMT_BATCH * FMT_CHUNK);
+	return nbad;
+}
+
+//h is the hole list of a ";holes" file, NULL for other files
+static int slot_is_hole(int fd, const struct layout* lo, const struct holes* h,
+			off_t idx, off_t end)
+{
+	size_t len = slot_size(lo);
+	unsigned char* s;
+	int hole;
+
+	if (h && !holes_has(h, idx))
+		return 0;
+	if (slot_off(lo, idx) + (off_t) len > end)
+		len = end - slot_off(lo, idx);
+	s = arena_get(slot_size(lo));
+	if (!s)
+		return 0;
+	hole = slot_io(fd, s, len, slot_off(lo, idx), 0) == (ssize_t) len &&
+		is_zero(s, len);
+	arena_put(s, slot_size(lo));
+	return hole;
+}
+
+off_t fmt_seek(int fd, const struct fmt_meta* m, off_t offset, int whence)
+{
+	struct layout lo;
+	off_t size = fmt_size(fd, m);
+	struct holes h;
+	struct stat st;
+	off_t pos, end, idx;
+	int i;
+
+	if (size < 0)
+		return -1;
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0 || offset >= size) {
+		errno = ENXIO;
+		return -1;
+	}
+	//the holes of a striped file are spread over several files, it is
+	//reported as all data, as are packed and deduplicated files
+	if (m->kind == FMT_LEGACY || m->kind == FMT_PACKED || m->kind == FMT_DEDUP ||
+	    m->stripes > 1)
+		return whence == SEEK_DATA ? offset : size;
+
+	if (layout_of(m, &lo))
+		return -1;
+	//a bad list lists nothing
+	h.n = 0;
+	if (m->holes)
+		holes_load(fd, m, &h, 1);
+	//holes are the backing file's, so it has to have all our data
+	if (fstat(fd, &st) == 0)
+		tier_sync(st.st_dev, st.st_ino);
+	end = lseek(fd, 0, SEEK_END);
+	pos = lseek(fd, slot_off(&lo, offset / FMT_CHUNK), whence);
+	//where slots aren't block aligned, the first backing block with data
+	//can be the zeroed end of a hole slot
+	while (whence == SEEK_DATA && pos != -1 && lo.overhead &&
+	       slot_is_hole(fd, &lo, m->holes ? &h : NULL, pos / (off_t) slot_size(&lo), end))
+		pos = lseek(fd, slot_off(&lo, pos / (off_t) slot_size(&lo) + 1), SEEK_DATA);
+	//a slot the list doesn't have is data (or damage), even where the
+	//backing file has a hole
+	if (whence == SEEK_DATA && m->holes && (pos != -1 || errno == ENXIO)) {
+		idx = offset / FMT_CHUNK;
+		for (i = 0; i < h.n; i++)
+			if (h.run[i][0] <= (uint64_t) idx && (uint64_t) idx < h.run[i][1])
+				idx = h.run[i][1];
+		if (slot_off(&lo, idx) < end && (pos == -1 || slot_off(&lo, idx) < pos))
+			pos = slot_off(&lo, idx);
+	}
+	while (whence == SEEK_HOLE && m->holes && pos != -1 && pos < end &&
+	       !holes_has(&h, pos / (off_t) slot_size(&lo))) {
+		idx = pos / (off_t) slot_size(&lo) + 1;
+		pos = slot_off(&lo, idx) < end ? lseek(fd, slot_off(&lo, idx), SEEK_HOLE) : end;
+	}
+	if (pos == -1 || end == -1)
+		return -1;
+	if (pos >= end)
+		return size;
+	//holes are whole slots; a backing hole can only start inside a zero
+	//slot, so round to the start of the slot holding pos either way
+	pos = pos / (off_t) slot_size(&lo) * FMT_CHUNK;
+	if (pos < offset)
+		pos = offset;
+	return pos < size ? pos : size;
+}
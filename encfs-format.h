@@ -0,0 +1,352 @@
+/* encfs-format.h
+ * Chunked on-disk format for pa4-encfs
+ *
+ * Files written by do_crypt() are a single CBC stream: every change
+ * re-encrypts the whole file and every zero byte ends up as ciphertext.
+ * Chunked files are cut into FMT_CHUNK byte chunks, each encrypted on its
+ * own by one of the cipher engines in aes-crypt.h into a slot of the
+ * backing file:
+ *
+ *  - chunk i is stored at i * (FMT_CHUNK + overhead), overhead being the
+ *    engine's nonce and tag bytes; aes256-cbc has none, so there every
+ *    chunk sits at its own offset and the backing file size is the file
+ *    size
+ *  - the last slot is only as long as the partial chunk in it plus the
+ *    overhead
+ *  - a chunk of zeros is not encrypted but left as a hole in the backing
+ *    file (or written as zeros where holes aren't supported); a slot that
+ *    reads back as all zeros is a hole and decrypts to zeros
+ *  - files with ";holes" (new files with checksums or an AEAD engine)
+ *    only take a zero slot for a hole if it is in the FMT_HOLES_ATTR
+ *    xattr: up to FMT_HOLE_RUNS runs of chunks (little endian 64 bit
+ *    first chunk and count), the CRC32C of the runs and an HMAC-SHA256 of
+ *    the nonce and the runs (crypt_mac()). Any other zero slot is damage
+ *    and reads as EIO, so zeroing a chunk in the mirror doesn't turn it
+ *    into a hole. With more runs than that the closest ones are merged,
+ *    and the chunks between them lose that protection. ";holes" is also
+ *    in the tweak, so dropping it from the xattr fails every chunk.
+ *  - files with ";crc" end every slot with the CRC32C (little endian) of
+ *    the sealed bytes before it, counted in the overhead. It is checked
+ *    before decrypting, so a damaged chunk reads as EIO rather than
+ *    garbage, and the whole tree can be checked without the key (see
+ *    pa4-encfs-scrub)
+ *
+ * The format is kept in the FMT_ATTR xattr: "true" for do_crypt() files,
+ * "chunked;nonce=<hex>[;cipher=<engine>][;stripes=<n>,<unit>][;crc][;holes]"
+ * for chunked ones (no cipher means aes256-cbc), so files of different
+ * engines can share a tree. A file waiting for deferred encryption has
+ * the same fields after "pending" instead of "chunked", a file kept in
+ * the pack store "packed;nonce=<hex>[;cipher=<engine>]" (encfs-pack.h),
+ * a deduplicated one "dedup;nonce=<hex>[;cipher=<engine>]"
+ * (encfs-dedup.h). The fmt_* calls below take packed and deduplicated
+ * files too and pass them on there.
+ *
+ * Files written with another key than the one the tree started out with
+ * add ";key=<id>", the key ID from aes-crypt.h. That first key is kept in
+ * the FMT_BASE_ATTR xattr of the mirror root, so files older than key
+ * rotation still open after the mount key has changed.
+ *
+ * A striped file spreads its slots over n files in units of <unit>
+ * slots, see encfs-stripe.h; the file in the mirror tree keeps its full
+ * (sparse) size, so its size still gives the plaintext size.
+ *
+ */
+
+#ifndef ENCFS_FORMAT_H
+#define ENCFS_FORMAT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define FMT_ATTR "user.pa4-encfs.encrypted"
+#define FMT_BASE_ATTR "user.pa4-encfs.basekey"
+#define FMT_HOLES_ATTR "user.pa4-encfs.holes"
+#define FMT_CHUNK 4096
+/* checksum bytes at the end of a slot */
+#define FMT_CRC 4
+/* chunks moved per backing read/write */
+#define FMT_BATCH 64
+/* runs of holes FMT_HOLES_ATTR keeps */
+#define FMT_HOLE_RUNS 64
+
+enum fmt_kind {
+	FMT_PLAIN,	/* no xattr, not encrypted */
+	FMT_LEGACY,	/* one do_crypt() stream */
+	FMT_CHUNKED,
+	FMT_PENDING,	/* new file still in the staging area, see encfs-defer.h */
+	FMT_PACKED,	/* small file kept in a pack, see encfs-pack.h */
+	FMT_DEDUP	/* table of shared chunks, see encfs-dedup.h */
+};
+
+struct fmt_meta {
+	int kind;
+	/* enum crypt_engine_id, -1 if the xattr names an unknown one */
+	int cipher;
+	unsigned char nonce[8];
+	/* striped files: stripe count and chunks per stripe unit */
+	int stripes;
+	int stripe_unit;
+	/* key slot (see aes-crypt.h), -1 if the file's key isn't loaded */
+	int key;
+	/* slots end with a checksum */
+	int crc;
+	/* zero slots are holes only if FMT_HOLES_ATTR lists them */
+	int holes;
+};
+
+/* int fmt_init(char* key_str)
+ * Purpose: Derive the chunk keys from the passphrase
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_init(char* key_str);
+
+/* int fmt_add_key(char* key_str)
+ * Purpose: Load another passphrase, for files written with it or to
+ *          switch new files over to it with fmt_use_key()
+ * Args: char* key_str : Passphrase, must stay valid
+ * Return: The key slot, -1 on error
+ */
+extern int fmt_add_key(char* key_str);
+
+/* void fmt_use_key(int key)
+ * Purpose: Make new files use another loaded key
+ */
+extern void fmt_use_key(int key);
+
+/* int fmt_current_key(void)
+ * Purpose: Key slot new files use
+ */
+extern int fmt_current_key(void);
+
+/* int fmt_init_root(const char* root)
+ * Purpose: Find the key of files without a key ID from root's
+ *          FMT_BASE_ATTR, recording the mount key there on first use.
+ *          Call once all keys are loaded.
+ * Return: 0 on success, -1 if that key isn't loaded (those files then
+ *         fail to read)
+ */
+extern int fmt_init_root(const char* root);
+
+/* char* fmt_legacy_key(void)
+ * Purpose: Passphrase of do_crypt files, which have no key ID and use the
+ *          key of fmt_init_root()
+ * Return: The passphrase, NULL (which do_crypt() fails on) if it isn't
+ *         loaded
+ */
+extern char* fmt_legacy_key(void);
+
+/* int fmt_use_cipher(const char* spec)
+ * Purpose: Pick the engine of new files
+ * Args: const char* spec : An engine name, "auto" to benchmark all engines
+ *                          and take the fastest, or "auto:<name>,<name>..."
+ *                          to choose among the listed ones only. The
+ *                          benchmark is left to fmt_pick_cipher().
+ * Return: 0 on success, -1 on an unknown name
+ */
+extern int fmt_use_cipher(const char* spec);
+
+/* int fmt_pick_cipher(void)
+ * Purpose: Run the benchmark of an "auto" fmt_use_cipher() and make new
+ *          files use the fastest engine. It takes arena blocks, whose
+ *          mlock() a fork doesn't keep, so call it after daemonizing.
+ *          No-op without "auto".
+ * Return: 0 on success, -1 if no engine works (new files keep aes256-cbc)
+ */
+extern int fmt_pick_cipher(void);
+
+/* void fmt_use_crc(int on)
+ * Purpose: Turn chunk checksums of new files on (the default) or off
+ */
+extern void fmt_use_crc(int on);
+
+/* void fmt_use_dedup(int on)
+ * Purpose: Make new files deduplicated (FMT_DEDUP) instead of chunked,
+ *          or not (the default)
+ */
+extern void fmt_use_dedup(int on);
+
+/* int fmt_parse(const char* val, struct fmt_meta* m)
+ * Purpose: Parse a nul terminated FMT_ATTR value
+ * Return: The file's enum fmt_kind (also stored in m->kind)
+ */
+extern int fmt_parse(const char* val, struct fmt_meta* m);
+
+/* int fmt_get(int fd, struct fmt_meta* m)
+ * Purpose: Read the format of an open backing file
+ * Return: enum fmt_kind, -errno if the xattr couldn't be read
+ */
+extern int fmt_get(int fd, struct fmt_meta* m);
+
+/* int fmt_get_path(const char* path, struct fmt_meta* m)
+ * Purpose: fmt_get() by path, without opening the file
+ * Return: enum fmt_kind, -errno if the xattr couldn't be read
+ */
+extern int fmt_get_path(const char* path, struct fmt_meta* m);
+
+/* int fmt_new(struct fmt_meta* m)
+ * Purpose: Fill in the format for a new chunked (or, with
+ *          fmt_use_dedup(), deduplicated) file: fresh nonce, the engine
+ *          picked by fmt_use_cipher(), the key of fmt_use_key()
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_new(struct fmt_meta* m);
+
+/* int fmt_set(int fd, const struct fmt_meta* m)
+ * Purpose: Store m in the FMT_ATTR xattr of fd
+ * Return: 0 on success, -errno on error
+ */
+extern int fmt_set(int fd, const struct fmt_meta* m);
+
+/* int fmt_copy_holes(int from, int to)
+ * Purpose: Copy the FMT_HOLES_ATTR of from onto to (or remove to's if
+ *          from has none), for a copy of from's slots under its nonce
+ * Return: 0 on success, -errno on error
+ */
+extern int fmt_copy_holes(int from, int to);
+
+/* off_t fmt_size(int fd, const struct fmt_meta* m)
+ * Purpose: Plaintext size of an encrypted backing file
+ * Return: Size in bytes, -1 on error
+ */
+extern off_t fmt_size(int fd, const struct fmt_meta* m);
+
+/* off_t fmt_plainsize(const struct fmt_meta* m, off_t backing)
+ * Purpose: Plaintext size of a chunked file from its backing file size.
+ *          Other formats return backing unchanged.
+ * Return: Size in bytes, -1 if the engine is unknown or the file is
+ *         pending
+ */
+extern off_t fmt_plainsize(const struct fmt_meta* m, off_t backing);
+
+/* ssize_t fmt_pread(int fd, const struct fmt_meta* m, char* buf,
+ *                   size_t size, off_t offset)
+ * Purpose: pread() on the plaintext of an encrypted file of either format.
+ *          Holes are returned as zeros without decrypting anything.
+ * Args: int fd : Backing file, may be O_DIRECT
+ * Return: Bytes read (short or 0 at end of file), -1 on error (errno EIO
+ *         if a chunk failed its checksum or authentication)
+ */
+extern ssize_t fmt_pread(int fd, const struct fmt_meta* m, char* buf,
+			 size_t size, off_t offset);
+
+/* ssize_t fmt_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+ *                    size_t size, off_t offset)
+ * Purpose: pwrite() on the plaintext of a chunked file. Only the chunks
+ *          covering the range are re-encrypted; chunks that end up all
+ *          zero become holes and a gap in front of offset stays sparse.
+ *          Slots that are already in the backing file are logged
+ *          (encfs-intent.h) before they are rewritten in place, so a
+ *          crash in the middle is finished at the next mount instead of
+ *          leaving a slot half old and half new.
+ * Args: int fd : Backing file opened read/write, may be O_DIRECT
+ * Return: size on success, -1 on error
+ */
+extern ssize_t fmt_pwrite(int fd, const struct fmt_meta* m, const char* buf,
+			  size_t size, off_t offset);
+
+/* int fmt_import(int fd, const struct fmt_meta* m, FILE* plain)
+ * Purpose: Encrypt all of plain into the empty chunked file fd
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_import(int fd, const struct fmt_meta* m, FILE* plain);
+
+/* int fmt_extend(int fd, const struct fmt_meta* m, off_t size)
+ * Purpose: Grow a chunked file to size with a hole
+ * Return: 0 on success (also if the file is already that long), -1 on error
+ */
+extern int fmt_extend(int fd, const struct fmt_meta* m, off_t size);
+
+/* int fmt_truncate(int fd, const struct fmt_meta* m, off_t size)
+ * Purpose: Truncate a chunked file to size plaintext bytes. Shrinking
+ *          cuts the backing file at a slot boundary and re-encrypts only
+ *          a new partial last chunk, whose new slot goes through the
+ *          intent log and over the old one before the file is cut to it;
+ *          growing adds a hole (fmt_extend()).
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_truncate(int fd, const struct fmt_meta* m, off_t size);
+
+/* int fmt_zero(int fd, const struct fmt_meta* m, off_t offset, off_t len)
+ * Purpose: Zero a range of a chunked file without changing its size,
+ *          punching holes for the whole chunks inside it
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_zero(int fd, const struct fmt_meta* m, off_t offset, off_t len);
+
+/* int fmt_trim(int fd, const struct fmt_meta* m)
+ * Purpose: After fd was truncated, cut the other stripes of a striped
+ *          file down to what fd's size still covers. No-op otherwise.
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_trim(int fd, const struct fmt_meta* m);
+
+/* int fmt_apply(int fd, const struct fmt_meta* m, off_t off,
+ *                const void* data, size_t len, off_t size)
+ * Purpose: Write a logged run of sealed slots (or holes) back to a
+ *          chunked file, for replaying the intent log. Needs no key.
+ * Args: off, len : Backing range
+ *       data     : Sealed slots, NULL for holes
+ *       size     : Backing size the file had after the write, -1 if a
+ *                  later record says; a shorter file is extended to it,
+ *                  a longer one cut back if its last slot was partial
+ * Return: 0 on success, -1 on error
+ */
+extern int fmt_apply(int fd, const struct fmt_meta* m, off_t off,
+		     const void* data, size_t len, off_t size);
+
+/* int fmt_sync(dev_t dev, ino_t ino, const struct fmt_meta* m)
+ * Purpose: tier_sync() a file: its backing file (dev, ino) and, for a
+ *          striped file, its other stripes
+ * Return: 0 on success, -errno on error
+ */
+extern int fmt_sync(dev_t dev, ino_t ino, const struct fmt_meta* m);
+
+/* int fmt_fdatasync(int fd, const struct fmt_meta* m)
+ * Purpose: Make a file durable on its own, before it is renamed into
+ *          place: fmt_sync(), then fdatasync() of fd and of the other
+ *          stripes of a striped file
+ * Return: 0 on success, -errno on error
+ */
+extern int fmt_fdatasync(int fd, const struct fmt_meta* m);
+
+/* void fmt_remove(int fd, const struct fmt_meta* m)
+ * Purpose: Delete what a file whose last link is gone keeps outside its
+ *          backing file: the other stripes of a striped file, the record
+ *          of a packed one, the chunk references of a deduplicated one.
+ *          No-op otherwise.
+ * Args: int fd : The backing file, still open, -1 if it isn't (then the
+ *                chunks of a deduplicated file stay stored)
+ */
+extern void fmt_remove(int fd, const struct fmt_meta* m);
+
+/* ssize_t fmt_backing_io(int fd, void* buf, size_t len, off_t off, int wr)
+ * Purpose: pread() (wr 0) or pwrite() (wr 1) all of a range of a backing
+ *          file, through the local cache tier. An O_DIRECT descriptor
+ *          bypasses the tier; unaligned ranges on it go through an
+ *          aligned bounce buffer.
+ * Return: Bytes done (short only at end of file), -1 on error
+ */
+extern ssize_t fmt_backing_io(int fd, void* buf, size_t len, off_t off, int wr);
+
+/* long fmt_verify(int fd, const struct fmt_meta* m,
+ *                  void (*bad)(void* arg, off_t chunk), void* arg)
+ * Purpose: Check every chunk of a checksummed file against its checksum,
+ *          without the key and without decrypting. A zero slot a
+ *          ";holes" file doesn't list (or whose list fails its CRC) is
+ *          bad too.
+ * Args: void (*bad)(void* arg, off_t chunk) : Called with the index of
+ *                                             each bad chunk, may be NULL
+ * Return: Number of bad chunks, -1 on error (errno EOPNOTSUPP if the file
+ *         has no checksums)
+ */
+extern long fmt_verify(int fd, const struct fmt_meta* m,
+		       void (*bad)(void* arg, off_t chunk), void* arg);
+
+/* off_t fmt_seek(int fd, const struct fmt_meta* m, off_t offset, int whence)
+ * Purpose: lseek() SEEK_DATA/SEEK_HOLE in chunk units on the plaintext of
+ *          an encrypted file. do_crypt() files are all data.
+ * Return: The new offset, -1 with errno set (ENXIO past end of file)
+ */
+extern off_t fmt_seek(int fd, const struct fmt_meta* m, off_t offset, int whence);
+
+#endif
@@ -0,0 +1,531 @@
+/* encfs-intent.c
+ * Intent log for chunk rewrites on pa4-encfs
+ *
+ * Records are appended under intent_lock, so a log is always a run of
+ * whole records and the offsets in it only grow until it is emptied.
+ * durable is how much of it the last fdatasync() covered. A log is only
+ * emptied while no batch has it pinned and it isn't the current one, so
+ * nothing is appended to it in between.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "encfs-commit.h"
+#include "encfs-crc.h"
+#include "encfs-format.h"
+#include "encfs-intent.h"
+#include "encfs-stats.h"
+
+#define INTENT_DIR "/.pa4-encfs-intent"
+#define INTENT_MAGIC 0x544e5449
+/* a log this long asks for a group commit, which empties it */
+#define INTENT_KICK (64 << 20)
+/* longest run a record holds: a batch of slots with any engine */
+#define INTENT_DATA_MAX (FMT_BATCH * (FMT_CHUNK + 64))
+#define HIDDEN_PREFIX ".pa4-encfs"
+#define FILE_BUCKETS 64
+
+struct intent_rec {
+	uint32_t magic;
+	uint32_t crc;		/* CRC32C of the rest of the header and the data */
+	uint64_t seq;
+	unsigned char nonce[8];	/* the file's */
+	uint64_t off;		/* backing offset */
+	uint64_t size;		/* backing size after the write */
+	uint64_t len;		/* backing bytes */
+	uint32_t zero;		/* 1: a run of holes, no data follows */
+	uint32_t pad;
+};
+
+/* a file with records in a log */
+struct intent_file {
+	dev_t dev;
+	ino_t ino;
+	struct fmt_meta m;
+	struct intent_file* next;
+};
+
+struct intent_log {
+	int fd;
+	off_t size;
+	off_t durable;
+	int flushing;		/* somebody is in fdatasync() */
+	int pinned;		/* batches between intent_begin() and _end() */
+	struct intent_file* files[FILE_BUCKETS];
+};
+
+struct intent_dir {
+	char* path;
+	struct intent_dir* next;
+};
+
+/* a record found at mount */
+struct intent_replay {
+	struct intent_rec r;
+	int log;
+	off_t data;		/* where its data is in the log */
+};
+
+static pthread_mutex_t intent_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t intent_cond = PTHREAD_COND_INITIALIZER;
+/* one checkpoint at a time, from intent_switch() to intent_retire() */
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct intent_log logs[2] = { { .fd = -1 }, { .fd = -1 } };
+static int cur;
+static int enabled;
+static uint64_t seq;
+
+static uint32_t rec_crc(const struct intent_rec* r, const void* data)
+{
+	uint32_t crc = crc32c(0, &r->seq, sizeof(*r) - offsetof(struct intent_rec, seq));
+
+	return data ? crc32c(crc, data, r->len) : crc;
+}
+
+static size_t file_hash(dev_t dev, ino_t ino)
+{
+	return ((size_t) dev * 31 + (size_t) ino) % FILE_BUCKETS;
+}
+
+static struct intent_file* file_find(struct intent_log* lg, dev_t dev, ino_t ino)
+{
+	struct intent_file* f;
+
+	for (f = lg->files[file_hash(dev, ino)]; f; f = f->next)
+		if (f->dev == dev && f->ino == ino)
+			return f;
+	return NULL;
+}
+
+static void files_free(struct intent_log* lg)
+{
+	struct intent_file* f;
+	int h;
+
+	for (h = 0; h < FILE_BUCKETS; h++) {
+		while ((f = lg->files[h]) != NULL) {
+			lg->files[h] = f->next;
+			free(f);
+		}
+	}
+}
+
+int intent_begin(void)
+{
+	int log;
+
+	if (!enabled)
+		return -1;
+	pthread_mutex_lock(&intent_lock);
+	log = cur;
+	logs[log].pinned++;
+	pthread_mutex_unlock(&intent_lock);
+	return log;
+}
+
+int intent_add(int log, const struct fmt_meta* m, dev_t dev, ino_t ino,
+	       off_t off, const void* data, size_t len, off_t size)
+{
+	struct intent_log* lg;
+	struct intent_file* f;
+	struct intent_rec r;
+	struct iovec iov[2];
+	size_t total = sizeof(r) + (data ? len : 0);
+	size_t h = file_hash(dev, ino);
+	int res = 0;
+
+	if (log < 0)
+		return 0;
+	if (data && len > INTENT_DATA_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	lg = &logs[log];
+	memset(&r, 0, sizeof(r));
+	r.magic = INTENT_MAGIC;
+	memcpy(r.nonce, m->nonce, sizeof(r.nonce));
+	r.off = off;
+	r.size = size;
+	r.len = len;
+	r.zero = !data;
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void*) data;
+	iov[1].iov_len = data ? len : 0;
+
+	pthread_mutex_lock(&intent_lock);
+	f = file_find(lg, dev, ino);
+	if (!f && (f = malloc(sizeof(*f))) != NULL) {
+		f->dev = dev;
+		f->ino = ino;
+		f->m = *m;
+		f->next = lg->files[h];
+		lg->files[h] = f;
+	}
+	r.seq = ++seq;
+	r.crc = rec_crc(&r, data);
+	if (!f || pwritev(lg->fd, iov, data ? 2 : 1, lg->size) != (ssize_t) total) {
+		//a short write leaves a torn record that replay stops at,
+		//anything after it would be lost
+		if (f && ftruncate(lg->fd, lg->size) == -1)
+			perror("intent log");
+		res = -1;
+	} else {
+		lg->size += total;
+		STAT_INC(intent_records);
+		STAT_ADD(intent_bytes, total);
+	}
+	pthread_mutex_unlock(&intent_lock);
+	return res;
+}
+
+int intent_sync(int log)
+{
+	struct intent_log* lg;
+	off_t end, upto;
+	int res = 0;
+	int err;
+
+	if (log < 0)
+		return 0;
+	lg = &logs[log];
+	pthread_mutex_lock(&intent_lock);
+	end = lg->size;
+	//whoever gets here first flushes for everybody who appended before
+	//the flush started, the others wait and check again
+	while (lg->durable < end && !res) {
+		if (lg->flushing) {
+			pthread_cond_wait(&intent_cond, &intent_lock);
+			continue;
+		}
+		lg->flushing = 1;
+		upto = lg->size;
+		pthread_mutex_unlock(&intent_lock);
+		err = fdatasync(lg->fd) == -1 ? errno : 0;
+		pthread_mutex_lock(&intent_lock);
+		lg->flushing = 0;
+		if (err)
+			res = -1;
+		else if (upto > lg->durable)
+			lg->durable = upto;
+		STAT_INC(intent_flushes);
+		pthread_cond_broadcast(&intent_cond);
+		errno = err;
+	}
+	pthread_mutex_unlock(&intent_lock);
+	return res;
+}
+
+void intent_end(int log)
+{
+	int kick;
+
+	if (log < 0)
+		return;
+	pthread_mutex_lock(&intent_lock);
+	if (--logs[log].pinned == 0)
+		pthread_cond_broadcast(&intent_cond);
+	kick = logs[log].size > INTENT_KICK;
+	pthread_mutex_unlock(&intent_lock);
+	if (kick)
+		commit_kick();
+}
+
+int intent_switch(void)
+{
+	struct intent_file* f;
+	int log, h;
+
+	if (!enabled)
+		return -1;
+	pthread_mutex_lock(&checkpoint_lock);
+	pthread_mutex_lock(&intent_lock);
+	//a log that couldn't be emptied last time is older than the current
+	//one and goes first, new records keep going to the current one
+	log = cur;
+	if (logs[1 - log].size)
+		log = 1 - log;
+	else
+		cur = 1 - log;
+	while (logs[log].pinned)
+		pthread_cond_wait(&intent_cond, &intent_lock);
+	if (!logs[log].size) {
+		pthread_mutex_unlock(&intent_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&intent_lock);
+
+	//the rewrites it covers have to reach the backing files before the
+	//sync, a write-back tier may still hold them
+	for (h = 0; h < FILE_BUCKETS; h++)
+		for (f = logs[log].files[h]; f; f = f->next)
+			if (fmt_sync(f->dev, f->ino, &f->m))
+				return -1;
+	return log;
+}
+
+void intent_retire(int log, int synced)
+{
+	struct intent_log* lg;
+
+	if (!enabled)
+		return;
+	if (log >= 0 && synced) {
+		lg = &logs[log];
+		if (ftruncate(lg->fd, 0) == 0 && fsync(lg->fd) == 0) {
+			pthread_mutex_lock(&intent_lock);
+			lg->size = lg->durable = 0;
+			files_free(lg);
+			pthread_mutex_unlock(&intent_lock);
+		}
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+void intent_settle(dev_t dev, ino_t ino)
+{
+	int found;
+
+	if (!enabled)
+		return;
+	pthread_mutex_lock(&intent_lock);
+	found = file_find(&logs[0], dev, ino) || file_find(&logs[1], dev, ino);
+	pthread_mutex_unlock(&intent_lock);
+	if (found)
+		commit_wait();
+}
+
+//the intact records at the start of log, appended to *recs
+static int load_log(int log, struct intent_replay** recs, size_t* n, size_t* max)
+{
+	struct intent_replay* t;
+	struct intent_rec r;
+	unsigned char* data;
+	off_t pos = 0;
+	int res = 0;
+
+	data = malloc(INTENT_DATA_MAX);
+	if (!data)
+		return -1;
+	while (pread(logs[log].fd, &r, sizeof(r), pos) == sizeof(r)) {
+		if (r.magic != INTENT_MAGIC || (!r.zero && r.len > INTENT_DATA_MAX) ||
+		    (!r.zero && pread(logs[log].fd, data, r.len, pos + sizeof(r)) !=
+		     (ssize_t) r.len) ||
+		    rec_crc(&r, r.zero ? NULL : data) != r.crc)
+			break;
+		if (*n == *max) {
+			*max = *max ? *max * 2 : 256;
+			t = realloc(*recs, *max * sizeof(*t));
+			if (!t) {
+				res = -1;
+				break;
+			}
+			*recs = t;
+		}
+		(*recs)[*n].r = r;
+		(*recs)[*n].log = log;
+		(*recs)[(*n)++].data = pos + sizeof(r);
+		pos += sizeof(r) + (r.zero ? 0 : r.len);
+	}
+	free(data);
+	return res;
+}
+
+static int cmp_seq(const void* a, const void* b)
+{
+	const struct intent_replay* x = a;
+	const struct intent_replay* y = b;
+
+	return x->r.seq < y->r.seq ? -1 : x->r.seq > y->r.seq;
+}
+
+//writes the records of the file at path (nonce m->nonce) back, in order;
+//only the last one says what size the file ended up with
+static int replay_file(const char* path, struct intent_replay* recs, size_t n)
+{
+	struct fmt_meta m;
+	struct stat st;
+	unsigned char* data;
+	size_t i, last = n;
+	int fd, res = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return -1;
+	data = malloc(INTENT_DATA_MAX);
+	if (!data || fmt_get(fd, &m) != FMT_CHUNKED) {
+		free(data);
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		if (!memcmp(recs[i].r.nonce, m.nonce, sizeof(m.nonce)))
+			last = i;
+	for (i = 0; i <= last && last < n && !res; i++) {
+		struct intent_rec* r = &recs[i].r;
+
+		if (memcmp(r->nonce, m.nonce, sizeof(m.nonce)))
+			continue;
+		if (!r->zero && pread(logs[recs[i].log].fd, data, r->len, recs[i].data) !=
+		    (ssize_t) r->len)
+			res = -1;
+		else
+			res = fmt_apply(fd, &m, r->off, r->zero ? NULL : data, r->len,
+					i == last ? (off_t) r->size : -1);
+		STAT_INC(intent_replayed);
+	}
+	if (!res && (fstat(fd, &st) == -1 || fmt_sync(st.st_dev, st.st_ino, &m)))
+		res = -1;
+	free(data);
+	close(fd);
+	return res;
+}
+
+//whether some record that wasn't replayed yet is one of a file with
+//nonce, marks them replayed
+static int claim(struct intent_replay* recs, size_t n, const unsigned char* nonce,
+		 char* done)
+{
+	size_t i;
+	int found = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!done[i] && !memcmp(recs[i].r.nonce, nonce, sizeof(recs[i].r.nonce))) {
+			done[i] = 1;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+static int push_dir(struct intent_dir** stack, const char* path)
+{
+	struct intent_dir* d = malloc(sizeof(*d));
+
+	if (!d)
+		return -1;
+	d->path = strdup(path);
+	if (!d->path) {
+		free(d);
+		return -1;
+	}
+	d->next = *stack;
+	*stack = d;
+	return 0;
+}
+
+//walks the mirror tree for the chunked files the records are of. one
+//that can't be written back is reported and left as it is
+static int replay_tree(const char* root, struct intent_replay* recs, size_t n)
+{
+	struct intent_dir* stack = NULL;
+	struct intent_dir* d;
+	char path[PATH_MAX];
+	struct fmt_meta m;
+	struct dirent* de;
+	struct stat st;
+	char* done;
+	size_t left = n, i;
+	DIR* dp;
+	int res = 0;
+
+	done = calloc(n, 1);
+	if (!done || push_dir(&stack, root)) {
+		free(done);
+		return -1;
+	}
+	while ((d = stack) != NULL) {
+		stack = d->next;
+		dp = left && !res ? opendir(d->path) : NULL;
+		while (dp && (de = readdir(dp)) != NULL && !res) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+			    !strncmp(de->d_name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", d->path, de->d_name) >=
+			    (int) sizeof(path) || lstat(path, &st) == -1)
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				res = push_dir(&stack, path);
+				continue;
+			}
+			if (!S_ISREG(st.st_mode) || fmt_get_path(path, &m) != FMT_CHUNKED ||
+			    !claim(recs, n, m.nonce, done))
+				continue;
+			if (replay_file(path, recs, n))
+				fprintf(stderr, "intent log: could not finish the writes to %s\n",
+					path);
+			for (left = 0, i = 0; i < n; i++)
+				left += !done[i];
+		}
+		if (dp)
+			closedir(dp);
+		free(d->path);
+		free(d);
+	}
+	free(done);
+	return res;
+}
+
+int intent_init(const char* root, int on)
+{
+	char dir[PATH_MAX], path[PATH_MAX + 8];
+	struct intent_replay* recs = NULL;
+	size_t n = 0, max = 0;
+	int log, res = 0;
+
+	if (snprintf(dir, sizeof(dir), "%s%s", root, INTENT_DIR) >= (int) sizeof(dir) ||
+	    (mkdir(dir, 0700) == -1 && errno != EEXIST))
+		return -1;
+	for (log = 0; log < 2; log++) {
+		snprintf(path, sizeof(path), "%s/log.%d", dir, log);
+		logs[log].fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (logs[log].fd == -1 || load_log(log, &recs, &n, &max))
+			res = -1;
+	}
+	if (!res && n) {
+		qsort(recs, n, sizeof(*recs), cmp_seq);
+		fprintf(stderr, "intent log: finishing %zu interrupted writes\n", n);
+		res = replay_tree(root, recs, n);
+	}
+	free(recs);
+	//the replayed slots have to be durable before their records go
+	if (!res && n && commit_wait())
+		res = -1;
+	for (log = 0; log < 2 && !res; log++)
+		if (ftruncate(logs[log].fd, 0) == -1 || fsync(logs[log].fd) == -1)
+			res = -1;
+	if (res) {
+		intent_destroy();
+		return -1;
+	}
+	cur = 0;
+	enabled = on;
+	return 0;
+}
+
+void intent_destroy(void)
+{
+	int log;
+
+	enabled = 0;
+	for (log = 0; log < 2; log++) {
+		if (logs[log].fd != -1)
+			close(logs[log].fd);
+		logs[log].fd = -1;
+		logs[log].size = logs[log].durable = 0;
+		files_free(&logs[log]);
+	}
+}
@@ -0,0 +1,102 @@
+/* encfs-intent.h
+ * Intent log for chunk rewrites on pa4-encfs
+ *
+ * fmt_pwrite() rewrites the slots of a chunked file in place, so a crash
+ * in the middle of a write could leave a slot half old and half new.
+ * Before a slot that is already in the backing file is overwritten or
+ * punched, its new contents are appended to an intent log,
+ * <root>/.pa4-encfs-intent/log.<n>, and the log is made durable; writers
+ * that get there at the same time share one fdatasync() of it. A record
+ * holds the file's nonce, the backing range, the backing size after the
+ * write and the sealed slots (nothing for a run of holes), all under one
+ * CRC32C.
+ *
+ * There are two logs. Each group commit (encfs-commit.h) moves new
+ * records over to the other one, writes back the files the old one
+ * covers and empties it once the backing filesystem is synced. At mount,
+ * the records that are left are written over their files' slots again
+ * in order, which finishes the interrupted writes. A torn record at the
+ * end of a log belongs to a write that never started and is dropped, as
+ * are the records of files that are gone.
+ *
+ */
+
+#ifndef ENCFS_INTENT_H
+#define ENCFS_INTENT_H
+
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+/* int intent_init(const char* root, int on)
+ * Purpose: Replay what the logs still hold from the last mount and empty
+ *          them, then log rewrites from now on if on is set. Needs the
+ *          stripe roots and the cache tier, and has to run before chunked
+ *          files are read or written.
+ * Args: const char* root : The mirror root
+ *       int on           : 0 for --no-intent-log
+ * Return: 0 on success, -1 on error (nothing is logged then)
+ */
+extern int intent_init(const char* root, int on);
+
+/* void intent_destroy(void)
+ * Purpose: Close the logs, after commit_destroy() emptied them
+ */
+extern void intent_destroy(void);
+
+/* int intent_begin(void)
+ * Purpose: Pin the current log for one batch of rewrites, so a group
+ *          commit doesn't empty it before they are written
+ * Return: The log to pass to the calls below, -1 if rewrites aren't
+ *         logged (the calls below do nothing then)
+ */
+extern int intent_begin(void);
+
+/* int intent_add(int log, const struct fmt_meta* m, dev_t dev, ino_t ino,
+ *                off_t off, const void* data, size_t len, off_t size)
+ * Purpose: Append the new contents of backing bytes [off, off + len) of a
+ *          chunked file
+ * Args: dev, ino : The backing file, written back from the cache tier
+ *                  before the log is emptied
+ *       data     : Sealed slots, NULL for a run of holes
+ *       size     : Backing size of the file once the write is done
+ * Return: 0 on success, -1 on error
+ */
+extern int intent_add(int log, const struct fmt_meta* m, dev_t dev, ino_t ino,
+		      off_t off, const void* data, size_t len, off_t size);
+
+/* int intent_sync(int log)
+ * Purpose: Make everything appended to log so far durable
+ * Return: 0 on success, -1 on error
+ */
+extern int intent_sync(int log);
+
+/* void intent_end(int log)
+ * Purpose: Unpin log once the batch's rewrites are done (or failed)
+ */
+extern void intent_end(int log);
+
+/* int intent_switch(void)
+ * Purpose: Start a checkpoint in the group commit: new records go to the
+ *          other log, and the files the current one covers are written
+ *          back once its batches are done. Always followed by
+ *          intent_retire(), after the backing filesystem was synced.
+ * Return: The log to empty, -1 if there is none
+ */
+extern int intent_switch(void);
+
+/* void intent_retire(int log, int synced)
+ * Purpose: Finish a checkpoint
+ * Args: int log    : What intent_switch() returned
+ *       int synced : 1 if the sync succeeded and log may be emptied
+ */
+extern void intent_retire(int log, int synced);
+
+/* void intent_settle(dev_t dev, ino_t ino)
+ * Purpose: Before a chunked file is cut shorter, run a group commit if a
+ *          log still has records of it, so a replay can't write past its
+ *          new end
+ */
+extern void intent_settle(dev_t dev, ino_t ino);
+
+#endif
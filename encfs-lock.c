@@ -0,0 +1,170 @@
+/* encfs-lock.c
+ * Per-file reader/writer locks for pa4-encfs
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-lock.h"
+#include "encfs-stats.h"
+
+#define NSHARDS 64
+#define NBUCKETS 64
+
+struct file_lock {
+	dev_t dev;
+	ino_t ino;
+	/* holders plus waiters, protected by the shard mutex */
+	int refs;
+	pthread_rwlock_t rw;
+	struct file_lock* next;
+	struct lock_shard* shard;
+};
+
+struct lock_shard {
+	pthread_mutex_t lock;
+	struct file_lock* table[NBUCKETS];
+};
+
+static struct lock_shard shards[NSHARDS];
+static unsigned long long wait_max_us;
+
+static unsigned long hash_file(dev_t dev, ino_t ino)
+{
+	return ((unsigned long) ino * 0x9e3779b97f4a7c15UL) ^ (unsigned long) dev;
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int lock_report(char* buf, size_t size)
+{
+	unsigned long long waits = STAT_GET(lock_contended);
+
+	return snprintf(buf, size, "lock_wait_avg_us %llu\nlock_wait_max_us %llu\n",
+			waits ? STAT_GET(lock_wait_us) / waits : 0,
+			__atomic_load_n(&wait_max_us, __ATOMIC_RELAXED));
+}
+
+int lock_init(void)
+{
+	int i;
+
+	for (i = 0; i < NSHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+	return stats_register(lock_report);
+}
+
+struct file_lock* lock_acquire(dev_t dev, ino_t ino, int exclusive)
+{
+	unsigned long h = hash_file(dev, ino);
+	struct lock_shard* sh = &shards[(h >> 20) % NSHARDS];
+	struct file_lock** bucket = &sh->table[h % NBUCKETS];
+	struct file_lock* l;
+	unsigned long long start, waited, max;
+	int busy;
+
+	pthread_mutex_lock(&sh->lock);
+	for (l = *bucket; l; l = l->next)
+		if (l->ino == ino && l->dev == dev)
+			break;
+	if (!l) {
+		l = calloc(1, sizeof(*l));
+		if (!l) {
+			pthread_mutex_unlock(&sh->lock);
+			return NULL;
+		}
+		l->dev = dev;
+		l->ino = ino;
+		l->shard = sh;
+		pthread_rwlock_init(&l->rw, NULL);
+		l->next = *bucket;
+		*bucket = l;
+	}
+	l->refs++;
+	pthread_mutex_unlock(&sh->lock);
+
+	if (exclusive) {
+		STAT_INC(lock_excl);
+		busy = pthread_rwlock_trywrlock(&l->rw);
+	} else {
+		STAT_INC(lock_shared);
+		busy = pthread_rwlock_tryrdlock(&l->rw);
+	}
+	if (busy) {
+		start = now_us();
+		if (exclusive)
+			pthread_rwlock_wrlock(&l->rw);
+		else
+			pthread_rwlock_rdlock(&l->rw);
+		waited = now_us() - start;
+
+		STAT_INC(lock_contended);
+		STAT_ADD(lock_wait_us, waited);
+		max = __atomic_load_n(&wait_max_us, __ATOMIC_RELAXED);
+		while (waited > max &&
+		       !__atomic_compare_exchange_n(&wait_max_us, &max, waited, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+	return l;
+}
+
+struct file_lock* lock_path(const char* path, int exclusive)
+{
+	struct file_lock* l;
+	struct stat st;
+	struct stat st2;
+
+	for (;;) {
+		if (lstat(path, &st) == -1)
+			return NULL;
+		if (!S_ISREG(st.st_mode)) {
+			errno = 0;
+			return NULL;
+		}
+		l = lock_acquire(st.st_dev, st.st_ino, exclusive);
+		if (!l) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		//make sure the name still points at what we locked
+		if (lstat(path, &st2) == 0 && st2.st_ino == st.st_ino &&
+		    st2.st_dev == st.st_dev)
+			return l;
+		lock_release(l);
+	}
+}
+
+void lock_release(struct file_lock* l)
+{
+	struct lock_shard* sh;
+	struct file_lock** pp;
+
+	if (!l)
+		return;
+
+	sh = l->shard;
+	pthread_rwlock_unlock(&l->rw);
+
+	pthread_mutex_lock(&sh->lock);
+	if (--l->refs == 0) {
+		for (pp = &sh->table[hash_file(l->dev, l->ino) % NBUCKETS]; *pp != l;
+		     pp = &(*pp)->next)
+			;
+		*pp = l->next;
+		pthread_rwlock_destroy(&l->rw);
+		free(l);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
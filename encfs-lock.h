@@ -0,0 +1,52 @@
+/* encfs-lock.h
+ * Per-file reader/writer locks for pa4-encfs
+ *
+ * Locks are keyed by the backing file's (dev, ino). Lock entries are
+ * created on first use and freed when the last holder or waiter lets go,
+ * so two different files never share a lock. The table that finds the
+ * entries is sharded; its mutexes are only held while looking up an
+ * entry, never while waiting for the file lock itself.
+ *
+ * Reads and getattr take the lock shared, writes and truncates take it
+ * exclusive. Time spent waiting is added to the lock_* counters.
+ *
+ */
+
+#ifndef ENCFS_LOCK_H
+#define ENCFS_LOCK_H
+
+#include <sys/types.h>
+
+#define LOCK_SHARED 0
+#define LOCK_EXCLUSIVE 1
+
+struct file_lock;
+
+/* int lock_init(void)
+ * Purpose: Set up the lock table
+ * Return: 0 on success, -1 on error
+ */
+extern int lock_init(void);
+
+/* struct file_lock* lock_acquire(dev_t dev, ino_t ino, int exclusive)
+ * Purpose: Lock a backing file, blocking until it is available
+ * Args: dev_t dev, ino_t ino : Backing file identity
+ *       int exclusive       : LOCK_SHARED or LOCK_EXCLUSIVE
+ * Return: The held lock, NULL if out of memory
+ */
+extern struct file_lock* lock_acquire(dev_t dev, ino_t ino, int exclusive);
+
+/* struct file_lock* lock_path(const char* path, int exclusive)
+ * Purpose: lstat() path and lock the regular file found there, retrying
+ *          if the path was pointed at another file meanwhile
+ * Return: The held lock. NULL with errno set if lstat failed, NULL with
+ *         errno 0 if path is not a regular file.
+ */
+extern struct file_lock* lock_path(const char* path, int exclusive);
+
+/* void lock_release(struct file_lock* l)
+ * Purpose: Drop a lock returned by lock_acquire()/lock_path(). NULL is ignored.
+ */
+extern void lock_release(struct file_lock* l);
+
+#endif
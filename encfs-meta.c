@@ -0,0 +1,173 @@
+/* encfs-meta.c
+ * Metadata cache for pa4-encfs
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "encfs-meta.h"
+#include "encfs-stats.h"
+
+#define META_WAYS 4
+#define NLOCKS 64
+
+struct meta_entry {
+	dev_t dev;
+	ino_t ino; /* 0: empty */
+	struct timespec ctime;
+	struct timespec mtime;
+	off_t csize;
+	off_t plainsize;
+	struct fmt_meta m;
+	unsigned long used;
+};
+
+struct meta_set {
+	struct meta_entry way[META_WAYS];
+};
+
+static struct meta_set* sets;
+static size_t nsets;
+static pthread_mutex_t locks[NLOCKS];
+static unsigned long tick;
+
+static size_t set_of(dev_t dev, ino_t ino)
+{
+	return (((unsigned long) ino * 0x9e3779b97f4a7c15UL) ^ (unsigned long) dev) % nsets;
+}
+
+static int stamp_ok(const struct meta_entry* e, const struct stat* st)
+{
+	return e->csize == st->st_size &&
+		e->ctime.tv_sec == st->st_ctim.tv_sec &&
+		e->ctime.tv_nsec == st->st_ctim.tv_nsec &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int meta_report(char* buf, size_t size)
+{
+	size_t used = 0;
+	size_t i;
+	int w;
+
+	for (i = 0; i < nsets; i++) {
+		pthread_mutex_lock(&locks[i % NLOCKS]);
+		for (w = 0; w < META_WAYS; w++)
+			used += sets[i].way[w].ino != 0;
+		pthread_mutex_unlock(&locks[i % NLOCKS]);
+	}
+	return snprintf(buf, size, "meta_entries %zu\nmeta_limit %zu\n",
+			used, nsets * META_WAYS);
+}
+
+int meta_init(size_t entries)
+{
+	int i;
+
+	if (entries == 0)
+		return 0;
+	nsets = (entries + META_WAYS - 1) / META_WAYS;
+	sets = calloc(nsets, sizeof(*sets));
+	if (!sets) {
+		nsets = 0;
+		return -1;
+	}
+	for (i = 0; i < NLOCKS; i++)
+		pthread_mutex_init(&locks[i], NULL);
+	stats_register(meta_report);
+	return 0;
+}
+
+void meta_destroy(void)
+{
+	free(sets);
+	sets = NULL;
+	nsets = 0;
+}
+
+int meta_lookup(const struct stat* st, struct fmt_meta* m, off_t* plainsize)
+{
+	struct meta_set* s;
+	size_t i;
+	int w, hit = 0;
+
+	if (!nsets)
+		return 0;
+	i = set_of(st->st_dev, st->st_ino);
+	s = &sets[i];
+	pthread_mutex_lock(&locks[i % NLOCKS]);
+	for (w = 0; w < META_WAYS; w++) {
+		struct meta_entry* e = &s->way[w];
+
+		if (e->ino != st->st_ino || e->dev != st->st_dev)
+			continue;
+		if (stamp_ok(e, st)) {
+			*m = e->m;
+			*plainsize = e->plainsize;
+			e->used = ++tick;
+			hit = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&locks[i % NLOCKS]);
+	if (hit)
+		STAT_INC(meta_hits);
+	else
+		STAT_INC(meta_misses);
+	return hit;
+}
+
+void meta_store(const struct stat* st, const struct fmt_meta* m, off_t plainsize)
+{
+	struct meta_entry* victim;
+	struct meta_set* s;
+	size_t i;
+	int w;
+
+	if (!nsets || st->st_ino == 0)
+		return;
+	i = set_of(st->st_dev, st->st_ino);
+	s = &sets[i];
+	pthread_mutex_lock(&locks[i % NLOCKS]);
+	victim = &s->way[0];
+	for (w = 0; w < META_WAYS; w++) {
+		struct meta_entry* e = &s->way[w];
+
+		if (e->ino == st->st_ino && e->dev == st->st_dev) {
+			victim = e;
+			break;
+		}
+		if (e->used < victim->used)
+			victim = e;
+	}
+	victim->dev = st->st_dev;
+	victim->ino = st->st_ino;
+	victim->ctime = st->st_ctim;
+	victim->mtime = st->st_mtim;
+	victim->csize = st->st_size;
+	victim->plainsize = plainsize;
+	victim->m = *m;
+	victim->used = ++tick;
+	pthread_mutex_unlock(&locks[i % NLOCKS]);
+}
+
+void meta_invalidate(dev_t dev, ino_t ino)
+{
+	struct meta_set* s;
+	size_t i;
+	int w;
+
+	if (!nsets)
+		return;
+	i = set_of(dev, ino);
+	s = &sets[i];
+	pthread_mutex_lock(&locks[i % NLOCKS]);
+	for (w = 0; w < META_WAYS; w++)
+		if (s->way[w].ino == ino && s->way[w].dev == dev)
+			memset(&s->way[w], 0, sizeof(s->way[w]));
+	pthread_mutex_unlock(&locks[i % NLOCKS]);
+}
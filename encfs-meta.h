@@ -0,0 +1,55 @@
+/* encfs-meta.h
+ * Metadata cache for pa4-encfs
+ *
+ * Remembers the format xattr and plaintext size of backing files, keyed
+ * by (dev, ino), so getattr doesn't have to probe the xattr (and, for
+ * do_crypt files, decrypt the last block) every time. An entry is only
+ * used while the file's ctime, mtime and size are what they were when it
+ * was stored; any write, xattr or attribute change moves ctime.
+ *
+ * The cache is a fixed, set associative table: no allocation after
+ * meta_init(), the least recently used way of a set is replaced.
+ *
+ */
+
+#ifndef ENCFS_META_H
+#define ENCFS_META_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "encfs-format.h"
+
+/* int meta_init(size_t entries)
+ * Purpose: Allocate the table
+ * Args: size_t entries : Files to remember (0 disables the cache)
+ * Return: 0 on success, -1 on error
+ */
+extern int meta_init(size_t entries);
+
+/* void meta_destroy(void)
+ * Purpose: Free the table
+ */
+extern void meta_destroy(void);
+
+/* int meta_lookup(const struct stat* st, struct fmt_meta* m, off_t* plainsize)
+ * Purpose: Look up a backing file
+ * Args: const struct stat* st : lstat() of the backing file
+ *       struct fmt_meta* m     : Format output
+ *       off_t* plainsize       : Plaintext size output
+ * Return: 1 on a hit, 0 on a miss
+ */
+extern int meta_lookup(const struct stat* st, struct fmt_meta* m, off_t* plainsize);
+
+/* void meta_store(const struct stat* st, const struct fmt_meta* m, off_t plainsize)
+ * Purpose: Remember what was worked out for the file st describes
+ */
+extern void meta_store(const struct stat* st, const struct fmt_meta* m,
+		       off_t plainsize);
+
+/* void meta_invalidate(dev_t dev, ino_t ino)
+ * Purpose: Forget a file
+ */
+extern void meta_invalidate(dev_t dev, ino_t ino);
+
+#endif
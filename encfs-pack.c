@@ -0,0 +1,963 @@
+/* encfs-pack.c
+ * Packed store for small files in pa4-encfs
+ *
+ * One rwlock covers the index and the pack table; readers hold it shared
+ * across their pread() so compaction can't close a pack under them.
+ * Appends (and compaction's copies) are serialized by a mutex of their
+ * own and take the rwlock exclusive only to publish a record, so a slow
+ * pwrite() never holds up readers. Everything that changes the index or
+ * the pack table holds the append mutex, so it can look at both without
+ * the rwlock.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-crc.h"
+#include "encfs-format.h"
+#include "encfs-pack.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-tier.h"
+
+#define PACK_DIR "/.pa4-encfs-packs"
+/* a pack takes no more records past this size */
+#define PACK_ROLL (64 << 20)
+/* the newest pack is closed early, so it can be compacted, once this
+ * much of it is dead */
+#define PACK_DEAD_MIN (16 << 20)
+#define PACK_MAGIC 0x4b435050
+/* plain of a tombstone */
+#define PACK_DEAD 0xffffffffu
+/* sealed bytes of a record: a chunk and the engine's nonce and tag */
+#define PACK_SEALED_MAX (FMT_CHUNK + 64)
+#define PACK_REC_MAX (sizeof(struct pack_rec) + PACK_SEALED_MAX)
+#define PACK_BUCKETS_MIN 1024
+
+struct pack_rec {
+	uint32_t magic;
+	uint32_t crc;		/* CRC32C of the rest of the header and the data */
+	unsigned char id[8];	/* the file's nonce */
+	uint64_t seq;
+	uint32_t key;		/* key ID */
+	uint32_t plain;		/* plaintext bytes, PACK_DEAD for a tombstone */
+	uint32_t len;		/* sealed bytes following the header */
+	uint16_t cipher;
+	uint16_t pad;
+};
+
+struct pack_file {
+	unsigned int no;
+	int fd;
+	off_t size;		/* bytes of records, the next one goes here */
+	off_t live;		/* bytes of the records the index points at */
+};
+
+struct pack_entry {
+	unsigned char id[8];
+	uint64_t seq;
+	struct pack_file* pack;
+	off_t off;
+	uint32_t len;
+	uint32_t plain;		/* PACK_DEAD: tombstone, only while loading */
+	struct pack_entry* next;
+};
+
+static char pack_dir[PATH_MAX];
+static size_t threshold;
+static int loaded;
+static pthread_rwlock_t pack_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+/* oldest first, the last one takes the appends */
+static struct pack_file** packs;
+static int npacks;
+static struct pack_entry** table;
+static size_t nbuckets, nentries;
+static uint64_t last_seq;
+/* a pack compaction gave up on, it is left alone */
+static unsigned int stuck;
+
+static pthread_t thread;
+static int running;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+static int registered;
+
+static size_t bucket_of(const unsigned char id[8], size_t n)
+{
+	uint64_t h;
+
+	memcpy(&h, id, sizeof(h));
+	return (h * 0x9e3779b97f4a7c15ULL >> 32) & (n - 1);
+}
+
+//pack_lock held
+static struct pack_entry* find(const unsigned char id[8])
+{
+	struct pack_entry* e;
+
+	if (!nbuckets)
+		return NULL;
+	for (e = table[bucket_of(id, nbuckets)]; e; e = e->next)
+		if (!memcmp(e->id, id, sizeof(e->id)))
+			return e;
+	return NULL;
+}
+
+//doubles the buckets, pack_lock held exclusive. Failing only makes the
+//chains longer.
+static void grow(void)
+{
+	size_t n = nbuckets ? nbuckets * 2 : PACK_BUCKETS_MIN;
+	struct pack_entry** t = calloc(n, sizeof(*t));
+	struct pack_entry* e;
+	size_t i;
+
+	if (!t)
+		return;
+	for (i = 0; i < nbuckets; i++) {
+		while ((e = table[i]) != NULL) {
+			table[i] = e->next;
+			e->next = t[bucket_of(e->id, n)];
+			t[bucket_of(e->id, n)] = e;
+		}
+	}
+	free(table);
+	table = t;
+	nbuckets = n;
+}
+
+//pack_lock held exclusive
+static void insert(struct pack_entry* e)
+{
+	size_t b;
+
+	if (nentries >= nbuckets)
+		grow();
+	b = bucket_of(e->id, nbuckets);
+	e->next = table[b];
+	table[b] = e;
+	nentries++;
+}
+
+//pack_lock held exclusive
+static void drop(struct pack_entry* e)
+{
+	struct pack_entry** p = &table[bucket_of(e->id, nbuckets)];
+
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	nentries--;
+	free(e);
+}
+
+static off_t rec_size(uint32_t len)
+{
+	return sizeof(struct pack_rec) + len;
+}
+
+static uint32_t rec_sum(const struct pack_rec* h)
+{
+	uint32_t crc = crc32c(0, h->id, sizeof(*h) - offsetof(struct pack_rec, id));
+
+	return crc32c(crc, h + 1, h->len);
+}
+
+//a header that can be the start of a record
+static int rec_sane(const struct pack_rec* h)
+{
+	return h->magic == PACK_MAGIC && h->len <= PACK_SEALED_MAX &&
+		(h->plain == PACK_DEAD ? h->len == 0 : h->plain <= FMT_CHUNK);
+}
+
+static void rec_tweak(const struct pack_rec* h, unsigned char tweak[CRYPT_TWEAK])
+{
+	int i;
+
+	memcpy(tweak, h->id, 8);
+	for (i = 0; i < 8; i++)
+		tweak[8 + i] = h->seq >> (56 - 8 * i);
+}
+
+static void pack_path(char* path, size_t size, unsigned int no)
+{
+	snprintf(path, size, "%s/pack.%u", pack_dir, no);
+}
+
+static struct pack_file* pack_open(unsigned int no, int create)
+{
+	char path[PATH_MAX + 32];
+	struct pack_file* p = calloc(1, sizeof(*p));
+
+	if (!p)
+		return NULL;
+	pack_path(path, sizeof(path), no);
+	p->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+	if (p->fd == -1) {
+		free(p);
+		return NULL;
+	}
+	p->no = no;
+	return p;
+}
+
+static void pack_close(struct pack_file* p, int remove)
+{
+	char path[PATH_MAX + 32];
+
+	close(p->fd);
+	if (remove) {
+		pack_path(path, sizeof(path), p->no);
+		unlink(path);
+	}
+	free(p);
+}
+
+//starts a new pack for appends, append_lock held
+static int roll(void)
+{
+	struct pack_file* p;
+	struct pack_file** t;
+
+	p = pack_open(npacks ? packs[npacks - 1]->no + 1 : 1, 1);
+	if (!p)
+		return -1;
+	pthread_rwlock_wrlock(&pack_lock);
+	t = realloc(packs, (npacks + 1) * sizeof(*t));
+	if (t) {
+		packs = t;
+		packs[npacks++] = p;
+	}
+	pthread_rwlock_unlock(&pack_lock);
+	if (!t) {
+		pack_close(p, 1);
+		return -1;
+	}
+	return 0;
+}
+
+//writes a record at the end of the newest pack, append_lock held.
+//Returns the pack, NULL on error.
+static struct pack_file* put(const struct pack_rec* h)
+{
+	off_t size = rec_size(h->len);
+	struct pack_file* p = npacks ? packs[npacks - 1] : NULL;
+	ssize_t n;
+	int err;
+
+	if ((!p || (p->size && p->size + size > PACK_ROLL)) && roll())
+		return NULL;
+	p = packs[npacks - 1];
+	n = pwrite(p->fd, h, size, p->size);
+	if (n != size) {
+		err = n == -1 ? errno : ENOSPC;
+		//nothing may follow a torn record
+		if (ftruncate(p->fd, p->size) == -1)
+			perror("pack");
+		errno = err;
+		return NULL;
+	}
+	return p;
+}
+
+//seals len bytes of plain as the new record of id, or appends a
+//tombstone for id if plain is NULL, and points the index at it
+static int append(const unsigned char id[8], int cipher,
+		  const unsigned char* plain, size_t len)
+{
+	const struct crypt_engine* e = NULL;
+	unsigned char tweak[CRYPT_TWEAK];
+	struct pack_entry* ent;
+	struct pack_entry* fresh = NULL;
+	struct pack_file* p;
+	struct pack_rec* h;
+	int key = fmt_current_key();
+	int res = -1;
+
+	if (plain && !(e = crypt_engine(cipher))) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	h = arena_get(PACK_REC_MAX);
+	if (!h)
+		return -1;
+	memset(h, 0, sizeof(*h));
+	h->magic = PACK_MAGIC;
+	memcpy(h->id, id, sizeof(h->id));
+	h->key = crypt_key_id(key);
+	h->plain = plain ? len : PACK_DEAD;
+	h->len = plain ? len + e->overhead : 0;
+	h->cipher = plain ? cipher : 0;
+
+	pthread_mutex_lock(&append_lock);
+	ent = find(id);
+	//a file that was never written needs no tombstone
+	if (!plain && !ent) {
+		res = 0;
+		goto out;
+	}
+	if (!ent && !(fresh = calloc(1, sizeof(*fresh))))
+		goto out;
+	h->seq = ++last_seq;
+	if (plain) {
+		rec_tweak(h, tweak);
+		if (!e->seal(e, key, tweak, plain, len, (unsigned char*) (h + 1))) {
+			errno = EIO;
+			goto out;
+		}
+	}
+	h->crc = rec_sum(h);
+	p = put(h);
+	if (!p)
+		goto out;
+
+	pthread_rwlock_wrlock(&pack_lock);
+	if (ent)
+		ent->pack->live -= rec_size(ent->len);
+	if (!plain) {
+		drop(ent);
+	} else {
+		if (!ent) {
+			ent = fresh;
+			fresh = NULL;
+			memcpy(ent->id, id, sizeof(ent->id));
+			insert(ent);
+		}
+		ent->seq = h->seq;
+		ent->pack = p;
+		ent->off = p->size;
+		ent->len = h->len;
+		ent->plain = h->plain;
+		p->live += rec_size(h->len);
+	}
+	p->size += rec_size(h->len);
+	pthread_rwlock_unlock(&pack_lock);
+	res = 0;
+
+out:
+	pthread_mutex_unlock(&append_lock);
+	free(fresh);
+	arena_put(h, PACK_REC_MAX);
+	return res;
+}
+
+//reads the newest record of id into h (header and data). Returns 1 if
+//there is one, 0 if the file has no record (is empty), -1 on error.
+static int rec_load(const unsigned char id[8], struct pack_rec* h)
+{
+	struct pack_entry* e;
+	ssize_t want = 0, got = 0;
+
+	if (!loaded) {
+		errno = EIO;
+		return -1;
+	}
+	pthread_rwlock_rdlock(&pack_lock);
+	e = find(id);
+	if (e) {
+		want = rec_size(e->len);
+		got = pread(e->pack->fd, h, want, e->off);
+	}
+	pthread_rwlock_unlock(&pack_lock);
+	if (!e)
+		return 0;
+	if (got != want || !rec_sane(h) || memcmp(h->id, id, sizeof(h->id)) ||
+	    rec_sum(h) != h->crc) {
+		STAT_INC(fmt_crc_failures);
+		errno = EIO;
+		return -1;
+	}
+	return 1;
+}
+
+//opens the data of a record into plain, returns its length or -1
+static ssize_t rec_open(const struct pack_rec* h, unsigned char* plain)
+{
+	const struct crypt_engine* e = crypt_engine(h->cipher);
+	unsigned char tweak[CRYPT_TWEAK];
+	int key = crypt_key_find(h->key);
+
+	if (!e) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (key < 0) {
+		errno = ENOKEY;
+		return -1;
+	}
+	if (h->len != h->plain + e->overhead) {
+		errno = EIO;
+		return -1;
+	}
+	rec_tweak(h, tweak);
+	if (!e->open(e, key, tweak, (const unsigned char*) (h + 1), h->len, plain)) {
+		STAT_INC(fmt_auth_failures);
+		errno = EIO;
+		return -1;
+	}
+	return h->plain;
+}
+
+//the whole plaintext of a packed file into plain (FMT_CHUNK bytes),
+//returns its length or -1
+static ssize_t load_plain(const struct fmt_meta* m, unsigned char* plain)
+{
+	struct pack_rec* h = arena_get(PACK_REC_MAX);
+	ssize_t res;
+
+	if (!h)
+		return -1;
+	res = rec_load(m->nonce, h);
+	if (res > 0)
+		res = rec_open(h, plain);
+	arena_put(h, PACK_REC_MAX);
+	return res;
+}
+
+size_t pack_threshold(void)
+{
+	return threshold;
+}
+
+int pack_new(struct fmt_meta* m)
+{
+	if (!threshold || !loaded)
+		return 0;
+	m->kind = FMT_PACKED;
+	m->stripes = 0;
+	m->stripe_unit = 0;
+	m->crc = 0;
+	m->holes = 0;
+	return 1;
+}
+
+off_t pack_size(const struct fmt_meta* m)
+{
+	struct pack_entry* e;
+	off_t size;
+
+	if (!loaded) {
+		errno = EIO;
+		return -1;
+	}
+	pthread_rwlock_rdlock(&pack_lock);
+	e = find(m->nonce);
+	size = e ? e->plain : 0;
+	pthread_rwlock_unlock(&pack_lock);
+	return size;
+}
+
+ssize_t pack_pread(const struct fmt_meta* m, char* buf, size_t size, off_t offset)
+{
+	unsigned char* plain = arena_get(FMT_CHUNK);
+	ssize_t len;
+
+	if (!plain)
+		return -1;
+	len = load_plain(m, plain);
+	if (len >= 0) {
+		STAT_INC(pack_reads);
+		len = offset < len ? len - offset : 0;
+		if ((size_t) len > size)
+			len = size;
+		if (len)
+			memcpy(buf, plain + offset, len);
+	}
+	arena_put(plain, FMT_CHUNK);
+	return len;
+}
+
+ssize_t pack_pwrite(const struct fmt_meta* m, const char* buf, size_t size,
+		    off_t offset)
+{
+	unsigned char* plain;
+	ssize_t len, res = -1;
+
+	if (size == 0)
+		return 0;
+	if (offset < 0 || offset + size > threshold) {
+		errno = EFBIG;
+		return -1;
+	}
+	plain = arena_get(FMT_CHUNK);
+	if (!plain)
+		return -1;
+	len = load_plain(m, plain);
+	if (len < 0)
+		goto out;
+	if (offset > len)
+		memset(plain + len, 0, offset - len);
+	memcpy(plain + offset, buf, size);
+	if (offset + (off_t) size > len)
+		len = offset + size;
+	if (append(m->nonce, m->cipher, plain, len) == 0) {
+		STAT_INC(pack_writes);
+		res = size;
+	}
+out:
+	arena_put(plain, FMT_CHUNK);
+	return res;
+}
+
+int pack_truncate(const struct fmt_meta* m, off_t size)
+{
+	unsigned char* plain;
+	ssize_t len;
+	int res = -1;
+
+	//an empty file is no record at all
+	if (size == 0)
+		return append(m->nonce, 0, NULL, 0);
+	if (size < 0 || (size_t) size > threshold) {
+		errno = EFBIG;
+		return -1;
+	}
+	plain = arena_get(FMT_CHUNK);
+	if (!plain)
+		return -1;
+	len = load_plain(m, plain);
+	if (len == size) {
+		res = 0;
+	} else if (len >= 0) {
+		if (size > len)
+			memset(plain + len, 0, size - len);
+		res = append(m->nonce, m->cipher, plain, size);
+	}
+	arena_put(plain, FMT_CHUNK);
+	return res;
+}
+
+void pack_remove(const struct fmt_meta* m)
+{
+	if (loaded && append(m->nonce, 0, NULL, 0))
+		perror("pack tombstone");
+}
+
+int pack_promote(int fd, struct fmt_meta* m)
+{
+	struct fmt_meta nm;
+	char* plain;
+	ssize_t len;
+	int res = -1;
+
+	plain = arena_get(FMT_CHUNK);
+	if (!plain)
+		return -1;
+	len = pack_pread(m, plain, FMT_CHUNK, 0);
+	if (len < 0 || fmt_new(&nm))
+		goto out;
+	//whatever a crash left in the stub isn't ours
+	if (tier_ftruncate(fd, 0) == -1 ||
+	    fmt_pwrite(fd, &nm, plain, len, 0) != len || fmt_set(fd, &nm)) {
+		fmt_remove(fd, &nm);
+		goto out;
+	}
+	pack_remove(m);
+	*m = nm;
+	STAT_INC(pack_promotions);
+	res = 0;
+out:
+	arena_put(plain, FMT_CHUNK);
+	return res;
+}
+
+ssize_t pack_rekey(const struct fmt_meta* m)
+{
+	struct pack_rec* h = arena_get(PACK_REC_MAX);
+	unsigned char* plain = arena_get(FMT_CHUNK);
+	ssize_t res = -1;
+
+	if (!h || !plain)
+		goto out;
+	res = rec_load(m->nonce, h);
+	if (res <= 0 || h->key == crypt_key_id(fmt_current_key()))
+		goto out;
+	res = rec_open(h, plain);
+	if (res > 0 && append(m->nonce, h->cipher, plain, res))
+		res = -1;
+out:
+	arena_put(plain, FMT_CHUNK);
+	arena_put(h, PACK_REC_MAX);
+	return res < 0 ? -1 : res;
+}
+
+//copies the live records of the oldest pack to the newest and deletes
+//it. One record per turn of the append mutex, so writers get in between.
+static int compact_oldest(size_t* moved)
+{
+	struct pack_entry* ent;
+	struct pack_file* old;
+	struct pack_file* p;
+	struct pack_rec* h;
+	off_t off, size;
+	int res = 0;
+
+	pthread_mutex_lock(&append_lock);
+	old = npacks > 1 ? packs[0] : NULL;
+	pthread_mutex_unlock(&append_lock);
+	*moved = 0;
+	if (!old)
+		return 0;
+	h = arena_get(PACK_REC_MAX);
+	if (!h)
+		return -1;
+
+	//only the newest pack grows, old->size stays put
+	for (off = 0; off < old->size && !res; off += size) {
+		if (__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+			res = 1;
+			break;
+		}
+		pthread_mutex_lock(&append_lock);
+		size = sizeof(*h);
+		if (pread(old->fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !rec_sane(h)) {
+			res = -1;
+		} else {
+			size = rec_size(h->len);
+			ent = find(h->id);
+			//records the index doesn't point at (and tombstones, all
+			//older packs are gone) are left behind
+			if (ent && ent->pack == old && ent->off == off) {
+				if (pread(old->fd, h + 1, h->len, off + sizeof(*h)) !=
+				    (ssize_t) h->len || !(p = put(h))) {
+					res = -1;
+				} else {
+					pthread_rwlock_wrlock(&pack_lock);
+					ent->pack = p;
+					ent->off = p->size;
+					p->size += size;
+					p->live += size;
+					old->live -= size;
+					pthread_rwlock_unlock(&pack_lock);
+					STAT_ADD(pack_compacted_bytes, size);
+					*moved += size;
+				}
+			}
+		}
+		pthread_mutex_unlock(&append_lock);
+	}
+	arena_put(h, PACK_REC_MAX);
+	*moved += off;
+	if (res < 0) {
+		fprintf(stderr, "pack.%u: can't be compacted\n", old->no);
+		stuck = old->no;
+	}
+	if (res)
+		return res;
+
+	pthread_mutex_lock(&append_lock);
+	pthread_rwlock_wrlock(&pack_lock);
+	memmove(packs, packs + 1, --npacks * sizeof(*packs));
+	pthread_rwlock_unlock(&pack_lock);
+	pthread_mutex_unlock(&append_lock);
+	pack_close(old, 1);
+	STAT_INC(pack_compactions);
+	return 0;
+}
+
+//whether the oldest pack should be compacted; rolls the newest one over
+//if it is the one holding the garbage
+static int want_compact(void)
+{
+	off_t size = 0, live = 0;
+	struct pack_file* last;
+	int i, roll_over;
+
+	pthread_mutex_lock(&append_lock);
+	if (!npacks || packs[0]->no == stuck) {
+		pthread_mutex_unlock(&append_lock);
+		return 0;
+	}
+	for (i = 0; i + 1 < npacks; i++) {
+		size += packs[i]->size;
+		live += packs[i]->live;
+	}
+	last = packs[npacks - 1];
+	roll_over = last->size - last->live >= PACK_DEAD_MIN &&
+		last->size - last->live > last->live;
+	if (roll_over && roll())
+		roll_over = 0;
+	pthread_mutex_unlock(&append_lock);
+	return roll_over || size - live > live;
+}
+
+static void* compact_thread(void* arg)
+{
+	struct sched_job job;
+	struct timespec ts;
+	size_t moved;
+	int res;
+
+	(void) arg;
+	pthread_mutex_lock(&compact_lock);
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&compact_cond, &compact_lock, &ts);
+		pthread_mutex_unlock(&compact_lock);
+		while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED) && want_compact()) {
+			sched_bg_begin(&job, SCHED_COMPACT);
+			res = compact_oldest(&moved);
+			sched_bg_end(&job, moved);
+			if (res)
+				break;
+		}
+		pthread_mutex_lock(&compact_lock);
+	}
+	pthread_mutex_unlock(&compact_lock);
+	return NULL;
+}
+
+static int pack_report(char* buf, size_t size)
+{
+	off_t bytes = 0, live = 0;
+	size_t files;
+	int i, n;
+
+	pthread_rwlock_rdlock(&pack_lock);
+	files = nentries;
+	n = npacks;
+	for (i = 0; i < npacks; i++) {
+		bytes += packs[i]->size;
+		live += packs[i]->live;
+	}
+	pthread_rwlock_unlock(&pack_lock);
+	return snprintf(buf, size, "pack_files %zu\npack_packs %d\n"
+			"pack_live_bytes %lld\npack_dead_bytes %lld\n",
+			files, n, (long long) live, (long long) (bytes - live));
+}
+
+//adds the records of p to the index; a damaged record ends the pack,
+//and is cut off if it is the last one (a torn append)
+static int pack_scan(struct pack_file* p, int last)
+{
+	struct pack_entry* ent;
+	struct pack_rec* h;
+	struct stat st;
+	off_t off, size;
+	int res = 0;
+
+	h = arena_get(PACK_REC_MAX);
+	if (!h || fstat(p->fd, &st) == -1) {
+		arena_put(h, PACK_REC_MAX);
+		return -1;
+	}
+	for (off = 0; off + (off_t) sizeof(*h) <= st.st_size; off += size) {
+		if (pread(p->fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !rec_sane(h))
+			break;
+		size = rec_size(h->len);
+		if (off + size > st.st_size ||
+		    pread(p->fd, h + 1, h->len, off + sizeof(*h)) != (ssize_t) h->len ||
+		    rec_sum(h) != h->crc)
+			break;
+		if (h->seq > last_seq)
+			last_seq = h->seq;
+		//the newest record wins, a copy made by compaction is as good
+		ent = find(h->id);
+		if (ent && ent->seq > h->seq)
+			continue;
+		if (!ent) {
+			ent = calloc(1, sizeof(*ent));
+			if (!ent) {
+				res = -1;
+				break;
+			}
+			memcpy(ent->id, h->id, sizeof(ent->id));
+			insert(ent);
+		}
+		ent->seq = h->seq;
+		ent->pack = p;
+		ent->off = off;
+		ent->len = h->len;
+		ent->plain = h->plain;
+	}
+	if (!res && off < st.st_size) {
+		fprintf(stderr, "pack.%u: damaged record at %lld, %s\n", p->no,
+			(long long) off, last ? "cut off" : "rest ignored");
+		if (last && ftruncate(p->fd, off) == -1)
+			res = -1;
+	}
+	p->size = off;
+	arena_put(h, PACK_REC_MAX);
+	return res;
+}
+
+long pack_verify(int fd, void (*bad)(void* arg, off_t off), void* arg)
+{
+	struct pack_rec* h;
+	struct stat st;
+	off_t off, size;
+	long nbad = 0;
+
+	h = arena_get(PACK_REC_MAX);
+	if (!h || fstat(fd, &st) == -1) {
+		arena_put(h, PACK_REC_MAX);
+		return -1;
+	}
+	for (off = 0; off < st.st_size; off += size) {
+		size = sizeof(*h);
+		if (off + size > st.st_size ||
+		    pread(fd, h, sizeof(*h), off) != (ssize_t) sizeof(*h) ||
+		    !rec_sane(h) || off + (size = rec_size(h->len)) > st.st_size ||
+		    pread(fd, h + 1, h->len, off + sizeof(*h)) != (ssize_t) h->len ||
+		    rec_sum(h) != h->crc) {
+			STAT_INC(fmt_crc_failures);
+			if (bad)
+				bad(arg, off);
+			nbad++;
+			break;
+		}
+	}
+	arena_put(h, PACK_REC_MAX);
+	return nbad;
+}
+
+static int cmp_no(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+//opens every pack and builds the index, pack_lock held exclusive
+static int load(void)
+{
+	unsigned int* nos = NULL;
+	unsigned int* t;
+	struct pack_entry* e;
+	struct pack_entry* next;
+	struct dirent* de;
+	size_t i, n = 0;
+	unsigned int no;
+	char c;
+	DIR* dp;
+	int res = 0;
+
+	dp = opendir(pack_dir);
+	if (!dp)
+		return -1;
+	while ((de = readdir(dp)) != NULL) {
+		if (sscanf(de->d_name, "pack.%u%c", &no, &c) != 1)
+			continue;
+		t = realloc(nos, (n + 1) * sizeof(*nos));
+		if (!t) {
+			res = -1;
+			break;
+		}
+		nos = t;
+		nos[n++] = no;
+	}
+	closedir(dp);
+	if (n)
+		qsort(nos, n, sizeof(*nos), cmp_no);
+	packs = n ? calloc(n, sizeof(*packs)) : NULL;
+	if (n && !packs)
+		res = -1;
+	for (i = 0; i < n && !res; i++) {
+		packs[npacks] = pack_open(nos[i], 0);
+		if (!packs[npacks] || pack_scan(packs[npacks], i == n - 1))
+			res = -1;
+		else
+			npacks++;
+	}
+	free(nos);
+
+	//tombstones have done their job once every pack was seen
+	for (i = 0; i < nbuckets; i++) {
+		for (e = table[i]; e; e = next) {
+			next = e->next;
+			if (e->plain == PACK_DEAD)
+				drop(e);
+			else
+				e->pack->live += rec_size(e->len);
+		}
+	}
+	return res;
+}
+
+int pack_init(const char* root, size_t size)
+{
+	struct stat st;
+	int res;
+
+	if (snprintf(pack_dir, sizeof(pack_dir), "%s%s", root, PACK_DIR) >=
+	    (int) sizeof(pack_dir))
+		return -1;
+	threshold = size > FMT_CHUNK ? FMT_CHUNK : size;
+	//without packing on and nothing packed, there is nothing to do
+	if (stat(pack_dir, &st) == -1) {
+		if (errno != ENOENT)
+			return -1;
+		if (!threshold) {
+			loaded = 1;
+			return 0;
+		}
+		if (mkdir(pack_dir, 0700) == -1 && errno != EEXIST)
+			return -1;
+	}
+	pthread_rwlock_wrlock(&pack_lock);
+	res = load();
+	pthread_rwlock_unlock(&pack_lock);
+	if (res) {
+		threshold = 0;
+		return -1;
+	}
+	loaded = 1;
+	stopping = 0;
+	if (pthread_create(&thread, NULL, compact_thread, NULL) == 0)
+		running = 1;
+	if (!registered)
+		registered = stats_register(pack_report) == 0;
+	return 0;
+}
+
+void pack_destroy(void)
+{
+	struct pack_entry* e;
+	size_t i;
+
+	if (running) {
+		pthread_mutex_lock(&compact_lock);
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&compact_cond);
+		pthread_mutex_unlock(&compact_lock);
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	pthread_rwlock_wrlock(&pack_lock);
+	loaded = 0;
+	threshold = 0;
+	for (i = 0; i < nbuckets; i++) {
+		while ((e = table[i]) != NULL) {
+			table[i] = e->next;
+			free(e);
+		}
+	}
+	free(table);
+	table = NULL;
+	nbuckets = nentries = 0;
+	for (i = 0; i < (size_t) npacks; i++)
+		pack_close(packs[i], 0);
+	free(packs);
+	packs = NULL;
+	npacks = 0;
+	pthread_rwlock_unlock(&pack_lock);
+}
@@ -0,0 +1,128 @@
+/* encfs-pack.h
+ * Packed store for small files in pa4-encfs
+ *
+ * With --pack-small, a new file keeps its data in a pack instead of a
+ * backing file of its own for as long as it stays small: the file in the
+ * mirror tree is an empty stub (so names, links, modes and xattrs work as
+ * usual) whose FMT_ATTR reads "packed;nonce=<hex>[;cipher=<engine>]",
+ * and its contents are one encrypted record in the append-only files
+ * <root>/.pa4-encfs-packs/pack.<n>. That saves the data block of every
+ * small file, and reading one is an index lookup and a single pread().
+ *
+ * A record is a header (record ID = the file's nonce, sequence number,
+ * key ID, engine, lengths, CRC32C of the whole record) and the file's
+ * plaintext sealed as one chunk, with the record ID and sequence number
+ * as the tweak. Every change appends a new record, removing a file
+ * appends a tombstone. The index from record ID to the newest record is
+ * kept in memory and rebuilt from the packs at mount; a torn record at
+ * the end of the last pack is cut off.
+ *
+ * A background thread compacts the oldest pack (copying its live records
+ * to the newest one, then deleting it) whenever more than half of the
+ * bytes outside the newest pack are dead. A file that grows past the
+ * threshold is promoted to a chunked file of its own (pack_promote()).
+ *
+ * Callers hold the stub's file lock, as for the other formats.
+ *
+ */
+
+#ifndef ENCFS_PACK_H
+#define ENCFS_PACK_H
+
+#include <sys/types.h>
+
+#include "encfs-format.h"
+
+/* int pack_init(const char* root, size_t threshold)
+ * Purpose: Load the index of the packs under root and start compaction
+ * Args: const char* root  : Mirror directory
+ *       size_t threshold  : New files up to this size are packed, 0 to
+ *                           pack nothing new (packed files are still
+ *                           read); at most FMT_CHUNK
+ * Return: 0 on success, -1 on error
+ */
+extern int pack_init(const char* root, size_t threshold);
+
+/* void pack_destroy(void)
+ * Purpose: Stop compaction and close the packs
+ */
+extern void pack_destroy(void);
+
+/* size_t pack_threshold(void)
+ * Purpose: Largest size a packed file may have, 0 if nothing is packed
+ */
+extern size_t pack_threshold(void);
+
+/* int pack_new(struct fmt_meta* m)
+ * Purpose: Make the format of a new file from fmt_new() packed, if
+ *          packing is on. An empty packed file has no record yet.
+ * Return: 1 if m is now FMT_PACKED, 0 if the file isn't to be packed
+ */
+extern int pack_new(struct fmt_meta* m);
+
+/* off_t pack_size(const struct fmt_meta* m)
+ * Purpose: Plaintext size of a packed file
+ * Return: Size in bytes, -1 if the pack store isn't loaded
+ */
+extern off_t pack_size(const struct fmt_meta* m);
+
+/* ssize_t pack_pread(const struct fmt_meta* m, char* buf, size_t size,
+ *                    off_t offset)
+ * Purpose: pread() on the plaintext of a packed file
+ * Return: Bytes read (short or 0 at end of file), -1 on error (errno EIO
+ *         if the record is damaged)
+ */
+extern ssize_t pack_pread(const struct fmt_meta* m, char* buf, size_t size,
+			  off_t offset);
+
+/* ssize_t pack_pwrite(const struct fmt_meta* m, const char* buf,
+ *                     size_t size, off_t offset)
+ * Purpose: pwrite() on the plaintext of a packed file, by appending a new
+ *          record
+ * Return: size on success, -1 on error (errno EFBIG if the file would
+ *         grow past pack_threshold(), promote it first)
+ */
+extern ssize_t pack_pwrite(const struct fmt_meta* m, const char* buf,
+			   size_t size, off_t offset);
+
+/* int pack_truncate(const struct fmt_meta* m, off_t size)
+ * Purpose: Truncate (or zero-extend) a packed file to size
+ * Return: 0 on success, -1 on error (errno EFBIG past pack_threshold())
+ */
+extern int pack_truncate(const struct fmt_meta* m, off_t size);
+
+/* void pack_remove(const struct fmt_meta* m)
+ * Purpose: Drop the record of a packed file whose last link is gone
+ */
+extern void pack_remove(const struct fmt_meta* m);
+
+/* int pack_promote(int fd, struct fmt_meta* m)
+ * Purpose: Move a packed file into its stub fd as a new chunked file,
+ *          then drop its record. A crash in between leaves the record
+ *          to compaction, never loses the data.
+ * Args: struct fmt_meta* m : The file's format, replaced by the new one
+ * Return: 0 on success, -1 on error (the file stays packed)
+ */
+extern int pack_promote(int fd, struct fmt_meta* m);
+
+/* ssize_t pack_rekey(const struct fmt_meta* m)
+ * Purpose: Rewrite a packed file's record with the current key if it
+ *          uses another one
+ * Return: Plaintext bytes rewritten (0 if it was already on the current
+ *         key), -1 on error
+ */
+extern ssize_t pack_rekey(const struct fmt_meta* m);
+
+/* long pack_verify(int fd, void (*bad)(void* arg, off_t off), void* arg)
+ * Purpose: Check every record of a pack file against its CRC, without
+ *          the key and without decrypting. Records can't be found past
+ *          a damaged one, so the first ends the check.
+ * Args: int fd                              : A pack.<n> file
+ *       void (*bad)(void* arg, off_t off)   : Called with the offset of
+ *                                             a damaged record, may be
+ *                                             NULL
+ * Return: Number of damaged records (0 or 1), -1 on error
+ */
+extern long pack_verify(int fd, void (*bad)(void* arg, off_t off), void* arg);
+
+#endif
@@ -0,0 +1,298 @@
+/* encfs-prefetch.c
+ * Sequential read detection and background decrypt-ahead for pa4-encfs
+ *
+ * Queued jobs hold a reference on their stream, so a handle can be
+ * released while its jobs are still queued. A job is cancelled by bumping
+ * the stream's generation; workers check it before every block.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-cache.h"
+#include "encfs-lock.h"
+#include "encfs-prefetch.h"
+#include "encfs-stats.h"
+
+#define MAX_QUEUED 256
+
+struct pf_stream {
+	pthread_mutex_t lock;
+	int refs;
+	char* path;
+	/* end of the previous read, -1 before the first one */
+	off_t next_off;
+	int run;
+	int window;
+	/* first block not queued yet */
+	off_t pf_next;
+	/* queued jobs of an older generation are cancelled */
+	unsigned long gen;
+};
+
+struct pf_job {
+	struct pf_stream* stream;
+	unsigned long gen;
+	off_t first;
+	int count;
+	struct pf_job* next;
+};
+
+static pthread_t* workers;
+static int nworkers;
+static int max_window;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct pf_job* queue_head;
+static struct pf_job* queue_tail;
+static int queued;
+static int stopping;
+
+static void stream_put(struct pf_stream* s)
+{
+	int last;
+
+	pthread_mutex_lock(&s->lock);
+	last = --s->refs == 0;
+	pthread_mutex_unlock(&s->lock);
+	if (last) {
+		pthread_mutex_destroy(&s->lock);
+		free(s->path);
+		free(s);
+	}
+}
+
+static int job_live(struct pf_job* j)
+{
+	int live;
+
+	pthread_mutex_lock(&j->stream->lock);
+	live = j->gen == j->stream->gen;
+	pthread_mutex_unlock(&j->stream->lock);
+	return live;
+}
+
+static void run_job(struct pf_job* j)
+{
+	struct file_lock* l;
+	struct stat st;
+	struct fmt_meta m;
+	int fd;
+	int i;
+
+	fd = open(j->stream->path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1 || fmt_get(fd, &m) < 0) {
+		if (fd != -1)
+			close(fd);
+		STAT_ADD(prefetch_cancelled, j->count);
+		return;
+	}
+
+	for (i = 0; i < j->count; i++) {
+		int res;
+
+		if (!job_live(j) || stopping) {
+			STAT_ADD(prefetch_cancelled, j->count - i);
+			break;
+		}
+		//shared with readers, but never while a writer rewrites the file
+		l = lock_acquire(st.st_dev, st.st_ino, LOCK_SHARED);
+		res = cache_prefetch(fd, &st, j->first + i, &m);
+		lock_release(l);
+		if (res > 0)
+			STAT_INC(prefetch_done);
+		else if (res < 0) {
+			//end of file
+			STAT_ADD(prefetch_cancelled, j->count - i);
+			break;
+		}
+	}
+	close(fd);
+}
+
+static void* worker(void* arg)
+{
+	struct pf_job* j;
+
+	(void) arg;
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head && !stopping)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (stopping) {
+			pthread_mutex_unlock(&queue_lock);
+			return NULL;
+		}
+		j = queue_head;
+		queue_head = j->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		queued--;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (job_live(j))
+			run_job(j);
+		else
+			STAT_ADD(prefetch_cancelled, j->count);
+		stream_put(j->stream);
+		free(j);
+	}
+}
+
+static void enqueue(struct pf_stream* s, unsigned long gen, off_t first, int count)
+{
+	struct pf_job* j;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queued >= MAX_QUEUED || stopping) {
+		pthread_mutex_unlock(&queue_lock);
+		STAT_ADD(prefetch_dropped, count);
+		return;
+	}
+	j = malloc(sizeof(*j));
+	if (!j) {
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	//the caller holds s->lock
+	s->refs++;
+	j->stream = s;
+	j->gen = gen;
+	j->first = first;
+	j->count = count;
+	j->next = NULL;
+	if (queue_tail)
+		queue_tail->next = j;
+	else
+		queue_head = j;
+	queue_tail = j;
+	queued++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	STAT_ADD(prefetch_issued, count);
+}
+
+int prefetch_init(int threads, int window)
+{
+	int i;
+
+	if (threads <= 0)
+		return 0;
+
+	max_window = window > PREFETCH_MIN ? window : PREFETCH_MIN;
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, worker, NULL))
+			break;
+		nworkers++;
+	}
+	return nworkers ? 0 : -1;
+}
+
+void prefetch_destroy(void)
+{
+	struct pf_job* j;
+	int i;
+
+	if (!nworkers)
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	while ((j = queue_head)) {
+		queue_head = j->next;
+		STAT_ADD(prefetch_cancelled, j->count);
+		stream_put(j->stream);
+		free(j);
+	}
+	queue_tail = NULL;
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+struct pf_stream* prefetch_open(const char* backingPath)
+{
+	struct pf_stream* s;
+
+	if (!nworkers)
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->path = strdup(backingPath);
+	if (!s->path) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	s->refs = 1;
+	s->next_off = -1;
+	s->window = PREFETCH_MIN;
+	return s;
+}
+
+void prefetch_close(struct pf_stream* s)
+{
+	if (!s)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->gen++;
+	pthread_mutex_unlock(&s->lock);
+	stream_put(s);
+}
+
+void prefetch_note_read(struct pf_stream* s, off_t offset, size_t size, int hits)
+{
+	off_t last, target, from;
+
+	if (!s || size == 0)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	if (offset == s->next_off) {
+		s->run++;
+	} else {
+		//a seek: whatever is queued for the old position is useless
+		if (s->run >= PREFETCH_TRIGGER)
+			s->gen++;
+		s->run = 1;
+		s->window = PREFETCH_MIN;
+		s->pf_next = 0;
+	}
+	s->next_off = offset + size;
+
+	if (hits && s->window < max_window) {
+		s->window *= 2;
+		if (s->window > max_window)
+			s->window = max_window;
+	}
+
+	if (s->run >= PREFETCH_TRIGGER) {
+		if (s->run == PREFETCH_TRIGGER)
+			STAT_INC(seq_streams);
+		last = (offset + size - 1) / CACHE_BLOCK;
+		target = last + s->window;
+		from = s->pf_next > last ? s->pf_next : last + 1;
+		if (from <= target) {
+			enqueue(s, s->gen, from, target - from + 1);
+			s->pf_next = target + 1;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,56 @@
+/* encfs-prefetch.h
+ * Sequential read detection and background decrypt-ahead for pa4-encfs
+ *
+ * Every open file handle gets a stream. Reads are reported to the stream;
+ * once PREFETCH_TRIGGER reads in a row have continued exactly where the
+ * previous one ended, the next blocks are queued for the worker threads,
+ * which decrypt them into the plaintext cache. The window starts at
+ * PREFETCH_MIN blocks, doubles every time a read finds a block that was
+ * decrypted ahead, and is cut back (with everything still queued
+ * cancelled) as soon as the reader seeks.
+ *
+ */
+
+#ifndef ENCFS_PREFETCH_H
+#define ENCFS_PREFETCH_H
+
+#include <sys/types.h>
+
+#define PREFETCH_TRIGGER 2
+#define PREFETCH_MIN 2
+
+struct pf_stream;
+
+/* int prefetch_init(int threads, int max_window)
+ * Purpose: Start the decrypt-ahead workers
+ * Args: int threads    : Worker threads (0 disables decrypt-ahead)
+ *       int max_window : Largest window, in cache blocks
+ * Return: 0 on success, -1 on error
+ */
+extern int prefetch_init(int threads, int max_window);
+
+/* void prefetch_destroy(void)
+ * Purpose: Cancel queued work and stop the workers
+ */
+extern void prefetch_destroy(void);
+
+/* struct pf_stream* prefetch_open(const char* backingPath)
+ * Purpose: Create the access pattern state for a new file handle
+ * Return: The stream, NULL when decrypt-ahead is off or out of memory
+ */
+extern struct pf_stream* prefetch_open(const char* backingPath);
+
+/* void prefetch_close(struct pf_stream* s)
+ * Purpose: Cancel the stream's queued work and drop the handle's reference
+ */
+extern void prefetch_close(struct pf_stream* s);
+
+/* void prefetch_note_read(struct pf_stream* s, off_t offset, size_t size, int hits)
+ * Purpose: Report a completed read on an encrypted file
+ * Args: off_t offset : Plaintext offset of the read
+ *       size_t size  : Bytes returned
+ *       int hits     : Blocks of the read served by decrypt-ahead
+ */
+extern void prefetch_note_read(struct pf_stream* s, off_t offset, size_t size, int hits);
+
+#endif
@@ -0,0 +1,268 @@
+/* encfs-record.c
+ * Capture of FUSE operations for pa4-encfs
+ *
+ * Same ring scheme as encfs-trace.c: the owner thread is the only
+ * producer of its ring and the writer thread the only consumer, so
+ * recording never takes a lock and a full ring drops the entry. Both
+ * entries of a two path op are published at once, so the writer never
+ * sees one without the other.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "encfs-record.h"
+#include "encfs-stats.h"
+
+#define RING_ENTRIES 8192
+#define DRAIN_MS 200
+
+struct rec_ring {
+	struct rec_entry ev[RING_ENTRIES];
+	unsigned long head;	/* written by the owner */
+	unsigned long tail;	/* written by the writer thread */
+	uint16_t thread;
+	int dead;		/* owner exited */
+	struct rec_ring* next;
+};
+
+int record_on;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rec_ring* rings;
+static pthread_key_t ring_key;
+static __thread struct rec_ring* my_ring;
+static uint16_t threads;
+
+static pthread_t writer;
+static int running;
+static int stopping;
+static sem_t wake;
+
+static FILE* out;
+static unsigned long long started;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//FNV-1a of the first len bytes
+static uint64_t hash(const char* s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h ^= (unsigned char) *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void hash_path(struct rec_entry* ev, const char* path)
+{
+	const char* slash;
+	size_t len;
+
+	if (!path) {
+		ev->path = ev->dir = 0;
+		return;
+	}
+	len = strlen(path);
+	ev->path = hash(path, len);
+	//the root is its own directory
+	slash = strrchr(path, '/');
+	ev->dir = !slash || len <= 1 ? ev->path :
+		hash(path, slash == path ? 1 : (size_t) (slash - path));
+}
+
+static void ring_release(void* arg)
+{
+	struct rec_ring* r = arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct rec_ring* ring_get(void)
+{
+	struct rec_ring* r = my_ring;
+
+	if (r)
+		return r;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	pthread_mutex_lock(&record_lock);
+	r->thread = threads++;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&record_lock);
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+void record_op(int op, const char* path, uint64_t off, uint64_t size,
+	       uint32_t arg, const char* path2, uint64_t off2)
+{
+	struct rec_ring* r = ring_get();
+	unsigned long h, used, n = path2 ? 2 : 1;
+	struct rec_entry* ev;
+
+	if (!r)
+		return;
+	h = r->head;
+	used = h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used + n > RING_ENTRIES) {
+		STAT_INC(record_dropped);
+		return;
+	}
+	if (used < RING_ENTRIES / 2 && used + n >= RING_ENTRIES / 2)
+		sem_post(&wake);
+	ev = &r->ev[h % RING_ENTRIES];
+	ev->ns = now_ns() - started;
+	hash_path(ev, path);
+	ev->off = off;
+	ev->size = size;
+	ev->arg = arg;
+	ev->thread = r->thread;
+	ev->op = op;
+	if (path2) {
+		struct rec_entry* ev2 = &r->ev[(h + 1) % RING_ENTRIES];
+
+		*ev2 = *ev;
+		hash_path(ev2, path2);
+		ev2->off = off2;
+		ev2->op = REC_target;
+	}
+	__atomic_store_n(&r->head, h + n, __ATOMIC_RELEASE);
+}
+
+//moves every entry to the capture file
+static void drain(void)
+{
+	struct rec_ring** p;
+	struct rec_ring* r;
+	unsigned long h, t, n;
+
+	pthread_mutex_lock(&record_lock);
+	for (p = &rings; (r = *p) != NULL; ) {
+		int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+
+		h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		//in at most two runs, the ring wraps
+		for (t = r->tail; t != h; t += n) {
+			n = RING_ENTRIES - t % RING_ENTRIES;
+			if (n > h - t)
+				n = h - t;
+			if (fwrite(&r->ev[t % RING_ENTRIES], sizeof(*r->ev), n, out) != n)
+				STAT_ADD(record_dropped, n);
+			else
+				STAT_ADD(record_entries, n);
+		}
+		__atomic_store_n(&r->tail, h, __ATOMIC_RELEASE);
+		if (dead) {
+			*p = r->next;
+			free(r);
+		} else {
+			p = &r->next;
+		}
+	}
+	pthread_mutex_unlock(&record_lock);
+}
+
+static void* writer_thread(void* arg)
+{
+	struct timespec ts;
+
+	(void) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DRAIN_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (sem_timedwait(&wake, &ts) == -1 && errno != ETIMEDOUT &&
+		    errno != EINTR)
+			break;
+		drain();
+	}
+	return NULL;
+}
+
+int record_init(const char* path)
+{
+	struct rec_header hdr;
+	struct timespec ts;
+
+	out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = REC_MAGIC;
+	hdr.version = REC_VERSION;
+	hdr.started = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    pthread_key_create(&ring_key, ring_release)) {
+		fclose(out);
+		out = NULL;
+		return -1;
+	}
+	if (sem_init(&wake, 0, 0)) {
+		pthread_key_delete(ring_key);
+		fclose(out);
+		out = NULL;
+		return -1;
+	}
+	started = now_ns();
+	stopping = 0;
+	if (pthread_create(&writer, NULL, writer_thread, NULL)) {
+		sem_destroy(&wake);
+		pthread_key_delete(ring_key);
+		fclose(out);
+		out = NULL;
+		return -1;
+	}
+	running = 1;
+	__atomic_store_n(&record_on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void record_destroy(void)
+{
+	struct rec_ring* r;
+
+	if (!running)
+		return;
+	__atomic_store_n(&record_on, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&wake);
+	pthread_join(writer, NULL);
+	running = 0;
+	drain();
+	if (fclose(out))
+		perror("record");
+	out = NULL;
+	//whatever threads are left don't record any more
+	while ((r = rings) != NULL) {
+		rings = r->next;
+		free(r);
+	}
+	my_ring = NULL;
+	threads = 0;
+	pthread_key_delete(ring_key);
+	sem_destroy(&wake);
+}
@@ -0,0 +1,97 @@
+/* encfs-record.h
+ * Capture of FUSE operations for pa4-encfs
+ *
+ * With --record=<file>, every call into xmp_oper is logged to <file> as a
+ * fixed size binary entry: the op, hashes of the path and of its
+ * directory, offset, size, a small per-thread number and the time since
+ * the capture started. File names and data are not kept, so a capture of
+ * a real workload can be attached to a bug report. pa4-encfs-replay runs
+ * one against a mount.
+ *
+ * As with spans (encfs-trace.h), each thread appends to a ring of its own
+ * and a writer thread drains the rings into the file, so entries are in
+ * order per thread but not across threads. An op on two paths (rename,
+ * link, copy_file_range) is followed by a REC_target entry of the same
+ * thread for the second one. The file is a struct rec_header and then
+ * the entries, in host byte order.
+ *
+ * An op is recorded with one line at the top of its handler:
+ *	RECORD(read, path, offset, size, 0);
+ * With --record off it costs one well-predicted branch.
+ *
+ */
+
+#ifndef ENCFS_RECORD_H
+#define ENCFS_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_MAGIC 0x52344150	/* "PA4R" */
+#define REC_VERSION 1
+
+#define RECORD_OPS(X)							\
+	X(getattr) X(access) X(readlink) X(opendir) X(readdir)		\
+	X(releasedir) X(mknod) X(mkdir) X(unlink) X(rmdir) X(symlink)	\
+	X(rename) X(link) X(chmod) X(chown) X(truncate) X(utimens)	\
+	X(open) X(read) X(write) X(statfs) X(create) X(release) X(fsync) \
+	X(setxattr) X(getxattr) X(listxattr) X(removexattr)		\
+	X(copy_file_range) X(lseek) X(fallocate) X(target)
+
+enum rec_op {
+#define REC_ENUM(name) REC_##name,
+	RECORD_OPS(REC_ENUM)
+#undef REC_ENUM
+	REC_MAX
+};
+
+struct rec_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t started;	/* CLOCK_REALTIME, ns */
+};
+
+struct rec_entry {
+	uint64_t ns;		/* since the capture started */
+	uint64_t path;		/* FNV-1a hash of the path, "/" based */
+	uint64_t dir;		/* hash of the directory it is in */
+	uint64_t off;		/* offset, new size for truncate */
+	uint64_t size;		/* bytes */
+	uint32_t arg;		/* mode, open flags, whence, datasync, ... */
+	uint16_t thread;	/* numbered in the order threads showed up */
+	uint16_t op;		/* enum rec_op */
+};
+
+extern int record_on;
+
+/* int record_init(const char* path)
+ * Purpose: Create the capture file and start recording
+ * Args: const char* path : Absolute path of the capture file
+ * Return: 0 on success, -1 on error
+ */
+extern int record_init(const char* path);
+
+/* void record_destroy(void)
+ * Purpose: Stop recording and write out what is left
+ */
+extern void record_destroy(void);
+
+/* void record_op(int op, const char* path, uint64_t off, uint64_t size,
+ *                uint32_t arg, const char* path2, uint64_t off2)
+ * Purpose: Log a call, use RECORD or RECORD2 instead
+ * Args: const char* path2 : Second path, NULL if there is none
+ *       uint64_t off2     : Offset in the second path
+ */
+extern void record_op(int op, const char* path, uint64_t off, uint64_t size,
+		      uint32_t arg, const char* path2, uint64_t off2);
+
+#define RECORD2(op, path, off, size, arg, path2, off2)			\
+	do {								\
+		if (__builtin_expect(__atomic_load_n(&record_on,	\
+						     __ATOMIC_RELAXED), 0)) \
+			record_op(REC_##op, path, off, size, arg, path2, off2); \
+	} while (0)
+#define RECORD(op, path, off, size, arg)				\
+	RECORD2(op, path, off, size, arg, NULL, 0)
+
+#endif
@@ -0,0 +1,370 @@
+/* encfs-rekey.c
+ * Online key rotation for pa4-encfs
+ *
+ * A single thread does the rotation: passes are rare and long, and one
+ * file at a time is what keeps the share of the disk predictable. A new
+ * key arriving during a pass restarts it from the root, since files
+ * already visited may now be on an old key.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-cache.h"
+#include "encfs-format.h"
+#include "encfs-lock.h"
+#include "encfs-meta.h"
+#include "encfs-pack.h"
+#include "encfs-rekey.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-tier.h"
+
+/* files and directories we made ourselves (scratch, aside, staging,
+ * stripes, tier) */
+#define HIDDEN_PREFIX ".pa4-encfs"
+/* plaintext moved per read/write while rewriting */
+#define REKEY_IO (FMT_BATCH * FMT_CHUNK)
+
+enum { REKEY_IDLE, REKEY_RUNNING, REKEY_DONE };
+
+struct rekey_dir {
+	char* path;
+	struct rekey_dir* next;
+};
+
+static char* root_dir;
+static int busy_share = 10;
+static pthread_t thread;
+static int running;
+
+static pthread_mutex_t rekey_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rekey_cond = PTHREAD_COND_INITIALIZER;
+static int requested;
+static int stopping;
+static int state = REKEY_IDLE;
+static unsigned long pass_files;
+
+static double seconds_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+//the pass is to be abandoned, for a new one or for good
+static int interrupted(void)
+{
+	return __atomic_load_n(&requested, __ATOMIC_RELAXED) ||
+		__atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+//sleeps so that busy seconds of work are busy_share percent of the time
+static void throttle(double busy)
+{
+	double wait = busy * (100 - busy_share) / busy_share;
+	struct timespec ts;
+
+	if (wait <= 0)
+		return;
+	ts.tv_sec = (time_t) wait;
+	ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+	STAT_ADD(rekey_throttle_us, (unsigned long long) (wait * 1e6));
+}
+
+//copies the extended attributes of from other than the format and the
+//hole list (the new file has its own) onto to
+static int copy_xattrs(int from, int to)
+{
+	char names[4096], value[4096];
+	ssize_t len, vlen;
+	char* name;
+
+	len = flistxattr(from, names, sizeof(names));
+	if (len == -1)
+		return errno == ENOTSUP ? 0 : -1;
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		if (!strcmp(name, FMT_ATTR) || !strcmp(name, FMT_HOLES_ATTR))
+			continue;
+		vlen = fgetxattr(from, name, value, sizeof(value));
+		if (vlen != -1)
+			fsetxattr(to, name, value, vlen, 0);
+	}
+	return 0;
+}
+
+//re-encrypts fd (old) into afd (new); returns the plaintext size, -1 on
+//error
+static off_t copy_plain(int fd, const struct fmt_meta* old, int afd,
+			const struct fmt_meta* m)
+{
+	off_t size, off;
+	ssize_t n;
+	char* buf;
+
+	size = fmt_size(fd, old);
+	if (size < 0)
+		return -1;
+	buf = arena_get(REKEY_IO);
+	if (!buf)
+		return -1;
+	//all zero chunks come out as holes again
+	for (off = 0; off < size; off += n) {
+		n = fmt_pread(fd, old, buf, REKEY_IO, off);
+		if (n <= 0 || fmt_pwrite(afd, m, buf, n, off) != n) {
+			size = -1;
+			break;
+		}
+	}
+	arena_put(buf, REKEY_IO);
+	return size;
+}
+
+//rewrites one file with the current key, called with it locked exclusive
+static int rekey_locked(const char* path, int fd, const struct stat* st,
+			const struct fmt_meta* old)
+{
+	char asidePath[PATH_MAX + 64];
+	const char* base = strrchr(path, '/') + 1;
+	struct fmt_meta m;
+	off_t size;
+	int afd;
+
+	if (fmt_new(&m))
+		return -1;
+	snprintf(asidePath, sizeof(asidePath), "%.*s.pa4-encfs-rekey.%.32s.XXXXXX",
+		 (int) (base - path), path, base);
+	afd = mkstemp(asidePath);
+	if (afd == -1)
+		return -1;
+	size = copy_plain(fd, old, afd, &m);
+	if (size < 0 || fchmod(afd, st->st_mode & 07777) == -1 ||
+	    (fchown(afd, st->st_uid, st->st_gid) == -1 && errno != EPERM) ||
+	    copy_xattrs(fd, afd) || fmt_set(afd, &m) || fmt_fdatasync(afd, &m))
+		goto fail;
+	//old ciphertext (and its stripes) only goes once the new one is in
+	//place
+	if (rename(asidePath, path) == -1)
+		goto fail;
+	close(afd);
+	fmt_remove(fd, old);
+	cache_invalidate(st->st_dev, st->st_ino);
+	meta_invalidate(st->st_dev, st->st_ino);
+	tier_invalidate(st->st_dev, st->st_ino);
+	STAT_INC(rekey_files);
+	STAT_ADD(rekey_bytes, size);
+	return 0;
+
+fail:
+	unlink(asidePath);
+	fmt_remove(afd, &m);
+	close(afd);
+	return -1;
+}
+
+static void rekey_file(const char* path)
+{
+	struct timespec started;
+	struct sched_job job;
+	struct file_lock* l;
+	struct fmt_meta old;
+	struct stat st;
+	size_t moved = 0;
+	ssize_t n;
+	int fd, kind;
+
+	sched_bg_begin(&job, SCHED_REKEY);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	l = lock_path(path, LOCK_EXCLUSIVE);
+	fd = l ? open(path, O_RDONLY) : -1;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		lock_release(l);
+		if (fd != -1)
+			close(fd);
+		sched_bg_end(&job, 0);
+		return;
+	}
+	__atomic_add_fetch(&pass_files, 1, __ATOMIC_RELAXED);
+	kind = fmt_get(fd, &old);
+	//packed files carry their key in the record, which is rewritten in
+	//the pack (hard links and all)
+	if (kind == FMT_PACKED) {
+		n = pack_rekey(&old);
+		if (n < 0)
+			STAT_INC(rekey_failures);
+		else if (n > 0) {
+			STAT_INC(rekey_files);
+			STAT_ADD(rekey_bytes, n);
+			moved = 2 * (size_t) n;
+		}
+	}
+	//pending files get the current key when they are encrypted
+	if ((kind == FMT_CHUNKED || kind == FMT_LEGACY || kind == FMT_DEDUP) &&
+	    old.key != fmt_current_key()) {
+		if (st.st_nlink > 1)
+			STAT_INC(rekey_skipped);
+		else if (rekey_locked(path, fd, &st, &old))
+			STAT_INC(rekey_failures);
+		else
+			moved = 2 * (size_t) st.st_size;
+	}
+	close(fd);
+	lock_release(l);
+	sched_bg_end(&job, moved);
+	throttle(seconds_since(&started));
+}
+
+static int push_dir(struct rekey_dir** stack, const char* path)
+{
+	struct rekey_dir* d = malloc(sizeof(*d));
+
+	if (!d || !(d->path = strdup(path))) {
+		free(d);
+		return -1;
+	}
+	d->next = *stack;
+	*stack = d;
+	return 0;
+}
+
+//one pass over the tree, 0 once every file was visited
+static int rekey_pass(void)
+{
+	struct rekey_dir* stack = NULL;
+	struct rekey_dir* d;
+	char path[PATH_MAX];
+	struct dirent* de;
+	DIR* dp;
+	int res = 0;
+
+	if (push_dir(&stack, root_dir))
+		return -1;
+	while ((d = stack) != NULL) {
+		stack = d->next;
+		dp = res ? NULL : opendir(d->path);
+		while (dp && (de = readdir(dp)) != NULL) {
+			if (interrupted()) {
+				res = -1;
+				break;
+			}
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+			    !strncmp(de->d_name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", d->path, de->d_name) >=
+			    (int) sizeof(path))
+				continue;
+			if (de->d_type == DT_UNKNOWN) {
+				struct stat st;
+
+				if (lstat(path, &st) == -1)
+					continue;
+				de->d_type = S_ISDIR(st.st_mode) ? DT_DIR :
+					S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (de->d_type == DT_DIR && push_dir(&stack, path))
+				res = -1;
+			else if (de->d_type == DT_REG)
+				rekey_file(path);
+		}
+		if (dp)
+			closedir(dp);
+		free(d->path);
+		free(d);
+	}
+	return res;
+}
+
+static void* rekey_thread(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&rekey_lock);
+	for (;;) {
+		while (!requested && !stopping)
+			pthread_cond_wait(&rekey_cond, &rekey_lock);
+		if (stopping)
+			break;
+		requested = 0;
+		state = REKEY_RUNNING;
+		__atomic_store_n(&pass_files, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&rekey_lock);
+
+		fprintf(stderr, "rekey: moving files to key %08x\n",
+			crypt_key_id(fmt_current_key()));
+		if (!rekey_pass() && !interrupted())
+			fprintf(stderr, "rekey: done, %lu files checked\n",
+				__atomic_load_n(&pass_files, __ATOMIC_RELAXED));
+
+		pthread_mutex_lock(&rekey_lock);
+		if (!requested && !stopping)
+			state = REKEY_DONE;
+	}
+	pthread_mutex_unlock(&rekey_lock);
+	return NULL;
+}
+
+static int rekey_report(char* buf, size_t size)
+{
+	static const char* names[] = { "idle", "running", "done" };
+	int st;
+
+	pthread_mutex_lock(&rekey_lock);
+	st = state;
+	pthread_mutex_unlock(&rekey_lock);
+	return snprintf(buf, size, "rekey_state %s\nrekey_key %08x\nrekey_pass_files %lu\n",
+			names[st], crypt_key_id(fmt_current_key()),
+			__atomic_load_n(&pass_files, __ATOMIC_RELAXED));
+}
+
+int rekey_init(const char* root, int share, int start)
+{
+	root_dir = strdup(root);
+	if (!root_dir)
+		return -1;
+	busy_share = share < 1 ? 1 : share > 100 ? 100 : share;
+	requested = start;
+	if (pthread_create(&thread, NULL, rekey_thread, NULL)) {
+		free(root_dir);
+		root_dir = NULL;
+		return -1;
+	}
+	running = 1;
+	stats_register(rekey_report);
+	return 0;
+}
+
+void rekey_start(void)
+{
+	pthread_mutex_lock(&rekey_lock);
+	__atomic_store_n(&requested, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&rekey_cond);
+	pthread_mutex_unlock(&rekey_lock);
+}
+
+void rekey_stop(void)
+{
+	if (!running)
+		return;
+	pthread_mutex_lock(&rekey_lock);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&rekey_cond);
+	pthread_mutex_unlock(&rekey_lock);
+	pthread_join(thread, NULL);
+	running = 0;
+	free(root_dir);
+	root_dir = NULL;
+}
@@ -0,0 +1,47 @@
+/* encfs-rekey.h
+ * Online key rotation for pa4-encfs
+ *
+ * Every file records the key it was written with (see encfs-format.h), so
+ * several keys can be in use at once. Once new files use a new key, one
+ * background thread walks the mirror directory and rewrites every file
+ * still on another key: it is re-encrypted into a hidden file next to it,
+ * which is flushed and renamed over the original under the file's
+ * exclusive lock, like a do_crypt file being converted. Hard linked files
+ * can't be renamed over and are left alone (rekey_skipped).
+ *
+ * The thread is paced to a share of the time: after each file it sleeps
+ * long enough that it is busy only share percent of the time, which
+ * bounds the disk and CPU it takes from the mount.
+ *
+ * Progress is reported in the stats (rekey_state, rekey_key,
+ * rekey_pass_files and the rekey_* counters).
+ *
+ */
+
+#ifndef ENCFS_REKEY_H
+#define ENCFS_REKEY_H
+
+/* int rekey_init(const char* root, int share, int start)
+ * Purpose: Start the rotation thread
+ * Args: const char* root : Mirror directory
+ *       int share        : Percent of the time the thread may be busy
+ *                          (1-100)
+ *       int start        : Begin a pass right away, for a rotation that
+ *                          was interrupted by an unmount
+ * Return: 0 on success, -1 on error
+ */
+extern int rekey_init(const char* root, int share, int start);
+
+/* void rekey_start(void)
+ * Purpose: Move every file to the key new files use now, starting the
+ *          pass over if one is running
+ */
+extern void rekey_start(void);
+
+/* void rekey_stop(void)
+ * Purpose: Abandon the pass (after the file being rewritten) and join the
+ *          thread
+ */
+extern void rekey_stop(void);
+
+#endif
@@ -0,0 +1,243 @@
+/* encfs-sched.c
+ * Foreground/background scheduling for pa4-encfs
+ *
+ * The foreground side is two atomics, the number of requests running and
+ * when the last one ended, so FUSE threads never take the scheduler
+ * lock. Background jobs held back for the foreground poll those on a
+ * timeout; they are only woken early for a job of a more urgent class
+ * being admitted, or for the unmount.
+ *
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+
+/* how often a job held back by running requests looks again */
+#define SCHED_POLL_MS 2
+
+enum { WAIT_NONE, WAIT_CLASS, WAIT_FG, WAIT_IO, WAIT_CPU };
+
+static const char* class_names[SCHED_CLASSES] = {
+	"flush", "encrypt", "compact", "rekey", "warmup"
+};
+
+static int fg_active;
+static unsigned long long fg_last; /* ns, when the last request ended */
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+static int registered;
+static unsigned long long idle_ns;
+static int running;
+static int queued[SCHED_CLASSES];
+static unsigned long long jobs[SCHED_CLASSES];
+static unsigned long long wait_us[SCHED_CLASSES];
+static unsigned long long wait_max_us[SCHED_CLASSES];
+
+/* token buckets, refilled at rate per second, hold at most one second;
+ * jobs are charged after the fact, so they go into debt. A rate of 0 is
+ * unlimited. io is in bytes, cpu in ns */
+static double io_rate, io_tokens;
+static double cpu_rate, cpu_tokens;
+static unsigned long long refilled;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//sched_lock held
+static void refill(void)
+{
+	unsigned long long now = now_ns();
+	double secs = (now - refilled) / 1e9;
+
+	refilled = now;
+	io_tokens += secs * io_rate;
+	if (io_tokens > io_rate)
+		io_tokens = io_rate;
+	cpu_tokens += secs * cpu_rate;
+	if (cpu_tokens > cpu_rate)
+		cpu_tokens = cpu_rate;
+}
+
+//sched_lock held; ns < 0 waits until woken
+static void wait_for(long long ns)
+{
+	struct timespec ts;
+
+	if (ns < 0) {
+		pthread_cond_wait(&sched_cond, &sched_lock);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ns / 1000000000LL;
+	ts.tv_nsec += ns % 1000000000LL;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+}
+
+void sched_fg_begin(void)
+{
+	__atomic_add_fetch(&fg_active, 1, __ATOMIC_ACQ_REL);
+	STAT_INC(sched_fg_requests);
+}
+
+void sched_fg_end(int* unused)
+{
+	(void) unused;
+	__atomic_store_n(&fg_last, now_ns(), __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&fg_active, 1, __ATOMIC_RELEASE);
+}
+
+//sched_lock held; why a job of class cls can't start yet, and for how
+//long it should sleep
+static int held_back(enum sched_class cls, unsigned long long start,
+		     long long* ns)
+{
+	unsigned long long now = now_ns(), last;
+	int c;
+
+	for (c = 0; c < (int) cls; c++) {
+		if (queued[c]) {
+			*ns = -1;
+			return WAIT_CLASS;
+		}
+	}
+	if (idle_ns && now - start < SCHED_STARVE_MS * 1000000ULL) {
+		if (__atomic_load_n(&fg_active, __ATOMIC_ACQUIRE)) {
+			*ns = SCHED_POLL_MS * 1000000LL;
+			return WAIT_FG;
+		}
+		last = __atomic_load_n(&fg_last, __ATOMIC_RELAXED);
+		if (now < last + idle_ns) {
+			*ns = last + idle_ns - now;
+			return WAIT_FG;
+		}
+	}
+	refill();
+	if (io_tokens < 0) {
+		*ns = -io_tokens / io_rate * 1e9;
+		return WAIT_IO;
+	}
+	if (cpu_tokens < 0) {
+		*ns = -cpu_tokens / cpu_rate * 1e9;
+		return WAIT_CPU;
+	}
+	return WAIT_NONE;
+}
+
+void sched_bg_begin(struct sched_job* job, enum sched_class cls)
+{
+	unsigned long long start = now_ns(), t, waited;
+	int why, preempted = 0;
+	long long ns;
+
+	pthread_mutex_lock(&sched_lock);
+	queued[cls]++;
+	while (!stopping && (why = held_back(cls, start, &ns)) != WAIT_NONE) {
+		t = now_ns();
+		wait_for(ns);
+		t = (now_ns() - t) / 1000;
+		if (why == WAIT_FG) {
+			preempted = 1;
+			STAT_ADD(sched_preempt_us, t);
+		} else if (why == WAIT_IO)
+			STAT_ADD(sched_io_throttle_us, t);
+		else if (why == WAIT_CPU)
+			STAT_ADD(sched_cpu_throttle_us, t);
+	}
+	waited = (now_ns() - start) / 1000;
+	if (preempted) {
+		STAT_INC(sched_preempted);
+		//given up waiting for the foreground
+		if (!stopping && __atomic_load_n(&fg_active, __ATOMIC_RELAXED))
+			STAT_INC(sched_starved);
+	}
+	queued[cls]--;
+	running++;
+	jobs[cls]++;
+	wait_us[cls] += waited;
+	if (waited > wait_max_us[cls])
+		wait_max_us[cls] = waited;
+	//less urgent classes may be waiting on us
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &job->cpu);
+}
+
+void sched_bg_end(struct sched_job* job, size_t bytes)
+{
+	struct timespec now;
+	double cpu;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	cpu = (now.tv_sec - job->cpu.tv_sec) * 1e9 +
+		(now.tv_nsec - job->cpu.tv_nsec);
+	pthread_mutex_lock(&sched_lock);
+	refill();
+	if (io_rate > 0)
+		io_tokens -= bytes;
+	if (cpu_rate > 0)
+		cpu_tokens -= cpu;
+	running--;
+	pthread_mutex_unlock(&sched_lock);
+}
+
+static int sched_report(char* buf, size_t size)
+{
+	size_t len = 0;
+	int c, n;
+
+	pthread_mutex_lock(&sched_lock);
+	n = snprintf(buf, size, "sched_fg_active %d\nsched_bg_running %d\n",
+		     __atomic_load_n(&fg_active, __ATOMIC_RELAXED), running);
+	for (c = 0; c < SCHED_CLASSES && n >= 0; c++) {
+		len += n;
+		n = snprintf(buf + (len < size ? len : size),
+			     len < size ? size - len : 0,
+			     "sched_%s_queued %d\nsched_%s_jobs %llu\n"
+			     "sched_%s_wait_us %llu\nsched_%s_wait_max_us %llu\n",
+			     class_names[c], queued[c], class_names[c], jobs[c],
+			     class_names[c], wait_us[c], class_names[c],
+			     wait_max_us[c]);
+	}
+	pthread_mutex_unlock(&sched_lock);
+	return n < 0 ? -1 : (int) (len + n);
+}
+
+int sched_init(int idle_ms, int io_mb, int cpu_share)
+{
+	pthread_mutex_lock(&sched_lock);
+	stopping = 0;
+	idle_ns = idle_ms > 0 ? idle_ms * 1000000ULL : 0;
+	io_rate = io_mb > 0 ? io_mb * 1048576.0 : 0;
+	cpu_rate = cpu_share > 0 ? cpu_share * 1e7 : 0;
+	io_tokens = io_rate;
+	cpu_tokens = cpu_rate;
+	refilled = now_ns();
+	pthread_mutex_unlock(&sched_lock);
+	if (!registered && stats_register(sched_report))
+		return -1;
+	registered = 1;
+	return 0;
+}
+
+void sched_destroy(void)
+{
+	pthread_mutex_lock(&sched_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
@@ -0,0 +1,93 @@
+/* encfs-sched.h
+ * Foreground/background scheduling for pa4-encfs
+ *
+ * FUSE requests that move file data are foreground work and never wait
+ * here; they only mark themselves busy (SCHED_FOREGROUND). Background
+ * jobs (tier write-back, deferred encryption, pack compaction and chunk
+ * collection, key rotation, warm-up) ask to be admitted before each job.
+ * A job is held back
+ *	- while foreground requests are running or ran in the last idle_ms,
+ *	  for at most SCHED_STARVE_MS, so background work still trickles
+ *	  through under constant load,
+ *	- while a job of a more urgent class is waiting, and
+ *	- while the disk or CPU token bucket is in debt.
+ * Jobs are charged the backing bytes they moved and the CPU time their
+ * thread used once they are done, so one big job delays the next ones
+ * instead of being cut up. Preemption is at job boundaries: a running
+ * job holds file locks a foreground request may need, so it is never
+ * paused halfway.
+ *
+ * Admission must be asked for with no file lock held.
+ *
+ */
+
+#ifndef ENCFS_SCHED_H
+#define ENCFS_SCHED_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* background classes, most urgent first */
+enum sched_class {
+	SCHED_FLUSH,	/* dirty tier blocks to the mirror */
+	SCHED_ENCRYPT,	/* deferred encryption of new files */
+	SCHED_COMPACT,	/* pack compaction, unused chunk collection */
+	SCHED_REKEY,	/* key rotation */
+	SCHED_WARMUP,	/* mount time warm-up */
+	SCHED_CLASSES
+};
+
+/* longest a background job waits for the foreground to go idle */
+#define SCHED_STARVE_MS 1000
+
+struct sched_job {
+	struct timespec cpu;	/* thread CPU time when admitted */
+};
+
+/* int sched_init(int idle_ms, int io_mb, int cpu_share)
+ * Purpose: Set the scheduling limits and register the stats reporter
+ * Args: int idle_ms   : How long the foreground must have been idle
+ *                       before a background job starts (0 = no preemption)
+ *       int io_mb     : Background disk bandwidth in MB/s (0 = unlimited)
+ *       int cpu_share : Background CPU time in percent of one CPU
+ *                       (0 = unlimited)
+ * Return: 0 on success, -1 on error
+ */
+extern int sched_init(int idle_ms, int io_mb, int cpu_share);
+
+/* void sched_destroy(void)
+ * Purpose: Admit every waiting and future job at once, so background
+ *          work drains at full speed on unmount
+ */
+extern void sched_destroy(void);
+
+/* void sched_fg_begin(void)
+ * Purpose: A foreground request starts, use SCHED_FOREGROUND instead
+ */
+extern void sched_fg_begin(void);
+
+/* void sched_fg_end(int* unused)
+ * Purpose: A foreground request is done, use SCHED_FOREGROUND instead
+ */
+extern void sched_fg_end(int* unused);
+
+/* void sched_bg_begin(struct sched_job* job, enum sched_class cls)
+ * Purpose: Wait until a background job of class cls may run
+ * Args: struct sched_job* job : Filled in, passed to sched_bg_end()
+ */
+extern void sched_bg_begin(struct sched_job* job, enum sched_class cls);
+
+/* void sched_bg_end(struct sched_job* job, size_t bytes)
+ * Purpose: Charge a finished job to the token buckets
+ * Args: size_t bytes : Backing bytes it read and wrote
+ */
+extern void sched_bg_end(struct sched_job* job, size_t bytes);
+
+/* Marks the rest of the enclosing scope as a foreground request:
+ *	SCHED_FOREGROUND;
+ */
+#define SCHED_FOREGROUND						\
+	int sched_fg_scope __attribute__((cleanup(sched_fg_end))) =	\
+		(sched_fg_begin(), 0)
+
+#endif
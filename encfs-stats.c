@@ -0,0 +1,74 @@
+/* encfs-stats.c
+ * Run time counters for pa4-encfs
+ *
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "encfs-stats.h"
+
+#define MAX_REPORTERS 16
+
+unsigned long long encfs_stats[STAT_MAX];
+
+static const char* stat_names[STAT_MAX] = {
+#define STAT_NAME(name, desc) #name,
+	ENCFS_STATS(STAT_NAME)
+#undef STAT_NAME
+};
+
+static int (*reporters[MAX_REPORTERS])(char* buf, size_t size);
+static int nreporters;
+static pthread_mutex_t reporters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int stats_register(int (*fn)(char* buf, size_t size))
+{
+	int res = -1;
+
+	pthread_mutex_lock(&reporters_lock);
+	if (nreporters < MAX_REPORTERS) {
+		reporters[nreporters++] = fn;
+		res = 0;
+	}
+	pthread_mutex_unlock(&reporters_lock);
+	return res;
+}
+
+//appends to buf while there is room, but always counts the full length
+#define APPEND(...) do {						\
+		int n_ = snprintf(len < size ? buf + len : NULL,	\
+				  len < size ? size - len : 0, __VA_ARGS__); \
+		if (n_ > 0)						\
+			len += n_;					\
+	} while (0)
+
+int stats_format(char* buf, size_t size)
+{
+	size_t len = 0;
+	unsigned long long hits, done;
+	int i;
+
+	for (i = 0; i < STAT_MAX; i++)
+		APPEND("%s %llu\n", stat_names[i],
+		       __atomic_load_n(&encfs_stats[i], __ATOMIC_RELAXED));
+
+	//derived ratios, in percent
+	hits = STAT_GET(prefetch_hits);
+	done = STAT_GET(prefetch_done);
+	APPEND("prefetch_hit_pct %llu\n", done ? hits * 100 / done : 0);
+	APPEND("prefetch_waste_pct %llu\n",
+	       done ? STAT_GET(prefetch_wasted) * 100 / done : 0);
+
+	pthread_mutex_lock(&reporters_lock);
+	for (i = 0; i < nreporters; i++) {
+		char tmp[1024];
+		int n = reporters[i](tmp, sizeof(tmp));
+
+		if (n > 0)
+			APPEND("%.*s", n < (int) sizeof(tmp) ? n : (int) sizeof(tmp) - 1, tmp);
+	}
+	pthread_mutex_unlock(&reporters_lock);
+
+	return len;
+}
@@ -0,0 +1,126 @@
+/* encfs-stats.h
+ * Run time counters for pa4-encfs
+ *
+ * Counters are 64 bit integers bumped with relaxed atomic adds, so FUSE
+ * and background threads can update them without taking a lock. The
+ * current values can be read from a mounted filesystem with
+ *	getfattr -n user.pa4-encfs.stats <mount point>
+ * and are printed to stderr when the filesystem is unmounted.
+ *
+ */
+
+#ifndef ENCFS_STATS_H
+#define ENCFS_STATS_H
+
+#include <stddef.h>
+
+/* name, description */
+#define ENCFS_STATS(X)							\
+	X(enc_reads,		"reads of encrypted files")		\
+	X(cache_hits,		"plaintext cache block hits")		\
+	X(cache_misses,		"plaintext cache block misses")		\
+	X(cache_evictions,	"plaintext cache blocks evicted")	\
+	X(seq_streams,		"sequential read streams detected")	\
+	X(prefetch_issued,	"blocks queued for decrypt-ahead")	\
+	X(prefetch_done,	"blocks decrypted ahead")		\
+	X(prefetch_hits,	"reads served by a decrypted-ahead block") \
+	X(prefetch_wasted,	"decrypted-ahead blocks never read")	\
+	X(prefetch_cancelled,	"queued blocks dropped on seek/close")	\
+	X(prefetch_dropped,	"blocks not queued, queue full")	\
+	X(lock_shared,		"shared file locks taken")		\
+	X(lock_excl,		"exclusive file locks taken")		\
+	X(lock_contended,	"file locks that had to wait")		\
+	X(lock_wait_us,		"total time spent waiting for file locks") \
+	X(commit_requests,	"fsync/fdatasync calls")		\
+	X(commit_flushes,	"group commit flushes of the backing fs") \
+	X(commit_wait_us,	"total time fsync callers waited")	\
+	X(intent_records,	"chunk rewrites logged before going in place") \
+	X(intent_bytes,		"bytes appended to the intent log")	\
+	X(intent_flushes,	"intent log flushes, shared by concurrent writers") \
+	X(intent_replayed,	"logged rewrites finished again at mount") \
+	X(aside_writes,		"encrypted rewrites committed by rename") \
+	X(fmt_hole_reads,	"chunks read back as holes, not decrypted") \
+	X(fmt_hole_writes,	"zero chunks stored as holes")		\
+	X(fmt_converted,	"do_crypt files converted to chunked")	\
+	X(fmt_auth_failures,	"chunks that failed to authenticate")	\
+	X(fmt_crc_failures,	"chunks that failed their checksum")	\
+	X(stripe_parallel_ios,	"stripe I/Os handed to the pool")	\
+	X(arena_maps,		"buffer blocks mapped")			\
+	X(arena_unlocked,	"buffer blocks that could not be mlocked") \
+	X(arena_oversize,	"one-off buffers bigger than any block")	\
+	X(meta_hits,		"getattr answered from the metadata cache") \
+	X(meta_misses,		"getattr that had to probe the file")	\
+	X(warmup_dirs,		"directories scanned by the warm-up")	\
+	X(warmup_files,		"files whose metadata was warmed up")	\
+	X(warmup_prefetched,	"blocks decrypted into the cache by the warm-up") \
+	X(warmup_throttle_us,	"time the warm-up slept to stay in budget") \
+	X(tier_hits,		"local cache tier block hits")		\
+	X(tier_misses,		"local cache tier blocks read from the mirror") \
+	X(tier_evictions,	"local cache tier blocks evicted")	\
+	X(tier_stale,		"files whose tier blocks were dropped, mirror changed") \
+	X(tier_write_back,	"bytes written to the tier, mirror write deferred") \
+	X(tier_flushed,		"dirty tier blocks written to the mirror") \
+	X(trace_events,		"spans written to trace files")		\
+	X(trace_dropped,	"spans lost, per-thread trace ring full") \
+	X(defer_staged,		"new files left pending, encryption deferred") \
+	X(defer_encrypted,	"pending files encrypted in the background") \
+	X(defer_failures,	"pending files that could not be encrypted") \
+	X(rekey_files,		"files rewritten with the current key")	\
+	X(rekey_bytes,		"plaintext bytes rewritten with the current key") \
+	X(rekey_skipped,	"hard linked files left on an old key")	\
+	X(rekey_failures,	"files that could not be rewritten")	\
+	X(rekey_throttle_us,	"time key rotation slept to stay in its share") \
+	X(pack_reads,		"packed file records read")		\
+	X(pack_writes,		"packed file records written")		\
+	X(pack_promotions,	"packed files moved out to chunked files") \
+	X(pack_compactions,	"packs compacted and deleted")		\
+	X(pack_compacted_bytes,	"live record bytes copied by compaction") \
+	X(dedup_stored,		"new chunks sealed into the chunk store") \
+	X(dedup_hits,		"chunk writes that found the chunk stored") \
+	X(dedup_hit_bytes,	"plaintext bytes not encrypted or written, already stored") \
+	X(dedup_freed,		"chunks that lost their last reference") \
+	X(dedup_freed_bytes,	"bytes of chunks that lost their last reference") \
+	X(dedup_compactions,	"chunk containers compacted and deleted") \
+	X(dedup_compacted_bytes, "live chunk bytes copied by compaction") \
+	X(sched_fg_requests,	"foreground requests seen by the scheduler") \
+	X(sched_preempted,	"background jobs held back for foreground requests") \
+	X(sched_starved,	"background jobs let through under foreground load") \
+	X(sched_preempt_us,	"time background jobs waited for the foreground") \
+	X(sched_io_throttle_us,	"time background jobs waited for disk tokens") \
+	X(sched_cpu_throttle_us, "time background jobs waited for CPU tokens") \
+	X(record_entries,	"ops written to the capture file")	\
+	X(record_dropped,	"ops lost, per-thread capture ring full")
+
+enum stat_id {
+#define STAT_ENUM(name, desc) STAT_##name,
+	ENCFS_STATS(STAT_ENUM)
+#undef STAT_ENUM
+	STAT_MAX
+};
+
+extern unsigned long long encfs_stats[STAT_MAX];
+
+#define STAT_ADD(name, n) \
+	__atomic_add_fetch(&encfs_stats[STAT_##name], (n), __ATOMIC_RELAXED)
+#define STAT_INC(name) STAT_ADD(name, 1)
+#define STAT_GET(name) \
+	__atomic_load_n(&encfs_stats[STAT_##name], __ATOMIC_RELAXED)
+
+/* int stats_register(int (*fn)(char* buf, size_t size))
+ * Purpose: Add a reporter for values that are not plain counters
+ *          (occupancy, progress, ...). Reporters append "name value" lines.
+ * Args: fn : Called with the free space left in the output buffer,
+ *            returns the number of bytes it wrote
+ * Return: 0 on success, -1 if the reporter table is full
+ */
+extern int stats_register(int (*fn)(char* buf, size_t size));
+
+/* int stats_format(char* buf, size_t size)
+ * Purpose: Render all counters and reporters as "name value" lines
+ * Args: char* buf   : Output buffer, may be NULL when size is 0
+ *       size_t size : Size of buf
+ * Return: Length of the full report (may exceed size, like snprintf)
+ */
+extern int stats_format(char* buf, size_t size);
+
+#endif
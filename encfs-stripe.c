@@ -0,0 +1,277 @@
+/* encfs-stripe.c
+ * Striping of chunked files across several mirror directories
+ *
+ * A stripe_parallel() call is a batch; its calls are queued one job each
+ * and the batch counts down as the pool (and the caller, which keeps
+ * taking jobs while it waits) finishes them.
+ *
+ */
+
+/* For syncfs() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-stats.h"
+#include "encfs-stripe.h"
+
+#define STRIPE_DIR "/.pa4-encfs/stripes"
+
+struct stripe_batch {
+	void (*fn)(void* arg, int i);
+	void* arg;
+	int left;
+};
+
+struct stripe_job {
+	struct stripe_batch* batch;
+	int i;
+	struct stripe_job* next;
+};
+
+static char* roots[STRIPE_MAX];
+/* stripe directories of the extra roots, for syncfs() */
+static int rootfds[STRIPE_MAX];
+static int nroots = 1;
+static int unit_chunks;
+
+static pthread_t workers[STRIPE_MAX];
+static int nworkers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct stripe_job* queue;
+static int stopping;
+
+static void run_job(struct stripe_job* j)
+{
+	j->batch->fn(j->batch->arg, j->i);
+	pthread_mutex_lock(&pool_lock);
+	if (--j->batch->left == 0)
+		pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+//takes the next queued job, called with pool_lock held
+static struct stripe_job* take_job(void)
+{
+	struct stripe_job* j = queue;
+
+	if (j)
+		queue = j->next;
+	return j;
+}
+
+static void* worker(void* arg)
+{
+	struct stripe_job* j;
+
+	(void) arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!queue && !stopping)
+			pthread_cond_wait(&work_cond, &pool_lock);
+		if (stopping)
+			break;
+		j = take_job();
+		pthread_mutex_unlock(&pool_lock);
+		run_job(j);
+		pthread_mutex_lock(&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+void stripe_parallel(int n, void (*fn)(void* arg, int i), void* arg)
+{
+	struct stripe_job jobs[64];
+	struct stripe_batch batch;
+	struct stripe_job* j;
+	int i;
+
+	if (n <= 1 || !nworkers || n > (int) (sizeof(jobs) / sizeof(*jobs))) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	batch.fn = fn;
+	batch.arg = arg;
+	batch.left = n - 1;
+	pthread_mutex_lock(&pool_lock);
+	for (i = n - 1; i > 0; i--) {
+		jobs[i].batch = &batch;
+		jobs[i].i = i;
+		jobs[i].next = queue;
+		queue = &jobs[i];
+	}
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+	STAT_ADD(stripe_parallel_ios, n - 1);
+
+	fn(arg, 0);
+	//help out rather than sleep while jobs are still queued
+	pthread_mutex_lock(&pool_lock);
+	while (batch.left) {
+		j = take_job();
+		if (!j) {
+			pthread_cond_wait(&done_cond, &pool_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		run_job(j);
+		pthread_mutex_lock(&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int mkdirs(const char* root)
+{
+	char path[PATH_MAX];
+	char* p;
+
+	if (snprintf(path, sizeof(path), "%s%s", root, STRIPE_DIR) >= (int) sizeof(path))
+		return -1;
+	for (p = path + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+int stripe_init(const char* const* extra, int n, int unit)
+{
+	int i;
+
+	if (n <= 0)
+		return 0;
+	if (n >= STRIPE_MAX || unit <= 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		char dir[PATH_MAX];
+
+		roots[i + 1] = strdup(extra[i]);
+		if (!roots[i + 1] || mkdirs(roots[i + 1]))
+			return -1;
+		snprintf(dir, sizeof(dir), "%s%s", roots[i + 1], STRIPE_DIR);
+		rootfds[i + 1] = open(dir, O_RDONLY | O_DIRECTORY);
+		if (rootfds[i + 1] == -1)
+			return -1;
+	}
+	nroots = n + 1;
+	unit_chunks = unit;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&workers[nworkers], NULL, worker, NULL))
+			break;
+		nworkers++;
+	}
+	return 0;
+}
+
+void stripe_destroy(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	nworkers = 0;
+}
+
+int stripe_count(void)
+{
+	return nroots;
+}
+
+int stripe_unit(void)
+{
+	return unit_chunks;
+}
+
+static void sync_root(void* arg, int i)
+{
+	int* err = arg;
+
+	if (syncfs(rootfds[i + 1]) == -1)
+		err[i] = errno;
+}
+
+int stripe_syncfs(void)
+{
+	int err[STRIPE_MAX] = { 0 };
+	int i;
+
+	//each root is likely a disk of its own, flush them side by side
+	stripe_parallel(nroots - 1, sync_root, err);
+	for (i = 0; i < nroots - 1; i++)
+		if (err[i])
+			return -err[i];
+	return 0;
+}
+
+static int stripe_path(char path[PATH_MAX], const unsigned char nonce[8], int k)
+{
+	if (k <= 0 || k >= nroots || !roots[k]) {
+		errno = ENODEV;
+		return -1;
+	}
+	snprintf(path, PATH_MAX, "%s%s/%02x%02x%02x%02x%02x%02x%02x%02x.%d",
+		 roots[k], STRIPE_DIR, nonce[0], nonce[1], nonce[2], nonce[3],
+		 nonce[4], nonce[5], nonce[6], nonce[7], k);
+	return 0;
+}
+
+int stripe_open(const unsigned char nonce[8], int k, int flags)
+{
+	char path[PATH_MAX];
+
+	if (stripe_path(path, nonce, k))
+		return -1;
+	return open(path, flags, 0600);
+}
+
+int stripe_fdatasync(const unsigned char nonce[8], int n)
+{
+	int k, fd, res = 0;
+
+	for (k = 1; k < n && !res; k++) {
+		fd = stripe_open(nonce, k, O_RDONLY);
+		if (fd == -1) {
+			//a stripe the file never reached
+			if (errno != ENOENT)
+				res = -errno;
+			continue;
+		}
+		//a new stripe file's name has to last as well
+		if (fdatasync(fd) == -1 || fsync(rootfds[k]) == -1)
+			res = -errno;
+		close(fd);
+	}
+	return res;
+}
+
+void stripe_unlink(const unsigned char nonce[8], int n)
+{
+	char path[PATH_MAX];
+	int k;
+
+	for (k = 1; k < n; k++)
+		if (stripe_path(path, nonce, k) == 0)
+			unlink(path);
+}
@@ -0,0 +1,81 @@
+/* encfs-stripe.h
+ * Striping of chunked files across several mirror directories
+ *
+ * The mirror directory given on the command line is the primary root: it
+ * holds the directory tree, the metadata and stripe 0 of every file.
+ * Extra roots (--stripe-root, ideally on other disks) hold the other
+ * stripes of files created while they were configured, in
+ * <root>/.pa4-encfs/stripes/<file nonce>. The roots have to be given in
+ * the same order on every mount.
+ *
+ * Stripe I/O of one request is spread over a pool with a thread per extra
+ * root, so each disk works on its part at the same time.
+ *
+ */
+
+#ifndef ENCFS_STRIPE_H
+#define ENCFS_STRIPE_H
+
+#include <sys/types.h>
+
+/* roots, the primary one included */
+#define STRIPE_MAX 8
+
+/* int stripe_init(const char* const* roots, int nroots, int unit)
+ * Purpose: Set up the extra roots and start the I/O pool
+ * Args: const char* const* roots : Extra roots (the primary one excluded),
+ *                                  absolute paths
+ *       int nroots               : Number of extra roots, 0 disables striping
+ *       int unit                 : Chunks per stripe unit for new files
+ * Return: 0 on success, -1 if a root is unusable
+ */
+extern int stripe_init(const char* const* roots, int nroots, int unit);
+
+/* void stripe_destroy(void)
+ * Purpose: Stop the I/O pool
+ */
+extern void stripe_destroy(void);
+
+/* int stripe_count(void)
+ * Purpose: Stripes of new files (1 if striping is off)
+ */
+extern int stripe_count(void);
+
+/* int stripe_unit(void)
+ * Purpose: Chunks per stripe unit of new files
+ */
+extern int stripe_unit(void);
+
+/* int stripe_open(const unsigned char nonce[8], int k, int flags)
+ * Purpose: open() stripe k (1 or more) of the file with the given nonce
+ * Args: int flags : open() flags, O_CREAT to create it
+ * Return: A descriptor, -1 with errno set (ENODEV if root k isn't mounted)
+ */
+extern int stripe_open(const unsigned char nonce[8], int k, int flags);
+
+/* int stripe_fdatasync(const unsigned char nonce[8], int n)
+ * Purpose: fdatasync() stripes 1 to n - 1 of a file and fsync() their
+ *          directories
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_fdatasync(const unsigned char nonce[8], int n);
+
+/* void stripe_unlink(const unsigned char nonce[8], int n)
+ * Purpose: Remove stripes 1 to n - 1 of a deleted file
+ */
+extern void stripe_unlink(const unsigned char nonce[8], int n);
+
+/* int stripe_syncfs(void)
+ * Purpose: syncfs() the filesystems of the extra roots, in parallel.
+ *          No-op without striping.
+ * Return: 0 on success, -errno of a root that failed
+ */
+extern int stripe_syncfs(void);
+
+/* void stripe_parallel(int n, void (*fn)(void* arg, int i), void* arg)
+ * Purpose: Run fn(arg, 0) .. fn(arg, n - 1) on the pool (the caller runs
+ *          one of them) and wait until all have returned
+ */
+extern void stripe_parallel(int n, void (*fn)(void* arg, int i), void* arg);
+
+#endif
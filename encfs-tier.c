@@ -0,0 +1,955 @@
+/* encfs-tier.c
+ * Local ciphertext cache in front of a slow mirror directory
+ *
+ * Each cached backing file has a sparse cache file named after its
+ * (dev, ino), holding its cached blocks at their own offsets. The index
+ * (which blocks are there, which are dirty) only lives in memory, so the
+ * cache directory is emptied on every mount.
+ *
+ * Locking: a file's lock covers its stamp and the contents of its cache
+ * file, tier_lock covers the table, the block index, the LRU list and the
+ * counters. tier_lock is always taken last; eviction only trylocks the
+ * files it takes blocks from. Dirty blocks are never evicted.
+ *
+ */
+
+/* For fallocate() and O_DIRECT */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "encfs-arena.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-tier.h"
+
+#define TIER_DIR "/.pa4-encfs-tier"
+#define TIER_FLUSH_MS 1000
+/* files with dirty blocks hold a descriptor each, past this many further
+ * files are written through */
+#define MAX_DIRTY_FILES 256
+#define FILE_BUCKETS 1024
+/* dirty data is tracked, and written back, in pages, so that the holes
+ * of a backing file aren't filled with the zeros around a write */
+#define TIER_PAGE 4096
+
+struct tier_file;
+
+struct tier_block {
+	struct tier_file* file;
+	off_t idx;
+	unsigned int dirty;		/* bitmap of pages to write back */
+	struct tier_block* hnext;	/* block index chain */
+	struct tier_block* lprev;	/* LRU, head is the most recent */
+	struct tier_block* lnext;
+	struct tier_block* fnext;	/* the file's blocks */
+	struct tier_block* fprev;
+};
+
+struct tier_file {
+	dev_t dev;
+	ino_t ino;
+	pthread_mutex_t lock;
+	/* backing file as we last left it */
+	struct timespec mtime;
+	off_t size;
+	struct tier_block* blocks;
+	size_t cached;
+	size_t dirty;
+	/* backing descriptor for the flusher, while blocks are dirty */
+	int bfd;
+	int refs;
+	struct tier_file* next;
+};
+
+static char* tier_dir;
+static size_t max_blocks;
+static int write_back;
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tier_file* files[FILE_BUCKETS];
+static struct tier_block** bindex;	/* (file, block) -> block */
+static size_t nindex;
+static struct tier_block* lru_head;
+static struct tier_block* lru_tail;
+static size_t used;
+static size_t dirty_blocks;
+static int dirty_files;
+
+static pthread_t flusher;
+static int flusher_running;
+static int stopping;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t file_hash(dev_t dev, ino_t ino)
+{
+	return ((unsigned long) ino * 0x9e3779b97f4a7c15UL) ^ (unsigned long) dev;
+}
+
+static size_t block_hash(const struct tier_file* f, off_t idx)
+{
+	return (file_hash(f->dev, f->ino) + (unsigned long) idx * 0x9e3779b97f4a7c15UL) % nindex;
+}
+
+static int cache_open(const struct tier_file* f)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%lx-%lx", tier_dir,
+		 (unsigned long) f->dev, (unsigned long) f->ino);
+	return open(path, O_RDWR | O_CREAT, 0600);
+}
+
+static void cache_unlink(const struct tier_file* f)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%lx-%lx", tier_dir,
+		 (unsigned long) f->dev, (unsigned long) f->ino);
+	unlink(path);
+}
+
+//pread/pwrite all of len, returns bytes done (short at end of file) or -1
+static ssize_t io_full(int fd, void* buf, size_t len, off_t off, int wr)
+{
+	size_t done = 0;
+	ssize_t res = 0;
+
+	while (done < len) {
+		res = wr ? pwrite(fd, (char*) buf + done, len - done, off + done) :
+			   pread(fd, (char*) buf + done, len - done, off + done);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+	if (res < 0 && done == 0)
+		return -1;
+	return done;
+}
+
+static void zero_cache(int cfd, off_t off, off_t len)
+{
+	static const char zeros[4096];
+	off_t n;
+
+	if (fallocate(cfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return;
+	for (; len > 0; off += n, len -= n) {
+		n = len < (off_t) sizeof(zeros) ? len : (off_t) sizeof(zeros);
+		if (pwrite(cfd, zeros, n, off) != n)
+			return;
+	}
+}
+
+//pages of a block that [in, in + n) touches
+static unsigned int page_mask(size_t in, size_t n)
+{
+	unsigned int first = in / TIER_PAGE, last = (in + n - 1) / TIER_PAGE;
+
+	return (last + 1 < 32 ? (1u << (last + 1)) - 1 : ~0u) & ~((1u << first) - 1);
+}
+
+static void stamp(struct tier_file* f, const struct stat* st)
+{
+	f->mtime = st->st_mtim;
+	f->size = st->st_size;
+}
+
+static int stamp_ok(const struct tier_file* f, const struct stat* st)
+{
+	return f->size == st->st_size && f->mtime.tv_sec == st->st_mtim.tv_sec &&
+		f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* LRU and index, tier_lock held */
+
+static void lru_unlink(struct tier_block* b)
+{
+	if (b->lprev)
+		b->lprev->lnext = b->lnext;
+	else
+		lru_head = b->lnext;
+	if (b->lnext)
+		b->lnext->lprev = b->lprev;
+	else
+		lru_tail = b->lprev;
+}
+
+static void lru_push(struct tier_block* b)
+{
+	b->lprev = NULL;
+	b->lnext = lru_head;
+	if (lru_head)
+		lru_head->lprev = b;
+	lru_head = b;
+	if (!lru_tail)
+		lru_tail = b;
+}
+
+static struct tier_block* find_block(const struct tier_file* f, off_t idx)
+{
+	struct tier_block* b;
+
+	for (b = bindex[block_hash(f, idx)]; b; b = b->hnext)
+		if (b->file == f && b->idx == idx)
+			return b;
+	return NULL;
+}
+
+static void set_clean(struct tier_block* b)
+{
+	struct tier_file* f = b->file;
+
+	if (!b->dirty)
+		return;
+	b->dirty = 0;
+	dirty_blocks--;
+	if (--f->dirty == 0) {
+		close(f->bfd);
+		f->bfd = -1;
+		dirty_files--;
+	}
+}
+
+//the block's file lock is held too; cfd is its cache file or -1 if the
+//caller empties the cache file itself
+static void drop_block(struct tier_block* b, int cfd)
+{
+	struct tier_file* f = b->file;
+	struct tier_block** p;
+
+	for (p = &bindex[block_hash(f, b->idx)]; *p != b; p = &(*p)->hnext)
+		;
+	*p = b->hnext;
+	lru_unlink(b);
+	if (b->fprev)
+		b->fprev->fnext = b->fnext;
+	else
+		f->blocks = b->fnext;
+	if (b->fnext)
+		b->fnext->fprev = b->fprev;
+	set_clean(b);
+	used--;
+	f->cached--;
+	if (cfd != -1)
+		zero_cache(cfd, b->idx * TIER_BLOCK, TIER_BLOCK);
+	free(b);
+}
+
+static void file_free(struct tier_file* f)
+{
+	struct tier_file** p;
+
+	for (p = &files[file_hash(f->dev, f->ino) % FILE_BUCKETS]; *p != f; p = &(*p)->next)
+		;
+	*p = f->next;
+	cache_unlink(f);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+//takes the least recently used clean block that nobody is busy with,
+//returns 0 if there is none
+static int evict_one(struct tier_file* self, int self_cfd)
+{
+	struct tier_block* b;
+	struct tier_file* f;
+	int cfd;
+
+	for (b = lru_tail; b; b = b->lprev) {
+		f = b->file;
+		if (b->dirty || (f != self && pthread_mutex_trylock(&f->lock)))
+			continue;
+		cfd = f == self ? self_cfd : cache_open(f);
+		drop_block(b, cfd);
+		STAT_INC(tier_evictions);
+		if (f != self) {
+			if (cfd != -1)
+				close(cfd);
+			pthread_mutex_unlock(&f->lock);
+			if (!f->cached && !f->refs)
+				file_free(f);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Files */
+
+static struct tier_file* file_get(dev_t dev, ino_t ino, int create)
+{
+	struct tier_file* f;
+	size_t h = file_hash(dev, ino) % FILE_BUCKETS;
+
+	pthread_mutex_lock(&tier_lock);
+	for (f = files[h]; f; f = f->next)
+		if (f->dev == dev && f->ino == ino)
+			break;
+	if (!f && create && (f = calloc(1, sizeof(*f))) != NULL) {
+		f->dev = dev;
+		f->ino = ino;
+		f->bfd = -1;
+		pthread_mutex_init(&f->lock, NULL);
+		f->next = files[h];
+		files[h] = f;
+	}
+	if (f)
+		f->refs++;
+	pthread_mutex_unlock(&tier_lock);
+	return f;
+}
+
+static void file_put(struct tier_file* f)
+{
+	pthread_mutex_lock(&tier_lock);
+	if (--f->refs == 0 && !f->cached)
+		file_free(f);
+	pthread_mutex_unlock(&tier_lock);
+}
+
+//file lock held
+static void drop_all(struct tier_file* f, int cfd)
+{
+	pthread_mutex_lock(&tier_lock);
+	while (f->blocks)
+		drop_block(f->blocks, -1);
+	pthread_mutex_unlock(&tier_lock);
+	if (cfd != -1 && ftruncate(cfd, 0) == -1)
+		perror("tier");
+}
+
+//file lock held; forgets what was read from the backing file if it
+//changed under us. Dirty blocks are newer than that and stay.
+static void check(struct tier_file* f, const struct stat* st, int cfd)
+{
+	struct tier_block* b;
+	struct tier_block* next;
+
+	if (f->cached && !stamp_ok(f, st)) {
+		STAT_INC(tier_stale);
+		if (!f->dirty) {
+			drop_all(f, cfd);
+		} else {
+			pthread_mutex_lock(&tier_lock);
+			for (b = f->blocks; b; b = next) {
+				next = b->fnext;
+				if (!b->dirty)
+					drop_block(b, cfd);
+			}
+			pthread_mutex_unlock(&tier_lock);
+		}
+	}
+	stamp(f, st);
+}
+
+//file lock held; NULL if there is no room
+static struct tier_block* add_block(struct tier_file* f, off_t idx, int cfd)
+{
+	struct tier_block* b;
+	size_t h;
+
+	pthread_mutex_lock(&tier_lock);
+	while (used >= max_blocks)
+		if (!evict_one(f, cfd))
+			break;
+	b = used < max_blocks ? calloc(1, sizeof(*b)) : NULL;
+	if (b) {
+		b->file = f;
+		b->idx = idx;
+		h = block_hash(f, idx);
+		b->hnext = bindex[h];
+		bindex[h] = b;
+		lru_push(b);
+		b->fnext = f->blocks;
+		if (f->blocks)
+			f->blocks->fprev = b;
+		f->blocks = b;
+		used++;
+		f->cached++;
+	}
+	pthread_mutex_unlock(&tier_lock);
+	return b;
+}
+
+//file lock held
+static struct tier_block* lookup(struct tier_file* f, off_t idx)
+{
+	struct tier_block* b;
+
+	pthread_mutex_lock(&tier_lock);
+	b = find_block(f, idx);
+	if (b) {
+		lru_unlink(b);
+		lru_push(b);
+	}
+	pthread_mutex_unlock(&tier_lock);
+	return b;
+}
+
+//file lock held; writes the dirty blocks back, returns 0 or -errno
+static int flush_file(struct tier_file* f, int cfd)
+{
+	struct tier_block* b;
+	struct stat st;
+	char* buf;
+	off_t start, end;
+	int bfd, p, q, res = 0;
+
+	if (!f->dirty)
+		return 0;
+	//f->bfd goes when the last block is clean, we still need it after
+	bfd = dup(f->bfd);
+	if (cfd == -1 || bfd == -1 || fstat(bfd, &st) == -1) {
+		if (bfd != -1)
+			close(bfd);
+		return -EIO;
+	}
+	buf = arena_get(TIER_BLOCK);
+	if (!buf) {
+		close(bfd);
+		return -ENOMEM;
+	}
+	for (b = f->blocks; b; b = b->fnext) {
+		if (!b->dirty)
+			continue;
+		//runs of dirty pages, cut at the end of the file
+		for (p = 0; p < TIER_BLOCK / TIER_PAGE; p = q) {
+			for (; p < TIER_BLOCK / TIER_PAGE && !(b->dirty & 1u << p); p++)
+				;
+			for (q = p; q < TIER_BLOCK / TIER_PAGE && (b->dirty & 1u << q); q++)
+				;
+			start = b->idx * TIER_BLOCK + (off_t) p * TIER_PAGE;
+			end = b->idx * TIER_BLOCK + (off_t) q * TIER_PAGE;
+			if (end > st.st_size)
+				end = st.st_size;
+			if (start < end &&
+			    (io_full(cfd, buf, end - start, start, 0) != end - start ||
+			     io_full(bfd, buf, end - start, start, 1) != end - start))
+				break;
+		}
+		if (p < TIER_BLOCK / TIER_PAGE) {
+			res = -EIO;
+			continue;
+		}
+		STAT_INC(tier_flushed);
+		pthread_mutex_lock(&tier_lock);
+		set_clean(b);
+		pthread_mutex_unlock(&tier_lock);
+	}
+	arena_put(buf, TIER_BLOCK);
+	//our own writes moved the mtime
+	if (fstat(bfd, &st) == 0)
+		stamp(f, &st);
+	close(bfd);
+	return res;
+}
+
+static int flush_some(void)
+{
+	struct tier_file* batch[64];
+	struct sched_job job;
+	struct tier_file* f;
+	int n = 0, i, cfd;
+	size_t moved;
+	size_t h;
+
+	pthread_mutex_lock(&tier_lock);
+	for (h = 0; h < FILE_BUCKETS && n < 64; h++) {
+		for (f = files[h]; f && n < 64; f = f->next) {
+			if (f->dirty) {
+				f->refs++;
+				batch[n++] = f;
+			}
+		}
+	}
+	pthread_mutex_unlock(&tier_lock);
+
+	for (i = 0; i < n; i++) {
+		f = batch[i];
+		sched_bg_begin(&job, SCHED_FLUSH);
+		pthread_mutex_lock(&f->lock);
+		//read from the tier, written to the mirror
+		pthread_mutex_lock(&tier_lock);
+		moved = 2 * f->dirty * (size_t) TIER_BLOCK;
+		pthread_mutex_unlock(&tier_lock);
+		cfd = cache_open(f);
+		flush_file(f, cfd);
+		if (cfd != -1)
+			close(cfd);
+		pthread_mutex_unlock(&f->lock);
+		file_put(f);
+		sched_bg_end(&job, moved);
+	}
+	return n;
+}
+
+static void* flush_thread(void* arg)
+{
+	struct timespec ts;
+
+	(void) arg;
+	pthread_mutex_lock(&tier_lock);
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TIER_FLUSH_MS / 1000;
+		ts.tv_nsec += (TIER_FLUSH_MS % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&flush_cond, &tier_lock, &ts);
+		if (stopping || !dirty_files)
+			continue;
+		pthread_mutex_unlock(&tier_lock);
+		flush_some();
+		pthread_mutex_lock(&tier_lock);
+	}
+	pthread_mutex_unlock(&tier_lock);
+	return NULL;
+}
+
+static int tier_report(char* buf, size_t size)
+{
+	size_t u, d;
+
+	pthread_mutex_lock(&tier_lock);
+	u = used;
+	d = dirty_blocks;
+	pthread_mutex_unlock(&tier_lock);
+	return snprintf(buf, size, "tier_blocks %zu\ntier_dirty_blocks %zu\ntier_limit_blocks %zu\n",
+			u, d, max_blocks);
+}
+
+int tier_init(const char* dir, size_t size, int writeback)
+{
+	char path[PATH_MAX];
+	struct dirent* de;
+	DIR* dp;
+
+	if (snprintf(path, sizeof(path), "%s%s", dir, TIER_DIR) >= (int) sizeof(path))
+		return -1;
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -1;
+	//the bindex of an earlier mount is gone, so are its blocks
+	dp = opendir(path);
+	if (!dp)
+		return -1;
+	while ((de = readdir(dp)) != NULL)
+		if (de->d_name[0] != '.')
+			unlinkat(dirfd(dp), de->d_name, 0);
+	closedir(dp);
+
+	max_blocks = size / TIER_BLOCK;
+	if (max_blocks == 0)
+		return -1;
+	nindex = max_blocks;
+	bindex = calloc(nindex, sizeof(*bindex));
+	tier_dir = strdup(path);
+	if (!bindex || !tier_dir) {
+		free(bindex);
+		free(tier_dir);
+		bindex = NULL;
+		tier_dir = NULL;
+		return -1;
+	}
+	write_back = writeback;
+	if (write_back) {
+		if (pthread_create(&flusher, NULL, flush_thread, NULL))
+			write_back = 0;
+		else
+			flusher_running = 1;
+	}
+	stats_register(tier_report);
+	return 0;
+}
+
+void tier_destroy(void)
+{
+	struct tier_file* f;
+	size_t h;
+	int cfd;
+
+	if (!tier_dir)
+		return;
+	pthread_mutex_lock(&tier_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&flush_cond);
+	pthread_mutex_unlock(&tier_lock);
+	if (flusher_running)
+		pthread_join(flusher, NULL);
+
+	for (h = 0; h < FILE_BUCKETS; h++) {
+		while ((f = files[h]) != NULL) {
+			pthread_mutex_lock(&f->lock);
+			cfd = cache_open(f);
+			if (flush_file(f, cfd))
+				fprintf(stderr, "tier: lost dirty blocks of inode %lu\n",
+					(unsigned long) f->ino);
+			drop_all(f, -1);
+			if (cfd != -1)
+				close(cfd);
+			pthread_mutex_unlock(&f->lock);
+			pthread_mutex_lock(&tier_lock);
+			file_free(f);
+			pthread_mutex_unlock(&tier_lock);
+		}
+	}
+	free(bindex);
+	bindex = NULL;
+	rmdir(tier_dir);
+	free(tier_dir);
+	tier_dir = NULL;
+}
+
+//the entry of fd's file, locked, and a stat taken under the lock (the
+//flusher moves the mtime)
+static struct tier_file* file_locked(int fd, struct stat* st, int create)
+{
+	struct tier_file* f;
+
+	if (fstat(fd, st) == -1 || !(f = file_get(st->st_dev, st->st_ino, create)))
+		return NULL;
+	pthread_mutex_lock(&f->lock);
+	if (fstat(fd, st) == -1) {
+		pthread_mutex_unlock(&f->lock);
+		file_put(f);
+		return NULL;
+	}
+	return f;
+}
+
+//O_DIRECT descriptors bypass the cache, after anything cached for the
+//file has been written back and dropped
+static int bypass(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	struct stat st;
+
+	if (flags == -1 || !(flags & O_DIRECT))
+		return 0;
+	if (fstat(fd, &st) == 0)
+		tier_invalidate(st.st_dev, st.st_ino);
+	return 1;
+}
+
+ssize_t tier_pread(int fd, void* buf, size_t len, off_t off)
+{
+	struct tier_file* f;
+	struct tier_block* b;
+	struct stat st;
+	char* blk = NULL;
+	size_t done = 0;
+	int cfd, err = 0;
+
+	if (!tier_dir || bypass(fd) || !(f = file_locked(fd, &st, 1)))
+		return pread(fd, buf, len, off);
+	cfd = cache_open(f);
+	if (cfd == -1) {
+		pthread_mutex_unlock(&f->lock);
+		file_put(f);
+		return pread(fd, buf, len, off);
+	}
+	check(f, &st, cfd);
+	if (off >= st.st_size)
+		len = 0;
+	else if (len > (size_t) (st.st_size - off))
+		len = st.st_size - off;
+
+	while (done < len) {
+		off_t pos = off + done;
+		off_t idx = pos / TIER_BLOCK;
+		size_t in = pos - idx * TIER_BLOCK;
+		size_t n = TIER_BLOCK - in < len - done ? TIER_BLOCK - in : len - done;
+		ssize_t got;
+
+		if (lookup(f, idx)) {
+			if (io_full(cfd, (char*) buf + done, n, pos, 0) != (ssize_t) n) {
+				err = 1;
+				break;
+			}
+			STAT_INC(tier_hits);
+			done += n;
+			continue;
+		}
+		STAT_INC(tier_misses);
+		if (!blk && !(blk = arena_get(TIER_BLOCK))) {
+			errno = ENOMEM;
+			err = 1;
+			break;
+		}
+		got = io_full(fd, blk, TIER_BLOCK, idx * TIER_BLOCK, 0);
+		if (got <= (ssize_t) in) {
+			err = got < 0;
+			break;
+		}
+		memset(blk + got, 0, TIER_BLOCK - got);
+		if (n > (size_t) got - in)
+			n = got - in;
+		memcpy((char*) buf + done, blk + in, n);
+		done += n;
+
+		b = add_block(f, idx, cfd);
+		if (b && io_full(cfd, blk, TIER_BLOCK, idx * TIER_BLOCK, 1) != TIER_BLOCK) {
+			pthread_mutex_lock(&tier_lock);
+			drop_block(b, cfd);
+			pthread_mutex_unlock(&tier_lock);
+		}
+	}
+
+	close(cfd);
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+	arena_put(blk, TIER_BLOCK);
+	return done || !err ? (ssize_t) done : -1;
+}
+
+//file lock held; keeps [off, off + len) as dirty blocks. Returns len, -1
+//on error or 0 if the blocks couldn't be had and the caller should write
+//through.
+static ssize_t write_back_range(struct tier_file* f, int fd, int cfd,
+				const struct stat* st, const char* buf,
+				size_t len, off_t off)
+{
+	struct tier_block* b;
+	char* blk = NULL;
+	size_t done = 0;
+	off_t end = off + len;
+	off_t live = end > st->st_size ? end : st->st_size;
+	ssize_t res = len;
+
+	while (done < len) {
+		off_t pos = off + done;
+		off_t idx = pos / TIER_BLOCK;
+		off_t start = idx * TIER_BLOCK;
+		size_t in = pos - start;
+		size_t n = TIER_BLOCK - in < len - done ? TIER_BLOCK - in : len - done;
+		off_t bend = start + TIER_BLOCK < live ? start + TIER_BLOCK : live;
+
+		b = lookup(f, idx);
+		if (!b) {
+			//a block partly written needs the rest of it first
+			if (!blk && !(blk = arena_get(TIER_BLOCK)))
+				goto through;
+			memset(blk, 0, TIER_BLOCK);
+			if ((pos > start || end < bend) && start < st->st_size &&
+			    io_full(fd, blk, TIER_BLOCK, start, 0) < 0)
+				goto through;
+			b = add_block(f, idx, cfd);
+			if (!b)
+				goto through;
+			if (io_full(cfd, blk, TIER_BLOCK, start, 1) != TIER_BLOCK) {
+				pthread_mutex_lock(&tier_lock);
+				drop_block(b, cfd);
+				pthread_mutex_unlock(&tier_lock);
+				goto through;
+			}
+		}
+		if (io_full(cfd, (char*) buf + done, n, pos, 1) != (ssize_t) n) {
+			pthread_mutex_lock(&tier_lock);
+			if (!b->dirty)
+				drop_block(b, cfd);
+			pthread_mutex_unlock(&tier_lock);
+			res = -1;
+			goto out;
+		}
+		pthread_mutex_lock(&tier_lock);
+		if (!b->dirty && f->bfd == -1) {
+			f->bfd = dup(fd);
+			if (f->bfd != -1)
+				dirty_files++;
+		}
+		if (f->bfd != -1) {
+			if (!b->dirty) {
+				f->dirty++;
+				dirty_blocks++;
+			}
+			b->dirty |= page_mask(in, n);
+		}
+		pthread_mutex_unlock(&tier_lock);
+		if (!b->dirty)
+			goto through;
+		done += n;
+	}
+	//only the data waits, the backing file grows now
+	if (end > st->st_size && ftruncate(fd, end) == -1)
+		res = -1;
+	goto out;
+
+through:
+	res = 0;
+out:
+	arena_put(blk, TIER_BLOCK);
+	return res;
+}
+
+ssize_t tier_pwrite(int fd, const void* buf, size_t len, off_t off)
+{
+	struct tier_file* f;
+	struct stat st;
+	ssize_t res = 0;
+	size_t done;
+	int cfd;
+
+	if (!tier_dir || bypass(fd) || !(f = file_locked(fd, &st, write_back)))
+		return pwrite(fd, buf, len, off);
+	cfd = cache_open(f);
+	if (cfd != -1)
+		check(f, &st, cfd);
+	else
+		drop_all(f, -1);
+
+	if (cfd != -1 && write_back && (f->dirty || dirty_files < MAX_DIRTY_FILES))
+		res = write_back_range(f, fd, cfd, &st, buf, len, off);
+	if (res == 0) {
+		res = io_full(fd, (void*) buf, len, off, 1);
+		//cached blocks in the range get the new data
+		for (done = 0; cfd != -1 && res > 0 && done < (size_t) res; ) {
+			off_t pos = off + done;
+			off_t idx = pos / TIER_BLOCK;
+			size_t n = (idx + 1) * TIER_BLOCK - pos;
+			struct tier_block* b;
+
+			if (n > res - done)
+				n = res - done;
+			b = lookup(f, idx);
+			if (b && io_full(cfd, (char*) buf + done, n, pos, 1) != (ssize_t) n) {
+				pthread_mutex_lock(&tier_lock);
+				drop_block(b, cfd);
+				pthread_mutex_unlock(&tier_lock);
+			}
+			done += n;
+		}
+	} else if (res > 0) {
+		STAT_ADD(tier_write_back, res);
+	}
+	if (fstat(fd, &st) == 0)
+		stamp(f, &st);
+
+	if (cfd != -1)
+		close(cfd);
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+
+	pthread_mutex_lock(&tier_lock);
+	if (dirty_blocks > max_blocks / 2)
+		pthread_cond_signal(&flush_cond);
+	pthread_mutex_unlock(&tier_lock);
+	return res;
+}
+
+int tier_ftruncate(int fd, off_t size)
+{
+	struct tier_file* f;
+	struct tier_block* b;
+	struct tier_block* next;
+	struct stat st;
+	int cfd, res;
+
+	if (!tier_dir || bypass(fd) || !(f = file_locked(fd, &st, 0)))
+		return ftruncate(fd, size);
+	cfd = cache_open(f);
+	check(f, &st, cfd);
+	//blocks past the new end go, the one holding it is cut
+	pthread_mutex_lock(&tier_lock);
+	for (b = f->blocks; b; b = next) {
+		next = b->fnext;
+		if (b->idx * TIER_BLOCK >= size)
+			drop_block(b, cfd);
+	}
+	b = size % TIER_BLOCK ? find_block(f, size / TIER_BLOCK) : NULL;
+	pthread_mutex_unlock(&tier_lock);
+	if (b && cfd != -1)
+		zero_cache(cfd, size, TIER_BLOCK - size % TIER_BLOCK);
+	res = ftruncate(fd, size);
+	if (fstat(fd, &st) == 0)
+		stamp(f, &st);
+	if (cfd != -1)
+		close(cfd);
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+	return res;
+}
+
+int tier_punch(int fd, off_t off, off_t len)
+{
+	struct tier_file* f;
+	struct stat st;
+	off_t idx;
+	int cfd, res;
+
+	if (!tier_dir || bypass(fd) || !(f = file_locked(fd, &st, 0)))
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+	cfd = cache_open(f);
+	check(f, &st, cfd);
+	res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+	//partly punched dirty pages are written back with the zeros
+	for (idx = off / TIER_BLOCK; res == 0 && cfd != -1 && idx * TIER_BLOCK < off + len; idx++) {
+		off_t a = idx * TIER_BLOCK > off ? idx * TIER_BLOCK : off;
+		off_t z = (idx + 1) * TIER_BLOCK < off + len ? (idx + 1) * TIER_BLOCK : off + len;
+
+		unsigned int whole;
+		struct tier_block* b = lookup(f, idx);
+
+		if (!b)
+			continue;
+		zero_cache(cfd, a, z - a);
+		//pages punched as a whole are holes now, nothing to write back
+		whole = (a + TIER_PAGE - 1) / TIER_PAGE < z / TIER_PAGE ?
+			page_mask((a + TIER_PAGE - 1) / TIER_PAGE * TIER_PAGE - idx * TIER_BLOCK,
+				  z / TIER_PAGE * TIER_PAGE - (a + TIER_PAGE - 1) / TIER_PAGE * TIER_PAGE) : 0;
+		pthread_mutex_lock(&tier_lock);
+		if (b->dirty && !(b->dirty & ~whole))
+			set_clean(b);
+		else
+			b->dirty &= ~whole;
+		pthread_mutex_unlock(&tier_lock);
+	}
+	if (fstat(fd, &st) == 0)
+		stamp(f, &st);
+	if (cfd != -1)
+		close(cfd);
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+	return res;
+}
+
+static int sync_file(dev_t dev, ino_t ino, int forget)
+{
+	struct tier_file* f;
+	int cfd, res;
+
+	if (!tier_dir || !(f = file_get(dev, ino, 0)))
+		return 0;
+	pthread_mutex_lock(&f->lock);
+	cfd = cache_open(f);
+	res = flush_file(f, cfd);
+	if (forget)
+		drop_all(f, cfd);
+	if (cfd != -1)
+		close(cfd);
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+	return res;
+}
+
+int tier_sync(dev_t dev, ino_t ino)
+{
+	return sync_file(dev, ino, 0);
+}
+
+void tier_invalidate(dev_t dev, ino_t ino)
+{
+	sync_file(dev, ino, 1);
+}
@@ -0,0 +1,81 @@
+/* encfs-tier.h
+ * Local ciphertext cache in front of a slow mirror directory
+ *
+ * Backing file I/O of encrypted files goes through here. With a cache
+ * directory configured (--local-cache), TIER_BLOCK sized blocks of
+ * ciphertext read from the mirror are kept in files under that directory
+ * and later reads are served from there, so data at rest stays encrypted
+ * on both sides. A block is only used while the backing file's mtime and
+ * size are what they were when we last looked; anything that changes the
+ * backing file behind our back drops the file's blocks.
+ *
+ * Writes go through to the backing file (updating cached blocks), or in
+ * write-back mode are kept as dirty blocks and written to the backing
+ * file by a flusher thread, on fsync and at unmount. The backing file is
+ * still extended right away, so its size stays right.
+ *
+ * Without a cache directory, and for O_DIRECT descriptors, every call
+ * goes straight to the backing file.
+ *
+ */
+
+#ifndef ENCFS_TIER_H
+#define ENCFS_TIER_H
+
+#include <sys/types.h>
+
+#define TIER_BLOCK (64 * 1024)
+
+/* int tier_init(const char* dir, size_t size, int writeback)
+ * Purpose: Set up the cache under dir, dropping whatever an earlier
+ *          mount left there, and start the flusher
+ * Args: const char* dir : Absolute path of the cache directory
+ *       size_t size     : Bytes of ciphertext to keep
+ *       int writeback   : 1 for write-back, 0 for write-through
+ * Return: 0 on success, -1 on error
+ */
+extern int tier_init(const char* dir, size_t size, int writeback);
+
+/* void tier_destroy(void)
+ * Purpose: Write back dirty blocks, stop the flusher and empty the cache
+ */
+extern void tier_destroy(void);
+
+/* ssize_t tier_pread(int fd, void* buf, size_t len, off_t off)
+ * Purpose: pread() on a backing file
+ * Return: Bytes read (short at end of file), -1 on error
+ */
+extern ssize_t tier_pread(int fd, void* buf, size_t len, off_t off);
+
+/* ssize_t tier_pwrite(int fd, const void* buf, size_t len, off_t off)
+ * Purpose: pwrite() on a backing file
+ * Return: Bytes written, -1 on error
+ */
+extern ssize_t tier_pwrite(int fd, const void* buf, size_t len, off_t off);
+
+/* int tier_ftruncate(int fd, off_t size)
+ * Purpose: ftruncate() on a backing file
+ * Return: 0 on success, -1 on error
+ */
+extern int tier_ftruncate(int fd, off_t size);
+
+/* int tier_punch(int fd, off_t off, off_t len)
+ * Purpose: fallocate(PUNCH_HOLE | KEEP_SIZE) on a backing file
+ * Return: 0 on success, -1 with errno set (EOPNOTSUPP if the backing
+ *         filesystem can't punch holes)
+ */
+extern int tier_punch(int fd, off_t off, off_t len);
+
+/* int tier_sync(dev_t dev, ino_t ino)
+ * Purpose: Write back the dirty blocks of a backing file
+ * Return: 0 on success, -errno on error
+ */
+extern int tier_sync(dev_t dev, ino_t ino);
+
+/* void tier_invalidate(dev_t dev, ino_t ino)
+ * Purpose: Write back and forget the blocks of a backing file that is
+ *          about to be changed by other means or removed
+ */
+extern void tier_invalidate(dev_t dev, ino_t ino);
+
+#endif
@@ -0,0 +1,277 @@
+/* encfs-trace.c
+ * Per-request span tracing for pa4-encfs
+ *
+ * Every thread that records spans owns a ring of finished spans. The
+ * thread is its only producer and the writer thread its only consumer, so
+ * head and tail are plain atomics and recording never takes a lock (a
+ * full ring drops the span). Rings are taken from the list under
+ * trace_lock once per thread; a ring whose thread exited is freed by the
+ * writer once it has been drained.
+ *
+ */
+
+/* For syscall(SYS_gettid) */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "encfs-stats.h"
+#include "encfs-trace.h"
+
+#define RING_SPANS 16384
+#define DRAIN_MS 500
+
+struct trace_event {
+	const char* name;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+struct trace_ring {
+	struct trace_event ev[RING_SPANS];
+	unsigned long head;	/* written by the owner */
+	unsigned long tail;	/* written by the writer thread */
+	long tid;
+	int dead;		/* owner exited */
+	struct trace_ring* next;
+};
+
+int trace_on;
+
+static char* prefix;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring* rings;
+static pthread_key_t ring_key;
+static __thread struct trace_ring* my_ring;
+
+static pthread_t writer;
+static int running;
+static int stopping;
+static sem_t wake;
+
+static FILE* out;
+static int session;
+static int first;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	__atomic_store_n(&trace_on, !__atomic_load_n(&trace_on, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	sem_post(&wake);
+}
+
+static void ring_release(void* arg)
+{
+	struct trace_ring* r = arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct trace_ring* ring_get(void)
+{
+	struct trace_ring* r = my_ring;
+
+	if (r)
+		return r;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&trace_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&trace_lock);
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+struct trace_span trace_begin(const char* name)
+{
+	struct trace_span sp = { name, now_ns() };
+
+	return sp;
+}
+
+void trace_end(struct trace_span* sp)
+{
+	struct trace_ring* r = ring_get();
+	unsigned long h, used;
+	struct trace_event* ev;
+
+	if (!r)
+		return;
+	h = r->head;
+	used = h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used >= RING_SPANS) {
+		STAT_INC(trace_dropped);
+		return;
+	}
+	//don't wait for the next round when a busy thread fills up
+	if (used == RING_SPANS / 2)
+		sem_post(&wake);
+	ev = &r->ev[h % RING_SPANS];
+	ev->name = sp->name;
+	ev->start = sp->start;
+	ev->end = now_ns();
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void session_start(void)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s-%d.json", prefix, ++session);
+	out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return;
+	}
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	first = 1;
+}
+
+static void session_end(void)
+{
+	fprintf(out, "\n]}\n");
+	if (fclose(out))
+		perror("trace");
+	out = NULL;
+}
+
+//moves every finished span to the trace file, or drops them when no file
+//is open
+static void drain(void)
+{
+	struct trace_ring** p;
+	struct trace_ring* r;
+	struct trace_event* ev;
+	unsigned long h, t;
+	int pid = getpid();
+
+	pthread_mutex_lock(&trace_lock);
+	for (p = &rings; (r = *p) != NULL; ) {
+		int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+
+		h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (t = r->tail; out && t != h; t++) {
+			ev = &r->ev[t % RING_SPANS];
+			fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+				"\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+				first ? "" : ",\n", ev->name, pid, r->tid,
+				ev->start / 1000, ev->start % 1000,
+				(ev->end - ev->start) / 1000, (ev->end - ev->start) % 1000);
+			first = 0;
+			STAT_INC(trace_events);
+		}
+		__atomic_store_n(&r->tail, h, __ATOMIC_RELEASE);
+		if (dead) {
+			*p = r->next;
+			free(r);
+		} else {
+			p = &r->next;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void* writer_thread(void* arg)
+{
+	struct timespec ts;
+	int on;
+
+	(void) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DRAIN_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (sem_timedwait(&wake, &ts) == -1 && errno != ETIMEDOUT &&
+		    errno != EINTR)
+			break;
+		on = __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+		if (on && !out)
+			session_start();
+		drain();
+		if (!on && out)
+			session_end();
+	}
+	return NULL;
+}
+
+int trace_init(const char* path)
+{
+	struct sigaction sa;
+
+	if (pthread_key_create(&ring_key, ring_release))
+		return -1;
+	if (sem_init(&wake, 0, 0)) {
+		pthread_key_delete(ring_key);
+		return -1;
+	}
+	prefix = strdup(path);
+	if (!prefix || pthread_create(&writer, NULL, writer_thread, NULL)) {
+		free(prefix);
+		prefix = NULL;
+		sem_destroy(&wake);
+		pthread_key_delete(ring_key);
+		return -1;
+	}
+	running = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR2, &sa, NULL) == -1)
+		perror("trace: SIGUSR2");
+	return 0;
+}
+
+void trace_destroy(void)
+{
+	struct trace_ring* r;
+
+	if (!running)
+		return;
+	signal(SIGUSR2, SIG_IGN);
+	__atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&wake);
+	pthread_join(writer, NULL);
+	running = 0;
+	drain();
+	if (out)
+		session_end();
+	//whatever threads are left don't record any more
+	while ((r = rings) != NULL) {
+		rings = r->next;
+		free(r);
+	}
+	my_ring = NULL;
+	pthread_key_delete(ring_key);
+	sem_destroy(&wake);
+	free(prefix);
+	prefix = NULL;
+}
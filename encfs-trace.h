@@ -0,0 +1,66 @@
+/* encfs-trace.h
+ * Per-request span tracing for pa4-encfs
+ *
+ * With --trace=<prefix>, SIGUSR2 switches tracing on and off. While it is
+ * on, every FUSE op and its phases (path fixup, xattr lookup, decrypt,
+ * backing I/O, re-encrypt, temp file removal) record a span into a
+ * per-thread ring, and a writer thread drains the rings into
+ * <prefix>-<n>.json in Chrome Trace Event format (load it in
+ * chrome://tracing or ui.perfetto.dev). Each time tracing is switched on
+ * a new file is started.
+ *
+ * A span is one line at the top of the scope it covers:
+ *	TRACE_SPAN("read");
+ * It ends when the scope is left. With tracing off it costs one
+ * well-predicted branch.
+ *
+ */
+
+#ifndef ENCFS_TRACE_H
+#define ENCFS_TRACE_H
+
+struct trace_span {
+	const char* name;	/* NULL: not recording */
+	unsigned long long start;	/* ns */
+};
+
+extern int trace_on;
+
+/* int trace_init(const char* prefix)
+ * Purpose: Install the SIGUSR2 handler and start the writer thread
+ * Args: const char* prefix : Absolute path the trace files are named after
+ * Return: 0 on success, -1 on error
+ */
+extern int trace_init(const char* prefix);
+
+/* void trace_destroy(void)
+ * Purpose: Finish the trace file being written, if any, and stop the
+ *          writer thread
+ */
+extern void trace_destroy(void);
+
+/* struct trace_span trace_begin(const char* name)
+ * Purpose: Start a span, use TRACE_SPAN instead
+ */
+extern struct trace_span trace_begin(const char* name);
+
+/* void trace_end(struct trace_span* sp)
+ * Purpose: Record a span started by trace_begin(), use TRACE_SPAN instead
+ */
+extern void trace_end(struct trace_span* sp);
+
+static inline void trace_scope_end(struct trace_span* sp)
+{
+	if (sp->name)
+		trace_end(sp);
+}
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+#define TRACE_SPAN(name)						\
+	struct trace_span TRACE_CAT(trace_span_, __LINE__)		\
+	__attribute__((cleanup(trace_scope_end))) =			\
+		__builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED), 0) ? \
+		trace_begin(name) : (struct trace_span) { NULL, 0 }
+
+#endif
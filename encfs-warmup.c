@@ -0,0 +1,330 @@
+/* encfs-warmup.c
+ * Mount time warm-up for pa4-encfs
+ *
+ * Directories still to be scanned sit on a stack shared by the walkers.
+ * A walker pops one, probes every regular file in it and pushes the
+ * subdirectories it finds; the walk is over once the stack is empty and
+ * no walker is busy with a directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-cache.h"
+#include "encfs-format.h"
+#include "encfs-lock.h"
+#include "encfs-meta.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-warmup.h"
+
+/* files we made ourselves (scratch, aside) */
+#define HIDDEN_PREFIX ".pa4-encfs-"
+/* how recently a file must have been used to be prefetched */
+#define HOT_AGE (24 * 60 * 60)
+
+enum { WARMUP_OFF, WARMUP_RUNNING, WARMUP_DONE };
+
+struct warm_dir {
+	char* path;
+	struct warm_dir* next;
+};
+
+static pthread_t* walkers;
+static int nwalkers;
+static size_t prefetch_limit;
+
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+static struct warm_dir* pending;
+static size_t npending;
+static int busy;
+static int state = WARMUP_OFF;
+static int stopping;
+static struct timespec started;
+static struct timespec finished;
+
+/* token bucket, refilled at rate per second, holds at most one second */
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static double rate;
+static double tokens;
+static struct timespec refilled;
+
+static double seconds_since(const struct timespec* t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static void budget_take(int n)
+{
+	double wait;
+
+	if (rate <= 0)
+		return;
+	pthread_mutex_lock(&budget_lock);
+	tokens += seconds_since(&refilled) * rate;
+	clock_gettime(CLOCK_MONOTONIC, &refilled);
+	if (tokens > rate)
+		tokens = rate;
+	tokens -= n;
+	wait = tokens < 0 ? -tokens / rate : 0;
+	pthread_mutex_unlock(&budget_lock);
+
+	//the debt is already taken, so walkers queue up behind each other
+	if (wait > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+		STAT_ADD(warmup_throttle_us, (unsigned long long) (wait * 1e6));
+	}
+}
+
+static int push_dir(const char* path)
+{
+	struct warm_dir* d = malloc(sizeof(*d));
+
+	if (!d || !(d->path = strdup(path))) {
+		free(d);
+		return -1;
+	}
+	pthread_mutex_lock(&walk_lock);
+	d->next = pending;
+	pending = d;
+	npending++;
+	pthread_cond_signal(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+	return 0;
+}
+
+static int hot(const struct stat* st)
+{
+	time_t now = time(NULL);
+
+	return now - st->st_atime < HOT_AGE || now - st->st_mtime < HOT_AGE;
+}
+
+//returns the ciphertext bytes it read
+static size_t prefetch_file(const char* path, const struct fmt_meta* m, off_t size)
+{
+	struct file_lock* l;
+	struct stat st;
+	size_t moved = 0;
+	off_t idx;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == 0) {
+		for (idx = 0; idx * CACHE_BLOCK < size && !stopping; idx++) {
+			budget_take(1);
+			l = lock_acquire(st.st_dev, st.st_ino, LOCK_SHARED);
+			if (cache_prefetch(fd, &st, idx, m) > 0) {
+				STAT_INC(warmup_prefetched);
+				moved += CACHE_BLOCK;
+			}
+			lock_release(l);
+		}
+	}
+	close(fd);
+	return moved;
+}
+
+//does what getattr would and keeps the answer; returns the bytes it
+//prefetched
+static size_t warm_file(const char* path)
+{
+	struct file_lock* l;
+	struct fmt_meta m;
+	struct stat st;
+	off_t size;
+	int fd;
+
+	budget_take(1);
+	l = lock_path(path, LOCK_SHARED);
+	if (!l)
+		return 0;
+	if (lstat(path, &st) == -1 || fmt_get_path(path, &m) < 0) {
+		lock_release(l);
+		return 0;
+	}
+	size = fmt_plainsize(&m, st.st_size);
+	if (m.kind == FMT_LEGACY) {
+		fd = open(path, O_RDONLY);
+		size = fd == -1 ? -1 : fmt_size(fd, &m);
+		if (fd != -1)
+			close(fd);
+	}
+	if (size >= 0) {
+		meta_store(&st, &m, size);
+		STAT_INC(warmup_files);
+	}
+	lock_release(l);
+
+	if (size > 0 && (size_t) size <= prefetch_limit &&
+	    m.kind != FMT_PLAIN && hot(&st))
+		return prefetch_file(path, &m, size);
+	return 0;
+}
+
+static void scan_dir(const char* dirpath)
+{
+	char path[PATH_MAX];
+	struct sched_job job;
+	struct dirent* de;
+	DIR* dp;
+
+	dp = opendir(dirpath);
+	if (!dp)
+		return;
+	STAT_INC(warmup_dirs);
+	while (!stopping && (de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    !strncmp(de->d_name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)))
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name) >=
+		    (int) sizeof(path))
+			continue;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (lstat(path, &st) == -1)
+				continue;
+			de->d_type = S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (de->d_type == DT_DIR)
+			push_dir(path);
+		else if (de->d_type == DT_REG) {
+			sched_bg_begin(&job, SCHED_WARMUP);
+			sched_bg_end(&job, warm_file(path));
+		}
+	}
+	closedir(dp);
+}
+
+static void* walker(void* arg)
+{
+	struct warm_dir* d;
+
+	(void) arg;
+	for (;;) {
+		pthread_mutex_lock(&walk_lock);
+		while (!pending && busy && !stopping)
+			pthread_cond_wait(&walk_cond, &walk_lock);
+		if (!pending || stopping) {
+			//nothing left and nobody who could add more
+			if (state == WARMUP_RUNNING && !stopping) {
+				state = WARMUP_DONE;
+				clock_gettime(CLOCK_MONOTONIC, &finished);
+			}
+			pthread_cond_broadcast(&walk_cond);
+			pthread_mutex_unlock(&walk_lock);
+			return NULL;
+		}
+		d = pending;
+		pending = d->next;
+		npending--;
+		busy++;
+		pthread_mutex_unlock(&walk_lock);
+
+		scan_dir(d->path);
+		free(d->path);
+		free(d);
+
+		pthread_mutex_lock(&walk_lock);
+		busy--;
+		if (!busy && !pending)
+			pthread_cond_broadcast(&walk_cond);
+		pthread_mutex_unlock(&walk_lock);
+	}
+}
+
+static int warmup_report(char* buf, size_t size)
+{
+	static const char* names[] = { "off", "running", "done" };
+	double elapsed = 0;
+	int st;
+	size_t n;
+
+	pthread_mutex_lock(&walk_lock);
+	st = state;
+	n = npending;
+	if (st == WARMUP_RUNNING)
+		elapsed = seconds_since(&started);
+	else if (st == WARMUP_DONE)
+		elapsed = (finished.tv_sec - started.tv_sec) +
+			(finished.tv_nsec - started.tv_nsec) / 1e9;
+	pthread_mutex_unlock(&walk_lock);
+
+	return snprintf(buf, size,
+			"warmup_state %s\nwarmup_pending_dirs %zu\nwarmup_elapsed_ms %.0f\n",
+			names[st], n, elapsed * 1000);
+}
+
+int warmup_start(const char* root, int threads, int budget, size_t prefetch_max)
+{
+	int i;
+
+	if (threads <= 0)
+		return 0;
+
+	stats_register(warmup_report);
+	prefetch_limit = prefetch_max;
+	rate = budget;
+	tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &refilled);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (push_dir(root))
+		return -1;
+
+	walkers = calloc(threads, sizeof(*walkers));
+	if (!walkers)
+		return -1;
+	state = WARMUP_RUNNING;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&walkers[i], NULL, walker, NULL))
+			break;
+		nwalkers++;
+	}
+	if (!nwalkers)
+		state = WARMUP_OFF;
+	return nwalkers ? 0 : -1;
+}
+
+void warmup_stop(void)
+{
+	struct warm_dir* d;
+	int i;
+
+	pthread_mutex_lock(&walk_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+	for (i = 0; i < nwalkers; i++)
+		pthread_join(walkers[i], NULL);
+	free(walkers);
+	walkers = NULL;
+	nwalkers = 0;
+
+	while ((d = pending) != NULL) {
+		pending = d->next;
+		free(d->path);
+		free(d);
+	}
+	npending = 0;
+}
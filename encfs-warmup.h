@@ -0,0 +1,40 @@
+/* encfs-warmup.h
+ * Mount time warm-up for pa4-encfs
+ *
+ * A pool of threads walks the mirror directory right after mount and
+ * fills the metadata cache (format and plaintext size of every file), so
+ * the first ls -l or find over a big tree doesn't probe every file from
+ * the FUSE threads. Small, recently used encrypted files can also be
+ * decrypted into the plaintext cache. The walk is paced by an I/O budget
+ * so it doesn't starve the mount it is warming up.
+ *
+ * Progress is reported in the stats (warmup_state, warmup_pending_dirs,
+ * warmup_elapsed_ms and the warmup_* counters).
+ *
+ */
+
+#ifndef ENCFS_WARMUP_H
+#define ENCFS_WARMUP_H
+
+#include <stddef.h>
+
+/* int warmup_start(const char* root, int threads, int budget, size_t prefetch_max)
+ * Purpose: Start walking root in the background
+ * Args: const char* root    : Mirror directory
+ *       int threads         : Walker threads (0 disables the warm-up)
+ *       int budget          : Backing file operations per second, one per
+ *                             file probed and one per block prefetched
+ *                             (0 = unlimited)
+ *       size_t prefetch_max : Decrypt encrypted files up to this size used
+ *                             in the last day into the cache (0 = never)
+ * Return: 0 on success, -1 if no thread could be started
+ */
+extern int warmup_start(const char* root, int threads, int budget,
+			size_t prefetch_max);
+
+/* void warmup_stop(void)
+ * Purpose: Abandon the walk if it is still running and join the threads
+ */
+extern void warmup_stop(void);
+
+#endif
@@ -0,0 +1,873 @@
+/* pa4-encfs-replay.c
+ * Replays a pa4-encfs --record capture against a directory
+ *
+ * Paths were only recorded as hashes, so every file gets a name of its
+ * own under the target directory: a directory is <dir>/<hash>, a file is
+ * <dir>/<hash of its directory>/<hash>. Files and directories the capture
+ * uses without creating them first are made before the replay starts,
+ * files as long as the furthest read from them.
+ *
+ * Ops of one recorded thread stay in order on one replay thread. FUSE
+ * hands requests to whichever of its threads is free, so the ops on one
+ * path are spread over recorded threads: an op also waits until the ops
+ * before it in the capture on its path(s), and on the directories they
+ * are in, have run. With timing preserved each op waits until its offset
+ * from the start of the capture; with --fast they run back to back. Every
+ * op is timed on its own and the latencies are reported per op.
+ *
+ */
+
+/* For copy_file_range() and fallocate() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "encfs-record.h"
+
+#define REPLAY_THREADS_MAX 256
+#define REPLAY_ATTR "user.replay"
+/* largest read, write, xattr or readlink buffer */
+#define IO_MAX (1 << 20)
+
+struct rfile {
+	uint64_t hash;
+	int isdir;
+	int seen;		/* setup: an op used it already */
+	int made;		/* the capture creates it itself */
+	uint64_t dir;		/* setup: directory it was first seen in */
+	uint64_t extent;	/* setup: end of the furthest read */
+	struct rop* last;	/* setup: latest op on it so far */
+	pthread_mutex_t lock;
+	int fd;			/* for I/O, opened when first needed */
+	int* opens;		/* descriptors of replayed open/create calls */
+	size_t nopens, maxopens;
+};
+
+struct rop {
+	struct rec_entry e;
+	const struct rec_entry* t;	/* second path, or NULL */
+	size_t no;			/* place in the capture */
+	struct rop* after[4];		/* earlier ops it has to wait for */
+	int done;
+};
+
+struct lat {
+	unsigned long long* ns;
+	size_t n, max;
+	unsigned long errors;
+};
+
+struct worker {
+	pthread_t thread;
+	char* buf;			/* what reads return, data stays as is */
+	struct rop** ops;
+	size_t nops, maxops;
+	struct lat lat[REC_MAX];
+	unsigned long long read, written;
+	unsigned long long behind;	/* ns started late, summed */
+	unsigned long long* late;
+	size_t nlate, maxlate;
+};
+
+static const char* op_names[REC_MAX] = {
+#define REC_NAME(name) #name,
+	RECORD_OPS(REC_NAME)
+#undef REC_NAME
+};
+
+static const char* root;
+static struct rfile* files;
+static size_t nfiles;
+static int fast;
+static double speed = 1;
+static struct timespec t0;
+static char* data;
+
+//ops waiting for an earlier op on their path
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int waiters;
+
+//descriptors replaced while other threads may still use them, closed at
+//the end
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static int* retired;
+static size_t nretired, maxretired;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int grow(void* pp, size_t* max, size_t n, size_t size)
+{
+	void** p = pp;
+	void* q;
+
+	if (n < *max)
+		return 0;
+	q = realloc(*p, (*max ? *max * 2 : 64) * size);
+	if (!q)
+		return -1;
+	*p = q;
+	*max = *max ? *max * 2 : 64;
+	return 0;
+}
+
+static int cmp_hash(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_time(const void* a, const void* b)
+{
+	const struct rop* x = a;
+	const struct rop* y = b;
+
+	if (x->e.ns != y->e.ns)
+		return x->e.ns < y->e.ns ? -1 : 1;
+	return x->no < y->no ? -1 : x->no > y->no;
+}
+
+static int cmp_ull(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*) a;
+	unsigned long long y = *(const unsigned long long*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static struct rfile* lookup(uint64_t hash)
+{
+	size_t lo = 0, hi = nfiles, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (files[mid].hash == hash)
+			return &files[mid];
+		if (files[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static void path_of(char* buf, size_t size, const struct rfile* f, uint64_t dir)
+{
+	if (f->isdir)
+		snprintf(buf, size, "%s/%016llx", root, (unsigned long long) f->hash);
+	else
+		snprintf(buf, size, "%s/%016llx/%016llx", root,
+			 (unsigned long long) dir, (unsigned long long) f->hash);
+}
+
+static void retire(int fd)
+{
+	if (fd == -1)
+		return;
+	pthread_mutex_lock(&retired_lock);
+	if (grow(&retired, &maxretired, nretired, sizeof(*retired)))
+		close(fd);
+	else
+		retired[nretired++] = fd;
+	pthread_mutex_unlock(&retired_lock);
+}
+
+//the name now points at another file (or none), later I/O opens it again
+static void forget(struct rfile* f)
+{
+	pthread_mutex_lock(&f->lock);
+	retire(f->fd);
+	f->fd = -1;
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int io_fd(struct rfile* f, uint64_t dir)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->fd == -1) {
+		path_of(path, sizeof(path), f, dir);
+		f->fd = open(path, O_RDWR);
+		if (f->fd == -1)
+			f->fd = open(path, O_RDONLY);
+	}
+	fd = f->fd;
+	pthread_mutex_unlock(&f->lock);
+	return fd;
+}
+
+//reads the capture and pairs each two path op with its second path
+static struct rop* load(const char* path, size_t* nops)
+{
+	struct rec_header hdr;
+	struct rec_entry* ev = NULL;
+	struct rop* ops;
+	size_t n = 0, max = 0, i, k;
+	FILE* in = fopen(path, "r");
+
+	if (!in) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != REC_MAGIC ||
+	    hdr.version != REC_VERSION) {
+		fprintf(stderr, "%s: not a pa4-encfs capture\n", path);
+		fclose(in);
+		return NULL;
+	}
+	for (;;) {
+		if (grow(&ev, &max, n, sizeof(*ev))) {
+			perror("replay");
+			fclose(in);
+			free(ev);
+			return NULL;
+		}
+		if (fread(&ev[n], sizeof(*ev), 1, in) != 1)
+			break;
+		if (ev[n].op < REC_MAX)
+			n++;
+	}
+	fclose(in);
+
+	ops = calloc(n ? n : 1, sizeof(*ops));
+	if (!ops) {
+		free(ev);
+		return NULL;
+	}
+	for (i = k = 0; i < n; i++) {
+		if (ev[i].op == REC_target)
+			continue;
+		ops[k].e = ev[i];
+		ops[k].no = k;
+		if (i + 1 < n && ev[i + 1].op == REC_target &&
+		    ev[i + 1].thread == ev[i].thread) {
+			struct rec_entry* t = malloc(sizeof(*t));
+
+			if (t)
+				*t = ev[i + 1];
+			ops[k].t = t;
+		}
+		k++;
+	}
+	free(ev);
+	qsort(ops, k, sizeof(*ops), cmp_time);
+	*nops = k;
+	return ops;
+}
+
+//one rfile per hash that shows up as a path or a directory
+static int index_files(const struct rop* ops, size_t nops)
+{
+	uint64_t* h = malloc((4 * nops + 1) * sizeof(*h));
+	size_t n = 0, i;
+
+	if (!h)
+		return -1;
+	for (i = 0; i < nops; i++) {
+		h[n++] = ops[i].e.path;
+		h[n++] = ops[i].e.dir;
+		if (ops[i].t) {
+			h[n++] = ops[i].t->path;
+			h[n++] = ops[i].t->dir;
+		}
+	}
+	qsort(h, n, sizeof(*h), cmp_hash);
+	files = calloc(n ? n : 1, sizeof(*files));
+	if (!files) {
+		free(h);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (i && h[i] == h[i - 1])
+			continue;
+		files[nfiles].hash = h[i];
+		files[nfiles].fd = -1;
+		pthread_mutex_init(&files[nfiles].lock, NULL);
+		nfiles++;
+	}
+	free(h);
+	return 0;
+}
+
+//first use of f by op; made if the op brings it into existence
+static void first_use(struct rfile* f, uint64_t dir, int made)
+{
+	if (f->seen)
+		return;
+	f->seen = 1;
+	f->dir = dir;
+	f->made = made;
+}
+
+//works out what each hash is and makes what exists before the capture
+static int setup(const struct rop* ops, size_t nops)
+{
+	char path[PATH_MAX];
+	struct rfile* f;
+	size_t i;
+	int op, fd;
+
+	for (i = 0; i < nops; i++) {
+		op = ops[i].e.op;
+		lookup(ops[i].e.dir)->isdir = 1;
+		f = lookup(ops[i].e.path);
+		if (op == REC_opendir || op == REC_readdir || op == REC_releasedir ||
+		    op == REC_mkdir || op == REC_rmdir)
+			f->isdir = 1;
+		first_use(f, ops[i].e.dir, op == REC_create || op == REC_mknod ||
+			  op == REC_mkdir || op == REC_symlink);
+		if (op == REC_read && !f->made &&
+		    ops[i].e.off + ops[i].e.size > f->extent)
+			f->extent = ops[i].e.off + ops[i].e.size;
+		if (ops[i].t) {
+			lookup(ops[i].t->dir)->isdir = 1;
+			f = lookup(ops[i].t->path);
+			first_use(f, ops[i].t->dir, op == REC_rename || op == REC_link);
+		}
+	}
+	//a directory renamed is one under its new name too
+	for (i = 0; i < nops; i++)
+		if (ops[i].e.op == REC_rename && ops[i].t &&
+		    lookup(ops[i].e.path)->isdir)
+			lookup(ops[i].t->path)->isdir = 1;
+	//directories first, they hold the files
+	for (i = 0; i < nfiles; i++) {
+		f = &files[i];
+		if (!f->isdir || f->made)
+			continue;
+		path_of(path, sizeof(path), f, 0);
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			perror(path);
+			return -1;
+		}
+	}
+	for (i = 0; i < nfiles; i++) {
+		uint64_t done;
+		ssize_t n;
+
+		f = &files[i];
+		if (f->isdir || f->made || !f->seen)
+			continue;
+		path_of(path, sizeof(path), f, f->dir);
+		//its ops fail in the replay too
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			perror(path);
+			continue;
+		}
+		for (done = 0; done < f->extent; done += n) {
+			n = f->extent - done < IO_MAX ? f->extent - done : IO_MAX;
+			n = write(fd, data, n);
+			if (n <= 0) {
+				perror(path);
+				close(fd);
+				return -1;
+			}
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void push_open(struct rfile* f, int fd)
+{
+	pthread_mutex_lock(&f->lock);
+	if (grow(&f->opens, &f->maxopens, f->nopens, sizeof(*f->opens))) {
+		pthread_mutex_unlock(&f->lock);
+		close(fd);
+		return;
+	}
+	f->opens[f->nopens++] = fd;
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int pop_open(struct rfile* f)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->nopens)
+		fd = f->opens[--f->nopens];
+	pthread_mutex_unlock(&f->lock);
+	return fd;
+}
+
+//replays one op; returns -1 with errno set if it failed, 1 if there was
+//nothing to replay. *ns is how long the call took
+static int run(struct worker* w, const struct rop* op, unsigned long long* ns)
+{
+	char path[PATH_MAX], path2[PATH_MAX];
+	const struct rec_entry* e = &op->e;
+	struct rfile* f = lookup(e->path);
+	struct rfile* f2 = op->t ? lookup(op->t->path) : NULL;
+	size_t size = e->size < IO_MAX ? e->size : IO_MAX;
+	unsigned long long start;
+	char buf[256];
+	struct statvfs sv;
+	struct stat st;
+	off_t off, off2;
+	ssize_t n = 0;
+	int res = 0, fd = -1, fd2;
+	DIR* dp;
+
+	path_of(path, sizeof(path), f, e->dir);
+	if (f2)
+		path_of(path2, sizeof(path2), f2, op->t->dir);
+	//descriptors are opened before the clock starts
+	switch (e->op) {
+	case REC_read: case REC_write: case REC_fsync: case REC_lseek:
+	case REC_fallocate: case REC_copy_file_range:
+		fd = io_fd(f, e->dir);
+		if (fd == -1)
+			return -1;
+		break;
+	case REC_readdir:
+		//later calls for the same listing were part of the first one
+		if (e->off)
+			return 1;
+		break;
+	case REC_releasedir:
+		return 1;
+	case REC_create:
+		forget(f);
+		break;
+	}
+	if ((e->op == REC_copy_file_range && !f2) ||
+	    ((e->op == REC_rename || e->op == REC_link) && !f2))
+		return 1;
+
+	start = now_ns();
+	switch (e->op) {
+	case REC_getattr:
+		res = lstat(path, &st);
+		break;
+	case REC_access:
+		res = access(path, e->arg & (R_OK | W_OK | X_OK));
+		break;
+	case REC_readlink:
+		n = readlink(path, buf, sizeof(buf));
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_opendir:
+		dp = opendir(path);
+		res = dp ? 0 : -1;
+		*ns = now_ns() - start;
+		if (dp)
+			closedir(dp);
+		return res;
+	case REC_readdir:
+		dp = opendir(path);
+		if (!dp) {
+			res = -1;
+			break;
+		}
+		while (readdir(dp))
+			;
+		closedir(dp);
+		break;
+	case REC_mknod:
+		res = mknod(path, S_IFREG | (e->arg & 07777), 0);
+		break;
+	case REC_mkdir:
+		res = mkdir(path, e->arg & 07777);
+		break;
+	case REC_unlink:
+		res = unlink(path);
+		break;
+	case REC_rmdir:
+		res = rmdir(path);
+		break;
+	case REC_symlink:
+		res = symlink("replay", path);
+		break;
+	case REC_rename:
+		res = rename(path, path2);
+		break;
+	case REC_link:
+		res = link(path, path2);
+		break;
+	case REC_chmod:
+		res = chmod(path, e->arg & 07777);
+		break;
+	case REC_chown:
+		res = lchown(path, -1, -1);
+		break;
+	case REC_truncate:
+		res = truncate(path, e->off);
+		break;
+	case REC_utimens:
+		res = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+		break;
+	case REC_open:
+		fd = open(path, e->arg & (O_ACCMODE | O_APPEND | O_TRUNC |
+					  O_SYNC | O_DSYNC));
+		*ns = now_ns() - start;
+		if (fd == -1)
+			return -1;
+		push_open(f, fd);
+		return 0;
+	case REC_create:
+		fd = open(path, O_CREAT | O_RDWR, e->arg & 07777);
+		*ns = now_ns() - start;
+		if (fd == -1)
+			return -1;
+		push_open(f, fd);
+		return 0;
+	case REC_release:
+		fd = pop_open(f);
+		if (fd == -1)
+			return 1;
+		start = now_ns();
+		res = close(fd);
+		break;
+	case REC_read:
+		n = pread(fd, w->buf, size, e->off);
+		if (n > 0)
+			w->read += n;
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_write:
+		n = pwrite(fd, data, size, e->off);
+		if (n > 0)
+			w->written += n;
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_statfs:
+		res = statvfs(root, &sv);
+		break;
+	case REC_fsync:
+		res = e->arg ? fdatasync(fd) : fsync(fd);
+		break;
+	case REC_setxattr:
+		res = setxattr(path, REPLAY_ATTR, data, size < 65536 ? size : 65536, 0);
+		break;
+	case REC_getxattr:
+		n = getxattr(path, REPLAY_ATTR, size ? w->buf : NULL, size < 65536 ? size : 65536);
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_listxattr:
+		n = listxattr(path, size ? w->buf : NULL, size);
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_removexattr:
+		res = removexattr(path, REPLAY_ATTR);
+		break;
+	case REC_copy_file_range:
+		fd2 = io_fd(f2, op->t->dir);
+		if (fd2 == -1)
+			return -1;
+		off = e->off;
+		off2 = op->t->off;
+		start = now_ns();
+		n = copy_file_range(fd, &off, fd2, &off2, e->size, 0);
+		if (n > 0) {
+			w->read += n;
+			w->written += n;
+		}
+		res = n < 0 ? -1 : 0;
+		break;
+	case REC_lseek:
+		res = lseek(fd, e->off, e->arg) == -1 ? -1 : 0;
+		break;
+	case REC_fallocate:
+		res = fallocate(fd, e->arg, e->off, e->size);
+		break;
+	default:
+		return 1;
+	}
+	*ns = now_ns() - start;
+	//the names point at other files now
+	if (res == 0 && (e->op == REC_unlink || e->op == REC_rename ||
+			 e->op == REC_mknod || e->op == REC_symlink)) {
+		forget(f);
+		if (f2)
+			forget(f2);
+	}
+	return res;
+}
+
+//links every op to the op before it on each of its paths and on the
+//directories they are in. Only ops on a path itself move it on, so the
+//ops on the files of a directory don't wait for each other.
+static void chain(struct rop* ops, size_t nops)
+{
+	uint64_t own[2], in[2];
+	struct rfile* f;
+	size_t i;
+	int j, n;
+
+	for (i = 0; i < nops; i++) {
+		own[0] = ops[i].e.path;
+		in[0] = ops[i].e.dir;
+		n = 1;
+		if (ops[i].t) {
+			own[1] = ops[i].t->path;
+			in[1] = ops[i].t->dir;
+			n = 2;
+		}
+		for (j = 0; j < n; j++) {
+			ops[i].after[2 * j] = lookup(own[j])->last;
+			f = lookup(in[j]);
+			if (f->hash != own[j])
+				ops[i].after[2 * j + 1] = f->last;
+		}
+		for (j = 0; j < n; j++)
+			lookup(own[j])->last = &ops[i];
+	}
+}
+
+//waits for the ops op->after[] until they have run
+static void wait_after(const struct rop* op)
+{
+	int j;
+
+	for (j = 0; j < 4; j++) {
+		struct rop* a = op->after[j];
+
+		if (!a || __atomic_load_n(&a->done, __ATOMIC_SEQ_CST))
+			continue;
+		pthread_mutex_lock(&done_lock);
+		__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&a->done, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&done_cond, &done_lock);
+		__atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&done_lock);
+	}
+}
+
+static void finish(struct rop* op)
+{
+	__atomic_store_n(&op->done, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&done_lock);
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&done_lock);
+	}
+}
+
+static void* replay_thread(void* arg)
+{
+	struct worker* w = arg;
+	unsigned long long ns, due, late;
+	struct timespec ts;
+	struct lat* l;
+	size_t i;
+	int res;
+
+	for (i = 0; i < w->nops; i++) {
+		if (!fast) {
+			due = (unsigned long long) t0.tv_sec * 1000000000ULL + t0.tv_nsec +
+				(unsigned long long) (w->ops[i]->e.ns / speed);
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+			wait_after(w->ops[i]);
+			late = now_ns() - due;
+			w->behind += late;
+			if (!grow(&w->late, &w->maxlate, w->nlate, sizeof(*w->late)))
+				w->late[w->nlate++] = late;
+		} else {
+			wait_after(w->ops[i]);
+		}
+		ns = 0;
+		res = run(w, w->ops[i], &ns);
+		finish(w->ops[i]);
+		if (res > 0)
+			continue;
+		l = &w->lat[w->ops[i]->e.op];
+		if (res)
+			l->errors++;
+		if (!grow(&l->ns, &l->max, l->n, sizeof(*l->ns)))
+			l->ns[l->n++] = ns;
+	}
+	return NULL;
+}
+
+static double pct(const unsigned long long* v, size_t n, double p)
+{
+	size_t i = (size_t) (p / 100 * n);
+
+	return n ? v[i < n ? i : n - 1] / 1000.0 : 0;
+}
+
+static void report(struct worker* w, int nworkers, double secs)
+{
+	unsigned long long rd = 0, wr = 0, total = 0;
+	unsigned long long* v;
+	unsigned long errors;
+	size_t n, k;
+	int op, i;
+
+	printf("%-16s %9s %7s %10s %10s %10s %10s %10s\n", "op", "count",
+	       "errors", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	for (op = 0; op < REC_MAX; op++) {
+		for (i = 0, n = 0, errors = 0; i < nworkers; i++) {
+			n += w[i].lat[op].n;
+			errors += w[i].lat[op].errors;
+		}
+		if (!n)
+			continue;
+		v = malloc(n * sizeof(*v));
+		if (!v)
+			continue;
+		for (i = 0, k = 0; i < nworkers; i++) {
+			if (w[i].lat[op].n)
+				memcpy(v + k, w[i].lat[op].ns,
+				       w[i].lat[op].n * sizeof(*v));
+			k += w[i].lat[op].n;
+		}
+		qsort(v, n, sizeof(*v), cmp_ull);
+		printf("%-16s %9zu %7lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       op_names[op], n, errors, pct(v, n, 50), pct(v, n, 90),
+		       pct(v, n, 99), pct(v, n, 99.9), v[n - 1] / 1000.0);
+		total += n;
+		free(v);
+	}
+	for (i = 0; i < nworkers; i++) {
+		rd += w[i].read;
+		wr += w[i].written;
+	}
+	printf("%llu ops in %.2f s (%.0f ops/s), %.1f MB read, %.1f MB written "
+	       "(%.1f MB/s)\n", total, secs, secs > 0 ? total / secs : 0,
+	       rd / 1048576.0, wr / 1048576.0,
+	       secs > 0 ? (rd + wr) / 1048576.0 / secs : 0);
+	if (!fast) {
+		for (i = 0, n = 0; i < nworkers; i++)
+			n += w[i].nlate;
+		v = malloc((n ? n : 1) * sizeof(*v));
+		if (!v)
+			return;
+		for (i = 0, k = 0; i < nworkers; i++) {
+			if (w[i].nlate)
+				memcpy(v + k, w[i].late, w[i].nlate * sizeof(*v));
+			k += w[i].nlate;
+		}
+		qsort(v, n, sizeof(*v), cmp_ull);
+		printf("started behind schedule: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		       pct(v, n, 50), pct(v, n, 99), n ? v[n - 1] / 1000.0 : 0);
+		free(v);
+	}
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [--fast | --speed=<factor>] [-j <threads>] "
+		"<capture> <directory>\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct worker workers[REPLAY_THREADS_MAX];
+	const char* capture = NULL;
+	int nworkers = 16, started, i, res = 0;
+	unsigned long long begin;
+	struct rlimit rl;
+	struct rop* ops;
+	struct worker* w;
+	size_t nops, k;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			nworkers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--fast"))
+			fast = 1;
+		else if (!strncmp(argv[i], "--speed=", 8) && atof(argv[i] + 8) > 0)
+			speed = atof(argv[i] + 8);
+		else if (argv[i][0] == '-' || root)
+			usage(argv[0]);
+		else if (!capture)
+			capture = argv[i];
+		else
+			root = argv[i];
+	}
+	if (!root)
+		usage(argv[0]);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > REPLAY_THREADS_MAX)
+		nworkers = REPLAY_THREADS_MAX;
+	//every file keeps a descriptor open
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	data = malloc(IO_MAX);
+	ops = load(capture, &nops);
+	if (!data || !ops || index_files(ops, nops))
+		return 2;
+	//not zeros, those would all be holes
+	srand(1);
+	for (i = 0; i < IO_MAX; i++)
+		data[i] = rand();
+	if (setup(ops, nops))
+		return 2;
+	chain(ops, nops);
+
+	//a recorded thread's ops go to one replay thread, in order. Each waits
+	//only for ops earlier in the capture, so the earliest op not run yet
+	//can always start
+	for (k = 0; k < nops; k++) {
+		w = &workers[ops[k].e.thread % nworkers];
+		if (grow(&w->ops, &w->maxops, w->nops, sizeof(*w->ops))) {
+			perror("replay");
+			return 2;
+		}
+		w->ops[w->nops++] = &ops[k];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	begin = now_ns();
+	for (started = 0; started < nworkers; started++) {
+		workers[started].buf = malloc(IO_MAX);
+		if (!workers[started].buf ||
+		    pthread_create(&workers[started].thread, NULL, replay_thread,
+				   &workers[started]))
+			break;
+	}
+	if (started < nworkers) {
+		//the ops of the others are never replayed, nothing waits for them
+		perror("pthread_create");
+		for (i = started; i < nworkers; i++)
+			for (k = 0; k < workers[i].nops; k++)
+				finish(workers[i].ops[k]);
+		nworkers = started;
+		res = 1;
+	}
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	report(workers, nworkers, (now_ns() - begin) / 1e9);
+
+	for (k = 0; k < nfiles; k++) {
+		if (files[k].fd != -1)
+			close(files[k].fd);
+		while (files[k].nopens)
+			close(files[k].opens[--files[k].nopens]);
+	}
+	for (k = 0; k < nretired; k++)
+		close(retired[k]);
+	return res;
+}
@@ -0,0 +1,360 @@
+/* pa4-encfs-scrub.c
+ * Checks the chunk checksums of a pa4-encfs mirror directory
+ *
+ * The checksums cover the ciphertext, so no key is needed and nothing is
+ * decrypted. One thread walks the tree and queues the files, the others
+ * read and check them, so the disk is kept busy with reads. The packs
+ * and the chunk containers are checked record by record from their CRCs.
+ *
+ */
+
+/* For O_NOATIME */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "encfs-dedup.h"
+#include "encfs-format.h"
+#include "encfs-pack.h"
+#include "encfs-stripe.h"
+
+/* files and directories pa4-encfs made itself (scratch, staging, stripes,
+ * tier) */
+#define HIDDEN_PREFIX ".pa4-encfs"
+/* stores of records, checked on their own */
+#define PACK_DIR ".pa4-encfs-packs"
+#define CHUNK_DIR ".pa4-encfs-chunks"
+#define SCRUB_THREADS_MAX 64
+#define QUEUE_MAX 1024
+
+enum { TREE_FILE, PACK_FILE, CHUNK_FILE };
+
+struct scrub_item {
+	char* path;
+	int kind;
+};
+
+struct scrub_dir {
+	char* path;
+	struct scrub_dir* next;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_put = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_take = PTHREAD_COND_INITIALIZER;
+static struct scrub_item queue[QUEUE_MAX];
+static int head, count;
+static int walked;
+
+//totals, updated under queue_lock
+static unsigned long files, checked, unchecked, badfiles, errors;
+static unsigned long long bytes, badchunks;
+static unsigned long stores, badstores;
+static unsigned long long storebytes;
+
+static void enqueue(char* path, int kind)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (count == QUEUE_MAX)
+		pthread_cond_wait(&queue_put, &queue_lock);
+	queue[(head + count) % QUEUE_MAX].path = path;
+	queue[(head + count++) % QUEUE_MAX].kind = kind;
+	pthread_cond_signal(&queue_take);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+//next file to check, 0 once the walk is over and the queue is empty
+static int dequeue(struct scrub_item* item)
+{
+	int got = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	while (count == 0 && !walked)
+		pthread_cond_wait(&queue_take, &queue_lock);
+	if (count) {
+		*item = queue[head];
+		head = (head + 1) % QUEUE_MAX;
+		count--;
+		got = 1;
+		pthread_cond_signal(&queue_put);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return got;
+}
+
+static void report_bad(void* arg, off_t chunk)
+{
+	printf("%s: chunk %lld (plaintext offset %lld) is damaged\n",
+	       (const char*) arg, (long long) chunk, (long long) chunk * FMT_CHUNK);
+}
+
+static void report_bad_record(void* arg, off_t off)
+{
+	printf("%s: record at %lld is damaged, the rest of the file can't be "
+	       "checked\n", (const char*) arg, (long long) off);
+}
+
+//checks a pack or chunk container record by record
+static void scrub_store(const char* path, int kind)
+{
+	struct stat st;
+	long bad = -1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if (fd == -1)
+		fd = open(path, O_RDONLY);
+	if (fd != -1 && fstat(fd, &st) == 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		bad = kind == PACK_FILE ? pack_verify(fd, report_bad_record, (void*) path) :
+			dedup_verify(fd, report_bad_record, (void*) path);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	if (bad < 0)
+		perror(path);
+
+	pthread_mutex_lock(&queue_lock);
+	if (bad < 0) {
+		errors++;
+	} else {
+		stores++;
+		storebytes += st.st_size;
+		if (bad)
+			badstores++;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	if (fd != -1)
+		close(fd);
+}
+
+static void scrub_file(const char* path)
+{
+	struct fmt_meta m;
+	struct stat st;
+	long bad = 0;
+	int fd, kind = FMT_PLAIN, res = 0;
+
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if (fd == -1)
+		fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		res = -1;
+		goto out;
+	}
+	kind = fmt_get(fd, &m);
+	if (kind < 0) {
+		errno = -kind;
+		perror(path);
+		res = -1;
+	} else if (kind == FMT_CHUNKED && m.crc) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		bad = fmt_verify(fd, &m, report_bad, (void*) path);
+		if (bad < 0) {
+			perror(path);
+			res = -1;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+out:
+	pthread_mutex_lock(&queue_lock);
+	files++;
+	if (res)
+		errors++;
+	else if (kind == FMT_CHUNKED && m.crc) {
+		checked++;
+		bytes += st.st_size;
+		if (bad) {
+			badfiles++;
+			badchunks += bad;
+		}
+	} else if (kind != FMT_PLAIN) {
+		//do_crypt, pending and unchecksummed chunked files
+		unchecked++;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	if (fd != -1)
+		close(fd);
+}
+
+static void* scrub_thread(void* arg)
+{
+	struct scrub_item item;
+
+	(void) arg;
+	while (dequeue(&item)) {
+		if (item.kind == TREE_FILE)
+			scrub_file(item.path);
+		else
+			scrub_store(item.path, item.kind);
+		free(item.path);
+	}
+	return NULL;
+}
+
+static int push_dir(struct scrub_dir** stack, const char* path)
+{
+	struct scrub_dir* d = malloc(sizeof(*d));
+
+	if (!d || !(d->path = strdup(path))) {
+		free(d);
+		return -1;
+	}
+	d->next = *stack;
+	*stack = d;
+	return 0;
+}
+
+//queues the record files of the store dir under the mirror root, those
+//whose names are <prefix><n>
+static void walk_store(const char* root, const char* dir, const char* prefix,
+		       int kind)
+{
+	char path[PATH_MAX];
+	struct dirent* de;
+	unsigned int no;
+	char* copy;
+	char c;
+	DIR* dp;
+
+	if (snprintf(path, sizeof(path), "%s/%s", root, dir) >= (int) sizeof(path))
+		return;
+	dp = opendir(path);
+	if (!dp) {
+		if (errno != ENOENT)
+			perror(path);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (strncmp(de->d_name, prefix, strlen(prefix)) ||
+		    sscanf(de->d_name + strlen(prefix), "%u%c", &no, &c) != 1 ||
+		    snprintf(path, sizeof(path), "%s/%s/%s", root, dir, de->d_name) >=
+		    (int) sizeof(path))
+			continue;
+		copy = strdup(path);
+		if (copy)
+			enqueue(copy, kind);
+	}
+	closedir(dp);
+}
+
+static void walk(const char* root)
+{
+	struct scrub_dir* stack = NULL;
+	struct scrub_dir* d;
+	char path[PATH_MAX];
+	struct dirent* de;
+	char* copy;
+	DIR* dp;
+
+	if (push_dir(&stack, root)) {
+		perror(root);
+		return;
+	}
+	while ((d = stack) != NULL) {
+		stack = d->next;
+		dp = opendir(d->path);
+		if (!dp)
+			perror(d->path);
+		while (dp && (de = readdir(dp)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+			    !strncmp(de->d_name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", d->path, de->d_name) >=
+			    (int) sizeof(path))
+				continue;
+			if (de->d_type == DT_UNKNOWN) {
+				struct stat st;
+
+				if (lstat(path, &st) == -1)
+					continue;
+				de->d_type = S_ISDIR(st.st_mode) ? DT_DIR :
+					S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (de->d_type == DT_DIR) {
+				if (push_dir(&stack, path))
+					perror(path);
+			} else if (de->d_type == DT_REG) {
+				copy = strdup(path);
+				if (copy)
+					enqueue(copy, TREE_FILE);
+			}
+		}
+		if (dp)
+			closedir(dp);
+		free(d->path);
+		free(d);
+	}
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-j <threads>] [--stripe-root=<dir>...] "
+		"<Mirror Directory>\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char* roots[STRIPE_MAX - 1];
+	pthread_t threads[SCRUB_THREADS_MAX];
+	int nroots = 0, nthreads = 4, started, i;
+	const char* mirror = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			nthreads = atoi(argv[++i]);
+		else if (!strncmp(argv[i], "--stripe-root=", 14) && nroots < STRIPE_MAX - 1)
+			roots[nroots++] = argv[i] + 14;
+		else if (argv[i][0] == '-' || mirror)
+			usage(argv[0]);
+		else
+			mirror = argv[i];
+	}
+	if (!mirror)
+		usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > SCRUB_THREADS_MAX)
+		nthreads = SCRUB_THREADS_MAX;
+	//striped files are read from all their roots, like pa4-encfs does
+	if (stripe_init(roots, nroots, 16)) {
+		fprintf(stderr, "unusable --stripe-root\n");
+		return 2;
+	}
+
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, scrub_thread, NULL))
+			break;
+	if (!started) {
+		perror("pthread_create");
+		return 2;
+	}
+	walk_store(mirror, PACK_DIR, "pack.", PACK_FILE);
+	walk_store(mirror, CHUNK_DIR, "chunks.", CHUNK_FILE);
+	walk(mirror);
+	pthread_mutex_lock(&queue_lock);
+	walked = 1;
+	pthread_cond_broadcast(&queue_take);
+	pthread_mutex_unlock(&queue_lock);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	stripe_destroy();
+
+	printf("%lu files, %lu checked (%llu MB), %lu without checksums, "
+	       "%llu bad chunks in %lu files, %lu pack and chunk store files "
+	       "checked (%llu MB), %lu damaged, %lu errors\n",
+	       files, checked, bytes >> 20, unchecked, badchunks, badfiles,
+	       stores, storebytes >> 20, badstores, errors);
+	return badchunks || badstores || errors ? 1 : 0;
+}
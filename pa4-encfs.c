@@ -20,9 +20,15 @@
         more complete implementation may wish to add fi->fh support to minimize
         open() and close() calls and support fh dependent functions.
 
+  Builds against either FUSE 2 or FUSE 3. The Makefile passes
+  -DFUSE_USE_VERSION=31 for the FUSE 3 build (writeback cache, readdirplus,
+  parallel dirops and copy_file_range) and 28 for the FUSE 2 fallback.
+
 */
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 28
+#endif
 #define HAVE_SETXATTR
 #define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
 #define PATH_MAX 200
@@ -34,6 +40,8 @@
 #ifdef linux
 /* For pread()/pwrite() */
 #define _XOPEN_SOURCE 500
+/* For copy_file_range() and O_DIRECT */
+#define _GNU_SOURCE
 /* Linux is missing ENOATTR error, using ENODATA instead */
 #define ENOATTR ENODATA
 #endif
@@ -52,7 +60,29 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include "aes-crypt.h"
+#include "encfs-arena.h"
+#include "encfs-cache.h"
+#include "encfs-commit.h"
+#include "encfs-dedup.h"
+#include "encfs-defer.h"
+#include "encfs-format.h"
+#include "encfs-intent.h"
+#include "encfs-lock.h"
+#include "encfs-meta.h"
+#include "encfs-pack.h"
+#include "encfs-prefetch.h"
+#include "encfs-record.h"
+#include "encfs-rekey.h"
+#include "encfs-sched.h"
+#include "encfs-stats.h"
+#include "encfs-stripe.h"
+#include "encfs-tier.h"
+#include "encfs-trace.h"
+#include "encfs-warmup.h"
 
 
 #ifdef HAVE_SETXATTR
@@ -68,149 +98,247 @@ struct bb_state {
 
 static struct bb_state bb_data = {NULL,NULL}; 
 
+//per open() state, kept in fi->fh
+struct xmp_file {
+	struct pf_stream *stream; //access pattern for decrypt-ahead
+	int direct; //bypass both page caches, see wantDirect()
+	int pending; //holds off deferred encryption, see encfs-defer.h
+	dev_t dev;
+	ino_t ino;
+};
+
+//per opendir() state, kept in fi->fh
+struct xmp_dir {
+	DIR *dp;
+	struct dirent *entry; //read but not taken by the kernel yet
+	off_t offset; //telldir() position after the last entry handed out
+};
+
+//tunables, set from the command line in main()
+static size_t cacheSize = 64 << 20; //plaintext cache, bytes
+static int prefetchThreads = 2; 
+static int prefetchWindow = 32; //max decrypt-ahead, cache blocks
+static int directAll = 0; //--direct-io: every file
+static char *directPatterns[16]; //--direct-io=<glob>: matching files
+static int nDirectPatterns = 0;
+static int commitInterval = 5; //ms a group commit waits for more fsyncs
+static int orderedWrites = 0; //--ordered-writes: flush before every rename
+static size_t metaEntries = 65536; //files in the metadata cache
+static int warmupThreads = 0; //mount time warm-up walkers, 0 = no warm-up
+static int warmupBudget = 500; //warm-up backing file ops per second
+static size_t warmupPrefetch = 0; //warm-up decrypts files up to this size
+static const char *cipherSpec = "aes256-cbc"; //engine of new files, or auto
+static int chunkChecksums = 1; //--no-checksums: new files without CRC32C
+static int intentLog = 1; //--no-intent-log: chunks rewritten in place unlogged
+static char *stripeRoots[STRIPE_MAX - 1]; //--stripe-root=<dir>: extra roots
+static int nStripeRoots = 0;
+static size_t stripeSize = 64 << 10; //bytes of plaintext per stripe unit
+static char *localCache = NULL; //--local-cache=<dir>: ciphertext cache tier
+static size_t localCacheSize = (size_t) 1024 << 20; //bytes in the tier
+static int localWriteBack = 0; //--local-cache-write=back
+static char *tracePrefix = NULL; //--trace=<prefix>: SIGUSR2 toggles tracing
+static int deferDelay = -1; //--defer-encrypt=<ms>: new files stay plain, -1 = off
+static int deferThreads = 1; //background encryption workers
+static char *oldKeys[CRYPT_KEYS - 1]; //--old-key=<phrase>: keys files may still use
+static int nOldKeys = 0;
+static int rekeyShare = 10; //percent of the time key rotation may be busy
+static size_t packSmall = 0; //--pack-small=<bytes>: new files packed up to this size
+static int dedupChunks = 0; //--dedup: new files share identical chunks
+static int bgIdle = 5; //ms without foreground I/O before background jobs run
+static int bgIO = 0; //--bg-io=<MB/s>: background disk bandwidth, 0 = unlimited
+static int bgCPU = 0; //--bg-cpu=<percent>: background CPU share, 0 = unlimited
+static char *recordPath = NULL; //--record=<file>: capture every op for replay
+
 char* key_str = "nudlyf"; //key used for encryption 
 char* flag = "user.pa4-encfs.encrypted";
+char* statsAttr = "user.pa4-encfs.stats";
+char* rekeyAttr = "user.pa4-encfs.rekey";
 
 void fixPath(char newPath[PATH_MAX],const char * path)
 {
+	TRACE_SPAN("path_fixup");
 	newPath = strcpy(newPath,bb_data.rootdir); 
 	newPath = strcat(newPath,path); 
 }
 
+//scratch file in the mirror root, one per thread, so that concurrent
+//operations on different files never share temp data
+void fixTmpPath(char tmpPath[PATH_MAX],const char * tag)
+{
+	char name[64];
 
-static int xmp_getattr(const char *path, struct stat *stbuf)
+	snprintf(name, sizeof(name), "/.pa4-encfs-%s.%lx", tag,
+		 (unsigned long) pthread_self());
+	fixPath(tmpPath,name);
+}
+
+//drops cached plaintext, metadata and ciphertext of a backing file that
+//is about to change or go away
+static void invalidatePath(const char *newPath)
 {
+	struct stat st;
 
-	fprintf(stderr,"Entered getattr\n");
+	if (lstat(newPath, &st) == 0) {
+		cache_invalidate(st.st_dev, st.st_ino);
+		meta_invalidate(st.st_dev, st.st_ino);
+		tier_invalidate(st.st_dev, st.st_ino);
+	}
+}
 
-	//create a new path 
-	char newPath[PATH_MAX];
-	char tmpPath[PATH_MAX];  
-	fixPath(newPath,path); 
-	fixPath(tmpPath,"/tmpreadfile.txt"); 
-	fprintf(stderr,"created this path:%s\n",tmpPath);
-        fprintf(stderr,"real this path:%s\n",newPath);
+//returns 1 if the backing file carries our encrypted flag, 0 if it doesn't
+//and -errno if the flag couldn't be read
+static int isEncrypted(const char *newPath)
+{
+	struct fmt_meta meta;
+	int kind = fmt_get_path(newPath, &meta);
+
+	return kind < 0 ? kind : kind != FMT_PLAIN;
+}
+
+//staging file holding the plaintext of a pending file
+static int stagePath(char stage[PATH_MAX + 64], const struct fmt_meta *meta)
+{
+	return defer_staging(meta, stage, PATH_MAX + 64) ? -ENAMETOOLONG : 0;
+}
 
+//opens a backing file, or the staging file if it is pending. the caller
+//holds the file's lock so it can't change over in between
+static int openStaged(const char *newPath, int flags)
+{
+	char stage[PATH_MAX + 64];
+	struct fmt_meta meta;
+	int res;
 
+	res = fmt_get_path(newPath, &meta);
+	if (res != FMT_PENDING)
+		return open(newPath, flags);
+	res = stagePath(stage, &meta);
+	if (res) {
+		errno = -res;
+		return -1;
+	}
+	return open(stage, flags);
+}
 
 
+//the stub of a packed file and the table of a deduplicated one take
+//(next to) no blocks, their data does (in a pack or the chunk store)
+static void storedBlocks(const struct fmt_meta *meta, struct stat *stbuf)
+{
+	if (meta->kind == FMT_PACKED || meta->kind == FMT_DEDUP)
+		stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+}
 
+//turns the backing file's lstat() in stbuf into the plaintext's, called
+//with the file locked shared
+static int plainAttr(const char *newPath, struct stat *stbuf)
+{
+	struct fmt_meta meta;
+	off_t size;
 	int res;
-	int res2; //res for decrypted file if we use it. 
+	int fd;
 
-	struct stat * stbuf2;
-	stbuf2 = (struct stat *) malloc(sizeof(struct stat));
+	if (!S_ISREG(stbuf->st_mode))
+		return 0;
 
-	fprintf(stderr,"abot to lstat it"); 
-	//grab the un-encrypted attributes. 
-		res = lstat(newPath, stbuf);
-		if (res == -1)
-			return -errno;
+	//the metadata cache saves the xattr probe (and the decrypt below)
+	//while the backing file is unchanged
+	if (meta_lookup(stbuf, &meta, &size)) {
+		stbuf->st_size = size;
+		storedBlocks(&meta, stbuf);
+		return 0;
+	}
 
-	fprintf(stderr,"just lstated it"); 
-	if (S_ISREG(stbuf->st_mode))
-	{
-
-
-		//========== begin of encryption check =============
-		int encrypted=0; // indicates whether its encrypted or not 
-		int action = 0; // this indicates decrypt 
-		char* tmpval = NULL;
-		ssize_t valsize = 0;
-		FILE* file = NULL; 
-		FILE* tmpfile = NULL; 
-
-		/* Get attribute value size */
-		valsize = getxattr(newPath, "user.pa4-encfs.encrypted", NULL, 0);
-		if(valsize < 0){
-		    if(errno == ENOATTR)
-		    {
-			fprintf(stdout, "No %s attribute set on %s inside of getattr\n", "user.pa4-encfs.encrypted", newPath);
-
-			return EXIT_SUCCESS;
-		    }
-		    else 
-		     {
-			perror("getxattr error,nudlyf");
-			exit(EXIT_FAILURE);
-		    }
-		}
-		/* Malloc Value Space */
-		tmpval = malloc(sizeof(*tmpval)*(valsize+1));
-		if(!tmpval){
-		    perror("malloc of 'tmpval' error");
-		    exit(EXIT_FAILURE);
-		}
-		/* Get attribute value */
-		valsize = getxattr(newPath,  "user.pa4-encfs.encrypted", tmpval, valsize);
-		if(valsize < 0){
-		    if(errno == ENOATTR){
-			fprintf(stdout, "No %s attribute set on %s inside of getattr\n", "user.pa4-encfs.encrypted", newPath);
-			free(tmpval);
-			return EXIT_SUCCESS;
-		    }
-		    else{
-			perror("getxattr error,nudlyf2");
-			free(tmpval);
-			exit(EXIT_FAILURE);
-		    }
-		}
+	res = fmt_get_path(newPath, &meta);
+	if (res < 0)
+		return res;
 
-		/* Print Value */
-		tmpval[valsize] = '\0';
-		fprintf(stdout, "%s = %s\n", "user.pa4-encfs.encrypted", tmpval);
-
-		//once we have the flag actually check to see if this file is encrypted 
-		if (!strcmp(tmpval,"true"))
-		{
-			encrypted  =1; //mark that the file was encrypted 
-			fprintf(stderr,"flag indicated it's encrypted\n");
-			//decrypt it 
-			/* Open Files */
-			    file = fopen(newPath,"r");
-			    tmpfile = fopen(tmpPath,"w");
-			    if(!file){
-				fprintf(stderr, "failed to open infile\n");
-				return EXIT_FAILURE;
-			    }
-
-			    /* Perform do_crpt action (encrypt, decrypt, copy) */
-			    if(!do_crypt(file, tmpfile, action,key_str)){
-				fprintf(stderr, "do_crypt failure\n");
-				//return -errno; 
-			    }
-
-			    /* Cleanup */
-			    if(fclose(file)){
-					return -errno;
-			    }
-			    if(fclose(tmpfile)){
-					return -errno;
-			    }
-		}
+	//pending files are as big as their plaintext, which changes without
+	//the backing file noticing, so they are never cached
+	if (res == FMT_PENDING) {
+		char stage[PATH_MAX + 64];
+		struct stat sst;
 
-		free(tmpval);
-		//========== end of encryption check =============
-		fprintf(stderr,"alive"); 
-		//if encrypted, decrypt the file, if it's not encrypted don't decrypt 
-		if (encrypted)
-		{
-			res2 = lstat(tmpPath, stbuf2);
-			if (res2 == -1)
-				return -errno;
-			stbuf->st_size = stbuf2->st_size;
-			stbuf->st_blocks = stbuf2->st_blocks; 
-			stbuf->st_blksize = stbuf2->st_blksize; 
-		}
-		remove(tmpPath); 
+		res = stagePath(stage, &meta);
+		if (res)
+			return res;
+		if (lstat(stage, &sst) == -1)
+			return -errno;
+		stbuf->st_size = sst.st_size;
+		stbuf->st_blocks = sst.st_blocks;
+		return 0;
+	}
 
+	//chunked files are sized from their slot count, do_crypt files by
+	//decrypting their last block
+	size = fmt_plainsize(&meta, stbuf->st_size);
+	if (size < 0)
+		return -EIO;
+	if (meta.kind == FMT_LEGACY) {
+		fd = open(newPath, O_RDONLY);
+		if (fd == -1)
+			return -errno;
+		size = fmt_size(fd, &meta);
+		close(fd);
+		if (size < 0)
+			return -EIO;
 	}
+	meta_store(stbuf, &meta, size);
+	stbuf->st_size = size;
+	storedBlocks(&meta, stbuf);
 
 	return 0;
 }
 
+//getattr body, called with the file locked shared
+static int getattrLocked(const char *path, struct stat *stbuf)
+{
+
+	fprintf(stderr,"Entered getattr\n");
+
+	//create a new path 
+	char newPath[PATH_MAX];
+	fixPath(newPath,path); 
+
+	//grab the un-encrypted attributes. 
+	if (lstat(newPath, stbuf) == -1)
+		return -errno;
+	return plainAttr(newPath, stbuf);
+}
+
+#if FUSE_USE_VERSION >= 30
+static int xmp_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+#else
+static int xmp_getattr(const char *path, struct stat *stbuf)
+#endif
+{
+	TRACE_SPAN("getattr");
+	RECORD(getattr, path, 0, 0, 0);
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path); 
+
+	struct file_lock *lock;
+	int res;
+
+#if FUSE_USE_VERSION >= 30
+	(void) fi;
+#endif
+
+	//keep writers out while the size is worked out
+	lock = lock_path(newPath, LOCK_SHARED);
+	if (!lock && errno)
+		return -errno;
+	res = getattrLocked(path, stbuf);
+	lock_release(lock);
+	return res;
+}
+
 static int xmp_access(const char *path, int mask)
 {
+	TRACE_SPAN("access");
+	RECORD(access, path, 0, 0, mask);
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
@@ -226,6 +354,8 @@ static int xmp_access(const char *path, int mask)
 
 static int xmp_readlink(const char *path, char *buf, size_t size)
 {
+	TRACE_SPAN("readlink");
+	RECORD(readlink, path, 0, size, 0);
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
@@ -242,39 +372,158 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 }
 
 
+static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("opendir");
+	RECORD(opendir, path, 0, 0, 0);
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path);  
+
+	struct xmp_dir *d = calloc(1, sizeof(*d));
+	int res;
+
+	if (!d)
+		return -ENOMEM;
+	d->dp = opendir(newPath);
+	if (d->dp == NULL) {
+		res = -errno;
+		free(d);
+		return res;
+	}
+	fi->fh = (uintptr_t) d;
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+//full attributes of entry name of directory d, for readdirplus; -errno if
+//there are none to give
+static int direntAttr(struct xmp_dir *d, const char *dirPath,
+		      const char *name, struct stat *st)
+{
+	char entPath[2 * PATH_MAX];
+	struct file_lock *lock;
+	ino_t ino;
+	int res;
+
+	if (fstatat(dirfd(d->dp), name, st, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+	if (!S_ISREG(st->st_mode))
+		return 0;
+	if (snprintf(entPath, sizeof(entPath), "%s/%s", dirPath, name) >=
+	    (int) sizeof(entPath))
+		return -ENAMETOOLONG;
+	//as in getattr, keep writers out while the size is worked out; one
+	//may have renamed a new version over the entry in the meantime
+	ino = st->st_ino;
+	lock = lock_acquire(st->st_dev, ino, LOCK_SHARED);
+	if (!lock)
+		return -ENOMEM;
+	if (fstatat(dirfd(d->dp), name, st, AT_SYMLINK_NOFOLLOW) == -1)
+		res = -errno;
+	else if (st->st_ino != ino)
+		res = -ESTALE;
+	else
+		res = plainAttr(entPath, st);
+	lock_release(lock);
+	return res;
+}
+#endif
+
+//lists the directory from offset on, as far as the kernel's buffer goes.
+//offsets are telldir() positions, so a listing of any size is handed out
+//a buffer at a time from the DIR kept open since opendir
+#if FUSE_USE_VERSION >= 30
+static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi,
+		       enum fuse_readdir_flags flags)
+#else
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
+#endif
 {
+	TRACE_SPAN("readdir");
+	RECORD(readdir, path, offset, 0, 0);
 
+	struct xmp_dir *d = (struct xmp_dir *) (uintptr_t) fi->fh;
+	struct stat st;
+	off_t next;
+#if FUSE_USE_VERSION >= 30
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path);  
 
-	DIR *dp;
-	struct dirent *de;
-
-	(void) offset;
-	(void) fi;
+	enum fuse_fill_dir_flags fill;
+#else
+	(void) path;
+#endif
 
-	dp = opendir(newPath);
-	if (dp == NULL)
-		return -errno;
+	if (!d)
+		return -EBADF;
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
+	for (;;) {
+		if (!d->entry) {
+			d->entry = readdir(d->dp);
+			if (!d->entry)
+				break;
+		}
+		next = telldir(d->dp);
+		//scratch and write-aside files are ours, not the user's
+		if (strncmp(d->entry->d_name, ".pa4-encfs-", 11)) {
+			memset(&st, 0, sizeof(st));
+			st.st_ino = d->entry->d_ino;
+			st.st_mode = d->entry->d_type << 12;
+#if FUSE_USE_VERSION >= 30
+			//readdirplus: hand the kernel the full attributes now so
+			//it doesn't come back with a getattr for every entry
+			fill = 0;
+			if (flags & FUSE_READDIR_PLUS) {
+				if (direntAttr(d, newPath, d->entry->d_name, &st) == 0) {
+					fill = FUSE_FILL_DIR_PLUS;
+				} else {
+					memset(&st, 0, sizeof(st));
+					st.st_ino = d->entry->d_ino;
+					st.st_mode = d->entry->d_type << 12;
+				}
+			}
+			//a full buffer keeps the entry for the next call
+			if (filler(buf, d->entry->d_name, &st, next, fill))
+				break;
+#else
+			if (filler(buf, d->entry->d_name, &st, next))
+				break;
+#endif
+		}
+		d->entry = NULL;
+		d->offset = next;
 	}
+	return 0;
+}
+
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("releasedir");
+	RECORD(releasedir, path, 0, 0, 0);
+	struct xmp_dir *d = (struct xmp_dir *) (uintptr_t) fi->fh;
 
-	closedir(dp);
+	(void) path;
+	if (d) {
+		closedir(d->dp);
+		free(d);
+		fi->fh = 0;
+	}
 	return 0;
 }
 
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+	TRACE_SPAN("mknod");
+	RECORD(mknod, path, 0, 0, mode);
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
@@ -288,9 +537,9 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifo(newPath, mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknod(newPath, mode, rdev);
 	if (res == -1)
 		return -errno;
 
@@ -299,6 +548,8 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int xmp_mkdir(const char *path, mode_t mode)
 {
+	TRACE_SPAN("mkdir");
+	RECORD(mkdir, path, 0, 0, mode);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -313,24 +564,72 @@ static int xmp_mkdir(const char *path, mode_t mode)
 	return 0;
 }
 
+//whether newPath is the last link of an encrypted file. the other
+//stripes of a striped file go with it, as do the staging file of a
+//pending one, the record of a packed one and the chunk references of a
+//deduplicated one, whose table is read once its name is gone: *fd is
+//opened on it. called with the file locked exclusive
+static int lastLink(const char *newPath, struct fmt_meta *meta, int *fd)
+{
+	struct stat st;
+	int last;
+
+	*fd = -1;
+	last = lstat(newPath, &st) == 0 && S_ISREG(st.st_mode) &&
+	       st.st_nlink == 1 && fmt_get_path(newPath, meta) > FMT_LEGACY;
+	if (last && meta->kind == FMT_DEDUP)
+		*fd = open(newPath, O_RDONLY);
+	return last;
+}
+
+//releases the storage lastLink() found once the name is gone (last 0
+//if it wasn't removed after all), and closes its descriptor
+static void dropLastLink(int last, int fd, const struct fmt_meta *meta)
+{
+	if (last && meta->kind == FMT_PENDING)
+		defer_remove(meta);
+	else if (last)
+		fmt_remove(fd, meta);
+	if (fd != -1)
+		close(fd);
+}
+
 static int xmp_unlink(const char *path)
 {
+	TRACE_SPAN("unlink");
+	RECORD(unlink, path, 0, 0, 0);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
 
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	int last;
 	int res;
+	int fd;
 
+	//the lock keeps the file from being encrypted in between
+	lock = lock_path(newPath, LOCK_EXCLUSIVE);
+	if (!lock && errno)
+		return -errno;
+	last = lastLink(newPath, &meta, &fd);
+	invalidatePath(newPath);
 	res = unlink(newPath);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	dropLastLink(res == 0 && last, fd, &meta);
+	lock_release(lock);
+	if (res < 0)
+		return res;
 
 	return 0;
 }
 
 static int xmp_rmdir(const char *path)
 {
+	TRACE_SPAN("rmdir");
+	RECORD(rmdir, path, 0, 0, 0);
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
@@ -346,45 +645,98 @@ static int xmp_rmdir(const char *path)
 
 static int xmp_symlink(const char *from, const char *to)
 {
-
+	TRACE_SPAN("symlink");
+	RECORD(symlink, to, 0, 0, 0);
+	//create a new path, the target is stored as given
+	char newTo[PATH_MAX];
+	fixPath(newTo,to);
 
 	int res;
 
-	res = symlink(from, to);
+	res = symlink(from, newTo);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int xmp_rename(const char *from, const char *to, unsigned int flags)
+#else
 static int xmp_rename(const char *from, const char *to)
+#endif
 {
-
-
+	TRACE_SPAN("rename");
+	RECORD2(rename, from, 0, 0, 0, to, 0);
+	//create new paths
+	char newFrom[PATH_MAX];
+	char newTo[PATH_MAX];
+	fixPath(newFrom,from);
+	fixPath(newTo,to);
+
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	struct stat a, b;
+	int last = 0;
 	int res;
+	int fd = -1;
 
-	res = rename(from, to);
-	if (res == -1)
+#if FUSE_USE_VERSION >= 30
+	if (flags)
+		return -EINVAL;
+#endif
+
+	//a file renamed over loses a link like in xmp_unlink(), unless both
+	//names are links of the same file (then rename() does nothing)
+	lock = lock_path(newTo, LOCK_EXCLUSIVE);
+	if (!lock && errno && errno != ENOENT)
 		return -errno;
+	if (lock && !(lstat(newFrom, &a) == 0 && lstat(newTo, &b) == 0 &&
+		      a.st_dev == b.st_dev && a.st_ino == b.st_ino)) {
+		last = lastLink(newTo, &meta, &fd);
+		invalidatePath(newTo);
+	}
+	res = rename(newFrom, newTo);
+	if (res == -1)
+		res = -errno;
+	dropLastLink(res == 0 && last, fd, &meta);
+	lock_release(lock);
+	if (res < 0)
+		return res;
 
 	return 0;
 }
 
 static int xmp_link(const char *from, const char *to)
 {
-
+	TRACE_SPAN("link");
+	RECORD2(link, from, 0, 0, 0, to, 0);
+	//create new paths
+	char newFrom[PATH_MAX];
+	char newTo[PATH_MAX];
+	fixPath(newFrom,from);
+	fixPath(newTo,to);
 
 	int res;
 
-	res = link(from, to);
+	res = link(newFrom, newTo);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int xmp_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+#else
 static int xmp_chmod(const char *path, mode_t mode)
+#endif
 {
+	TRACE_SPAN("chmod");
+	RECORD(chmod, path, 0, 0, mode);
+#if FUSE_USE_VERSION >= 30
+	(void) fi;
+#endif
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -399,8 +751,18 @@ static int xmp_chmod(const char *path, mode_t mode)
 	return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int xmp_chown(const char *path, uid_t uid, gid_t gid,
+		     struct fuse_file_info *fi)
+#else
 static int xmp_chown(const char *path, uid_t uid, gid_t gid)
+#endif
 {
+	TRACE_SPAN("chown");
+	RECORD(chown, path, 0, 0, 0);
+#if FUSE_USE_VERSION >= 30
+	(void) fi;
+#endif
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -415,24 +777,150 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 	return 0;
 }
 
+static int convertLegacy(const char *newPath, const char *buf, size_t size,
+			 off_t offset, int direct);
+
+//moves a packed file that is about to outgrow the pack store into a
+//chunked file of its own, called with the file locked exclusive
+static int promotePacked(const char *newPath)
+{
+	struct fmt_meta meta;
+	struct stat st;
+	int fd, res;
+
+	fd = open(newPath, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	res = fmt_get(fd, &meta);
+	if (res == FMT_PACKED)
+		res = pack_promote(fd, &meta) ? (errno ? -errno : -EIO) : 0;
+	else if (res > 0)
+		res = 0;
+	cache_invalidate(st.st_dev, st.st_ino);
+	meta_invalidate(st.st_dev, st.st_ino);
+	close(fd);
+	return res;
+}
+
+//truncate body for chunked files, called with the file locked exclusive
+static int truncateChunked(const char *newPath, off_t size)
+{
+	struct fmt_meta meta;
+	struct stat st;
+	int fd, res;
+
+	fd = open(newPath, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	res = fmt_get(fd, &meta);
+	if (res >= 0)
+		res = fmt_truncate(fd, &meta, size) ? (errno ? -errno : -EIO) : 0;
+	//the size getattr sees changes with the lock still held
+	cache_invalidate(st.st_dev, st.st_ino);
+	meta_invalidate(st.st_dev, st.st_ino);
+	close(fd);
+	return res;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int xmp_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+#else
 static int xmp_truncate(const char *path, off_t size)
+#endif
 {
+	TRACE_SPAN("truncate");
+	SCHED_FOREGROUND;
+	RECORD(truncate, path, size, 0, 0);
+#if FUSE_USE_VERSION >= 30
+	(void) fi;
+#endif
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
 
+	struct file_lock *lock;
+	struct fmt_meta meta;
 	int res;
 
-	res = truncate(newPath, size);
-	if (res == -1)
+again:
+	lock = lock_path(newPath, LOCK_EXCLUSIVE);
+	if (!lock && errno)
 		return -errno;
+	res = fmt_get_path(newPath, &meta);
+	if (res < 0) {
+		lock_release(lock);
+		return res;
+	}
+	//the plaintext of a pending file is in its staging file
+	if (res == FMT_PENDING) {
+		char stage[PATH_MAX + 64];
 
-	return 0;
+		res = stagePath(stage, &meta);
+		if (!res && truncate(stage, size) == -1)
+			res = -errno;
+		lock_release(lock);
+		return res;
+	}
+	//a single CBC stream can't be cut anywhere but at its end, switch
+	//the file over and start again on the new one
+	if (res == FMT_LEGACY) {
+		res = convertLegacy(newPath, NULL, 0, 0, 0);
+		lock_release(lock);
+		if (res)
+			return res;
+		goto again;
+	}
+	if (res == FMT_PACKED && (size_t) size > pack_threshold()) {
+		res = promotePacked(newPath);
+		lock_release(lock);
+		if (res)
+			return res;
+		goto again;
+	}
+	if (res == FMT_CHUNKED || res == FMT_PACKED || res == FMT_DEDUP) {
+		res = truncateChunked(newPath, size);
+	} else {
+		invalidatePath(newPath);
+		res = truncate(newPath, size) == -1 ? -errno : 0;
+	}
+	lock_release(lock);
+	return res;
+}
+
+#if FUSE_USE_VERSION < 30
+//FUSE 2 has a separate op for truncating an open file, the FUSE 3 one
+//passes the handle to truncate
+static int xmp_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
+{
+	(void) fi;
+	return xmp_truncate(path, size);
 }
+#endif
 
+#if FUSE_USE_VERSION >= 30
+static int xmp_utimens(const char *path, const struct timespec ts[2],
+		       struct fuse_file_info *fi)
+#else
 static int xmp_utimens(const char *path, const struct timespec ts[2])
+#endif
 {
+	TRACE_SPAN("utimens");
+	RECORD(utimens, path, 0, 0, 0);
+#if FUSE_USE_VERSION >= 30
+	(void) fi;
+#endif
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
@@ -451,8 +939,73 @@ static int xmp_utimens(const char *path, const struct timespec ts[2])
 	return 0;
 }
 
+//direct I/O for a file? Big streaming files are read and written around
+//both the FUSE and the backing page cache, so they don't push everything
+//else out of memory
+static int wantDirect(const char *path)
+{
+	int i;
+
+	if (directAll)
+		return 1;
+	for (i = 0; i < nDirectPatterns; i++)
+		if (!fnmatch(directPatterns[i], path, 0))
+			return 1;
+	return 0;
+}
+
+static int isDirect(struct fuse_file_info *fi)
+{
+	return fi && fi->fh && ((struct xmp_file *) (uintptr_t) fi->fh)->direct;
+}
+
+//opens a backing file with O_DIRECT, quietly falling back to buffered
+//I/O on filesystems that don't support it (tmpfs and friends)
+static int openDirect(const char *newPath, int flags)
+{
+	int fd = open(newPath, flags | O_DIRECT);
+
+	if (fd == -1 && errno == EINVAL)
+		fd = open(newPath, flags);
+	return fd;
+}
+
+//sets up the per-handle state released in xmp_release
+static int newHandle(const char *path, const char *newPath,
+		     struct fuse_file_info *fi)
+{
+	struct xmp_file *xf;
+
+	xf = calloc(1, sizeof(*xf));
+	if (!xf)
+		return -ENOMEM;
+	if (wantDirect(path)) {
+		xf->direct = 1;
+		fi->direct_io = 1;
+	} else {
+		xf->stream = prefetch_open(newPath);
+	}
+	fi->fh = (uintptr_t) xf;
+	return 0;
+}
+
+//keeps a pending file from being encrypted while the handle is open, it
+//would only move the handle's reads and writes to the slow path
+static void trackPending(const char *newPath, struct fuse_file_info *fi)
+{
+	struct xmp_file *xf = (struct xmp_file *) (uintptr_t) fi->fh;
+	struct fmt_meta meta;
+
+	if (fmt_get_path(newPath, &meta) == FMT_PENDING &&
+	    defer_open(newPath, &xf->dev, &xf->ino) == 0)
+		xf->pending = 1;
+}
+
 static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
+	TRACE_SPAN("open");
+	SCHED_FOREGROUND;
+	RECORD(open, path, 0, 0, fi->flags);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -460,345 +1013,521 @@ static int xmp_open(const char *path, struct fuse_file_info *fi)
 
 	int res;
 
-	res = open(newPath, fi->flags);
+	//truncation is done through xmp_truncate so the ciphertext is
+	//never cut underneath us
+	res = open(newPath, fi->flags & ~O_TRUNC);
 	if (res == -1)
 		return -errno;
 
 	close(res);
+	res = newHandle(path, newPath, fi);
+	if (res)
+		return res;
+	trackPending(newPath, fi);
 	return 0;
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+//pread of an unencrypted file, through an aligned bounce buffer for
+//direct handles
+static int readPlain(const char *newPath, char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
 {
-        fprintf(stderr,"Entered read\n");
-
-	//create a new path 
-	char newPath[PATH_MAX]; 
-	char tmpPath[PATH_MAX]; 
-	//fix both the paths
-	fixPath(newPath,path); 
-	fixPath(tmpPath,"/tmpreadfile.txt"); 
-	fprintf(stderr,"created this path:%s\n",tmpPath);
-        fprintf(stderr,"real this path:%s\n",newPath);
-
+	off_t astart, aend;
+	char *abuf;
 	int fd;
 	int res;
-	(void) fi; //void fi to avoid warning
-
-
-	//========== begin of encryption check =============
-	int encrypted=0; // indicates whether its encrypted or not 
-	int action = 0; // this indicates decrypt 
-	char* tmpval = NULL;
-        ssize_t valsize = 0;
-	FILE* file = NULL; 
-	FILE* tmpfile = NULL; 
-
-	/* Get attribute value size */
-	valsize = getxattr(newPath, "user.pa4-encfs.encrypted", NULL, 0);
-	if(valsize < 0){
-	    if(errno == ENOATTR)
-	    {
-		fprintf(stdout, "No %s attribute set on %s\n", "user.pa4-encfs.encrypted", newPath);
-		//instead of exiting do the read operation 
-
-
 
+	if (!isDirect(fi)) {
 		fd = open(newPath, O_RDONLY);
-
 		if (fd == -1)
 			return -errno;
-
 		res = pread(fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
-
 		close(fd);
-		//remove the tmp file we created
-		remove(tmpPath); 
 		return res;
-		//return EXIT_SUCCESS;
-	    }
-	    else 
-             {
-		perror("getxattr error");
-		exit(EXIT_FAILURE);
-	    }
-	}
-	/* Malloc Value Space */
-	tmpval = malloc(sizeof(*tmpval)*(valsize+1));
-	if(!tmpval){
-	    perror("malloc of 'tmpval' error");
-	    exit(EXIT_FAILURE);
-	}
-	/* Get attribute value */
-	valsize = getxattr(newPath,  "user.pa4-encfs.encrypted", tmpval, valsize);
-	if(valsize < 0){
-	    if(errno == ENOATTR){
-		fprintf(stdout, "No %s attribute set on %s\n", "user.pa4-encfs.encrypted", newPath);
-		free(tmpval);
-		//instead of exiting do the read operation 
-		fd = open(newPath, O_RDONLY);
+	}
+
+	astart = offset - offset % DIRECT_ALIGN;
+	aend = offset + size;
+	if (aend % DIRECT_ALIGN)
+		aend += DIRECT_ALIGN - aend % DIRECT_ALIGN;
+	abuf = arena_get(aend - astart);
+	if (!abuf)
+		return -ENOMEM;
+	fd = openDirect(newPath, O_RDONLY);
+	if (fd == -1) {
+		res = -errno;
+		arena_put(abuf, aend - astart);
+		return res;
+	}
+	res = pread(fd, abuf, aend - astart, astart);
+	if (res == -1) {
+		res = -errno;
+	} else {
+		res -= offset - astart;
+		if (res < 0)
+			res = 0;
+		if ((size_t) res > size)
+			res = size;
+		memcpy(buf, abuf + (offset - astart), res);
+	}
+	close(fd);
+	arena_put(abuf, aend - astart);
+	return res;
+}
 
+//pwrite of an unencrypted file. Direct handles do an aligned
+//read-modify-write, which is safe since writes hold the file exclusive.
+static int writePlain(const char *newPath, const char *buf, size_t size,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	off_t astart, aend;
+	struct stat st;
+	char *abuf;
+	ssize_t got;
+	int fd;
+	int res;
+
+	if (!isDirect(fi)) {
+		fd = open(newPath, O_WRONLY);
 		if (fd == -1)
 			return -errno;
-
-		res = pread(fd, buf, size, offset);
+		res = pwrite(fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
-
 		close(fd);
-		//remove the tmp file we created
-		remove(tmpPath); 
 		return res;
+	}
 
+	astart = offset - offset % DIRECT_ALIGN;
+	aend = offset + size;
+	if (aend % DIRECT_ALIGN)
+		aend += DIRECT_ALIGN - aend % DIRECT_ALIGN;
+	abuf = arena_get(aend - astart);
+	if (!abuf)
+		return -ENOMEM;
+	fd = openDirect(newPath, O_RDWR);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
 
-
-		//return EXIT_SUCCESS;
-	    }
-	    else{
-		perror("getxattr error");
-		free(tmpval);
-		exit(EXIT_FAILURE);
-	    }
-	}
-
-	/* Print Value */
-	tmpval[valsize] = '\0';
-	fprintf(stdout, "%s = %s\n", "user.pa4-encfs.encrypted", tmpval);
-
-	//once we have the flag actually check to see if this file is encrypted 
-	if (!strcmp(tmpval,"true"))
-	{
-		encrypted  =1; //mark that the file was encrypted 
-        	fprintf(stderr,"flag indicated it's encrypted\n");
-		//decrypt it 
-		/* Open Files */
-		    file = fopen(newPath,"r");
-		    tmpfile = fopen(tmpPath,"w");
-		    if(!file){
-			fprintf(stderr, "failed to open infile\n");
-			return EXIT_FAILURE;
-		    }
-
-		    /* Perform do_crpt action (encrypt, decrypt, copy) */
-		    if(!do_crypt(file, tmpfile, action,key_str)){
-			fprintf(stderr, "do_crypt failure\n");
-			return -errno; 
-		    }
-
-		    /* Cleanup */
-		    if(fclose(file)){
-				return -errno;
-		    }
-	            if(fclose(tmpfile)){
-				return -errno;
-		    }
+	got = pread(fd, abuf, aend - astart, astart);
+	if (got == -1) {
+		res = -errno;
+		goto out;
+	}
+	memset(abuf + got, 0, (aend - astart) - got);
+	memcpy(abuf + (offset - astart), buf, size);
+	if (pwrite(fd, abuf, aend - astart, astart) == -1) {
+		res = -errno;
+		goto out;
 	}
+	//the aligned write may have run past the real end of file
+	if (aend > st.st_size && aend > offset + (off_t) size &&
+	    ftruncate(fd, st.st_size > offset + (off_t) size ?
+		      st.st_size : offset + (off_t) size) == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = size;
 
-	free(tmpval);
-	//========== end of encryption check =============
+out:
+	if (fd != -1)
+		close(fd);
+	arena_put(abuf, aend - astart);
+	return res;
+}
 
-	//if encrypted, decrypt the file, if it's not encrypted don't decrypt 
-	if (!encrypted)
-	{
-		fd = open(newPath, O_RDONLY);
-	}	
+//reads plaintext of an encrypted file block by block through the plaintext
+//cache and feeds the handle's access pattern to the decrypt-ahead code
+static int readEncrypted(const char *newPath, char *buf, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct xmp_file *xf = fi ? (struct xmp_file *) (uintptr_t) fi->fh : NULL;
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	struct stat st, cur;
+	ssize_t res;
+	int hits = 0;
+	int fd;
 
-	else
-	{
-	//if it is encrypted, open the tmp file we created 
-		fprintf(stderr,"opening: %s",tmpPath);
-		fd = open(tmpPath, O_RDONLY);
-	}
+again:
+	fd = xf && xf->direct ? openDirect(newPath, O_RDONLY) : open(newPath, O_RDONLY);
 	if (fd == -1)
 		return -errno;
-
-	res = pread(fd, buf, size, offset);
-	if (res == -1)
+	if (fstat(fd, &st) == -1) {
 		res = -errno;
+		close(fd);
+		return res;
+	}
+	lock = lock_acquire(st.st_dev, st.st_ino, LOCK_SHARED);
+	//a writer may have been in before we got the lock
+	if (!lock || fstat(fd, &st) == -1) {
+		lock_release(lock);
+		close(fd);
+		return lock ? -errno : -ENOMEM;
+	}
+	//and may have renamed a new version over the one we opened
+	if (lstat(newPath, &cur) == 0 && cur.st_ino != st.st_ino) {
+		lock_release(lock);
+		close(fd);
+		goto again;
+	}
+	res = fmt_get(fd, &meta);
+	if (res < 0) {
+		lock_release(lock);
+		close(fd);
+		return res;
+	}
 
+	STAT_INC(enc_reads);
+	//direct handles skip the plaintext cache as well, it would just be a
+	//third copy of the data. so do packed files, which are one pread
+	//of their record anyway
+	if ((xf && xf->direct) || meta.kind == FMT_PACKED)
+		res = fmt_pread(fd, &meta, buf, size, offset);
+	else
+		res = cache_read(fd, &st, buf, size, offset, &meta, &hits);
+	lock_release(lock);
 	close(fd);
-	//remove the tmp file we created
-	remove(tmpPath); 
-	fprintf(stderr,"about to return fd!\n");
+	if (res < 0) {
+		fprintf(stderr, "decrypt failure on %s\n", newPath);
+		return -EIO;
+	}
+
+	if (xf)
+		prefetch_note_read(xf->stream, offset, res, hits);
 	return res;
 }
 
-static int xmp_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+//reads a pending file from its staging file, unless it was encrypted in
+//the meantime
+static int readPending(const char *newPath, char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
 {
-	(void) fi; 
+	char stage[PATH_MAX + 64];
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	int res;
 
-	fprintf(stderr,"Entered write\n");
+	lock = lock_path(newPath, LOCK_SHARED);
+	if (!lock && errno)
+		return -errno;
+	res = fmt_get_path(newPath, &meta);
+	if (res != FMT_PENDING) {
+		lock_release(lock);
+		if (res < 0)
+			return res;
+		return readEncrypted(newPath, buf, size, offset, fi);
+	}
+	res = stagePath(stage, &meta);
+	if (!res)
+		res = readPlain(stage, buf, size, offset, NULL);
+	lock_release(lock);
+	return res;
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	TRACE_SPAN("read");
+	SCHED_FOREGROUND;
+	RECORD(read, path, offset, size, 0);
+        fprintf(stderr,"Entered read\n");
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
-	char tmpPath[PATH_MAX]; 
-	//fix both the paths
 	fixPath(newPath,path); 
-	fixPath(tmpPath,"/tmpwritefile.txt"); 
-	fprintf(stderr,"created this path:%s\n",tmpPath);
-        fprintf(stderr,"real this path:%s\n",newPath);
-
-	int fd; 
-	int res; 
-
-	//========== begin of encryption check =============
-	int encrypted=0; // indicates whether its encrypted or not 
-	int action = 0; // this indicates decrypt 
-	char* tmpval = NULL;
-        ssize_t valsize = 0;
-	FILE* file = NULL; 
-	FILE* tmpfile = NULL; 
-
-	/* Get attribute value size */
-	valsize = getxattr(newPath, "user.pa4-encfs.encrypted", NULL, 0);
-	if(valsize < 0){
-	    if(errno == ENOATTR)
-	    {
-		fprintf(stdout, "No %s attribute set on %s\n", "user.pa4-encfs.encrypted", newPath);
-
-	    	//perform the write 
-		fprintf(stderr, "getxattr failed, attempting to write the file...\n"); 
-		fd = open(newPath, O_WRONLY);
-		if (fd == -1)
-			return -errno;
-		//perform the write 
-		res = pwrite(fd, buf, size, offset);
-		if (res == -1)
-			res = -errno;
-		close(fd); 
-		fprintf(stderr, "I think I wrote the file... returning.\n"); 
 
+	struct fmt_meta meta;
+	int kind;
 
-		return res;
-	    }
-	    else 
-             {
-		perror("getxattr error");
-		exit(EXIT_FAILURE);
-	    }
-	}
-	/* Malloc Value Space */
-	tmpval = malloc(sizeof(*tmpval)*(valsize+1));
-	if(!tmpval){
-	    perror("malloc of 'tmpval' error");
-	    exit(EXIT_FAILURE);
-	}
-	/* Get attribute value */
-	valsize = getxattr(newPath,  "user.pa4-encfs.encrypted", tmpval, valsize);
-	if(valsize < 0){
-	    if(errno == ENOATTR){
-		fprintf(stdout, "No %s attribute set on %s\n", "user.pa4-encfs.encrypted", newPath);
-		free(tmpval);
-
-		fprintf(stderr, "getxattr failed, attempting to write the file...\n"); 
-		//perform the write 
-		fd = open(newPath, O_WRONLY);
+	kind = fmt_get_path(newPath, &meta);
+	if (kind < 0)
+		return kind;
+
+	if (kind == FMT_PENDING)
+		return readPending(newPath, buf, size, offset, fi);
+
+	//if encrypted, decrypt only the blocks we need (through the cache)
+	if (kind != FMT_PLAIN)
+		return readEncrypted(newPath, buf, size, offset, fi);
+
+	return readPlain(newPath, buf, size, offset, fi);
+}
+
+//decrypts a whole do_crypt file
+static int decryptLegacy(FILE *in, FILE *out)
+{
+	TRACE_SPAN("decrypt");
+
+	return do_crypt(in, out, 0, fmt_legacy_key());
+}
+
+//removes a scratch or aside file
+static void removeTmp(const char *tmpPath)
+{
+	TRACE_SPAN("tmp_remove");
+
+	remove(tmpPath);
+}
+
+//copies every extended attribute (our flag included) of src onto fd,
+//except a hole list: fd's is its own
+static int copyXattrs(const char *src, int fd)
+{
+	char names[4096], value[4096];
+	ssize_t len, vlen;
+	char *name;
+
+	len = llistxattr(src, names, sizeof(names));
+	if (len == -1)
+		return errno == ENOTSUP ? 0 : -errno;
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		if (!strcmp(name, FMT_HOLES_ATTR))
+			continue;
+		vlen = lgetxattr(src, name, value, sizeof(value));
+		if (vlen == -1 || fsetxattr(fd, name, value, vlen, 0) == -1)
+			//only our own flag is required to read the file back
+			if (!strcmp(name, flag))
+				return -errno;
+	}
+	return 0;
+}
+
+//encrypts plain in the chunked format into a new file next to newPath and
+//renames it over newPath, so a crash leaves either the old or the new
+//ciphertext and never a truncated one. hard linked files are rewritten in
+//place since a rename would split them from their other names.
+static int commitAside(const char *newPath, FILE *plain, int direct)
+{
+	char asidePath[PATH_MAX + 64];
+	const char *base = strrchr(newPath, '/') + 1;
+	struct fmt_meta meta;
+	struct stat st;
+	int fd, res = 0;
 
+	if (lstat(newPath, &st) == -1)
+		return -errno;
+	if (fmt_new(&meta))
+		return -EIO;
+	if (st.st_nlink > 1) {
+		fd = direct ? openDirect(newPath, O_RDWR | O_TRUNC) :
+			      open(newPath, O_RDWR | O_TRUNC);
 		if (fd == -1)
 			return -errno;
-		//perform the write 
-		res = pwrite(fd, buf, size, offset);
-		if (res == -1)
-			res = -errno;
-		close(fd); 
-		fprintf(stderr, "I think I wrote the file... returning.\n"); 
+		if (fmt_import(fd, &meta, plain) || fmt_set(fd, &meta))
+			res = -EIO;
+		close(fd);
+		cache_invalidate(st.st_dev, st.st_ino);
+		if (!res)
+			STAT_INC(fmt_converted);
+		return res;
+	}
+
+	snprintf(asidePath, sizeof(asidePath), "%.*s.pa4-encfs-aside.%.32s.XXXXXX",
+		 (int) (base - newPath), newPath, base);
+	fd = mkstemp(asidePath);
+	if (fd == -1)
+		return -errno;
+	//write the new ciphertext around the page cache too
+	if (direct)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+	if (fmt_import(fd, &meta, plain)) {
+		res = -EIO;
+		goto fail;
+	}
+	if (fchmod(fd, st.st_mode & 07777) == -1) {
+		res = -errno;
+		goto fail;
+	}
+	//only works as root, otherwise the file already belongs to us
+	if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM) {
+		res = -errno;
+		goto fail;
+	}
+	res = copyXattrs(newPath, fd);
+	if (!res)
+		res = fmt_set(fd, &meta);
+	if (res)
+		goto fail;
+	//filesystems without rename-over-file ordering (ext4 and btrfs have
+	//it) could otherwise persist the rename before the data, which
+	//has to be out of the write-back tier first. no filesystem orders
+	//the rename after stripes on other filesystems
+	if (orderedWrites || meta.stripes > 1) {
+		res = fmt_fdatasync(fd, &meta);
+		if (res)
+			goto fail;
+	}
+	close(fd);
+	if (rename(asidePath, newPath) == -1) {
+		res = -errno;
+		removeTmp(asidePath);
 		return res;
-	    }
-	    else{
-		perror("getxattr error");
-		free(tmpval);
-		exit(EXIT_FAILURE);
-	    }
-	}
-
-	/* Print Value */
-	tmpval[valsize] = '\0';
-	fprintf(stdout, "%s = %s\n", "user.pa4-encfs.encrypted", tmpval);
-
-	//once we have the flag actually check to see if this file is encrypted 
-	if (!strcmp(tmpval,"true"))
-	{
-		encrypted  =1; //mark that the file was encrypted 
-        	fprintf(stderr,"flag indicated it's encrypted\n");
-		//decrypt it 
-		/* Open Files */
-		    file = fopen(newPath,"r");
-		    tmpfile = fopen(tmpPath,"w");
-		    if(!file){
-			fprintf(stderr, "failed to open infile\n");
-			return EXIT_FAILURE;
-		    }
-
-		    /* Perform do_crpt action (encrypt, decrypt, copy) */
-		    if(!do_crypt(file, tmpfile, action,key_str)){
-			fprintf(stderr, "do_crypt failure\n");
-			//return -errno; 
-		    }
-
-		    /* Cleanup */
-		    if(fclose(file)){
-				return -errno;
-		    }
-		    if(fclose(tmpfile)){
-				return -errno;
-		    }
 	}
+	STAT_INC(aside_writes);
+	STAT_INC(fmt_converted);
+	cache_invalidate(st.st_dev, st.st_ino);
+	tier_invalidate(st.st_dev, st.st_ino);
+	return 0;
 
-	free(tmpval);
-	//========== end of encryption check =============
+fail:
+	close(fd);
+	removeTmp(asidePath);
+	return res;
+}
 
-	//if encrypted, decrypt the file, if it's not encrypted don't decrypt 
-	if (!encrypted)
-	{
-		fd = open(newPath, O_WRONLY);
-	}	
+//rewrites a do_crypt file in the chunked format, applying a write on the
+//way when buf is given
+static int convertLegacy(const char *newPath, const char *buf, size_t size,
+			 off_t offset, int direct)
+{
+	char tmpPath[PATH_MAX];
+	FILE *file, *tmpfile;
+	int res;
 
-	else
-	{
-	//if it is encrypted, open the tmp file we created 
-		fprintf(stderr,"opening: %s",tmpPath);
-		fd = open(tmpPath, O_WRONLY);
+	fixTmpPath(tmpPath,"convert");
+	file = fopen(newPath,"r");
+	if (!file)
+		return -errno;
+	tmpfile = fopen(tmpPath,"w+");
+	if (!tmpfile) {
+		res = -errno;
+		fclose(file);
+		return res;
 	}
+	if (!decryptLegacy(file, tmpfile)) {
+		fprintf(stderr, "do_crypt failure\n");
+		res = -EIO;
+	} else if (fflush(tmpfile) ||
+		   (buf && pwrite(fileno(tmpfile), buf, size, offset) != (ssize_t) size)) {
+		res = -errno;
+	} else {
+		rewind(tmpfile);
+		res = commitAside(newPath, tmpfile, direct);
+	}
+	fclose(file);
+	fclose(tmpfile);
+	removeTmp(tmpPath);
+	return res;
+}
+
+//writes into a chunked file in place, only the chunks the write touches
+//are re-encrypted (see encfs-format.h)
+static int writeChunked(const char *newPath, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct fmt_meta meta;
+	struct stat st;
+	ssize_t res;
+	int fd;
 
+	fd = isDirect(fi) ? openDirect(newPath, O_RDWR) : open(newPath, O_RDWR);
 	if (fd == -1)
 		return -errno;
-	//perform the write 
-	res = pwrite(fd, buf, size, offset);
-	if (res == -1)
+	if (fstat(fd, &st) == -1) {
 		res = -errno;
+		close(fd);
+		return res;
+	}
+	res = fmt_get(fd, &meta);
+	if (res >= 0) {
+		res = fmt_pwrite(fd, &meta, buf, size, offset);
+		if (res == -1)
+			res = errno ? -errno : -EIO;
+	}
+	cache_invalidate(st.st_dev, st.st_ino);
+	//the stub of a packed file keeps its size
+	if (meta.kind == FMT_PACKED)
+		meta_invalidate(st.st_dev, st.st_ino);
 	close(fd);
+	return res;
+}
 
-	//open the two files back up
-	file = fopen(newPath,"w+");
-	tmpfile = fopen(tmpPath,"r+");
+//write body, called with the file locked exclusive
+static int writeLocked(const char *path, const char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
 
-	action = 1; //set back to encrypting. 
-	/* Perform do_crpt action (encrypt, decrypt, copy) */
-	    if(!do_crypt(tmpfile, file, action,key_str)){
-		fprintf(stderr, "do_crypt failure\n");
-		//return -errno; 
-	    }
+	fprintf(stderr,"Entered write\n");
 
-	/* Cleanup */
-		    if(fclose(file)){
-				return -errno;
-		    }
-		    if(fclose(tmpfile)){
-				return -errno;
-		    }
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path); 
 
+	struct fmt_meta meta;
+	int res;
+
+	res = fmt_get_path(newPath, &meta);
+	if (res < 0)
+		return res;
+	if (res == FMT_PLAIN)
+		return writePlain(newPath, buf, size, offset, fi);
+
+	//pending files stay plaintext in the staging area until the
+	//background encryption gets to them
+	if (res == FMT_PENDING) {
+		char stage[PATH_MAX + 64];
+
+		res = stagePath(stage, &meta);
+		if (res)
+			return res;
+		return writePlain(stage, buf, size, offset, NULL);
+	}
+
+	//small files live in the pack store until a write makes them too big
+	//for it
+	if (res == FMT_PACKED && offset + size > pack_threshold()) {
+		res = promotePacked(newPath);
+		if (res)
+			return res;
+		res = FMT_CHUNKED;
+	}
+
+	//chunked files are updated in place, no need to decrypt them,
+	//packed ones get a new record and deduplicated ones new chunk IDs
+	if (res == FMT_CHUNKED || res == FMT_PACKED || res == FMT_DEDUP)
+		return writeChunked(newPath, buf, size, offset, fi);
 
+	//do_crypt files are decrypted, written and re-encrypted as chunked
+	res = convertLegacy(newPath, buf, size, offset, isDirect(fi));
+	if (res < 0) {
+		fprintf(stderr, "commitAside failure on %s\n", newPath);
+		return res;
+	}
+	return size;
+}
+
+static int xmp_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("write");
+	SCHED_FOREGROUND;
+	RECORD(write, path, offset, size, 0);
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path); 
+
+	struct file_lock *lock;
+	int res;
 
-	remove(tmpPath); 
+	//the encrypted rewrite truncates the backing file, nobody may be
+	//reading it meanwhile
+	lock = lock_path(newPath, LOCK_EXCLUSIVE);
+	if (!lock && errno)
+		return -errno;
+	res = writeLocked(path, buf, size, offset, fi);
+	lock_release(lock);
 	return res;
 }
 
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
+	TRACE_SPAN("statfs");
+	RECORD(statfs, path, 0, 0, 0);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -813,88 +1542,594 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 	return 0;
 }
 
-static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi)
+{
+	TRACE_SPAN("create");
+	SCHED_FOREGROUND;
+	RECORD(create, path, 0, 0, mode);
+
+	//create a new path
+	char newPath[PATH_MAX];
+	fixPath(newPath,path);
+
+	struct fmt_meta meta;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	int res;
+
+	//new files are chunked, and an empty chunked file is just the flag.
+	//with --pack-small they start out packed (an empty packed file is
+	//just the flag too), with --defer-encrypt pending
+	fd = open(newPath, O_CREAT | O_WRONLY | O_TRUNC, mode);
+	if (fd == -1)
+		return -errno;
+
+	meta.kind = FMT_PLAIN;
+	res = fmt_new(&meta) ? -EIO : 0;
+	//deduplicated files are not deferred, a chunk that is already stored
+	//isn't encrypted again anyway
+	if (res == 0)
+		res = pack_new(&meta) || meta.kind == FMT_DEDUP ? 0 :
+		      defer_create(fd, &meta, &dev, &ino);
+	if (res == 0)
+		res = fmt_set(fd, &meta);
+	if (close(fd) && res >= 0)
+		res = -errno;
+	if (res >= 0)
+		res = newHandle(path, newPath, fi);
+	if (res < 0)
+		goto fail;
+	if (meta.kind == FMT_PENDING) {
+		struct xmp_file *xf = (struct xmp_file *) (uintptr_t) fi->fh;
+
+		xf->pending = 1;
+		xf->dev = dev;
+		xf->ino = ino;
+	}
+	return 0;
+
+fail:
+	//a backing file without the format flag would be taken for a plain
+	//file, and store whatever is written to it in the clear
+	unlink(newPath);
+	if (meta.kind == FMT_PENDING) {
+		defer_remove(&meta);
+		defer_release(dev, ino);
+	}
+	return res;
+}
+
+
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+//copies a whole encrypted file by moving its ciphertext instead of
+//decrypting and re-encrypting it. The ciphertext depends on the source's
+//format xattr (chunk IVs come from its nonce), so it is only reusable when
+//the destination ends up as an exact copy of the source and takes over
+//that xattr too: len has to cover the whole source, and the destination
+//can't be longer.
+static ssize_t copyCiphertext(const char *inPath, const char *outPath,
+			      size_t len)
+{
+	int in, out;
+	off_t plainSize, outSize, cipherSize;
+	off_t inOff = 0, outOff = 0;
+	struct stat inSt, outSt;
+	struct fmt_meta inMeta, outMeta;
+	struct file_lock *inLock = NULL, *outLock = NULL;
+	ssize_t res;
+
+	in = open(inPath, O_RDONLY);
+	if (in == -1)
+		return -errno;
+	out = open(outPath, O_WRONLY);
+	if (out == -1) {
+		res = -errno;
+		close(in);
+		return res;
+	}
+	if (fstat(in, &inSt) == -1 || fstat(out, &outSt) == -1) {
+		res = -errno;
+		goto out;
+	}
+	if (inSt.st_ino == outSt.st_ino && inSt.st_dev == outSt.st_dev) {
+		res = -EXDEV;
+		goto out;
+	}
+	//always lock in (dev, ino) order so two opposite copies can't deadlock
+	if (inSt.st_dev < outSt.st_dev ||
+	    (inSt.st_dev == outSt.st_dev && inSt.st_ino < outSt.st_ino)) {
+		inLock = lock_acquire(inSt.st_dev, inSt.st_ino, LOCK_SHARED);
+		outLock = lock_acquire(outSt.st_dev, outSt.st_ino, LOCK_EXCLUSIVE);
+	} else {
+		outLock = lock_acquire(outSt.st_dev, outSt.st_ino, LOCK_EXCLUSIVE);
+		inLock = lock_acquire(inSt.st_dev, inSt.st_ino, LOCK_SHARED);
+	}
+	if (!inLock || !outLock) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	if (fmt_get(in, &inMeta) < 0 || fmt_get(out, &outMeta) < 0) {
+		res = -EIO;
+		goto out;
+	}
+	//stripe files and pack records are named after the nonce, a copy
+	//would share them, a copied dedup table wouldn't hold references to
+	//its chunks, and pending files have no ciphertext yet
+	if (inMeta.stripes > 1 || outMeta.stripes > 1 ||
+	    inMeta.kind == FMT_PENDING || outMeta.kind == FMT_PENDING ||
+	    inMeta.kind == FMT_PACKED || outMeta.kind == FMT_PACKED ||
+	    inMeta.kind == FMT_DEDUP || outMeta.kind == FMT_DEDUP) {
+		res = -EXDEV;
+		goto out;
+	}
+	plainSize = fmt_size(in, &inMeta);
+	outSize = fmt_size(out, &outMeta);
+	cipherSize = lseek(in, 0, SEEK_END);
+	if (plainSize < 0 || cipherSize < 0) {
+		res = -EIO;
+		goto out;
+	}
+	//a shorter copy would take the rest of the source along, and
+	//anything in the destination past the copied range would be lost
+	if ((off_t) len < plainSize || outSize > plainSize) {
+		res = -EXDEV;
+		goto out;
+	}
+
+	//the ciphertext has to be all in the backing files, and what the tier
+	//holds of the destination is about to be stale
+	res = tier_sync(inSt.st_dev, inSt.st_ino);
+	if (res)
+		goto out;
+	tier_invalidate(outSt.st_dev, outSt.st_ino);
+	while (inOff < cipherSize) {
+		res = copy_file_range(in, &inOff, out, &outOff,
+				      cipherSize - inOff, 0);
+		if (res == -1) {
+			res = -errno;
+			goto out;
+		}
+		if (res == 0)
+			break;
+	}
+	if (inOff != cipherSize || ftruncate(out, cipherSize) == -1) {
+		res = inOff != cipherSize ? -EIO : -errno;
+		goto out;
+	}
+	res = fmt_set(out, &inMeta);
+	//the slots keep their nonce, so their hole list still holds
+	if (!res)
+		res = fmt_copy_holes(in, out);
+	if (res)
+		goto out;
+	invalidatePath(outPath);
+	res = plainSize;
+
+out:
+	lock_release(outLock);
+	lock_release(inLock);
+	close(in);
+	close(out);
+	return res;
+}
+
+static ssize_t xmp_copy_file_range(const char *path_in,
+				   struct fuse_file_info *fi_in,
+				   off_t offset_in, const char *path_out,
+				   struct fuse_file_info *fi_out,
+				   off_t offset_out, size_t len, int flags)
+{
+	TRACE_SPAN("copy_file_range");
+	SCHED_FOREGROUND;
+	RECORD2(copy_file_range, path_in, offset_in, len, 0, path_out, offset_out);
+	//create the new paths
+	char inPath[PATH_MAX];
+	char outPath[PATH_MAX];
+	fixPath(inPath,path_in);
+	fixPath(outPath,path_out);
+
+	int inEnc, outEnc;
+	ssize_t res = 0;
+	ssize_t done = 0;
+	char *buf;
+	int in, out;
+
+	if (flags)
+		return -EINVAL;
+
+	inEnc = isEncrypted(inPath);
+	if (inEnc < 0)
+		return inEnc;
+	outEnc = isEncrypted(outPath);
+	if (outEnc < 0)
+		return outEnc;
+
+	//plain to plain: let the backing filesystem do it (possibly reflink)
+	if (!inEnc && !outEnc) {
+		in = open(inPath, O_RDONLY);
+		if (in == -1)
+			return -errno;
+		out = open(outPath, O_WRONLY);
+		if (out == -1) {
+			res = -errno;
+			close(in);
+			return res;
+		}
+		res = copy_file_range(in, &offset_in, out, &offset_out, len, 0);
+		if (res == -1)
+			res = -errno;
+		close(in);
+		close(out);
+		return res;
+	}
+
+	//same key on both ends and a whole-file copy: reuse the ciphertext
+	if (inEnc && outEnc && offset_in == 0 && offset_out == 0) {
+		res = copyCiphertext(inPath, outPath, len);
+		if (res >= 0)
+			return res;
+		if (res != -EXDEV)
+			return res;
+	}
+
+	//everything else goes through the normal decrypt/encrypt paths
+	buf = arena_get(BLOCKSIZE * 64);
+	if (!buf)
+		return -ENOMEM;
+	while ((size_t) done < len) {
+		size_t n = len - done;
+
+		if (n > BLOCKSIZE * 64)
+			n = BLOCKSIZE * 64;
+		res = xmp_read(path_in, buf, n, offset_in + done, fi_in);
+		if (res <= 0)
+			break;
+		res = xmp_write(path_out, buf, res, offset_out + done, fi_out);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+	arena_put(buf, BLOCKSIZE * 64);
+	if (done == 0 && res < 0)
+		return res;
+	return done;
+}
+#endif
 
-(void) mode; 
-    fprintf(stderr,"created a file!\n");
-    //create a new path  
-    char newPath[PATH_MAX]; 
-    fixPath(newPath,path); 
+#if FUSE_USE_VERSION >= 30 && FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+//SEEK_DATA/SEEK_HOLE, so cp --sparse and backup tools skip holes. holes in
+//encrypted files are whole chunks of the backing file.
+static off_t xmp_lseek(const char *path, off_t off, int whence,
+		       struct fuse_file_info *fi)
+{
+	TRACE_SPAN("lseek");
+	RECORD(lseek, path, off, 0, whence);
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path); 
 
-    (void) fi;
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	off_t res;
+	int fd;
 
-    int action = 1; // this indicates encrypt 
-    FILE* file = NULL;
-    
-    //encrypt the file, since it's a new file 
-    
- 
-    //strmode(mode,modeString); 
+	(void) fi;
+	lock = lock_path(newPath, LOCK_SHARED);
+	if (!lock && errno)
+		return -errno;
+	//a pending file's staging file is plain, holes and all
+	fd = openStaged(newPath, O_RDONLY);
+	if (fd == -1) {
+		res = -errno;
+		lock_release(lock);
+		return res;
+	}
+	res = fmt_get(fd, &meta);
+	if (res >= 0) {
+		if (meta.kind == FMT_PLAIN)
+			res = lseek(fd, off, whence);
+		else
+			res = fmt_seek(fd, &meta, off, whence);
+		if (res == -1)
+			res = -errno;
+	}
+	close(fd);
+	lock_release(lock);
+	return res;
+}
+#endif
 
-    /* Open Files */
-    file = fopen(newPath,"w");
-    if(!file){
-	fprintf(stderr, "failed to open infile\n");
-	return EXIT_FAILURE;
-    }
-    
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+//fallocate body for chunked files. punched and zeroed ranges become
+//holes; preallocated space is zeros in the backing file, which also
+//reads back as holes
+static int allocChunked(int fd, const struct fmt_meta *meta, int mode,
+			off_t offset, off_t length)
+{
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		if (fmt_zero(fd, meta, offset, length))
+			return -errno;
+		if (!(mode & FALLOC_FL_KEEP_SIZE) &&
+		    fmt_extend(fd, meta, offset + length))
+			return -errno;
+		return 0;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && fmt_extend(fd, meta, offset + length))
+		return -errno;
+	//nothing to reserve for a packed file, its stub stays empty, nor for
+	//a deduplicated one, whose chunks are stored when written
+	if (meta->kind == FMT_PACKED || meta->kind == FMT_DEDUP)
+		return 0;
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == -1 &&
+	    errno != EOPNOTSUPP)
+		return -errno;
+	return 0;
+}
 
+static int xmp_fallocate(const char *path, int mode, off_t offset,
+			 off_t length, struct fuse_file_info *fi)
+{
+	TRACE_SPAN("fallocate");
+	SCHED_FOREGROUND;
+	RECORD(fallocate, path, offset, length, mode);
+	//create a new path 
+	char newPath[PATH_MAX]; 
+	fixPath(newPath,path); 
 
-    /* Perform do_crpt action (encrypt, decrypt, copy) */
-    if(!do_crypt(file, file, action,key_str)){
-	fprintf(stderr, "do_crypt failure\n");
-	return -errno; 
-    }
+	struct file_lock *lock;
+	struct fmt_meta meta;
+	struct stat st;
+	int fd, res;
 
+	(void) fi;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
 
-    /* Cleanup */
-    if(fclose(file)){
+again:
+	lock = lock_path(newPath, LOCK_EXCLUSIVE);
+	if (!lock && errno)
 		return -errno;
-    }
-    
-   //TODO: flag as encrypted 
+	fd = openStaged(newPath, O_RDWR);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = fmt_get(fd, &meta);
+	if (res < 0)
+		goto out;
+
+	if (meta.kind == FMT_LEGACY) {
+		//a single CBC stream has no room for holes, switch the file
+		//over and start again on the new one
+		res = convertLegacy(newPath, NULL, 0, 0, 0);
+		close(fd);
+		lock_release(lock);
+		if (res)
+			return res;
+		goto again;
+	}
+	if (meta.kind == FMT_PACKED && !(mode & FALLOC_FL_KEEP_SIZE) &&
+	    offset + length > (off_t) pack_threshold()) {
+		close(fd);
+		res = promotePacked(newPath);
+		lock_release(lock);
+		if (res)
+			return res;
+		goto again;
+	}
+	if (meta.kind == FMT_PLAIN)
+		res = fallocate(fd, mode, offset, length) == -1 ? -errno : 0;
+	else
+		res = allocChunked(fd, &meta, mode, offset, length);
+	cache_invalidate(st.st_dev, st.st_ino);
 
+out:
+	if (fd != -1)
+		close(fd);
+	lock_release(lock);
+	return res;
+}
+#endif
 
-	if(setxattr(newPath, flag, "true", strlen("true"), 0)){
-	    perror("setxattr error");
+//background threads can only be started once fuse_main has daemonized
+static void startWorkers(void)
+{
+	if (arena_init())
+		fprintf(stderr, "buffer pool statistics unavailable\n");
+	//--cipher=auto benchmarks with arena blocks, mlocked in this process
+	if (fmt_pick_cipher())
+		fprintf(stderr, "no cipher works, new files use aes256-cbc\n");
+	if (lock_init())
+		fprintf(stderr, "lock statistics unavailable\n");
+	if (sched_init(bgIdle, bgIO, bgCPU))
+		fprintf(stderr, "scheduler statistics unavailable\n");
+	if (cache_init(cacheSize))
+		fprintf(stderr, "plaintext cache disabled\n");
+	if (prefetchThreads && prefetch_init(prefetchThreads, prefetchWindow))
+		fprintf(stderr, "decrypt-ahead disabled\n");
+	if (commit_init(bb_data.rootdir, commitInterval))
+		fprintf(stderr, "group commit disabled, fsync flushes alone\n");
+	if (localCache && tier_init(localCache, localCacheSize, localWriteBack))
+		fprintf(stderr, "local cache tier disabled\n");
+	if (stripe_init((const char *const *) stripeRoots, nStripeRoots,
+			stripeSize < FMT_CHUNK ? 1 : stripeSize / FMT_CHUNK))
+		fprintf(stderr, "striping disabled, a stripe root is unusable\n");
+	//also with --no-intent-log, to finish what an earlier mount logged
+	if (intent_init(bb_data.rootdir, intentLog))
+		fprintf(stderr, "intent log unusable, a crash can tear rewritten chunks\n");
+	if (meta_init(metaEntries))
+		fprintf(stderr, "metadata cache disabled\n");
+	//runs without --defer-encrypt too, for files left pending earlier
+	if (defer_init(bb_data.rootdir, deferDelay, deferThreads))
+		fprintf(stderr, "deferred encryption disabled\n");
+	//also without --pack-small, to read what was packed before
+	if (pack_init(bb_data.rootdir, packSmall))
+		fprintf(stderr, "pack store unusable, packed files can't be read\n");
+	//also without --dedup, to collect chunks of files deleted later
+	if (dedup_init(bb_data.rootdir, dedupChunks)) {
+		fmt_use_dedup(0);
+		fprintf(stderr, "chunk store unusable, new files aren't deduplicated\n");
+	}
+	//a rotation that didn't finish before the last unmount carries on
+	if (rekey_init(bb_data.rootdir, rekeyShare, nOldKeys > 0))
+		fprintf(stderr, "key rotation disabled\n");
+	if (tracePrefix && trace_init(tracePrefix))
+		fprintf(stderr, "tracing disabled\n");
+	if (recordPath && record_init(recordPath))
+		fprintf(stderr, "capture disabled\n");
+	if (warmupThreads && warmup_start(bb_data.rootdir, warmupThreads,
+					  warmupBudget, warmupPrefetch))
+		fprintf(stderr, "warm-up disabled\n");
+}
 
-	    exit(EXIT_FAILURE);
+static void xmp_destroy(void *private_data)
+{
+	int len = stats_format(NULL, 0);
+	char *report = malloc(len + 1);
+
+	(void) private_data;
+	//what is left runs at full speed
+	sched_destroy();
+	warmup_stop();
+	rekey_stop();
+	//pending files are encrypted through the caches below
+	defer_destroy();
+	pack_destroy();
+	dedup_destroy();
+	prefetch_destroy();
+	cache_destroy();
+	tier_destroy();
+	stripe_destroy();
+	commit_destroy();
+	intent_destroy();
+	meta_destroy();
+	trace_destroy();
+	record_destroy();
+	if (report) {
+		stats_format(report, len + 1);
+		fprintf(stderr, "%s", report);
+		free(report);
 	}
-    return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	startWorkers();
+	cfg->use_ino = 1;
+
+	//let the kernel batch small writes into whole pages before they
+	//reach xmp_write, since every write there re-encrypts the file
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	if (conn->capable & FUSE_CAP_READDIRPLUS_AUTO)
+		conn->want |= FUSE_CAP_READDIRPLUS_AUTO;
+	if (conn->capable & FUSE_CAP_PARALLEL_DIROPS)
+		conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+	//O_TRUNC has to come through xmp_truncate, never through open
+	conn->want &= ~FUSE_CAP_ATOMIC_O_TRUNC;
+
+	return &bb_data;
+}
+#else
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+	startWorkers();
+	return &bb_data;
+}
+#endif
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	TRACE_SPAN("release");
+	RECORD(release, path, 0, 0, 0);
+	struct xmp_file *xf = (struct xmp_file *) (uintptr_t) fi->fh;
 
 	(void) path;
-	(void) fi;
+	if (xf) {
+		if (xf->pending)
+			defer_release(xf->dev, xf->ino);
+		prefetch_close(xf->stream);
+		free(xf);
+		fi->fh = 0;
+	}
 	return 0;
 }
 
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	TRACE_SPAN("fsync");
+	SCHED_FOREGROUND;
+	RECORD(fsync, path, 0, 0, isdatasync);
+	//rewrites of chunked files went in place behind the intent log and
+	//those of do_crypt files were renamed in, all fsync has to do is
+	//make them durable. that is one syncfs() shared by everybody
+	//who asks within the same commit interval, see encfs-commit.c. with
+	//a write-back tier the file's dirty blocks (and its stripes') go to
+	//the mirror first
+	char newPath[PATH_MAX];
+	struct fmt_meta meta;
+	struct stat st;
+	int res;
 
-	(void) path;
 	(void) isdatasync;
 	(void) fi;
-	return 0;
+	fixPath(newPath,path);
+	if (lstat(newPath, &st) == 0) {
+		//a file whose format can't be read is synced as plain
+		fmt_get_path(newPath, &meta);
+		res = fmt_sync(st.st_dev, st.st_ino, &meta);
+		if (res)
+			return res;
+	}
+	return commit_wait();
 }
 
 #ifdef HAVE_SETXATTR
+//loads a passphrase given at run time and rotates the tree to it. the
+//passphrase is kept for as long as we run since files may use it
+static int addKey(const char *value, size_t size)
+{
+	char *phrase;
+	int key;
+
+	if (size == 0)
+		return -EINVAL;
+	phrase = strndup(value, size);
+	if (!phrase)
+		return -ENOMEM;
+	key = fmt_add_key(phrase);
+	if (key < 0) {
+		free(phrase);
+		return -ENOSPC;
+	}
+	fmt_use_key(key);
+	fprintf(stderr, "new files use key %08x\n", crypt_key_id(key));
+	rekey_start();
+	return 0;
+}
+
 static int xmp_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
+	TRACE_SPAN("setxattr");
+	RECORD(setxattr, path, 0, size, 0);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
 
+	//a new key on the mount point: new files use it from now on and the
+	//existing ones are moved over in the background
+	if (!strcmp(path, "/") && !strcmp(name, rekeyAttr))
+		return addKey(value, size);
+
 	int res = lsetxattr(newPath, name, value, size, flags);
 	if (res == -1)
 		return -errno;
@@ -904,11 +2139,39 @@ static int xmp_setxattr(const char *path, const char *name, const char *value,
 static int xmp_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
+	TRACE_SPAN("getxattr");
+	RECORD(getxattr, path, 0, size, 0);
 	fprintf(stderr, "entered xmp_getxattr\n"); 
         //create a new path 
 	char newPath[PATH_MAX]; 
 	fixPath(newPath,path); 
 
+	//run time counters, read-only, on the mount point
+	if (!strcmp(path, "/") && !strcmp(name, statsAttr)) {
+		char *report = NULL;
+		int len = stats_format(NULL, 0);
+		int room;
+
+		if (size == 0)
+			return len;
+		//reporters may have more to say by the second call, retry until it fits
+		do {
+			free(report);
+			room = len + 256;
+			report = malloc(room);
+			if (!report)
+				return -ENOMEM;
+			len = stats_format(report, room);
+		} while (len >= room);
+		if ((size_t) len > size) {
+			free(report);
+			return -ERANGE;
+		}
+		memcpy(value, report, len);
+		free(report);
+		return len;
+	}
+
 	fprintf(stderr, "called lgetxaattr with path: %s\n", newPath); 
 	int res = lgetxattr(newPath, name, value, size);
 	if (res == -1)
@@ -919,6 +2182,8 @@ static int xmp_getxattr(const char *path, const char *name, char *value,
 
 static int xmp_listxattr(const char *path, char *list, size_t size)
 {
+	TRACE_SPAN("listxattr");
+	RECORD(listxattr, path, 0, size, 0);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -932,6 +2197,8 @@ static int xmp_listxattr(const char *path, char *list, size_t size)
 
 static int xmp_removexattr(const char *path, const char *name)
 {
+	TRACE_SPAN("removexattr");
+	RECORD(removexattr, path, 0, 0, 0);
 
 	//create a new path 
 	char newPath[PATH_MAX]; 
@@ -948,7 +2215,9 @@ static struct fuse_operations xmp_oper = {
 	.getattr	= xmp_getattr,
 	.access		= xmp_access,
 	.readlink	= xmp_readlink,
+	.opendir	= xmp_opendir,
 	.readdir	= xmp_readdir,
+	.releasedir	= xmp_releasedir,
 	.mknod		= xmp_mknod,
 	.mkdir		= xmp_mkdir,
 	.symlink	= xmp_symlink,
@@ -959,6 +2228,9 @@ static struct fuse_operations xmp_oper = {
 	.chmod		= xmp_chmod,
 	.chown		= xmp_chown,
 	.truncate	= xmp_truncate,
+#if FUSE_USE_VERSION < 30
+	.ftruncate	= xmp_ftruncate,
+#endif
 	.utimens	= xmp_utimens,
 	.open		= xmp_open,
 	.read		= xmp_read,
@@ -972,15 +2244,132 @@ static struct fuse_operations xmp_oper = {
 	.getxattr	= xmp_getxattr,
 	.listxattr	= xmp_listxattr,
 	.removexattr	= xmp_removexattr,
+#endif
+	.init		= xmp_init,
+	.destroy	= xmp_destroy,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+	.fallocate	= xmp_fallocate,
+#endif
+#if FUSE_USE_VERSION >= 30
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+	.copy_file_range = xmp_copy_file_range,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	.lseek		= xmp_lseek,
+#endif
 #endif
 };
 
 
 
 
+//handles one of our own --name=value options, returns 0 if it isn't ours
+static int parseOption(const char *arg)
+{
+	unsigned long val;
+
+	if (sscanf(arg, "--cache-size=%lu", &val) == 1)
+		cacheSize = val << 20;
+	else if (sscanf(arg, "--prefetch-threads=%lu", &val) == 1)
+		prefetchThreads = val;
+	else if (sscanf(arg, "--prefetch-window=%lu", &val) == 1)
+		prefetchWindow = val;
+	else if (sscanf(arg, "--commit-interval=%lu", &val) == 1)
+		commitInterval = val;
+	else if (sscanf(arg, "--meta-cache=%lu", &val) == 1)
+		metaEntries = val;
+	else if (sscanf(arg, "--warmup-threads=%lu", &val) == 1)
+		warmupThreads = val;
+	else if (sscanf(arg, "--warmup-budget=%lu", &val) == 1)
+		warmupBudget = val;
+	else if (sscanf(arg, "--warmup-prefetch=%lu", &val) == 1)
+		warmupPrefetch = val << 10;
+	else if (!strncmp(arg, "--stripe-root=", 14) &&
+		 nStripeRoots < (int) (sizeof(stripeRoots) / sizeof(*stripeRoots)))
+		stripeRoots[nStripeRoots++] = (char *) arg + 14;
+	else if (sscanf(arg, "--stripe-size=%lu", &val) == 1 && val)
+		stripeSize = val << 10;
+	else if (!strncmp(arg, "--local-cache=", 14))
+		localCache = (char *) arg + 14;
+	else if (sscanf(arg, "--local-cache-size=%lu", &val) == 1 && val)
+		localCacheSize = val << 20;
+	else if (!strcmp(arg, "--local-cache-write=through"))
+		localWriteBack = 0;
+	else if (!strcmp(arg, "--local-cache-write=back"))
+		localWriteBack = 1;
+	else if (!strncmp(arg, "--trace=", 8) && arg[8])
+		tracePrefix = (char *) arg + 8;
+	else if (!strncmp(arg, "--record=", 9) && arg[9])
+		recordPath = (char *) arg + 9;
+	else if (sscanf(arg, "--defer-encrypt=%lu", &val) == 1)
+		deferDelay = val;
+	else if (sscanf(arg, "--defer-threads=%lu", &val) == 1 && val)
+		deferThreads = val;
+	else if (!strncmp(arg, "--old-key=", 10) && arg[10] &&
+		 nOldKeys < (int) (sizeof(oldKeys) / sizeof(*oldKeys)))
+		oldKeys[nOldKeys++] = (char *) arg + 10;
+	else if (sscanf(arg, "--rekey-share=%lu", &val) == 1 && val)
+		rekeyShare = val;
+	else if (sscanf(arg, "--pack-small=%lu", &val) == 1)
+		packSmall = val;
+	else if (!strcmp(arg, "--dedup"))
+		dedupChunks = 1;
+	else if (sscanf(arg, "--bg-idle=%lu", &val) == 1)
+		bgIdle = val;
+	else if (sscanf(arg, "--bg-io=%lu", &val) == 1)
+		bgIO = val;
+	else if (sscanf(arg, "--bg-cpu=%lu", &val) == 1)
+		bgCPU = val;
+	else if (!strncmp(arg, "--cipher=", 9))
+		cipherSpec = arg + 9;
+	else if (!strcmp(arg, "--no-checksums"))
+		chunkChecksums = 0;
+	else if (!strcmp(arg, "--no-intent-log"))
+		intentLog = 0;
+	else if (!strcmp(arg, "--ordered-writes"))
+		orderedWrites = 1;
+	else if (!strcmp(arg, "--direct-io"))
+		directAll = 1;
+	else if (!strncmp(arg, "--direct-io=", 12) &&
+		 nDirectPatterns < (int) (sizeof(directPatterns) / sizeof(*directPatterns)))
+		directPatterns[nDirectPatterns++] = (char *) arg + 12;
+	else
+		return 0;
+	return 1;
+}
+
+//makes the path of a file we create later absolute, the daemon runs in /.
+//the file doesn't exist yet, so only the cwd can be resolved
+static int absPath(char **path, const char *option)
+{
+	char cwd[PATH_MAX];
+	char *abs;
+
+	if (!*path || (*path)[0] == '/')
+		return 0;
+	abs = malloc(2 * PATH_MAX);
+	if (!abs || !getcwd(cwd, sizeof(cwd))) {
+		perror(option);
+		free(abs);
+		return -1;
+	}
+	snprintf(abs, 2 * PATH_MAX, "%s/%s", cwd, *path);
+	*path = abs;
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	int i, j;
+
 	umask(0);
+
+	//pull our options out before fuse sees the arguments
+	for (i = j = 1; i < argc; i++)
+		if (i >= argc - 3 || !parseOption(argv[i]))
+			argv[j++] = argv[i];
+	argc = j;
+
 	//phrase, mirror dir, mount point
 	//path information
 	printf("Mounting from: %s\n",argv[argc-2]);
@@ -989,10 +2378,47 @@ int main(int argc, char *argv[])
 
 	//grab the key 
 	key_str = argv[argc-3]; 
+	if (fmt_init(key_str)) {
+		fprintf(stderr, "failed to derive the chunk keys\n");
+		return 1;
+	}
+	for (i = 0; i < nOldKeys; i++) {
+		if (fmt_add_key(oldKeys[i]) < 0) {
+			fprintf(stderr, "failed to derive the keys of --old-key\n");
+			return 1;
+		}
+	}
+	if (fmt_use_cipher(cipherSpec)) {
+		fprintf(stderr, "unknown cipher %s\n", cipherSpec);
+		return 1;
+	}
+	fmt_use_crc(chunkChecksums);
+	fmt_use_dedup(dedupChunks);
 
 	//change the root directory to the one we are supplying. 
 	bb_data.rootdir = realpath(argv[argc-2], NULL); 
 	printf("New Root Dir: %s\n",bb_data.rootdir); 
+	//files without a key ID use the key the tree started out with
+	if (fmt_init_root(bb_data.rootdir))
+		fprintf(stderr, "the key of older files isn't loaded, pass it with "
+			"--old-key; they can't be read until then\n");
+	//fuse changes to / when it daemonizes, so the stripe roots have to
+	//be absolute too
+	for (i = 0; i < nStripeRoots; i++) {
+		char *root = realpath(stripeRoots[i], NULL);
+
+		if (!root) {
+			perror(stripeRoots[i]);
+			return 1;
+		}
+		stripeRoots[i] = root;
+	}
+	if (localCache && !(localCache = realpath(localCache, NULL))) {
+		perror("--local-cache");
+		return 1;
+	}
+	if (absPath(&tracePrefix, "--trace") || absPath(&recordPath, "--record"))
+		return 1;
 	//remove that path after we use it... 
 	argv[argc-3] = argv[argc-1];
 	argc--; 